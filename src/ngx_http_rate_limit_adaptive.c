@@ -0,0 +1,517 @@
+#include "ngx_http_rate_limit_adaptive.h"
+#include "ngx_http_rate_limit_state.h"
+
+/* the configured rate is scaled in thousandths */
+#define NGX_HTTP_RATE_LIMIT_ADAPTIVE_ONE 1000
+
+typedef struct {
+    /* the current interval */
+    ngx_msec_t start;
+    ngx_uint_t samples;
+    ngx_uint_t errors;
+    uint64_t   latency;
+
+    ngx_uint_t scale;
+} ngx_http_rate_limit_adaptive_sh_t;
+
+typedef struct {
+    ngx_http_rate_limit_adaptive_sh_t *sh;
+    ngx_slab_pool_t                   *shpool;
+
+    ngx_msec_t latency;
+    ngx_uint_t errors;   /* percent */
+    ngx_uint_t min;      /* percent */
+    ngx_uint_t increase; /* percent */
+    ngx_uint_t decrease; /* percent */
+    ngx_msec_t interval;
+
+    /* the snapshot file, if any */
+    ngx_str_t state;
+} ngx_http_rate_limit_adaptive_ctx_t;
+
+static ngx_int_t ngx_http_rate_limit_adaptive_init_zone(
+        ngx_shm_zone_t *shm_zone, void *data);
+static void ngx_http_rate_limit_adaptive_state(
+        ngx_http_rate_limit_state_header_t *h);
+static void ngx_http_rate_limit_adaptive_load(ngx_shm_zone_t *shm_zone);
+static ngx_int_t ngx_http_rate_limit_adaptive_save(ngx_shm_zone_t *shm_zone,
+                                                   ngx_str_t *path,
+                                                   ngx_log_t *log);
+static ngx_int_t ngx_http_rate_limit_adaptive_percent(ngx_str_t *value);
+
+static ngx_int_t
+ngx_http_rate_limit_adaptive_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_rate_limit_adaptive_ctx_t *octx = data;
+
+    size_t                              len;
+    ngx_http_rate_limit_adaptive_ctx_t *ctx;
+
+    ctx = shm_zone->data;
+
+    if (octx) {
+        /* the current rate survives a reload */
+        ctx->sh = octx->sh;
+        ctx->shpool = octx->shpool;
+
+        return NGX_OK;
+    }
+
+    ctx->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        ctx->sh = ctx->shpool->data;
+
+        return NGX_OK;
+    }
+
+    ctx->sh = ngx_slab_calloc(ctx->shpool,
+                              sizeof(ngx_http_rate_limit_adaptive_sh_t));
+    if (ctx->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->shpool->data = ctx->sh;
+
+    ctx->sh->start = ngx_current_msec;
+    ctx->sh->scale = NGX_HTTP_RATE_LIMIT_ADAPTIVE_ONE;
+
+    len = sizeof(" in rate_limit_adaptive_zone \"\"") + shm_zone->shm.name.len;
+
+    ctx->shpool->log_ctx = ngx_slab_alloc(ctx->shpool, len);
+    if (ctx->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(ctx->shpool->log_ctx, " in rate_limit_adaptive_zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    if (ctx->state.len) {
+        ngx_http_rate_limit_adaptive_load(shm_zone);
+    }
+
+    return NGX_OK;
+}
+
+/* only the current rate is kept, the samples are not worth it */
+static void
+ngx_http_rate_limit_adaptive_state(ngx_http_rate_limit_state_header_t *h)
+{
+    ngx_memzero(h, sizeof(ngx_http_rate_limit_state_header_t));
+
+    h->kind = NGX_HTTP_RATE_LIMIT_STATE_ADAPTIVE;
+    h->params[0] = NGX_HTTP_RATE_LIMIT_ADAPTIVE_ONE;
+    h->len = sizeof(ngx_uint_t);
+}
+
+static void
+ngx_http_rate_limit_adaptive_load(ngx_shm_zone_t *shm_zone)
+{
+    uint64_t                            now, steps;
+    ngx_uint_t                          scale;
+    ngx_time_t                         *tp;
+    ngx_http_rate_limit_adaptive_ctx_t *ctx;
+    ngx_http_rate_limit_state_header_t  h;
+
+    ctx = shm_zone->data;
+
+    ngx_http_rate_limit_adaptive_state(&h);
+
+    if (ngx_http_rate_limit_state_read(&ctx->state, &h, (u_char *) &scale,
+                                       shm_zone->shm.log) != NGX_OK) {
+        return;
+    }
+
+    /* the rate recovers as if the backend was healthy meanwhile */
+
+    tp = ngx_timeofday();
+    now = (uint64_t) tp->sec * 1000 + tp->msec;
+
+    steps = (now > h.saved) ? (now - h.saved) / ctx->interval : 0;
+
+    if (steps * ctx->increase * 10 >= NGX_HTTP_RATE_LIMIT_ADAPTIVE_ONE) {
+        scale = NGX_HTTP_RATE_LIMIT_ADAPTIVE_ONE;
+
+    } else {
+        scale += steps * ctx->increase * 10;
+        scale = ngx_min(scale, NGX_HTTP_RATE_LIMIT_ADAPTIVE_ONE);
+    }
+
+    ctx->sh->scale = ngx_max(scale, ctx->min * 10);
+
+    ngx_log_error(NGX_LOG_NOTICE, shm_zone->shm.log, 0,
+                  "loaded zone \"%V\" from \"%V\", the rate is %ui.%ui%% "
+                  "of the configured one",
+                  &shm_zone->shm.name, &ctx->state, ctx->sh->scale / 10,
+                  ctx->sh->scale % 10);
+}
+
+static ngx_int_t
+ngx_http_rate_limit_adaptive_save(ngx_shm_zone_t *shm_zone, ngx_str_t *path,
+                                  ngx_log_t *log)
+{
+    ngx_http_rate_limit_adaptive_ctx_t *ctx;
+    ngx_http_rate_limit_state_header_t  h;
+
+    ctx = shm_zone->data;
+
+    if (ctx->sh == NULL) {
+        return NGX_DECLINED;
+    }
+
+    ngx_http_rate_limit_adaptive_state(&h);
+
+    return ngx_http_rate_limit_state_write(path, &h,
+                                           (u_char *) &ctx->sh->scale, log);
+}
+
+ngx_int_t
+ngx_http_rate_limit_adaptive_log_handler(ngx_http_request_t *r)
+{
+    ngx_msec_t                          latency, elapsed;
+    ngx_uint_t                          error, scale, old;
+    ngx_http_upstream_t                *u;
+    ngx_http_rate_limit_adaptive_sh_t  *sh;
+    ngx_http_rate_limit_loc_conf_t     *rlcf;
+    ngx_http_rate_limit_adaptive_ctx_t *actx;
+
+    rlcf = ngx_http_get_module_loc_conf(r, ngx_http_rate_limit_module);
+
+    if (rlcf->adaptive_zone == NULL) {
+        return NGX_OK;
+    }
+
+    u = r->upstream;
+
+    /* only responses of the proxied backend are feedback, not our checks */
+    if (u == NULL || u->state == NULL ||
+        u->output.tag == (ngx_buf_tag_t) &ngx_http_rate_limit_module) {
+        return NGX_OK;
+    }
+
+    latency = u->state->response_time;
+
+    if (latency == (ngx_msec_t) -1) {
+        latency = ngx_current_msec - u->start_time;
+    }
+
+    error = r->headers_out.status >= NGX_HTTP_INTERNAL_SERVER_ERROR ||
+            u->state->status >= NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    actx = rlcf->adaptive_zone->data;
+    sh = actx->sh;
+
+    ngx_shmtx_lock(&actx->shpool->mutex);
+
+    sh->samples++;
+    sh->errors += error;
+    sh->latency += latency;
+
+    old = sh->scale;
+    scale = old;
+
+    elapsed = ngx_current_msec - sh->start;
+
+    if ((ngx_msec_int_t) elapsed >= (ngx_msec_int_t) actx->interval) {
+
+        /* AIMD: back off multiplicatively, recover additively */
+
+        if (sh->latency / sh->samples > actx->latency ||
+            sh->errors * 100 > actx->errors * sh->samples) {
+            scale = scale * (100 - actx->decrease) / 100;
+            scale = ngx_max(scale, actx->min * 10);
+
+        } else {
+            scale += actx->increase * 10;
+            scale = ngx_min(scale, NGX_HTTP_RATE_LIMIT_ADAPTIVE_ONE);
+        }
+
+        sh->scale = scale;
+
+        sh->start = ngx_current_msec;
+        sh->samples = 0;
+        sh->errors = 0;
+        sh->latency = 0;
+    }
+
+    ngx_shmtx_unlock(&actx->shpool->mutex);
+
+    if (scale != old) {
+        ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0,
+                      "adaptive rate limit \"%V\" is now %ui.%ui%% "
+                      "of the configured rate",
+                      &rlcf->adaptive_zone->shm.name, scale / 10, scale % 10);
+    }
+
+    return NGX_OK;
+}
+
+void
+ngx_http_rate_limit_adaptive_apply(ngx_shm_zone_t *shm_zone,
+                                   ngx_rate_limit_rule_t *rule)
+{
+    ngx_uint_t                          scale;
+    ngx_http_rate_limit_adaptive_ctx_t *actx;
+
+    actx = shm_zone->data;
+
+    /* a word sized read, a stale value is harmless */
+    scale = actx->sh->scale;
+
+    if (scale >= NGX_HTTP_RATE_LIMIT_ADAPTIVE_ONE) {
+        return;
+    }
+
+    rule->requests = rule->requests * scale / NGX_HTTP_RATE_LIMIT_ADAPTIVE_ONE;
+    rule->requests = ngx_max(rule->requests, 1);
+
+    rule->burst = rule->burst * scale / NGX_HTTP_RATE_LIMIT_ADAPTIVE_ONE;
+}
+
+static ngx_int_t
+ngx_http_rate_limit_adaptive_percent(ngx_str_t *value)
+{
+    ngx_int_t n;
+
+    if (value->len > 1 && value->data[value->len - 1] == '%') {
+        n = ngx_atoi(value->data, value->len - 1);
+
+    } else {
+        n = ngx_atoi(value->data, value->len);
+    }
+
+    if (n < 0 || n > 100) {
+        return NGX_ERROR;
+    }
+
+    return n;
+}
+
+char *
+ngx_http_rate_limit_adaptive_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+                                  void *conf)
+{
+    ngx_str_t                          *value, name, state, s;
+    ngx_int_t                           latency, interval, n;
+    ngx_int_t                           errors, min, increase, decrease;
+    ngx_uint_t                          i;
+    ngx_shm_zone_t                     *shm_zone;
+    ngx_http_rate_limit_adaptive_ctx_t *ctx;
+
+    value = cf->args->elts;
+
+    ngx_str_null(&name);
+    ngx_str_null(&state);
+
+    latency = 500;
+    errors = 5;
+    min = 10;
+    increase = 5;
+    decrease = 30;
+    interval = 1000;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "zone=", 5) == 0) {
+
+            name.len = value[i].len - 5;
+            name.data = value[i].data + 5;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "latency=", 8) == 0) {
+
+            s.len = value[i].len - 8;
+            s.data = value[i].data + 8;
+
+            latency = ngx_parse_time(&s, 0);
+            if (latency <= 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid latency time \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "interval=", 9) == 0) {
+
+            s.len = value[i].len - 9;
+            s.data = value[i].data + 9;
+
+            interval = ngx_parse_time(&s, 0);
+            if (interval <= 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid interval time \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "errors=", 7) == 0) {
+
+            s.len = value[i].len - 7;
+            s.data = value[i].data + 7;
+
+            errors = ngx_http_rate_limit_adaptive_percent(&s);
+            if (errors == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid errors value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "min=", 4) == 0) {
+
+            s.len = value[i].len - 4;
+            s.data = value[i].data + 4;
+
+            min = ngx_http_rate_limit_adaptive_percent(&s);
+            if (min == NGX_ERROR || min == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid min value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "increase=", 9) == 0) {
+
+            s.len = value[i].len - 9;
+            s.data = value[i].data + 9;
+
+            increase = ngx_http_rate_limit_adaptive_percent(&s);
+            if (increase == NGX_ERROR || increase == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid increase value \"%V\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "decrease=", 9) == 0) {
+
+            s.len = value[i].len - 9;
+            s.data = value[i].data + 9;
+
+            n = ngx_http_rate_limit_adaptive_percent(&s);
+            if (n == NGX_ERROR || n == 0 || n == 100) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid decrease value \"%V\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            decrease = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "state=", 6) == 0) {
+
+            state.len = value[i].len - 6;
+            state.data = value[i].data + 6;
+
+            if (state.len == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid state file \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"",
+                           &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (name.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must have \"zone\" parameter",
+                           &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    ctx = ngx_pcalloc(cf->pool, sizeof(ngx_http_rate_limit_adaptive_ctx_t));
+    if (ctx == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ctx->latency = latency;
+    ctx->errors = errors;
+    ctx->min = min;
+    ctx->increase = increase;
+    ctx->decrease = decrease;
+    ctx->interval = interval;
+
+    shm_zone = ngx_shared_memory_add(cf, &name, 8 * ngx_pagesize,
+                                     &ngx_http_rate_limit_module);
+    if (shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (shm_zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "duplicate zone \"%V\"",
+                           &name);
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone->init = ngx_http_rate_limit_adaptive_init_zone;
+    shm_zone->data = ctx;
+
+    if (state.len) {
+        if (ngx_http_rate_limit_state_add(cf, &state, shm_zone,
+                                          ngx_http_rate_limit_adaptive_save,
+                                          NULL) != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
+
+        ctx->state = state;
+    }
+
+    return NGX_CONF_OK;
+}
+
+char *
+ngx_http_rate_limit_adaptive(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_rate_limit_loc_conf_t *rlcf = conf;
+
+    ngx_str_t *value, name;
+
+    if (rlcf->adaptive_zone != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        rlcf->adaptive_zone = NULL;
+        return NGX_CONF_OK;
+    }
+
+    if (ngx_strncmp(value[1].data, "zone=", 5) != 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"",
+                           &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    name.len = value[1].len - 5;
+    name.data = value[1].data + 5;
+
+    rlcf->adaptive_zone = ngx_shared_memory_add(cf, &name, 0,
+                                                &ngx_http_rate_limit_module);
+    if (rlcf->adaptive_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
@@ -0,0 +1,14 @@
+#ifndef NGX_HTTP_RATE_LIMIT_ADAPTIVE_H
+#define NGX_HTTP_RATE_LIMIT_ADAPTIVE_H
+
+#include "ngx_http_rate_limit_module.h"
+
+char *ngx_http_rate_limit_adaptive_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+                                        void *conf);
+char *ngx_http_rate_limit_adaptive(ngx_conf_t *cf, ngx_command_t *cmd,
+                                   void *conf);
+ngx_int_t ngx_http_rate_limit_adaptive_log_handler(ngx_http_request_t *r);
+void ngx_http_rate_limit_adaptive_apply(ngx_shm_zone_t *shm_zone,
+                                        ngx_rate_limit_rule_t *rule);
+
+#endif /* NGX_HTTP_RATE_LIMIT_ADAPTIVE_H */
@@ -0,0 +1,125 @@
+#include "ngx_http_rate_limit_backend.h"
+#include "ngx_http_rate_limit_memcached.h"
+
+static size_t ngx_http_rate_limit_redis_command_size(
+        ngx_http_rate_limit_ctx_t *ctx);
+static u_char *ngx_http_rate_limit_redis_write_command(
+        u_char *p, ngx_http_rate_limit_ctx_t *ctx);
+static ngx_flag_t ngx_http_rate_limit_redis_test_reply(u_char ch);
+static ngx_int_t ngx_http_rate_limit_redis_parse_reply(
+        ngx_http_rate_limit_ctx_t *ctx, ngx_buf_t *b);
+
+ngx_http_rate_limit_backend_t ngx_http_rate_limit_redis_backend = {
+    ngx_string("redis"),
+    ngx_http_rate_limit_redis_command_size,
+    ngx_http_rate_limit_redis_write_command,
+    ngx_http_rate_limit_redis_test_reply,
+    ngx_http_rate_limit_redis_parse_reply,
+    NULL
+};
+
+static ngx_http_rate_limit_backend_t *ngx_http_rate_limit_backends[] = {
+    &ngx_http_rate_limit_redis_backend,
+    &ngx_http_rate_limit_memcached_backend,
+    NULL
+};
+
+static size_t
+ngx_http_rate_limit_redis_command_size(ngx_http_rate_limit_ctx_t *ctx)
+{
+    return ngx_rate_limit_redis_command_size(&ctx->key, &ctx->rule);
+}
+
+static u_char *
+ngx_http_rate_limit_redis_write_command(u_char *p,
+                                        ngx_http_rate_limit_ctx_t *ctx)
+{
+    return ngx_rate_limit_redis_write_command(p, &ctx->key, &ctx->rule);
+}
+
+static ngx_flag_t
+ngx_http_rate_limit_redis_test_reply(u_char ch)
+{
+    /* we are always expecting a multi bulk reply */
+    return ch == '*';
+}
+
+static ngx_int_t
+ngx_http_rate_limit_redis_parse_reply(ngx_http_rate_limit_ctx_t *ctx,
+                                      ngx_buf_t *b)
+{
+    return ngx_rate_limit_redis_parse_reply(&ctx->reply, b);
+}
+
+char *
+ngx_http_rate_limit_backend(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_rate_limit_loc_conf_t *rlcf = conf;
+
+    ngx_str_t                      *value;
+    ngx_http_rate_limit_backend_t **backend;
+
+    if (rlcf->backend != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    for (backend = ngx_http_rate_limit_backends; *backend; backend++) {
+        if ((*backend)->name.len == value[1].len &&
+            ngx_strncmp((*backend)->name.data, value[1].data,
+                        value[1].len) == 0) {
+            rlcf->backend = *backend;
+            return NGX_CONF_OK;
+        }
+    }
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "unknown backend \"%V\"",
+                       &value[1]);
+
+    return NGX_CONF_ERROR;
+}
+
+/*
+ * The handshake, the charges on the connection of the worker and the
+ * pub/sub channel of rate_limit_block all speak the redis protocol.
+ */
+ngx_int_t
+ngx_http_rate_limit_backend_merge(ngx_conf_t *cf,
+                                  ngx_http_rate_limit_loc_conf_t *prev,
+                                  ngx_http_rate_limit_loc_conf_t *conf)
+{
+    char *directive;
+
+    ngx_conf_merge_ptr_value(conf->backend, prev->backend,
+                             &ngx_http_rate_limit_redis_backend);
+
+    if (conf->backend == &ngx_http_rate_limit_redis_backend) {
+        return NGX_OK;
+    }
+
+    if (conf->handshake.len) {
+        directive = "rate_limit_redis_*";
+
+    } else if (conf->charge) {
+        directive = "rate_limit_charge";
+
+    } else if (conf->connection_cache) {
+        directive = "rate_limit_connection_cache";
+
+    } else if (conf->block_zone && conf->upstream.upstream) {
+        directive = "rate_limit_block";
+
+    } else if (conf->replica_upstream) {
+        directive = "rate_limit_pass_replica";
+
+    } else {
+        return NGX_OK;
+    }
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "\"%s\" requires the redis backend, not \"%V\"",
+                       directive, &conf->backend->name);
+
+    return NGX_ERROR;
+}
@@ -0,0 +1,35 @@
+#ifndef NGX_HTTP_RATE_LIMIT_BACKEND_H
+#define NGX_HTTP_RATE_LIMIT_BACKEND_H
+
+#include "ngx_http_rate_limit_module.h"
+
+/*
+ * The protocol a check is made in. The command is built from ctx->rule
+ * and ctx->time, the reply is parsed as it arrives and then decided on,
+ * which leaves the outcome in ctx->reply.
+ */
+struct ngx_http_rate_limit_backend_s {
+    ngx_str_t name;
+
+    size_t (*command_size)(ngx_http_rate_limit_ctx_t *ctx);
+    u_char *(*write_command)(u_char *p, ngx_http_rate_limit_ctx_t *ctx);
+
+    /* whether a reply can start with the char */
+    ngx_flag_t (*test_reply)(u_char ch);
+
+    /* NGX_AGAIN until the reply is complete */
+    ngx_int_t (*parse_reply)(ngx_http_rate_limit_ctx_t *ctx, ngx_buf_t *b);
+
+    /* NULL if the reply carries the decision */
+    void (*decide)(ngx_http_rate_limit_ctx_t *ctx);
+};
+
+extern ngx_http_rate_limit_backend_t ngx_http_rate_limit_redis_backend;
+
+char *ngx_http_rate_limit_backend(ngx_conf_t *cf, ngx_command_t *cmd,
+                                  void *conf);
+ngx_int_t ngx_http_rate_limit_backend_merge(
+        ngx_conf_t *cf, ngx_http_rate_limit_loc_conf_t *prev,
+        ngx_http_rate_limit_loc_conf_t *conf);
+
+#endif /* NGX_HTTP_RATE_LIMIT_BACKEND_H */
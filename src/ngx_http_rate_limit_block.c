@@ -0,0 +1,745 @@
+#include "ngx_http_rate_limit_block.h"
+#include "ngx_http_rate_limit_charge.h"
+#include "ngx_http_rate_limit_link.h"
+
+/* the longest key, and the length and retry_after in front of it */
+#define NGX_HTTP_RATE_LIMIT_BLOCK_BUFFER (65535 + 256)
+
+/* before connecting again once the subscription is lost */
+#define NGX_HTTP_RATE_LIMIT_BLOCK_RETRY 1000
+
+typedef struct {
+    u_char  color;
+    u_char  dummy;
+    u_short len;
+
+    ngx_queue_t queue;
+
+    /* rejected until then */
+    time_t expires;
+
+    u_char data[1];
+} ngx_http_rate_limit_block_node_t;
+
+typedef struct {
+    ngx_rbtree_t      rbtree;
+    ngx_rbtree_node_t sentinel;
+    ngx_queue_t       queue;
+} ngx_http_rate_limit_block_sh_t;
+
+typedef struct {
+    ngx_http_rate_limit_block_sh_t *sh;
+    ngx_slab_pool_t                *shpool;
+
+    ngx_str_t channel;
+
+    /* that of the first location publishing to the zone */
+    ngx_str_t handshake;
+
+    /* in the worker that subscribes */
+    ngx_http_rate_limit_link_t link;
+} ngx_http_rate_limit_block_ctx_t;
+
+static ngx_int_t ngx_http_rate_limit_block_init_zone(ngx_shm_zone_t *shm_zone,
+                                                     void *data);
+static void ngx_http_rate_limit_block_rbtree_insert_value(
+        ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node,
+        ngx_rbtree_node_t *sentinel);
+static ngx_http_rate_limit_block_node_t *ngx_http_rate_limit_block_lookup_node(
+        ngx_http_rate_limit_block_ctx_t *ctx, ngx_str_t *key, uint32_t hash);
+static void ngx_http_rate_limit_block_add(ngx_http_rate_limit_block_ctx_t *ctx,
+                                          ngx_str_t *key, time_t expires);
+static void ngx_http_rate_limit_block_expire(
+        ngx_http_rate_limit_block_ctx_t *ctx, ngx_uint_t n);
+static ngx_int_t ngx_http_rate_limit_block_reply(
+        ngx_http_rate_limit_link_t *link, ngx_str_t *value, ngx_int_t rc);
+static void ngx_http_rate_limit_block_message(
+        ngx_http_rate_limit_block_ctx_t *ctx, u_char *p, u_char *last);
+static ngx_int_t ngx_http_rate_limit_block_bulk(u_char **pos, u_char *last,
+                                                ngx_str_t *s);
+
+static ngx_int_t
+ngx_http_rate_limit_block_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_rate_limit_block_ctx_t *octx = data;
+
+    size_t                           len;
+    ngx_http_rate_limit_block_ctx_t *ctx;
+
+    ctx = shm_zone->data;
+
+    if (octx) {
+        /* the channel may change, the blocked keys are kept */
+        ctx->sh = octx->sh;
+        ctx->shpool = octx->shpool;
+
+        return NGX_OK;
+    }
+
+    ctx->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        ctx->sh = ctx->shpool->data;
+
+        return NGX_OK;
+    }
+
+    ctx->sh = ngx_slab_alloc(ctx->shpool,
+                             sizeof(ngx_http_rate_limit_block_sh_t));
+    if (ctx->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->shpool->data = ctx->sh;
+
+    ngx_rbtree_init(&ctx->sh->rbtree, &ctx->sh->sentinel,
+                    ngx_http_rate_limit_block_rbtree_insert_value);
+
+    ngx_queue_init(&ctx->sh->queue);
+
+    len = sizeof(" in rate_limit_block_zone \"\"") + shm_zone->shm.name.len;
+
+    ctx->shpool->log_ctx = ngx_slab_alloc(ctx->shpool, len);
+    if (ctx->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(ctx->shpool->log_ctx, " in rate_limit_block_zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    ctx->shpool->log_nomem = 0;
+
+    return NGX_OK;
+}
+
+/* Reference: ngx_http_limit_req_rbtree_insert_value */
+static void
+ngx_http_rate_limit_block_rbtree_insert_value(ngx_rbtree_node_t *temp,
+                                              ngx_rbtree_node_t *node,
+                                              ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t               **p;
+    ngx_http_rate_limit_block_node_t *bn, *bnt;
+
+    for (;;) {
+
+        if (node->key < temp->key) {
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            bn = (ngx_http_rate_limit_block_node_t *) &node->color;
+            bnt = (ngx_http_rate_limit_block_node_t *) &temp->color;
+
+            p = (ngx_memn2cmp(bn->data, bnt->data, bn->len, bnt->len) < 0)
+                    ? &temp->left
+                    : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+static ngx_http_rate_limit_block_node_t *
+ngx_http_rate_limit_block_lookup_node(ngx_http_rate_limit_block_ctx_t *ctx,
+                                      ngx_str_t *key, uint32_t hash)
+{
+    ngx_int_t                         rc;
+    ngx_rbtree_node_t                *node, *sentinel;
+    ngx_http_rate_limit_block_node_t *bn;
+
+    node = ctx->sh->rbtree.root;
+    sentinel = ctx->sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* hash == node->key */
+
+        bn = (ngx_http_rate_limit_block_node_t *) &node->color;
+
+        rc = ngx_memn2cmp(key->data, bn->data, key->len, (size_t) bn->len);
+
+        if (rc == 0) {
+            return bn;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+/* Records that a key is limited, by this node or another one */
+static void
+ngx_http_rate_limit_block_add(ngx_http_rate_limit_block_ctx_t *ctx,
+                              ngx_str_t *key, time_t expires)
+{
+    size_t                            size;
+    uint32_t                          hash;
+    ngx_rbtree_node_t                *node;
+    ngx_http_rate_limit_block_node_t *bn;
+
+    hash = ngx_crc32_short(key->data, key->len);
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    ngx_http_rate_limit_block_expire(ctx, 1);
+
+    bn = ngx_http_rate_limit_block_lookup_node(ctx, key, hash);
+
+    if (bn) {
+        bn->expires = ngx_max(bn->expires, expires);
+
+        ngx_queue_remove(&bn->queue);
+        ngx_queue_insert_head(&ctx->sh->queue, &bn->queue);
+
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        return;
+    }
+
+    size = offsetof(ngx_rbtree_node_t, color) +
+           offsetof(ngx_http_rate_limit_block_node_t, data) + key->len;
+
+    node = ngx_slab_alloc_locked(ctx->shpool, size);
+
+    if (node == NULL) {
+        ngx_http_rate_limit_block_expire(ctx, 0);
+
+        node = ngx_slab_alloc_locked(ctx->shpool, size);
+        if (node == NULL) {
+            ngx_shmtx_unlock(&ctx->shpool->mutex);
+            return;
+        }
+    }
+
+    node->key = hash;
+
+    bn = (ngx_http_rate_limit_block_node_t *) &node->color;
+
+    bn->len = (u_short) key->len;
+    bn->expires = expires;
+
+    ngx_memcpy(bn->data, key->data, key->len);
+
+    ngx_rbtree_insert(&ctx->sh->rbtree, node);
+
+    ngx_queue_insert_head(&ctx->sh->queue, &bn->queue);
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+}
+
+/*
+ * Reference: ngx_http_limit_req_expire
+ *
+ * n == 0 frees the least recently blocked key whether or not it has
+ * expired, then up to two more keys that have.
+ */
+static void
+ngx_http_rate_limit_block_expire(ngx_http_rate_limit_block_ctx_t *ctx,
+                                 ngx_uint_t n)
+{
+    time_t                            now;
+    ngx_queue_t                      *q;
+    ngx_rbtree_node_t                *node;
+    ngx_http_rate_limit_block_node_t *bn;
+
+    now = ngx_time();
+
+    while (n < 3) {
+
+        if (ngx_queue_empty(&ctx->sh->queue)) {
+            return;
+        }
+
+        q = ngx_queue_last(&ctx->sh->queue);
+
+        bn = ngx_queue_data(q, ngx_http_rate_limit_block_node_t, queue);
+
+        if (n++ != 0 && bn->expires > now) {
+            return;
+        }
+
+        ngx_queue_remove(q);
+
+        node = (ngx_rbtree_node_t *) ((u_char *) bn -
+                                      offsetof(ngx_rbtree_node_t, color));
+
+        ngx_rbtree_delete(&ctx->sh->rbtree, node);
+
+        ngx_slab_free_locked(ctx->shpool, node);
+    }
+}
+
+/*
+ * Returns NGX_BUSY with the reply of a rejection for a key blocked on any
+ * node, NGX_DECLINED otherwise.
+ */
+ngx_int_t
+ngx_http_rate_limit_block_lookup(ngx_http_request_t *r,
+                                 ngx_http_rate_limit_ctx_t *ctx)
+{
+    time_t                            now, expires;
+    uint32_t                          hash;
+    ngx_http_rate_limit_block_ctx_t  *bctx;
+    ngx_http_rate_limit_block_node_t *bn;
+    ngx_http_rate_limit_loc_conf_t   *rlcf;
+
+    rlcf = ngx_http_get_module_loc_conf(r, ngx_http_rate_limit_module);
+
+    bctx = rlcf->block_zone->data;
+
+    hash = ngx_crc32_short(ctx->key.data, ctx->key.len);
+
+    ngx_shmtx_lock(&bctx->shpool->mutex);
+
+    bn = ngx_http_rate_limit_block_lookup_node(bctx, &ctx->key, hash);
+    expires = bn ? bn->expires : 0;
+
+    ngx_shmtx_unlock(&bctx->shpool->mutex);
+
+    now = ngx_time();
+
+    if (expires <= now) {
+        return NGX_DECLINED;
+    }
+
+    ctx->reply.limited = 1;
+    ctx->reply.limit = rlcf->rule.burst + 1;
+    ctx->reply.remaining = 0;
+    ctx->reply.reset = expires - now;
+    ctx->reply.retry_after = expires - now;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "rate limit: key \"%V\" blocked for %i",
+                   &ctx->key, ctx->reply.retry_after);
+
+    return NGX_BUSY;
+}
+
+/* Shares a rejection of redis with the other nodes */
+void
+ngx_http_rate_limit_block_publish(ngx_http_request_t *r,
+                                  ngx_http_rate_limit_ctx_t *ctx)
+{
+    ngx_http_rate_limit_block_ctx_t *bctx;
+    ngx_http_rate_limit_loc_conf_t  *rlcf;
+
+    rlcf = ngx_http_get_module_loc_conf(r, ngx_http_rate_limit_module);
+
+    if (ctx->reply.retry_after <= 0) {
+        return;
+    }
+
+    bctx = rlcf->block_zone->data;
+
+    /* this node does not wait for its own message */
+    ngx_http_rate_limit_block_add(bctx, &ctx->key,
+                                  ngx_time() + ctx->reply.retry_after);
+
+    if (rlcf->charge_sink) {
+        ngx_http_rate_limit_charge_publish(rlcf->charge_sink, &bctx->channel,
+                                           ctx->reply.retry_after,
+                                           &ctx->key, r->connection->log);
+    }
+}
+
+ngx_int_t
+ngx_http_rate_limit_block_init_process(ngx_cycle_t *cycle)
+{
+    u_char                          *p;
+    size_t                           len;
+    ngx_uint_t                       i;
+    ngx_shm_zone_t                 **zones;
+    ngx_http_rate_limit_block_ctx_t *ctx;
+    ngx_http_rate_limit_main_conf_t *rlmcf;
+
+    if (ngx_process != NGX_PROCESS_WORKER &&
+        ngx_process != NGX_PROCESS_SINGLE) {
+        return NGX_OK;
+    }
+
+    /* one worker subscribes for the whole node */
+    if (ngx_process == NGX_PROCESS_WORKER && ngx_worker != 0) {
+        return NGX_OK;
+    }
+
+    rlmcf = ngx_http_cycle_get_module_main_conf(cycle,
+                                                ngx_http_rate_limit_module);
+
+    if (rlmcf == NULL) {
+        return NGX_OK;
+    }
+
+    zones = rlmcf->blocks.elts;
+
+    for (i = 0; i < rlmcf->blocks.nelts; i++) {
+        ctx = zones[i]->data;
+
+        if (ctx->link.upstream == NULL) {
+            /* no location publishes to it */
+            continue;
+        }
+
+        /* sent again on every new connection, like a handshake */
+        len = ctx->handshake.len + sizeof("*2\r\n$9\r\nSUBSCRIBE\r\n") - 1 +
+              NGX_SIZE_T_LEN + 5 + ctx->channel.len;
+
+        p = ngx_pnalloc(cycle->pool, len);
+        if (p == NULL) {
+            return NGX_ERROR;
+        }
+
+        ctx->link.handshake.data = p;
+
+        p = ngx_cpymem(p, ctx->handshake.data, ctx->handshake.len);
+        p = ngx_sprintf(p, "*2\r\n$9\r\nSUBSCRIBE\r\n$%uz\r\n%V\r\n",
+                        ctx->channel.len, &ctx->channel);
+
+        ctx->link.handshake.len = p - ctx->link.handshake.data;
+
+        ctx->link.out = ngx_create_temp_buf(cycle->pool, len);
+        if (ctx->link.out == NULL) {
+            return NGX_ERROR;
+        }
+
+        ctx->link.in = ngx_create_temp_buf(cycle->pool,
+                                           NGX_HTTP_RATE_LIMIT_BLOCK_BUFFER);
+        if (ctx->link.in == NULL) {
+            return NGX_ERROR;
+        }
+
+        ctx->link.reply = ngx_http_rate_limit_block_reply;
+        ctx->link.data = ctx;
+
+        /* keys blocked meanwhile are only learnt by asking redis */
+        ctx->link.retry = NGX_HTTP_RATE_LIMIT_BLOCK_RETRY;
+
+        ngx_http_rate_limit_link_connect(&ctx->link);
+    }
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_rate_limit_block_reply(ngx_http_rate_limit_link_t *link,
+                                ngx_str_t *value, ngx_int_t rc)
+{
+    ngx_http_rate_limit_block_ctx_t *ctx = link->data;
+
+    if (rc == NGX_DECLINED) {
+        /* the handshake or the subscription failed */
+        ngx_log_error(NGX_LOG_ERR, link->connection->log, 0,
+                      "rate limit: redis rejected the subscription "
+                      "to \"%V\": \"%V\"",
+                      &ctx->channel, value);
+
+        return NGX_ERROR;
+    }
+
+    /* the replies to the handshake and to SUBSCRIBE are skipped */
+    ngx_http_rate_limit_block_message(ctx, value->data,
+                                      value->data + value->len);
+
+    return NGX_OK;
+}
+
+/*
+ * Handles a complete value, the "message" of a subscription is an array
+ * or a push of "message", the channel and the retry_after and the key.
+ */
+static void
+ngx_http_rate_limit_block_message(ngx_http_rate_limit_block_ctx_t *ctx,
+                                  u_char *p, u_char *last)
+{
+    u_char    *lf;
+    ngx_str_t  s, key;
+    ngx_int_t  retry_after;
+
+    if (*p != '*' && *p != '>') {
+        return;
+    }
+
+    lf = ngx_strlchr(p, last, LF);
+
+    if (lf == NULL || lf - p != 3 || p[1] != '3') {
+        return;
+    }
+
+    p = lf + 1;
+
+    if (ngx_http_rate_limit_block_bulk(&p, last, &s) != NGX_OK ||
+        s.len != sizeof("message") - 1 ||
+        ngx_strncmp(s.data, "message", s.len) != 0) {
+        return;
+    }
+
+    if (ngx_http_rate_limit_block_bulk(&p, last, &s) != NGX_OK ||
+        ngx_http_rate_limit_block_bulk(&p, last, &s) != NGX_OK) {
+        return;
+    }
+
+    key.data = ngx_strlchr(s.data, s.data + s.len, ' ');
+
+    if (key.data == NULL) {
+        goto invalid;
+    }
+
+    retry_after = ngx_atoi(s.data, key.data - s.data);
+
+    key.data++;
+    key.len = s.data + s.len - key.data;
+
+    if (retry_after <= 0 || key.len == 0 || key.len > 65535) {
+        goto invalid;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ctx->link.connection->log, 0,
+                   "rate limit: key \"%V\" blocked for %i by a peer", &key,
+                   retry_after);
+
+    ngx_http_rate_limit_block_add(ctx, &key, ngx_time() + retry_after);
+
+    return;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_WARN, ctx->link.connection->log, 0,
+                  "rate limit: invalid message on \"%V\"", &ctx->channel);
+}
+
+static ngx_int_t
+ngx_http_rate_limit_block_bulk(u_char **pos, u_char *last, ngx_str_t *s)
+{
+    u_char    *p, *lf;
+    ngx_int_t  n;
+
+    p = *pos;
+
+    if (p >= last || *p != '$') {
+        return NGX_DECLINED;
+    }
+
+    lf = ngx_strlchr(p, last, LF);
+
+    if (lf == NULL) {
+        return NGX_DECLINED;
+    }
+
+    n = ngx_atoi(p + 1, lf - p - 2);
+
+    if (n == NGX_ERROR || last - lf <= n + 2) {
+        return NGX_DECLINED;
+    }
+
+    s->data = lf + 1;
+    s->len = n;
+
+    *pos = lf + n + 3;
+
+    return NGX_OK;
+}
+
+char *
+ngx_http_rate_limit_block_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    u_char                          *p;
+    ssize_t                          size;
+    ngx_str_t                       *value, name, s;
+    ngx_uint_t                       i;
+    ngx_shm_zone_t                  *shm_zone, **zone;
+    ngx_http_rate_limit_block_ctx_t *ctx;
+    ngx_http_rate_limit_main_conf_t *rlmcf;
+
+    value = cf->args->elts;
+
+    ctx = ngx_pcalloc(cf->pool, sizeof(ngx_http_rate_limit_block_ctx_t));
+    if (ctx == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_str_null(&name);
+    ngx_str_set(&ctx->channel, "rate_limit:blocks");
+
+    size = 0;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "zone=", 5) == 0) {
+
+            name.data = value[i].data + 5;
+
+            p = (u_char *) ngx_strchr(name.data, ':');
+
+            if (p == NULL) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid zone size \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            name.len = p - name.data;
+
+            s.data = p + 1;
+            s.len = value[i].data + value[i].len - s.data;
+
+            size = ngx_parse_size(&s);
+
+            if (size == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid zone size \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            if (size < (ssize_t) (8 * ngx_pagesize)) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "zone \"%V\" is too small", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "channel=", 8) == 0) {
+
+            ctx->channel.len = value[i].len - 8;
+            ctx->channel.data = value[i].data + 8;
+
+            if (ctx->channel.len == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid channel \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"",
+                           &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (name.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must have \"zone\" parameter",
+                           &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone = ngx_shared_memory_add(cf, &name, size,
+                                     &ngx_http_rate_limit_module);
+    if (shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (shm_zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "duplicate zone \"%V\"",
+                           &name);
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone->init = ngx_http_rate_limit_block_init_zone;
+    shm_zone->data = ctx;
+
+    rlmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_rate_limit_module);
+
+    zone = ngx_array_push(&rlmcf->blocks);
+    if (zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    *zone = shm_zone;
+
+    return NGX_CONF_OK;
+}
+
+char *
+ngx_http_rate_limit_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_rate_limit_loc_conf_t *rlcf = conf;
+
+    ngx_str_t *value, name;
+
+    if (rlcf->block_zone != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        rlcf->block_zone = NULL;
+        return NGX_CONF_OK;
+    }
+
+    if (ngx_strncmp(value[1].data, "zone=", 5) != 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"",
+                           &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    name.len = value[1].len - 5;
+    name.data = value[1].data + 5;
+
+    rlcf->block_zone = ngx_shared_memory_add(cf, &name, 0,
+                                             &ngx_http_rate_limit_module);
+    if (rlcf->block_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+ngx_int_t
+ngx_http_rate_limit_block_merge(ngx_conf_t *cf,
+                                ngx_http_rate_limit_loc_conf_t *prev,
+                                ngx_http_rate_limit_loc_conf_t *conf)
+{
+    ngx_http_rate_limit_block_ctx_t *ctx;
+
+    ngx_conf_merge_ptr_value(conf->block_zone, prev->block_zone, NULL);
+
+    /* only locations checking on an upstream block publish */
+    if (conf->block_zone == NULL || conf->upstream.upstream == NULL) {
+        return NGX_OK;
+    }
+
+    ctx = conf->block_zone->data;
+
+    if (ctx == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "unknown rate_limit_block_zone \"%V\"",
+                           &conf->block_zone->shm.name);
+        return NGX_ERROR;
+    }
+
+    if (ctx->link.upstream == NULL) {
+        /* the subscription goes to the same redis */
+        ctx->link.upstream = conf->upstream.upstream;
+        ctx->link.connect_timeout = conf->upstream.connect_timeout;
+        ctx->link.send_timeout = conf->upstream.send_timeout;
+        ctx->handshake = conf->handshake;
+    }
+
+    return ngx_http_rate_limit_charge_add_sink(cf, conf);
+}
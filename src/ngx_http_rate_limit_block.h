@@ -0,0 +1,19 @@
+#ifndef NGX_HTTP_RATE_LIMIT_BLOCK_H
+#define NGX_HTTP_RATE_LIMIT_BLOCK_H
+
+#include "ngx_http_rate_limit_module.h"
+
+char *ngx_http_rate_limit_block_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+                                     void *conf);
+char *ngx_http_rate_limit_block(ngx_conf_t *cf, ngx_command_t *cmd,
+                                void *conf);
+ngx_int_t ngx_http_rate_limit_block_merge(
+        ngx_conf_t *cf, ngx_http_rate_limit_loc_conf_t *prev,
+        ngx_http_rate_limit_loc_conf_t *conf);
+ngx_int_t ngx_http_rate_limit_block_lookup(ngx_http_request_t *r,
+                                           ngx_http_rate_limit_ctx_t *ctx);
+void ngx_http_rate_limit_block_publish(ngx_http_request_t *r,
+                                       ngx_http_rate_limit_ctx_t *ctx);
+ngx_int_t ngx_http_rate_limit_block_init_process(ngx_cycle_t *cycle);
+
+#endif /* NGX_HTTP_RATE_LIMIT_BLOCK_H */
@@ -0,0 +1,285 @@
+#include "ngx_http_rate_limit_cache.h"
+#include "ngx_http_rate_limit_adaptive.h"
+#include "ngx_http_rate_limit_charge.h"
+#include "ngx_http_rate_limit_policy.h"
+
+#include <ngx_md5.h>
+
+struct ngx_http_rate_limit_cache_s {
+    ngx_shm_zone_t          *shm_zone;
+    ngx_http_complex_value_t key;
+
+    /* charged for a hit without waiting, 0 for none */
+    ngx_uint_t hit;
+};
+
+#if (NGX_HTTP_CACHE)
+static ngx_module_t *ngx_http_rate_limit_cache_owner(ngx_conf_t *cf);
+#endif
+
+char *
+ngx_http_rate_limit_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+#if (NGX_HTTP_CACHE)
+    ngx_http_rate_limit_loc_conf_t *rlcf = conf;
+
+    ngx_str_t                        *value, s;
+    ngx_int_t                         n;
+    ngx_uint_t                        i;
+    ngx_module_t                     *owner;
+    ngx_http_rate_limit_cache_t      *cache;
+    ngx_http_compile_complex_value_t  ccv;
+
+    if (rlcf->cache != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        if (cf->args->nelts != 2) {
+            return "takes no parameters with \"off\"";
+        }
+
+        rlcf->cache = NULL;
+        return NGX_CONF_OK;
+    }
+
+    cache = ngx_pcalloc(cf->pool, sizeof(ngx_http_rate_limit_cache_t));
+    if (cache == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "zone=", 5) == 0) {
+            s.len = value[i].len - 5;
+            s.data = value[i].data + 5;
+
+            owner = ngx_http_rate_limit_cache_owner(cf);
+            if (owner == NULL) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "\"%V\" requires the proxy module",
+                                   &cmd->name);
+                return NGX_CONF_ERROR;
+            }
+
+            /* declared by proxy_cache_path, before or after */
+            cache->shm_zone = ngx_shared_memory_add(cf, &s, 0, owner);
+            if (cache->shm_zone == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "key=", 4) == 0) {
+            s.len = value[i].len - 4;
+            s.data = value[i].data + 4;
+
+            ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+            ccv.cf = cf;
+            ccv.value = &s;
+            ccv.complex_value = &cache->key;
+
+            if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "hit=", 4) == 0) {
+            n = ngx_atoi(value[i].data + 4, value[i].len - 4);
+
+            if (n == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid hit value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            cache->hit = (ngx_uint_t) n;
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"",
+                           &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (cache->shm_zone == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must have \"zone\" parameter",
+                           &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    if (cache->key.value.data == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must have \"key\" parameter",
+                           &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    rlcf->cache = cache;
+
+    return NGX_CONF_OK;
+#else
+    return "requires nginx built with the http cache";
+#endif
+}
+
+#if (NGX_HTTP_CACHE)
+/*
+ * The proxy module owns the zones of proxy_cache_path. It is found by name,
+ * so that nginx links even if it was configured without that module.
+ */
+static ngx_module_t *
+ngx_http_rate_limit_cache_owner(ngx_conf_t *cf)
+{
+    ngx_uint_t  i;
+
+    for (i = 0; cf->cycle->modules[i]; i++) {
+        if (ngx_strcmp(cf->cycle->modules[i]->name, "ngx_http_proxy_module")
+            == 0)
+        {
+            return cf->cycle->modules[i];
+        }
+    }
+
+    return NULL;
+}
+#endif
+
+ngx_int_t
+ngx_http_rate_limit_cache_merge(ngx_conf_t *cf,
+                                ngx_http_rate_limit_loc_conf_t *prev,
+                                ngx_http_rate_limit_loc_conf_t *conf)
+{
+    ngx_conf_merge_ptr_value(conf->cache, prev->cache, NULL);
+
+    if (conf->cache == NULL || conf->cache->hit == 0) {
+        return NGX_OK;
+    }
+
+    /* hits are charged on the connection of rate_limit_charge */
+    return ngx_http_rate_limit_charge_add_sink(cf, conf);
+}
+
+/*
+ * Look the request up in the cache that will serve it, with the same key.
+ * Returns NGX_OK for a fresh entry, for which neither the origin nor the
+ * limiter is involved; a miss is checked as usual.
+ */
+ngx_int_t
+ngx_http_rate_limit_cache_lookup(ngx_http_request_t *r,
+                                 ngx_http_rate_limit_ctx_t *ctx)
+{
+#if (NGX_HTTP_CACHE)
+    u_char                          key[NGX_HTTP_CACHE_KEY_LEN];
+    ngx_int_t                       rc;
+    ngx_str_t                       value;
+    ngx_md5_t                       md5;
+    ngx_uint_t                      hit;
+    ngx_rbtree_key_t                node_key;
+    ngx_rbtree_node_t              *node, *sentinel;
+    ngx_rate_limit_rule_t           rule;
+    ngx_http_file_cache_t          *fc;
+    ngx_http_file_cache_node_t     *fcn;
+    ngx_http_rate_limit_cache_t    *cache;
+    ngx_http_rate_limit_loc_conf_t *rlcf;
+
+    rlcf = ngx_http_get_module_loc_conf(r, ngx_http_rate_limit_module);
+
+    cache = rlcf->cache;
+
+    /* the methods proxy_cache serves by default */
+    if (!(r->method & (NGX_HTTP_GET | NGX_HTTP_HEAD))) {
+        return NGX_DECLINED;
+    }
+
+    fc = cache->shm_zone->data;
+
+    if (fc == NULL || fc->sh == NULL) {
+        return NGX_DECLINED;
+    }
+
+    if (ngx_http_complex_value(r, &cache->key, &value) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    /* Reference: ngx_http_file_cache_create_key */
+    ngx_md5_init(&md5);
+    ngx_md5_update(&md5, value.data, value.len);
+    ngx_md5_final(key, &md5);
+
+    ngx_memcpy((u_char *) &node_key, key, sizeof(ngx_rbtree_key_t));
+
+    hit = 0;
+
+    ngx_shmtx_lock(&fc->shpool->mutex);
+
+    /* Reference: ngx_http_file_cache_lookup */
+
+    node = fc->sh->rbtree.root;
+    sentinel = fc->sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (node_key < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (node_key > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* node_key == node->key */
+
+        fcn = (ngx_http_file_cache_node_t *) node;
+
+        rc = ngx_memcmp(&key[sizeof(ngx_rbtree_key_t)], fcn->key,
+                        NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+        if (rc == 0) {
+            hit = fcn->exists && fcn->valid_sec >= ngx_time();
+            break;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    ngx_shmtx_unlock(&fc->shpool->mutex);
+
+    if (!hit) {
+        return NGX_DECLINED;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "rate limit: cache hit for key \"%V\"", &ctx->key);
+
+    if (cache->hit && rlcf->charge_sink) {
+        rule = rlcf->rule;
+        rule.quantity = cache->hit;
+
+        if (rlcf->policy_zone) {
+            ngx_http_rate_limit_policy_apply(r, &rule);
+        }
+
+        if (rlcf->adaptive_zone) {
+            ngx_http_rate_limit_adaptive_apply(rlcf->adaptive_zone, &rule);
+        }
+
+        ngx_http_rate_limit_charge_send(rlcf->charge_sink, &ctx->key, &rule,
+                                        r->connection->log);
+    }
+
+    return NGX_OK;
+#else
+    return NGX_DECLINED;
+#endif
+}
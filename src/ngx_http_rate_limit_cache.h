@@ -0,0 +1,14 @@
+#ifndef NGX_HTTP_RATE_LIMIT_CACHE_H
+#define NGX_HTTP_RATE_LIMIT_CACHE_H
+
+#include "ngx_http_rate_limit_module.h"
+
+char *ngx_http_rate_limit_cache(ngx_conf_t *cf, ngx_command_t *cmd,
+                                void *conf);
+ngx_int_t ngx_http_rate_limit_cache_merge(
+        ngx_conf_t *cf, ngx_http_rate_limit_loc_conf_t *prev,
+        ngx_http_rate_limit_loc_conf_t *conf);
+ngx_int_t ngx_http_rate_limit_cache_lookup(ngx_http_request_t *r,
+                                           ngx_http_rate_limit_ctx_t *ctx);
+
+#endif /* NGX_HTTP_RATE_LIMIT_CACHE_H */
@@ -0,0 +1,463 @@
+#include "ngx_http_rate_limit_charge.h"
+#include "ngx_http_rate_limit_adaptive.h"
+#include "ngx_http_rate_limit_handler.h"
+#include "ngx_http_rate_limit_link.h"
+#include "ngx_http_rate_limit_policy.h"
+
+/* commands waiting for the connection, per upstream and worker */
+#define NGX_HTTP_RATE_LIMIT_CHARGE_BUFFER 65536
+
+/* replies are discarded, a RATER.LIMIT one fits easily */
+#define NGX_HTTP_RATE_LIMIT_CHARGE_REPLY 1024
+
+struct ngx_http_rate_limit_charge_s {
+    ngx_http_complex_value_t  quantity;
+    ngx_http_complex_value_t *filter;
+
+    /* a status code, or its class for 1..5 */
+    ngx_array_t *statuses; /* ngx_uint_t */
+};
+
+struct ngx_http_rate_limit_charge_sink_s {
+    ngx_http_rate_limit_link_t link;
+
+    /* charges dropped since the last message about it */
+    ngx_uint_t dropped;
+    time_t     logged;
+};
+
+static u_char *ngx_http_rate_limit_charge_reserve(
+    ngx_http_rate_limit_charge_sink_t *sink, size_t len, ngx_log_t *log);
+static void ngx_http_rate_limit_charge_drop(
+    ngx_http_rate_limit_charge_sink_t *sink, ngx_log_t *log);
+static ngx_int_t ngx_http_rate_limit_charge_reply(
+    ngx_http_rate_limit_link_t *link, ngx_str_t *value, ngx_int_t rc);
+
+char *
+ngx_http_rate_limit_charge(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_rate_limit_loc_conf_t *rlcf = conf;
+
+    u_char                           *p, *last;
+    ngx_str_t                        *value, s;
+    ngx_int_t                         n;
+    ngx_uint_t                        i, *status;
+    ngx_http_rate_limit_charge_t     *charge;
+    ngx_http_compile_complex_value_t  ccv;
+
+    if (rlcf->charge != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        if (cf->args->nelts != 2) {
+            return "takes no parameters with \"off\"";
+        }
+
+        rlcf->charge = NULL;
+        return NGX_CONF_OK;
+    }
+
+    charge = ngx_pcalloc(cf->pool, sizeof(ngx_http_rate_limit_charge_t));
+    if (charge == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+    ccv.cf = cf;
+    ccv.value = &value[1];
+    ccv.complex_value = &charge->quantity;
+
+    if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "status=", 7) == 0) {
+
+            charge->statuses = ngx_array_create(cf->pool, 4,
+                                                sizeof(ngx_uint_t));
+            if (charge->statuses == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            p = value[i].data + 7;
+            last = value[i].data + value[i].len;
+
+            while (p < last) {
+                s.data = p;
+
+                while (p < last && *p != ',') {
+                    p++;
+                }
+
+                s.len = p - s.data;
+                p++;
+
+                /* "4xx" is a class, anything else a status code */
+
+                if (s.len == 3 && s.data[1] == 'x' && s.data[2] == 'x' &&
+                    s.data[0] >= '1' && s.data[0] <= '5') {
+                    n = s.data[0] - '0';
+
+                } else {
+                    n = ngx_atoi(s.data, s.len);
+
+                    if (n < 100 || n > 599) {
+                        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                           "invalid status \"%V\"", &s);
+                        return NGX_CONF_ERROR;
+                    }
+                }
+
+                status = ngx_array_push(charge->statuses);
+                if (status == NULL) {
+                    return NGX_CONF_ERROR;
+                }
+
+                *status = (ngx_uint_t) n;
+            }
+
+            if (charge->statuses->nelts == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "if=", 3) == 0) {
+            s.len = value[i].len - 3;
+            s.data = value[i].data + 3;
+
+            charge->filter = ngx_palloc(cf->pool,
+                                        sizeof(ngx_http_complex_value_t));
+            if (charge->filter == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+            ccv.cf = cf;
+            ccv.value = &s;
+            ccv.complex_value = charge->filter;
+
+            if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+    invalid:
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"",
+                           &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    rlcf->charge = charge;
+
+    return NGX_CONF_OK;
+}
+
+ngx_int_t
+ngx_http_rate_limit_charge_merge(ngx_conf_t *cf,
+                                 ngx_http_rate_limit_loc_conf_t *prev,
+                                 ngx_http_rate_limit_loc_conf_t *conf)
+{
+    ngx_conf_merge_ptr_value(conf->charge, prev->charge, NULL);
+
+    if (conf->charge == NULL) {
+        return NGX_OK;
+    }
+
+    return ngx_http_rate_limit_charge_add_sink(cf, conf);
+}
+
+/* The connection of the worker to the upstream of a location, if fixed */
+ngx_int_t
+ngx_http_rate_limit_charge_add_sink(ngx_conf_t *cf,
+                                    ngx_http_rate_limit_loc_conf_t *conf)
+{
+    ngx_uint_t                          i;
+    ngx_http_upstream_srv_conf_t       *us;
+    ngx_http_rate_limit_main_conf_t    *rlmcf;
+    ngx_http_rate_limit_charge_sink_t **sinkp, *sink;
+
+    us = conf->upstream.upstream;
+
+    /* a target in variables is not known before the request */
+    if (us == NULL || conf->charge_sink) {
+        return NGX_OK;
+    }
+
+    rlmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_rate_limit_module);
+
+    sinkp = rlmcf->charges.elts;
+
+    for (i = 0; i < rlmcf->charges.nelts; i++) {
+        if (sinkp[i]->link.upstream == us) {
+            conf->charge_sink = sinkp[i];
+            return NGX_OK;
+        }
+    }
+
+    sink = ngx_pcalloc(cf->pool, sizeof(ngx_http_rate_limit_charge_sink_t));
+    if (sink == NULL) {
+        return NGX_ERROR;
+    }
+
+    sink->link.upstream = us;
+    sink->link.connect_timeout = conf->upstream.connect_timeout;
+    sink->link.send_timeout = conf->upstream.send_timeout;
+
+    /* that of the first location charging to the upstream */
+    sink->link.handshake = conf->handshake;
+
+    sink->link.reply = ngx_http_rate_limit_charge_reply;
+    sink->link.data = sink;
+    sink->link.lost = "charges";
+
+    /* no link.retry, connected again with the next charge */
+
+    sink->link.out = ngx_create_temp_buf(cf->pool,
+                                         NGX_HTTP_RATE_LIMIT_CHARGE_BUFFER);
+    if (sink->link.out == NULL) {
+        return NGX_ERROR;
+    }
+
+    sink->link.in = ngx_create_temp_buf(cf->pool,
+                                        NGX_HTTP_RATE_LIMIT_CHARGE_REPLY);
+    if (sink->link.in == NULL) {
+        return NGX_ERROR;
+    }
+
+    sinkp = ngx_array_push(&rlmcf->charges);
+    if (sinkp == NULL) {
+        return NGX_ERROR;
+    }
+
+    *sinkp = sink;
+
+    conf->charge_sink = sink;
+
+    return NGX_OK;
+}
+
+/*
+ * Charge the cost of a response once it is known, such as the bytes sent
+ * or the cost of a failed login. Nothing is waited for: the command is
+ * queued on a connection of the worker and its reply discarded.
+ */
+ngx_int_t
+ngx_http_rate_limit_charge_log_handler(ngx_http_request_t *r)
+{
+    off_t                           n;
+    ngx_str_t                       value;
+    ngx_uint_t                      i, status, *statuses;
+    ngx_rate_limit_rule_t           rule;
+    ngx_http_rate_limit_ctx_t      *ctx;
+    ngx_http_rate_limit_charge_t   *charge;
+    ngx_http_rate_limit_loc_conf_t *rlcf;
+
+    rlcf = ngx_http_get_module_loc_conf(r, ngx_http_rate_limit_module);
+
+    charge = rlcf->charge;
+
+    if (charge == NULL) {
+        return NGX_OK;
+    }
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_rate_limit_module);
+
+    if (ctx == NULL) {
+        ctx = ngx_http_rate_limit_main_ctx(r);
+    }
+
+    /* not checked, such as on an allowlist */
+    if (ctx == NULL || ctx->key.len == 0) {
+        return NGX_OK;
+    }
+
+    if (rlcf->charge_sink == NULL) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "rate limit: charge needs a static upstream");
+        return NGX_OK;
+    }
+
+    if (charge->statuses) {
+        status = r->err_status ? r->err_status : r->headers_out.status;
+
+        statuses = charge->statuses->elts;
+
+        for (i = 0; i < charge->statuses->nelts; i++) {
+            if (statuses[i] == status ||
+                (statuses[i] < 10 && statuses[i] == status / 100)) {
+                break;
+            }
+        }
+
+        if (i == charge->statuses->nelts) {
+            return NGX_OK;
+        }
+    }
+
+    if (charge->filter) {
+        if (ngx_http_complex_value(r, charge->filter, &value) != NGX_OK) {
+            return NGX_OK;
+        }
+
+        if (value.len == 0 || (value.len == 1 && value.data[0] == '0')) {
+            return NGX_OK;
+        }
+    }
+
+    if (ngx_http_complex_value(r, &charge->quantity, &value) != NGX_OK) {
+        return NGX_OK;
+    }
+
+    n = ngx_atoof(value.data, value.len);
+
+    if (n <= 0) {
+        return NGX_OK;
+    }
+
+    rule = rlcf->rule;
+    rule.quantity = (ngx_uint_t) n;
+
+    if (rlcf->policy_zone) {
+        ngx_http_rate_limit_policy_apply(r, &rule);
+    }
+
+    if (rlcf->adaptive_zone) {
+        ngx_http_rate_limit_adaptive_apply(rlcf->adaptive_zone, &rule);
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "rate limit: charge %ui for key \"%V\"", rule.quantity,
+                   &ctx->key);
+
+    ngx_http_rate_limit_charge_send(rlcf->charge_sink, &ctx->key, &rule,
+                                    r->connection->log);
+
+    return NGX_OK;
+}
+
+/* Queue a charge without waiting for its reply */
+void
+ngx_http_rate_limit_charge_send(ngx_http_rate_limit_charge_sink_t *sink,
+                                ngx_str_t *key, ngx_rate_limit_rule_t *rule,
+                                ngx_log_t *log)
+{
+    u_char *p;
+
+    p = ngx_http_rate_limit_charge_reserve(
+            sink, ngx_rate_limit_redis_command_size(key, rule), log);
+
+    if (p == NULL) {
+        return;
+    }
+
+    sink->link.out->last = ngx_rate_limit_redis_write_command(p, key, rule);
+
+    if (sink->link.connected) {
+        ngx_http_rate_limit_link_flush(&sink->link);
+    }
+}
+
+/*
+ * Queue "PUBLISH channel message" on the same connection, where the
+ * message is the retry_after of a limited key and the key.
+ */
+void
+ngx_http_rate_limit_charge_publish(ngx_http_rate_limit_charge_sink_t *sink,
+                                   ngx_str_t *channel, ngx_int_t retry_after,
+                                   ngx_str_t *key, ngx_log_t *log)
+{
+    u_char *p;
+    size_t  len;
+
+    len = ngx_rate_limit_num_size((uint64_t) retry_after) + 1 + key->len;
+
+    p = ngx_http_rate_limit_charge_reserve(
+            sink,
+            sizeof("*3\r\n$7\r\nPUBLISH\r\n") - 1 + 2 * (NGX_SIZE_T_LEN + 5) +
+                channel->len + len,
+            log);
+
+    if (p == NULL) {
+        return;
+    }
+
+    p = ngx_sprintf(p, "*3\r\n$7\r\nPUBLISH\r\n$%uz\r\n%V\r\n", channel->len,
+                    channel);
+    p = ngx_sprintf(p, "$%uz\r\n%i %V\r\n", len, retry_after, key);
+
+    sink->link.out->last = p;
+
+    if (sink->link.connected) {
+        ngx_http_rate_limit_link_flush(&sink->link);
+    }
+}
+
+/* Room for a command of up to len bytes, NULL if it is dropped */
+static u_char *
+ngx_http_rate_limit_charge_reserve(ngx_http_rate_limit_charge_sink_t *sink,
+                                   size_t len, ngx_log_t *log)
+{
+    ngx_buf_t *b;
+
+    if (sink->link.connection == NULL) {
+        ngx_http_rate_limit_link_connect(&sink->link);
+
+        if (sink->link.connection == NULL) {
+            ngx_http_rate_limit_charge_drop(sink, log);
+            return NULL;
+        }
+    }
+
+    b = sink->link.out;
+
+    if ((size_t) (b->end - b->last) < len) {
+        ngx_http_rate_limit_charge_drop(sink, log);
+        return NULL;
+    }
+
+    return b->last;
+}
+
+static void
+ngx_http_rate_limit_charge_drop(ngx_http_rate_limit_charge_sink_t *sink,
+                                ngx_log_t *log)
+{
+    sink->dropped++;
+
+    if (sink->logged == ngx_time()) {
+        return;
+    }
+
+    ngx_log_error(NGX_LOG_WARN, log, 0,
+                  "rate limit: %ui charges dropped, redis is unreachable "
+                  "or falling behind",
+                  sink->dropped);
+
+    sink->dropped = 0;
+    sink->logged = ngx_time();
+}
+
+/* The reply to a charge is discarded, an error only logged */
+static ngx_int_t
+ngx_http_rate_limit_charge_reply(ngx_http_rate_limit_link_t *link,
+                                 ngx_str_t *value, ngx_int_t rc)
+{
+    if (rc == NGX_DECLINED) {
+        ngx_log_error(NGX_LOG_ERR, link->connection->log, 0,
+                      "rate limit: redis rejected a charge: \"%V\"", value);
+    }
+
+    return NGX_OK;
+}
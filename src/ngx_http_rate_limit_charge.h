@@ -0,0 +1,22 @@
+#ifndef NGX_HTTP_RATE_LIMIT_CHARGE_H
+#define NGX_HTTP_RATE_LIMIT_CHARGE_H
+
+#include "ngx_http_rate_limit_module.h"
+
+char *ngx_http_rate_limit_charge(ngx_conf_t *cf, ngx_command_t *cmd,
+                                 void *conf);
+ngx_int_t ngx_http_rate_limit_charge_merge(
+        ngx_conf_t *cf, ngx_http_rate_limit_loc_conf_t *prev,
+        ngx_http_rate_limit_loc_conf_t *conf);
+ngx_int_t ngx_http_rate_limit_charge_add_sink(
+        ngx_conf_t *cf, ngx_http_rate_limit_loc_conf_t *conf);
+ngx_int_t ngx_http_rate_limit_charge_log_handler(ngx_http_request_t *r);
+void ngx_http_rate_limit_charge_send(ngx_http_rate_limit_charge_sink_t *sink,
+                                     ngx_str_t *key,
+                                     ngx_rate_limit_rule_t *rule,
+                                     ngx_log_t *log);
+void ngx_http_rate_limit_charge_publish(
+        ngx_http_rate_limit_charge_sink_t *sink, ngx_str_t *channel,
+        ngx_int_t retry_after, ngx_str_t *key, ngx_log_t *log);
+
+#endif /* NGX_HTTP_RATE_LIMIT_CHARGE_H */
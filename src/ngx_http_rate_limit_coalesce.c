@@ -0,0 +1,443 @@
+#include "ngx_http_rate_limit_coalesce.h"
+#include "ngx_http_rate_limit_handler.h"
+
+/*
+ * A flight is the check outstanding for a key in this worker. Requests for
+ * the same key that arrive meanwhile wait for it, and are then settled with
+ * one follow-up command for all of them.
+ */
+struct ngx_http_rate_limit_flight_s {
+    ngx_rbtree_node_t node;
+
+    ngx_http_rate_limit_loc_conf_t *conf;
+    ngx_str_t                       key;
+
+    /* the request that sends the command */
+    ngx_http_rate_limit_ctx_t *leader;
+
+    /* covered by the command of the leader, in arrival order */
+    ngx_queue_t batch;
+
+    /* arrived while the command was outstanding */
+    ngx_queue_t waiters;
+};
+
+static void ngx_http_rate_limit_flight_insert_value(
+        ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node,
+        ngx_rbtree_node_t *sentinel);
+static ngx_http_rate_limit_flight_t *ngx_http_rate_limit_flight_lookup(
+        ngx_http_rate_limit_loc_conf_t *conf, ngx_str_t *key, uint32_t hash);
+static void ngx_http_rate_limit_coalesce_promote(
+        ngx_http_rate_limit_flight_t *flight);
+static void ngx_http_rate_limit_coalesce_decide(ngx_http_rate_limit_ctx_t *ctx,
+                                                ngx_uint_t status,
+                                                ngx_rate_limit_reply_t *reply);
+static void ngx_http_rate_limit_coalesce_wake_handler(ngx_event_t *ev);
+static void ngx_http_rate_limit_coalesce_cleanup(void *data);
+
+static ngx_rbtree_t      ngx_http_rate_limit_flights;
+static ngx_rbtree_node_t ngx_http_rate_limit_flights_sentinel;
+
+ngx_int_t
+ngx_http_rate_limit_coalesce_init_process(ngx_cycle_t *cycle)
+{
+    ngx_rbtree_init(&ngx_http_rate_limit_flights,
+                    &ngx_http_rate_limit_flights_sentinel,
+                    ngx_http_rate_limit_flight_insert_value);
+
+    return NGX_OK;
+}
+
+/* Reference: ngx_str_rbtree_insert_value */
+static void
+ngx_http_rate_limit_flight_insert_value(ngx_rbtree_node_t *temp,
+                                        ngx_rbtree_node_t *node,
+                                        ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t            **p;
+    ngx_http_rate_limit_flight_t  *f, *t;
+
+    for (;;) {
+
+        if (node->key < temp->key) {
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            f = (ngx_http_rate_limit_flight_t *) node;
+            t = (ngx_http_rate_limit_flight_t *) temp;
+
+            if (f->conf != t->conf) {
+                p = (f->conf < t->conf) ? &temp->left : &temp->right;
+
+            } else {
+                p = (ngx_memn2cmp(f->key.data, t->key.data, f->key.len,
+                                  t->key.len) < 0)
+                        ? &temp->left
+                        : &temp->right;
+            }
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+static ngx_http_rate_limit_flight_t *
+ngx_http_rate_limit_flight_lookup(ngx_http_rate_limit_loc_conf_t *conf,
+                                  ngx_str_t *key, uint32_t hash)
+{
+    ngx_int_t                     rc;
+    ngx_rbtree_node_t            *node, *sentinel;
+    ngx_http_rate_limit_flight_t *f;
+
+    node = ngx_http_rate_limit_flights.root;
+    sentinel = ngx_http_rate_limit_flights.sentinel;
+
+    while (node != sentinel) {
+
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* hash == node->key */
+
+        f = (ngx_http_rate_limit_flight_t *) node;
+
+        if (conf != f->conf) {
+            node = (conf < f->conf) ? node->left : node->right;
+            continue;
+        }
+
+        rc = ngx_memn2cmp(key->data, f->key.data, key->len, f->key.len);
+
+        if (rc == 0) {
+            return f;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+ngx_int_t
+ngx_http_rate_limit_coalesce(ngx_http_request_t *r,
+                             ngx_http_rate_limit_ctx_t *ctx)
+{
+    uint32_t                        hash;
+    ngx_pool_cleanup_t             *cln;
+    ngx_http_rate_limit_flight_t   *flight;
+    ngx_http_rate_limit_loc_conf_t *rlcf;
+
+    rlcf = ngx_http_get_module_loc_conf(r, ngx_http_rate_limit_module);
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_http_rate_limit_coalesce_cleanup;
+    cln->data = ctx;
+
+    ctx->wake.handler = ngx_http_rate_limit_coalesce_wake_handler;
+    ctx->wake.data = r;
+    ctx->wake.log = r->connection->log;
+
+    hash = ngx_crc32_short(ctx->key.data, ctx->key.len);
+
+    flight = ngx_http_rate_limit_flight_lookup(rlcf, &ctx->key, hash);
+
+    if (flight == NULL) {
+        flight = ngx_alloc(sizeof(ngx_http_rate_limit_flight_t) + ctx->key.len,
+                           r->connection->log);
+        if (flight == NULL) {
+            return NGX_ERROR;
+        }
+
+        flight->node.key = hash;
+        flight->conf = rlcf;
+        flight->key.len = ctx->key.len;
+        flight->key.data = (u_char *) flight +
+                           sizeof(ngx_http_rate_limit_flight_t);
+        ngx_memcpy(flight->key.data, ctx->key.data, ctx->key.len);
+
+        ngx_queue_init(&flight->batch);
+        ngx_queue_init(&flight->waiters);
+
+        flight->leader = ctx;
+        ngx_queue_insert_tail(&flight->batch, &ctx->queue);
+
+        ngx_rbtree_insert(&ngx_http_rate_limit_flights, &flight->node);
+
+        ctx->flight = flight;
+
+        return NGX_OK;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "rate limit: coalesced with the check for \"%V\"",
+                   &ctx->key);
+
+    ngx_queue_insert_tail(&flight->waiters, &ctx->queue);
+    ctx->flight = flight;
+
+    ngx_http_set_ctx(r, ctx, ngx_http_rate_limit_module);
+
+    /* Reference: ngx_http_limit_req_handler */
+    r->read_event_handler = ngx_http_test_reading;
+    r->write_event_handler = ngx_http_core_run_phases;
+
+    return NGX_AGAIN;
+}
+
+void
+ngx_http_rate_limit_coalesce_settle(ngx_http_rate_limit_ctx_t *ctx)
+{
+    ngx_uint_t                      n, i, q, step, allowed;
+    ngx_queue_t                    *h;
+    ngx_rate_limit_reply_t          reply;
+    ngx_http_rate_limit_ctx_t      *m;
+    ngx_http_rate_limit_flight_t   *flight;
+    ngx_http_rate_limit_loc_conf_t *rlcf;
+
+    flight = ctx->flight;
+
+    if (flight == NULL || flight->leader != ctx) {
+        return;
+    }
+
+    rlcf = flight->conf;
+    reply = ctx->reply;
+
+    n = 0;
+
+    for (h = ngx_queue_head(&flight->batch);
+         h != ngx_queue_sentinel(&flight->batch); h = ngx_queue_next(h)) {
+        n++;
+    }
+
+    ngx_queue_remove(&ctx->queue);
+    ctx->flight = NULL;
+    flight->leader = NULL;
+
+    if (ctx->status != NGX_HTTP_OK &&
+        ctx->status != NGX_HTTP_TOO_MANY_REQUESTS) {
+        /* the batch shares the error, the waiters try again */
+
+        while (!ngx_queue_empty(&flight->batch)) {
+            h = ngx_queue_head(&flight->batch);
+            m = ngx_queue_data(h, ngx_http_rate_limit_ctx_t, queue);
+
+            ngx_http_rate_limit_coalesce_decide(m, ctx->status, &reply);
+        }
+
+        ngx_http_rate_limit_coalesce_promote(flight);
+        return;
+    }
+
+    /*
+     * The batch was charged at once, so earlier arrivals are reported
+     * the units that were left after them.
+     */
+
+    q = rlcf->rule.quantity;
+    step = (ctx->status == NGX_HTTP_OK) ? q : 0;
+
+    ctx->reply.remaining = reply.remaining + (n - 1) * step;
+
+    for (i = 1; !ngx_queue_empty(&flight->batch); i++) {
+        h = ngx_queue_head(&flight->batch);
+        m = ngx_queue_data(h, ngx_http_rate_limit_ctx_t, queue);
+
+        reply.remaining = ctx->reply.remaining - i * step;
+
+        ngx_http_rate_limit_coalesce_decide(m, ctx->status, &reply);
+    }
+
+    reply.remaining = ctx->reply.remaining - (n - 1) * step;
+
+    if (q == 0) {
+        /* nothing is charged, the waiters share the answer */
+
+        while (!ngx_queue_empty(&flight->waiters)) {
+            h = ngx_queue_head(&flight->waiters);
+            m = ngx_queue_data(h, ngx_http_rate_limit_ctx_t, queue);
+
+            ngx_http_rate_limit_coalesce_decide(m, ctx->status, &reply);
+        }
+
+        ngx_http_rate_limit_coalesce_promote(flight);
+        return;
+    }
+
+    /* the waiters split the units left, in arrival order */
+
+    allowed = (ctx->status == NGX_HTTP_OK) ? reply.remaining / q : 0;
+
+    while (allowed && !ngx_queue_empty(&flight->waiters)) {
+        h = ngx_queue_head(&flight->waiters);
+        ngx_queue_remove(h);
+        ngx_queue_insert_tail(&flight->batch, h);
+
+        allowed--;
+    }
+
+    /* the rest is rejected without asking redis again */
+
+    reply.limited = 1;
+    reply.remaining = 0;
+
+    for (i = 1; !ngx_queue_empty(&flight->waiters); i++) {
+        h = ngx_queue_head(&flight->waiters);
+        m = ngx_queue_data(h, ngx_http_rate_limit_ctx_t, queue);
+
+        if (ctx->status == NGX_HTTP_OK) {
+            /* one emission interval for each unit short, rounded up */
+            reply.retry_after = (i * q * rlcf->rule.period +
+                                 rlcf->rule.requests * 1000 - 1) /
+                                (rlcf->rule.requests * 1000);
+        }
+
+        ngx_http_rate_limit_coalesce_decide(m, NGX_HTTP_TOO_MANY_REQUESTS,
+                                            &reply);
+    }
+
+    ngx_http_rate_limit_coalesce_promote(flight);
+}
+
+static void
+ngx_http_rate_limit_coalesce_promote(ngx_http_rate_limit_flight_t *flight)
+{
+    ngx_uint_t                 n;
+    ngx_queue_t               *h;
+    ngx_http_rate_limit_ctx_t *leader;
+
+    if (ngx_queue_empty(&flight->batch)) {
+
+        if (ngx_queue_empty(&flight->waiters)) {
+            ngx_rbtree_delete(&ngx_http_rate_limit_flights, &flight->node);
+            ngx_free(flight);
+            return;
+        }
+
+        h = ngx_queue_head(&flight->waiters);
+        ngx_queue_remove(h);
+        ngx_queue_insert_tail(&flight->batch, h);
+    }
+
+    n = 0;
+
+    for (h = ngx_queue_head(&flight->batch);
+         h != ngx_queue_sentinel(&flight->batch); h = ngx_queue_next(h)) {
+        n++;
+    }
+
+    h = ngx_queue_head(&flight->batch);
+    leader = ngx_queue_data(h, ngx_http_rate_limit_ctx_t, queue);
+
+    leader->quantity = (n > 1) ? n * flight->conf->rule.quantity : 0;
+    leader->promoted = 1;
+
+    flight->leader = leader;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, leader->request->connection->log, 0,
+                   "rate limit: checking %ui coalesced requests for \"%V\"",
+                   n, &flight->key);
+
+    ngx_post_event(&leader->wake, &ngx_posted_events);
+}
+
+static void
+ngx_http_rate_limit_coalesce_decide(ngx_http_rate_limit_ctx_t *ctx,
+                                    ngx_uint_t status,
+                                    ngx_rate_limit_reply_t *reply)
+{
+    ngx_http_request_t             *r;
+    ngx_http_rate_limit_loc_conf_t *rlcf;
+
+    ngx_queue_remove(&ctx->queue);
+
+    ctx->flight = NULL;
+    ctx->status = status;
+    ctx->reply = *reply;
+    ctx->finalized = 1;
+
+    r = ctx->request;
+
+    rlcf = ngx_http_get_module_loc_conf(r, ngx_http_rate_limit_module);
+
+    if (status == NGX_HTTP_TOO_MANY_REQUESTS || rlcf->enable_headers) {
+        ngx_http_rate_limit_set_headers(r, ctx);
+    }
+
+    ngx_post_event(&ctx->wake, &ngx_posted_events);
+}
+
+/* Reference: ngx_http_limit_req_delay */
+static void
+ngx_http_rate_limit_coalesce_wake_handler(ngx_event_t *ev)
+{
+    ngx_connection_t   *c;
+    ngx_http_request_t *r;
+
+    r = ev->data;
+    c = r->connection;
+
+    ngx_http_set_log_request(c->log, r);
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "rate limit: coalesced request woken up");
+
+    r->read_event_handler = ngx_http_block_reading;
+    r->write_event_handler = ngx_http_core_run_phases;
+
+    ngx_http_core_run_phases(r);
+
+    ngx_http_run_posted_requests(c);
+}
+
+static void
+ngx_http_rate_limit_coalesce_cleanup(void *data)
+{
+    ngx_http_rate_limit_ctx_t *ctx = data;
+
+    ngx_http_rate_limit_flight_t *flight;
+
+    if (ctx->wake.posted) {
+        ngx_delete_posted_event(&ctx->wake);
+    }
+
+    flight = ctx->flight;
+
+    if (flight == NULL) {
+        return;
+    }
+
+    ngx_queue_remove(&ctx->queue);
+    ctx->flight = NULL;
+
+    if (flight->leader == ctx) {
+        /* gone before its command was answered */
+        flight->leader = NULL;
+        ngx_http_rate_limit_coalesce_promote(flight);
+    }
+}
@@ -0,0 +1,11 @@
+#ifndef NGX_HTTP_RATE_LIMIT_COALESCE_H
+#define NGX_HTTP_RATE_LIMIT_COALESCE_H
+
+#include "ngx_http_rate_limit_module.h"
+
+ngx_int_t ngx_http_rate_limit_coalesce_init_process(ngx_cycle_t *cycle);
+ngx_int_t ngx_http_rate_limit_coalesce(ngx_http_request_t *r,
+                                       ngx_http_rate_limit_ctx_t *ctx);
+void ngx_http_rate_limit_coalesce_settle(ngx_http_rate_limit_ctx_t *ctx);
+
+#endif /* NGX_HTTP_RATE_LIMIT_COALESCE_H */
@@ -0,0 +1,200 @@
+#include "ngx_http_rate_limit_connection.h"
+#include "ngx_http_rate_limit_adaptive.h"
+#include "ngx_http_rate_limit_charge.h"
+#include "ngx_http_rate_limit_policy.h"
+
+/* The last decision on a client connection */
+typedef struct {
+    /* the location and the key it was made for */
+    ngx_http_rate_limit_loc_conf_t *conf;
+    ngx_str_t                       key;
+    size_t                          size;
+
+    ngx_msec_t expires;
+    time_t     time;
+
+    ngx_rate_limit_reply_t reply;
+} ngx_http_rate_limit_connection_t;
+
+static ngx_connection_t *ngx_http_rate_limit_connection_get(
+        ngx_http_request_t *r);
+static ngx_http_rate_limit_connection_t *ngx_http_rate_limit_connection_find(
+        ngx_connection_t *c);
+static void ngx_http_rate_limit_connection_cleanup(void *data);
+
+ngx_int_t
+ngx_http_rate_limit_connection_merge(ngx_conf_t *cf,
+                                     ngx_http_rate_limit_loc_conf_t *prev,
+                                     ngx_http_rate_limit_loc_conf_t *conf)
+{
+    ngx_conf_merge_msec_value(conf->connection_cache, prev->connection_cache,
+                              0);
+
+    if (conf->connection_cache == 0 || conf->rule.quantity == 0) {
+        return NGX_OK;
+    }
+
+    /* units approved from the cache are charged on it */
+    return ngx_http_rate_limit_charge_add_sink(cf, conf);
+}
+
+/*
+ * Decide from the last decision on the connection of the request, made
+ * for the same key within rate_limit_connection_cache. Returns NGX_OK for
+ * an approval, NGX_BUSY for a denial, or NGX_DECLINED to check as usual.
+ */
+ngx_int_t
+ngx_http_rate_limit_connection_lookup(ngx_http_request_t *r,
+                                      ngx_http_rate_limit_ctx_t *ctx)
+{
+    time_t                            elapsed;
+    ngx_uint_t                        quantity;
+    ngx_rate_limit_rule_t             rule;
+    ngx_http_rate_limit_connection_t *cc;
+    ngx_http_rate_limit_loc_conf_t   *rlcf;
+
+    rlcf = ngx_http_get_module_loc_conf(r, ngx_http_rate_limit_module);
+
+    cc = ngx_http_rate_limit_connection_find(
+            ngx_http_rate_limit_connection_get(r));
+
+    if (cc == NULL || cc->conf != rlcf ||
+        (ngx_msec_int_t) (cc->expires - ngx_current_msec) <= 0) {
+        return NGX_DECLINED;
+    }
+
+    if (cc->key.len != ctx->key.len ||
+        ngx_memcmp(cc->key.data, ctx->key.data, ctx->key.len) != 0) {
+        return NGX_DECLINED;
+    }
+
+    quantity = ctx->quantity ? ctx->quantity : rlcf->rule.quantity;
+
+    if (!cc->reply.limited && quantity > 0) {
+
+        /* what is left is only ever less than redis has */
+        if (cc->reply.remaining < quantity || rlcf->charge_sink == NULL) {
+            return NGX_DECLINED;
+        }
+
+        cc->reply.remaining -= quantity;
+
+        rule = rlcf->rule;
+        rule.quantity = quantity;
+
+        if (rlcf->policy_zone) {
+            ngx_http_rate_limit_policy_apply(r, &rule);
+        }
+
+        if (rlcf->adaptive_zone) {
+            ngx_http_rate_limit_adaptive_apply(rlcf->adaptive_zone, &rule);
+        }
+
+        ngx_http_rate_limit_charge_send(rlcf->charge_sink, &ctx->key, &rule,
+                                        r->connection->log);
+    }
+
+    ctx->reply = cc->reply;
+
+    elapsed = ngx_time() - cc->time;
+
+    ctx->reply.reset = (ctx->reply.reset > (ngx_uint_t) elapsed)
+                           ? ctx->reply.reset - elapsed
+                           : 0;
+
+    if (ctx->reply.limited) {
+        ctx->reply.retry_after =
+            ngx_max(ctx->reply.retry_after - (ngx_int_t) elapsed, 1);
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "rate limit: connection cache %s for key \"%V\"",
+                   ctx->reply.limited ? "denied" : "approved", &ctx->key);
+
+    return ctx->reply.limited ? NGX_BUSY : NGX_OK;
+}
+
+/* Remember a decision of redis for later requests on the connection */
+ngx_int_t
+ngx_http_rate_limit_connection_store(ngx_http_request_t *r,
+                                     ngx_http_rate_limit_ctx_t *ctx)
+{
+    ngx_connection_t                 *c;
+    ngx_pool_cleanup_t               *cln;
+    ngx_http_rate_limit_connection_t *cc;
+    ngx_http_rate_limit_loc_conf_t   *rlcf;
+
+    rlcf = ngx_http_get_module_loc_conf(r, ngx_http_rate_limit_module);
+
+    c = ngx_http_rate_limit_connection_get(r);
+
+    cc = ngx_http_rate_limit_connection_find(c);
+
+    if (cc == NULL) {
+        cln = ngx_pool_cleanup_add(c->pool,
+                                   sizeof(ngx_http_rate_limit_connection_t));
+        if (cln == NULL) {
+            return NGX_ERROR;
+        }
+
+        cln->handler = ngx_http_rate_limit_connection_cleanup;
+
+        cc = cln->data;
+        ngx_memzero(cc, sizeof(ngx_http_rate_limit_connection_t));
+    }
+
+    /* the same key most of the time, a longer one grows the room */
+    if (cc->size < ctx->key.len) {
+        cc->key.data = ngx_pnalloc(c->pool, ctx->key.len);
+        if (cc->key.data == NULL) {
+            cc->conf = NULL;
+            cc->size = 0;
+            return NGX_ERROR;
+        }
+
+        cc->size = ctx->key.len;
+    }
+
+    cc->key.len = ngx_cpymem(cc->key.data, ctx->key.data, ctx->key.len) -
+                  cc->key.data;
+
+    cc->conf = rlcf;
+    cc->expires = ngx_current_msec + rlcf->connection_cache;
+    cc->time = ngx_time();
+    cc->reply = ctx->reply;
+
+    return NGX_OK;
+}
+
+/* The client connection, not the fake one of an HTTP/2 stream */
+static ngx_connection_t *
+ngx_http_rate_limit_connection_get(ngx_http_request_t *r)
+{
+#if (NGX_HTTP_V2)
+    if (r->stream) {
+        return r->stream->connection->connection;
+    }
+#endif
+
+    return r->connection;
+}
+
+static ngx_http_rate_limit_connection_t *
+ngx_http_rate_limit_connection_find(ngx_connection_t *c)
+{
+    ngx_pool_cleanup_t *cln;
+
+    for (cln = c->pool->cleanup; cln; cln = cln->next) {
+        if (cln->handler == ngx_http_rate_limit_connection_cleanup) {
+            return cln->data;
+        }
+    }
+
+    return NULL;
+}
+
+static void
+ngx_http_rate_limit_connection_cleanup(void *data)
+{
+    /* nothing to release, marks the decision in the pool */
+}
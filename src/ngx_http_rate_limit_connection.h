@@ -0,0 +1,14 @@
+#ifndef NGX_HTTP_RATE_LIMIT_CONNECTION_H
+#define NGX_HTTP_RATE_LIMIT_CONNECTION_H
+
+#include "ngx_http_rate_limit_module.h"
+
+ngx_int_t ngx_http_rate_limit_connection_merge(
+        ngx_conf_t *cf, ngx_http_rate_limit_loc_conf_t *prev,
+        ngx_http_rate_limit_loc_conf_t *conf);
+ngx_int_t ngx_http_rate_limit_connection_lookup(
+        ngx_http_request_t *r, ngx_http_rate_limit_ctx_t *ctx);
+ngx_int_t ngx_http_rate_limit_connection_store(
+        ngx_http_request_t *r, ngx_http_rate_limit_ctx_t *ctx);
+
+#endif /* NGX_HTTP_RATE_LIMIT_CONNECTION_H */
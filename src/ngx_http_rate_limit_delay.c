@@ -0,0 +1,211 @@
+#include "ngx_http_rate_limit_delay.h"
+#include "ngx_http_rate_limit_handler.h"
+#include "ngx_http_rate_limit_util.h"
+
+static void ngx_http_rate_limit_delay_handler(ngx_event_t *ev);
+static void ngx_http_rate_limit_delay_cleanup(void *data);
+
+/* requests this worker is holding on a timer */
+static ngx_uint_t ngx_http_rate_limit_delayed;
+
+/*
+ * Park a limited request until its retry_after is due, after which it is
+ * checked again. Returns NGX_DECLINED when it is to be rejected instead.
+ */
+ngx_int_t
+ngx_http_rate_limit_delay_request(ngx_http_request_t *r,
+                                  ngx_http_rate_limit_ctx_t *ctx)
+{
+    ngx_str_t                       text;
+    ngx_msec_t                      delay;
+    ngx_uint_t                      level;
+    ngx_pool_cleanup_t             *cln;
+    ngx_http_rate_limit_loc_conf_t *rlcf;
+
+    rlcf = ngx_http_get_module_loc_conf(r, ngx_http_rate_limit_module);
+
+    if (rlcf->delay == 0 || ctx->reply.retry_after < 0) {
+        return NGX_DECLINED;
+    }
+
+    delay = (ngx_msec_t) ctx->reply.retry_after * 1000;
+
+    if (delay == 0) {
+        /* due within a second, wait for one emission interval */
+        delay = rlcf->rule.period / rlcf->rule.requests;
+        delay = ngx_max(delay, 1);
+    }
+
+    if (ctx->delayed + delay > rlcf->delay) {
+        return NGX_DECLINED;
+    }
+
+    if (ngx_http_rate_limit_delayed >= rlcf->delay_queue) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "rate limit: delay queue is full (%ui)",
+                       ngx_http_rate_limit_delayed);
+        return NGX_DECLINED;
+    }
+
+    if (ctx->delayed == 0) {
+        cln = ngx_pool_cleanup_add(r->pool, 0);
+        if (cln == NULL) {
+            return NGX_ERROR;
+        }
+
+        cln->handler = ngx_http_rate_limit_delay_cleanup;
+        cln->data = ctx;
+    }
+
+    /* Reference: ngx_http_limit_req_handler */
+    level = (rlcf->limit_log_level == NGX_LOG_INFO) ? NGX_LOG_INFO
+                                                    : rlcf->limit_log_level + 1;
+
+    if (ngx_http_rate_limit_log_key(r, &ctx->key, &text) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ngx_log_error(level, r->connection->log, 0,
+                  "rate limit delaying request for %Mms, key \"%V\"", delay,
+                  &text);
+
+    ngx_http_rate_limit_clear_headers(r);
+
+    ctx->finalized = 0;
+    ctx->status = 0;
+    ctx->quantity = 0;
+    ngx_memzero(&ctx->reply, sizeof(ngx_rate_limit_reply_t));
+
+    ctx->delayed += delay;
+
+    if (ctx->wake.posted) {
+        ngx_delete_posted_event(&ctx->wake);
+    }
+
+    ctx->wake.handler = ngx_http_rate_limit_delay_handler;
+    ctx->wake.data = r;
+    ctx->wake.log = r->connection->log;
+
+    ngx_add_timer(&ctx->wake, delay);
+
+    ngx_http_rate_limit_delayed++;
+
+    r->read_event_handler = ngx_http_test_reading;
+    r->write_event_handler = ngx_http_core_run_phases;
+
+    return NGX_AGAIN;
+}
+
+/* Reference: ngx_http_limit_req_delay */
+static void
+ngx_http_rate_limit_delay_handler(ngx_event_t *ev)
+{
+    ngx_connection_t          *c;
+    ngx_http_request_t        *r;
+    ngx_http_rate_limit_ctx_t *ctx;
+
+    r = ev->data;
+    c = r->connection;
+
+    ngx_http_set_log_request(c->log, r);
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "rate limit: delayed request woken up");
+
+    ngx_http_rate_limit_delayed--;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_rate_limit_module);
+    ctx->retry = 1;
+
+    r->read_event_handler = ngx_http_block_reading;
+    r->write_event_handler = ngx_http_core_run_phases;
+
+    ngx_http_core_run_phases(r);
+
+    ngx_http_run_posted_requests(c);
+}
+
+static void
+ngx_http_rate_limit_delay_cleanup(void *data)
+{
+    ngx_http_rate_limit_ctx_t *ctx = data;
+
+    if (ctx->wake.timer_set) {
+        /* the client went away while waiting */
+        ngx_del_timer(&ctx->wake);
+        ngx_http_rate_limit_delayed--;
+    }
+}
+
+char *
+ngx_http_rate_limit_delay(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_rate_limit_loc_conf_t *rlcf = conf;
+
+    ngx_str_t *value, s;
+    ngx_int_t  max, queue;
+    ngx_uint_t i;
+
+    if (rlcf->delay != NGX_CONF_UNSET_MSEC) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        if (cf->args->nelts != 2) {
+            return "takes no parameters with \"off\"";
+        }
+
+        rlcf->delay = 0;
+        return NGX_CONF_OK;
+    }
+
+    max = 0;
+    queue = 1024;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "max=", 4) == 0) {
+
+            s.len = value[i].len - 4;
+            s.data = value[i].data + 4;
+
+            max = ngx_parse_time(&s, 0);
+            if (max <= 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid max time \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "queue=", 6) == 0) {
+
+            queue = ngx_atoi(value[i].data + 6, value[i].len - 6);
+            if (queue <= 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid queue value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"",
+                           &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (max == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must have \"max\" parameter", &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    rlcf->delay = (ngx_msec_t) max;
+    rlcf->delay_queue = (ngx_uint_t) queue;
+
+    return NGX_CONF_OK;
+}
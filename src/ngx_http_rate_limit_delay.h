@@ -0,0 +1,11 @@
+#ifndef NGX_HTTP_RATE_LIMIT_DELAY_H
+#define NGX_HTTP_RATE_LIMIT_DELAY_H
+
+#include "ngx_http_rate_limit_module.h"
+
+char *ngx_http_rate_limit_delay(ngx_conf_t *cf, ngx_command_t *cmd,
+                                void *conf);
+ngx_int_t ngx_http_rate_limit_delay_request(ngx_http_request_t *r,
+                                            ngx_http_rate_limit_ctx_t *ctx);
+
+#endif /* NGX_HTTP_RATE_LIMIT_DELAY_H */
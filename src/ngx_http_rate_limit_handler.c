@@ -1,8 +1,49 @@
 #include "ngx_http_rate_limit_handler.h"
+#include "ngx_http_rate_limit_backend.h"
+#include "ngx_http_rate_limit_block.h"
+#include "ngx_http_rate_limit_cache.h"
+#include "ngx_http_rate_limit_coalesce.h"
+#include "ngx_http_rate_limit_connection.h"
+#include "ngx_http_rate_limit_delay.h"
+#include "ngx_http_rate_limit_list.h"
+#include "ngx_http_rate_limit_local.h"
+#include "ngx_http_rate_limit_log.h"
+#include "ngx_http_rate_limit_metrics.h"
 #include "ngx_http_rate_limit_reply.h"
+#include "ngx_http_rate_limit_sketch.h"
+#include "ngx_http_rate_limit_target.h"
 #include "ngx_http_rate_limit_upstream.h"
 #include "ngx_http_rate_limit_util.h"
 
+/* the room for the values of the headers below, after the ctx */
+#define NGX_HTTP_RATE_LIMIT_VALUES_LEN (4 * NGX_INT_T_LEN)
+
+/* a RATER.LIMIT reply, or an error, without a handshake ahead of it */
+#define NGX_HTTP_RATE_LIMIT_REPLY_SIZE 256
+
+typedef struct ngx_http_rate_limit_reply_buf_s ngx_http_rate_limit_reply_buf_t;
+
+struct ngx_http_rate_limit_reply_buf_s {
+    ngx_http_rate_limit_reply_buf_t *next;
+    u_char                           data[NGX_HTTP_RATE_LIMIT_REPLY_SIZE];
+};
+
+/* reply buffers of finished requests, reused by this worker */
+static ngx_http_rate_limit_reply_buf_t *ngx_http_rate_limit_free_replies;
+
+static ngx_int_t ngx_http_rate_limit_reject(ngx_http_request_t *r,
+                                            ngx_http_rate_limit_ctx_t *ctx);
+static ngx_int_t ngx_http_rate_limit_mark_main(ngx_http_request_t *r,
+                                               ngx_http_rate_limit_ctx_t *ctx);
+static ngx_int_t ngx_http_rate_limit_status(ngx_http_request_t *r,
+                                            ngx_http_rate_limit_ctx_t *ctx);
+static ngx_int_t ngx_http_rate_limit_check(ngx_http_request_t *r,
+                                           ngx_http_rate_limit_ctx_t *ctx);
+static ngx_int_t ngx_http_rate_limit_send(ngx_http_request_t *r,
+                                          ngx_http_rate_limit_ctx_t *ctx);
+static ngx_int_t ngx_http_rate_limit_reply_buffer(ngx_http_request_t *r,
+                                                  ngx_http_upstream_t *u);
+static void ngx_http_rate_limit_reply_cleanup(void *data);
 static ngx_int_t ngx_http_rate_limit_create_request(ngx_http_request_t *r);
 static ngx_int_t ngx_http_rate_limit_reinit_request(ngx_http_request_t *r);
 static ngx_int_t ngx_http_rate_limit_process_header(ngx_http_request_t *r);
@@ -11,23 +52,37 @@ static ngx_int_t ngx_http_rate_limit_filter(void *data, ssize_t bytes);
 static void ngx_http_rate_limit_abort_request(ngx_http_request_t *r);
 static void ngx_http_rate_limit_finalize_request(ngx_http_request_t *r,
                                                  ngx_int_t rc);
+static void ngx_http_rate_limit_ctx_cleanup(void *data);
+#if (NGX_DEBUG)
+static void ngx_http_rate_limit_pool_usage(ngx_http_request_t *r);
+#endif
 
-static ngx_str_t x_limit_header = ngx_string("X-RateLimit-Limit");
-static ngx_str_t x_remaining_header = ngx_string("X-RateLimit-Remaining");
-static ngx_str_t x_reset_header = ngx_string("X-RateLimit-Reset");
-static ngx_str_t x_retry_after_header = ngx_string("Retry-After");
+/* the hashes are set by ngx_http_rate_limit_headers_init() */
+static ngx_http_rate_limit_header_t x_limit_header = {
+    ngx_string("X-RateLimit-Limit"), (u_char *) "x-ratelimit-limit", 0
+};
+
+static ngx_http_rate_limit_header_t x_remaining_header = {
+    ngx_string("X-RateLimit-Remaining"), (u_char *) "x-ratelimit-remaining", 0
+};
+
+static ngx_http_rate_limit_header_t x_reset_header = {
+    ngx_string("X-RateLimit-Reset"), (u_char *) "x-ratelimit-reset", 0
+};
+
+static ngx_http_rate_limit_header_t x_retry_after_header = {
+    ngx_string("Retry-After"), (u_char *) "retry-after", 0
+};
 
 ngx_int_t
 ngx_http_rate_limit_handler(ngx_http_request_t *r)
 {
-    ngx_http_upstream_t            *u;
     ngx_http_rate_limit_ctx_t      *ctx;
     ngx_http_rate_limit_loc_conf_t *rlcf;
+    ngx_str_t                       key;
     size_t                          len;
-    u_char                         *p, *n;
-    ngx_uint_t                      status;
-    ngx_str_t                       target;
-    ngx_url_t                       url;
+    u_char                         *p;
+    ngx_int_t                       rc;
 
     rlcf = ngx_http_get_module_loc_conf(r, ngx_http_rate_limit_module);
 
@@ -38,58 +93,133 @@ ngx_http_rate_limit_handler(ngx_http_request_t *r)
     ctx = ngx_http_get_module_ctx(r, ngx_http_rate_limit_module);
 
     if (ctx != NULL) {
+        if (ctx->promoted) {
+            /* this request sends the check for a coalesced batch */
+            ctx->promoted = 0;
+
+            return ngx_http_rate_limit_send(r, ctx);
+        }
+
+        if (ctx->resolved) {
+            /* the rate_limit_pass target has its addresses now */
+            ctx->resolved = 0;
+
+            return ngx_http_rate_limit_send(r, ctx);
+        }
+
+        if (ctx->retry) {
+            /* a delayed request is due, check it again */
+            ctx->retry = 0;
+
+            return ngx_http_rate_limit_check(r, ctx);
+        }
+
         if (!ctx->finalized) {
             return NGX_AGAIN;
         }
 
-        status = r->upstream->state->status;
+        return ngx_http_rate_limit_status(r, ctx);
+    }
 
-        /* Return appropriate status */
+    /* decided before an internal redirect, or for the main request */
 
-        if (status == NGX_HTTP_TOO_MANY_REQUESTS) {
-            ngx_log_error(rlcf->limit_log_level, r->connection->log, 0,
-                          "rate limit exceeded for key \"%V\"", &ctx->key);
+    ctx = rlcf->recheck ? NULL : ngx_http_rate_limit_main_ctx(r);
 
-            return rlcf->status_code;
-        }
+    if (ctx != NULL && ctx->finalized) {
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "rate limit: reusing status %ui for key \"%V\"",
+                       ctx->status, &ctx->key);
 
-        if (status == NGX_HTTP_OK) {
-            return NGX_OK;
+        if (ctx->status == NGX_HTTP_OK) {
+            return NGX_DECLINED;
         }
 
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                      "rate limit unexpected status: %ui", status);
+        if (ctx->status == NGX_HTTP_TOO_MANY_REQUESTS) {
+            return rlcf->status_code;
+        }
 
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
 
-    ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_rate_limit_ctx_t));
-    if (ctx == NULL) {
-        return NGX_ERROR;
+    /* Allowlists and denylists are consulted before any Redis traffic */
+
+    if (rlcf->allow &&
+        ngx_http_rate_limit_list_match_addr(rlcf->allow, r->connection) ==
+            NGX_OK) {
+        return NGX_DECLINED;
     }
 
-    if (ngx_http_complex_value(r, &rlcf->key, &ctx->key) != NGX_OK) {
+    if (rlcf->deny &&
+        ngx_http_rate_limit_list_match_addr(rlcf->deny, r->connection) ==
+            NGX_OK) {
+        ngx_log_error(rlcf->limit_log_level, r->connection->log, 0,
+                      "rate limit denied client address");
+
+        return ngx_http_rate_limit_reject(r, NULL);
+    }
+
+    if (ngx_http_complex_value(r, &rlcf->key, &key) != NGX_OK) {
         return NGX_ERROR;
     }
 
-    if (ctx->key.len == 0) {
+    if (key.len == 0) {
+        return NGX_DECLINED;
+    }
+
+    if (rlcf->allow &&
+        ngx_http_rate_limit_list_match_key(rlcf->allow, &key) == NGX_OK) {
         return NGX_DECLINED;
     }
 
-    len = rlcf->prefix.len;
+    if (rlcf->deny &&
+        ngx_http_rate_limit_list_match_key(rlcf->deny, &key) == NGX_OK) {
+        ngx_log_error(rlcf->limit_log_level, r->connection->log, 0,
+                      "rate limit denied key \"%V\"", &key);
+
+        return ngx_http_rate_limit_reject(r, NULL);
+    }
+
+    /* the ctx, the values of its headers and its prefixed key at once */
+
+    len = rlcf->address ? NGX_HTTP_RATE_LIMIT_ADDRESS_LEN : 0;
+
+    if (rlcf->prefix.len) {
+        len = rlcf->prefix.len + 1 + (len ? len : key.len) + 1;
+    }
+
+    ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_rate_limit_ctx_t) +
+                                   NGX_HTTP_RATE_LIMIT_VALUES_LEN + len);
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->values = (u_char *) ctx + sizeof(ngx_http_rate_limit_ctx_t);
+    ctx->key = key;
+    ctx->request = r;
 
     if (len > 0) {
-        n = ngx_pnalloc(r->pool, len + ctx->key.len + 2);
-        if (n == NULL) {
-            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        p = ctx->values + NGX_HTTP_RATE_LIMIT_VALUES_LEN;
+
+        ctx->key.data = p;
+
+        if (rlcf->prefix.len) {
+            p = ngx_cpymem(p, rlcf->prefix.data, rlcf->prefix.len);
+            *p++ = '_';
         }
 
-        p = ngx_cpymem(n, rlcf->prefix.data, len);
-        p = ngx_cpymem(p, "_", 1);
-        ngx_cpystrn(p, ctx->key.data, ctx->key.len + 2);
+        /* the key only decides whether the address is limited */
+        if (rlcf->address) {
+            p = ngx_http_rate_limit_address_key(r, p);
+
+        } else {
+            p = ngx_cpymem(p, key.data, key.len);
+        }
 
-        ctx->key.len += len + 1;
-        ctx->key.data = n;
+        ctx->key.len = p - ctx->key.data;
+    }
+
+    if (ngx_http_rate_limit_mark_main(r, ctx) != NGX_OK) {
+        return NGX_ERROR;
     }
 
     if (ctx->key.len > 65535) {
@@ -100,15 +230,283 @@ ngx_http_rate_limit_handler(ngx_http_request_t *r)
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
 
-    ctx->request = r;
+    if (rlcf->cache) {
+        rc = ngx_http_rate_limit_cache_lookup(r, ctx);
 
-    if (ngx_http_upstream_create(r) != NGX_OK) {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        if (rc == NGX_ERROR) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        if (rc == NGX_OK) {
+            /* served from the cache, at no cost to the origin */
+            return NGX_DECLINED;
+        }
     }
 
-    u = r->upstream;
+    if (rlcf->block_zone &&
+        ngx_http_rate_limit_block_lookup(r, ctx) == NGX_BUSY) {
+        /* limited on this or another node, redis would say the same */
+        ctx->status = NGX_HTTP_TOO_MANY_REQUESTS;
+        ctx->finalized = 1;
+
+        ngx_http_rate_limit_set_headers(r, ctx);
+
+        ngx_http_set_ctx(r, ctx, ngx_http_rate_limit_module);
+
+        return ngx_http_rate_limit_status(r, ctx);
+    }
+
+    if (rlcf->sketch_zone) {
+        rc = ngx_http_rate_limit_sketch_account(r, ctx);
+
+        if (rc == NGX_BUSY) {
+            ngx_http_rate_limit_set_headers(r, ctx);
+
+            ngx_http_rate_limit_log_limited(r, &ctx->key);
+
+            return ngx_http_rate_limit_reject(r, ctx);
+        }
+
+        if (rlcf->upstream.upstream == NULL && rlcf->complex_target == NULL &&
+            rlcf->local_zone == NULL) {
+            /* the sketch is the only stage */
+
+            if (rlcf->enable_headers) {
+                ngx_http_rate_limit_set_headers(r, ctx);
+            }
+
+            return NGX_DECLINED;
+        }
+
+        /* the exact check below parses its own values */
+        ngx_memzero(&ctx->reply, sizeof(ngx_rate_limit_reply_t));
+    }
+
+    return ngx_http_rate_limit_check(r, ctx);
+}
+
+/*
+ * A rejection decided before redis is kept like one of redis, so that an
+ * internal redirect, such as to an error_page, does not decide again.
+ * A denied request gets a ctx without a key, which nothing charges.
+ */
+static ngx_int_t
+ngx_http_rate_limit_reject(ngx_http_request_t *r,
+                           ngx_http_rate_limit_ctx_t *ctx)
+{
+    ngx_http_rate_limit_loc_conf_t *rlcf;
+
+    rlcf = ngx_http_get_module_loc_conf(r, ngx_http_rate_limit_module);
+
+    if (ctx == NULL) {
+        ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_rate_limit_ctx_t) +
+                                       NGX_HTTP_RATE_LIMIT_VALUES_LEN);
+        if (ctx == NULL) {
+            return NGX_ERROR;
+        }
+
+        ctx->values = (u_char *) ctx + sizeof(ngx_http_rate_limit_ctx_t);
+        ctx->request = r;
+
+        if (ngx_http_rate_limit_mark_main(r, ctx) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    ctx->status = NGX_HTTP_TOO_MANY_REQUESTS;
+    ctx->finalized = 1;
+
+    ngx_http_set_ctx(r, ctx, ngx_http_rate_limit_module);
+
+    return rlcf->status_code;
+}
+
+/* The ctx outlives the module ctx, which an internal redirect wipes */
+static ngx_int_t
+ngx_http_rate_limit_mark_main(ngx_http_request_t *r,
+                              ngx_http_rate_limit_ctx_t *ctx)
+{
+    ngx_pool_cleanup_t *cln;
+
+    if (r != r->main) {
+        return NGX_OK;
+    }
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_http_rate_limit_ctx_cleanup;
+    cln->data = ctx;
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_rate_limit_status(ngx_http_request_t *r,
+                           ngx_http_rate_limit_ctx_t *ctx)
+{
+    ngx_int_t                       rc;
+    ngx_uint_t                      status;
+    ngx_http_rate_limit_loc_conf_t *rlcf;
+
+    rlcf = ngx_http_get_module_loc_conf(r, ngx_http_rate_limit_module);
+
+    status = ctx->status;
+
+    /*
+     * A check of 0 is never limited, but with rate_limit_charge nothing is
+     * left for the response to be charged against once none remain.
+     */
+    if (status == NGX_HTTP_OK && rlcf->charge && rlcf->rule.quantity == 0 &&
+        ctx->quantity == 0 && ctx->reply.remaining == 0) {
+        ctx->status = NGX_HTTP_TOO_MANY_REQUESTS;
+        ctx->reply.limited = 1;
+        ctx->reply.retry_after =
+            (ngx_int_t) ctx->reply.reset -
+            (ngx_int_t) (rlcf->rule.burst * rlcf->rule.period /
+                         rlcf->rule.requests / 1000);
+        ctx->reply.retry_after = ngx_max(ctx->reply.retry_after, 1);
+
+        if (rlcf->enable_headers) {
+            ngx_http_rate_limit_clear_headers(r);
+            ngx_http_rate_limit_set_headers(r, ctx);
+        }
+
+        status = NGX_HTTP_TOO_MANY_REQUESTS;
+    }
+
+    /* Return appropriate status */
+
+    if (status == NGX_HTTP_TOO_MANY_REQUESTS) {
+        rc = ngx_http_rate_limit_delay_request(r, ctx);
+
+        if (rc == NGX_AGAIN) {
+            return NGX_AGAIN;
+        }
+
+        if (rc == NGX_ERROR) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        ngx_http_rate_limit_log_limited(r, &ctx->key);
+
+        return rlcf->status_code;
+    }
+
+    if (status == NGX_HTTP_OK) {
+        return NGX_OK;
+    }
+
+    if (ctx->replica) {
+        ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                      "rate limit replica failed with status %ui, "
+                      "checking on the primary",
+                      status);
+
+        ctx->replica = 0;
+        ctx->fallback = 1;
+        ctx->finalized = 0;
+        ctx->status = 0;
+
+        ngx_memzero(&ctx->reply, sizeof(ngx_rate_limit_reply_t));
+
+        /* whatever the replica left, the primary sets them again */
+        ngx_http_rate_limit_clear_headers(r);
+
+        return ngx_http_rate_limit_send(r, ctx);
+    }
+
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                  "rate limit unexpected status: %ui", status);
+
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+}
+
+static ngx_int_t
+ngx_http_rate_limit_check(ngx_http_request_t *r, ngx_http_rate_limit_ctx_t *ctx)
+{
+    ngx_int_t                       rc;
+    ngx_http_rate_limit_loc_conf_t *rlcf;
+
+    rlcf = ngx_http_get_module_loc_conf(r, ngx_http_rate_limit_module);
+
+    if (rlcf->local_zone) {
+        /* decided here, without a round trip to redis */
 
-    if (rlcf->complex_target) {
+        rc = ngx_http_rate_limit_local_account(r, ctx);
+
+        if (rc == NGX_ERROR) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        ctx->status = (rc == NGX_BUSY) ? NGX_HTTP_TOO_MANY_REQUESTS
+                                       : NGX_HTTP_OK;
+        ctx->finalized = 1;
+
+        if (rc == NGX_BUSY || rlcf->enable_headers) {
+            ngx_http_rate_limit_set_headers(r, ctx);
+        }
+
+        ngx_http_set_ctx(r, ctx, ngx_http_rate_limit_module);
+
+        return ngx_http_rate_limit_status(r, ctx);
+    }
+
+    if (rlcf->connection_cache) {
+        /* decided by an earlier request on the same connection */
+
+        rc = ngx_http_rate_limit_connection_lookup(r, ctx);
+
+        if (rc != NGX_DECLINED) {
+            ctx->status = (rc == NGX_BUSY) ? NGX_HTTP_TOO_MANY_REQUESTS
+                                           : NGX_HTTP_OK;
+            ctx->finalized = 1;
+
+            if (rc == NGX_BUSY || rlcf->enable_headers) {
+                ngx_http_rate_limit_set_headers(r, ctx);
+            }
+
+            ngx_http_set_ctx(r, ctx, ngx_http_rate_limit_module);
+
+            return ngx_http_rate_limit_status(r, ctx);
+        }
+    }
+
+    if (rlcf->coalesce) {
+        rc = ngx_http_rate_limit_coalesce(r, ctx);
+
+        if (rc == NGX_AGAIN) {
+            /* settled along with the check already in flight */
+            return NGX_AGAIN;
+        }
+
+        if (rc != NGX_OK) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+
+    return ngx_http_rate_limit_send(r, ctx);
+}
+
+static ngx_int_t
+ngx_http_rate_limit_send(ngx_http_request_t *r, ngx_http_rate_limit_ctx_t *ctx)
+{
+    ngx_int_t                       rc;
+    ngx_http_upstream_t            *u;
+    ngx_http_rate_limit_loc_conf_t *rlcf;
+    ngx_http_upstream_srv_conf_t   *us;
+    ngx_str_t                       target;
+    ngx_url_t                       url;
+
+    rlcf = ngx_http_get_module_loc_conf(r, ngx_http_rate_limit_module);
+
+    /* a check that consumes nothing can be answered by a replica */
+    ctx->replica = rlcf->replica && !ctx->fallback &&
+                   rlcf->rule.quantity == 0 && ctx->quantity == 0;
+
+    if (rlcf->complex_target && !ctx->replica) {
         /* Variables used in the rate_limit_pass directive */
 
         if (ngx_http_complex_value(r, rlcf->complex_target, &target) !=
@@ -126,20 +524,54 @@ ngx_http_rate_limit_handler(ngx_http_request_t *r)
         url.port = 0;
         url.no_resolve = 1;
 
-        rlcf->upstream.upstream = ngx_http_rate_limit_upstream_add(r, &url);
+        us = ngx_http_rate_limit_upstream_add(r, &url);
 
-        if (rlcf->upstream.upstream == NULL) {
-            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                          "rate limit: upstream \"%V\" not found", &target);
+        if (us == NULL) {
+            /* a host:port, resolved at run time */
 
-            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            rc = ngx_http_rate_limit_target(r, ctx, &target, &us);
+
+            if (rc == NGX_AGAIN) {
+                return NGX_AGAIN;
+            }
+
+            if (rc != NGX_OK) {
+                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                              "rate limit: upstream \"%V\" not found",
+                              &target);
+
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
         }
+
+        rlcf->upstream.upstream = us;
+    }
+
+    if (ngx_http_upstream_create(r) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
 
+    u = r->upstream;
+
     ngx_str_set(&u->schema, "redis2://");
     u->output.tag = (ngx_buf_tag_t) &ngx_http_rate_limit_module;
 
-    u->conf = &rlcf->upstream;
+#if (NGX_HTTP_SSL)
+    if (rlcf->ssl) {
+        /* the handshake is done by the upstream module once connected */
+        ngx_str_set(&u->schema, "rediss://");
+        u->ssl = 1;
+    }
+#endif
+
+    u->conf = ctx->replica ? rlcf->replica : &rlcf->upstream;
+
+    /* replies to a handshake, such as HELLO, may need the full buffer */
+    if (rlcf->handshake.len == 0 &&
+        u->conf->buffer_size >= NGX_HTTP_RATE_LIMIT_REPLY_SIZE &&
+        ngx_http_rate_limit_reply_buffer(r, u) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
 
     u->create_request = ngx_http_rate_limit_create_request;
     u->reinit_request = ngx_http_rate_limit_reinit_request;
@@ -149,6 +581,9 @@ ngx_http_rate_limit_handler(ngx_http_request_t *r)
 
     ngx_http_set_ctx(r, ctx, ngx_http_rate_limit_module);
 
+    /* set again if the connection turns out to be a new one */
+    ctx->handshake = 0;
+
     u->input_filter_init = ngx_http_rate_limit_filter_init;
     u->input_filter = ngx_http_rate_limit_filter;
     u->input_filter_ctx = ctx;
@@ -164,6 +599,58 @@ ngx_http_rate_limit_handler(ngx_http_request_t *r)
     return NGX_AGAIN;
 }
 
+/*
+ * Instead of a page of rate_limit_buffer_size from the request pool, the
+ * reply is read into a small buffer taken from a free list of the worker.
+ * It is given back once the request is done.
+ */
+static ngx_int_t
+ngx_http_rate_limit_reply_buffer(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_pool_cleanup_t              *cln;
+    ngx_http_rate_limit_reply_buf_t *rb;
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    rb = ngx_http_rate_limit_free_replies;
+
+    if (rb) {
+        ngx_http_rate_limit_free_replies = rb->next;
+
+    } else {
+        rb = ngx_alloc(sizeof(ngx_http_rate_limit_reply_buf_t),
+                       r->connection->log);
+        if (rb == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    cln->handler = ngx_http_rate_limit_reply_cleanup;
+    cln->data = rb;
+
+    u->buffer.start = rb->data;
+    u->buffer.pos = u->buffer.start;
+    u->buffer.last = u->buffer.start;
+    u->buffer.end = u->buffer.start + NGX_HTTP_RATE_LIMIT_REPLY_SIZE;
+    u->buffer.temporary = 1;
+
+    u->buffer.tag = u->output.tag;
+
+    return NGX_OK;
+}
+
+static void
+ngx_http_rate_limit_reply_cleanup(void *data)
+{
+    ngx_http_rate_limit_reply_buf_t *rb = data;
+
+    rb->next = ngx_http_rate_limit_free_replies;
+    ngx_http_rate_limit_free_replies = rb;
+}
+
 static ngx_int_t
 ngx_http_rate_limit_create_request(ngx_http_request_t *r)
 {
@@ -210,42 +697,69 @@ ngx_http_rate_limit_reinit_request(ngx_http_request_t *r)
 static ngx_int_t
 ngx_http_rate_limit_process_header(ngx_http_request_t *r)
 {
-    ngx_http_upstream_t       *u;
-    ngx_http_rate_limit_ctx_t *ctx;
-    ngx_buf_t                 *b;
-    u_char                     chr;
-    ngx_str_t                  buf;
+    ngx_http_upstream_t            *u;
+    ngx_http_rate_limit_ctx_t      *ctx;
+    ngx_http_rate_limit_loc_conf_t *rlcf;
+    ngx_buf_t                      *b;
+    u_char                          chr;
+    ngx_int_t                       rc;
+    ngx_str_t                       buf;
+
+    rlcf = ngx_http_get_module_loc_conf(r, ngx_http_rate_limit_module);
 
     u = r->upstream;
     b = &u->buffer;
 
-    if (b->last - b->pos < (ssize_t) sizeof(u_char)) {
-        return NGX_AGAIN;
-    }
-
     ctx = ngx_http_get_module_ctx(r, ngx_http_rate_limit_module);
     if (ctx == NULL) {
         return NGX_ERROR;
     }
 
-    /* the first char is the response header */
+    /* the replies to AUTH, SELECT and HELLO come first */
+    while (ctx->handshake) {
+        rc = ngx_rate_limit_redis_skip_reply(b);
+
+        if (rc == NGX_AGAIN) {
+            return NGX_AGAIN;
+        }
+
+        if (rc != NGX_OK) {
+            buf.data = b->pos;
+            buf.len = b->last - b->pos;
+
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "rate limit: redis rejected the handshake: \"%V\"",
+                          &buf);
+
+            return NGX_HTTP_UPSTREAM_INVALID_HEADER;
+        }
+
+        ctx->handshake--;
+    }
+
+    if (b->last - b->pos < (ssize_t) sizeof(u_char)) {
+        return NGX_AGAIN;
+    }
+
+    /* the first char is the response header, it is parsed again along
+     * with the rest of the reply */
     chr = *b->pos;
 
-    /* we are always expecting a multi bulk reply */
-    if (chr != '*') {
+    if (!rlcf->backend->test_reply(chr)) {
         buf.data = b->pos;
         buf.len = b->last - b->pos;
 
         ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                      "rate limit: redis sent invalid response: \"%V\"", &buf);
+                      "rate limit: %V sent invalid response: \"%V\"",
+                      &rlcf->backend->name, &buf);
 
         return NGX_HTTP_UPSTREAM_INVALID_HEADER;
     }
 
-    ++b->pos;
-
     u->state->status = NGX_HTTP_OK;
 
+    ngx_http_rate_limit_metrics_ssl(r, u->peer.connection);
+
     return NGX_OK;
 }
 
@@ -287,23 +801,179 @@ ngx_http_rate_limit_finalize_request(ngx_http_request_t *r, ngx_int_t rc)
 
     rlcf = ngx_http_get_module_loc_conf(r, ngx_http_rate_limit_module);
 
-    if (r->upstream->state->status == NGX_HTTP_TOO_MANY_REQUESTS ||
-        rlcf->enable_headers) {
-        /* X-RateLimit-Limit HTTP header */
-        (void) ngx_set_custom_header(r, &x_limit_header, ctx->limit);
+    ctx->status = r->upstream->state->status;
 
-        /* X-RateLimit-Remaining HTTP header */
-        (void) ngx_set_custom_header(r, &x_remaining_header, ctx->remaining);
+    if (ctx->flight) {
+        ngx_http_rate_limit_coalesce_settle(ctx);
+    }
 
-        /* X-RateLimit-Reset */
-        (void) ngx_set_custom_header(r, &x_reset_header, ctx->reset);
+    if (rlcf->block_zone && ctx->status == NGX_HTTP_TOO_MANY_REQUESTS) {
+        ngx_http_rate_limit_block_publish(r, ctx);
+    }
 
-        /* Retry-After (always -1 if the action was allowed) */
-        if (ctx->retry_after != -1) {
-            (void) ngx_set_custom_header(r, &x_retry_after_header,
-                                         (ngx_uint_t) ctx->retry_after);
-        }
+    /* a replica lags behind, only a decision of the primary is kept */
+    if (rlcf->connection_cache && !ctx->replica &&
+        (ctx->status == NGX_HTTP_OK ||
+         ctx->status == NGX_HTTP_TOO_MANY_REQUESTS)) {
+        (void) ngx_http_rate_limit_connection_store(r, ctx);
+    }
+
+    /* a replica that failed is asked again on the primary */
+    if ((ctx->status == NGX_HTTP_TOO_MANY_REQUESTS || rlcf->enable_headers) &&
+        !(ctx->replica && ctx->status != NGX_HTTP_OK &&
+          ctx->status != NGX_HTTP_TOO_MANY_REQUESTS)) {
+        ngx_http_rate_limit_set_headers(r, ctx);
     }
 
     ctx->finalized = 1;
+
+#if (NGX_DEBUG)
+    ngx_http_rate_limit_pool_usage(r);
+#endif
+}
+
+#if (NGX_DEBUG)
+/*
+ * What the request pool holds once a check is done. Checks of subrequests
+ * share the pool of the main request, so with N of them in flight the
+ * growth from one line to the next is what a check costs.
+ */
+static void
+ngx_http_rate_limit_pool_usage(ngx_http_request_t *r)
+{
+    size_t             size;
+    ngx_uint_t         blocks, large;
+    ngx_pool_t        *p;
+    ngx_pool_large_t  *l;
+
+    size = 0;
+    blocks = 0;
+    large = 0;
+
+    for (p = r->pool; p; p = p->d.next) {
+        size += p->d.last - (u_char *) p;
+        blocks++;
+    }
+
+    for (l = r->pool->large; l; l = l->next) {
+        if (l->alloc) {
+            large++;
+        }
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "rate limit: request pool holds %uz bytes in %ui blocks "
+                   "and %ui large allocations", size, blocks, large);
+}
+#endif
+
+void
+ngx_http_rate_limit_set_headers(ngx_http_request_t *r,
+                                ngx_http_rate_limit_ctx_t *ctx)
+{
+    u_char *p;
+
+    /* written over if set again, the headers set before are cleared */
+    p = ctx->values;
+
+    /* X-RateLimit-Limit HTTP header */
+    (void) ngx_set_custom_header(r, &x_limit_header, p, ctx->reply.limit);
+    p += NGX_INT_T_LEN;
+
+    /* X-RateLimit-Remaining HTTP header */
+    (void) ngx_set_custom_header(r, &x_remaining_header, p,
+                                 ctx->reply.remaining);
+    p += NGX_INT_T_LEN;
+
+    /* X-RateLimit-Reset */
+    (void) ngx_set_custom_header(r, &x_reset_header, p, ctx->reply.reset);
+    p += NGX_INT_T_LEN;
+
+    /*
+     * Retry-After (always -1 if the action was allowed), in whole seconds:
+     * a wait of less than a second is rounded up, 0 would have the client
+     * come back right away.
+     */
+    if (ctx->reply.retry_after != -1) {
+        (void) ngx_set_custom_header(
+                r, &x_retry_after_header, p,
+                (ctx->reply.limited && ctx->reply.retry_after == 0)
+                    ? 1
+                    : (ngx_uint_t) ctx->reply.retry_after);
+    }
+}
+
+void
+ngx_http_rate_limit_clear_headers(ngx_http_request_t *r)
+{
+    ngx_uint_t       i;
+    ngx_list_part_t *part;
+    ngx_table_elt_t *h;
+
+    part = &r->headers_out.headers.part;
+    h = part->elts;
+
+    for (i = 0; /* void */; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            h = part->elts;
+            i = 0;
+        }
+
+        /* the headers set above share the key of their name */
+        if (h[i].key.data == x_limit_header.key.data ||
+            h[i].key.data == x_remaining_header.key.data ||
+            h[i].key.data == x_reset_header.key.data ||
+            h[i].key.data == x_retry_after_header.key.data) {
+            h[i].hash = 0;
+        }
+    }
+}
+
+void
+ngx_http_rate_limit_headers_init(void)
+{
+    x_limit_header.hash =
+        ngx_hash_key(x_limit_header.lowcase_key, x_limit_header.key.len);
+    x_remaining_header.hash = ngx_hash_key(x_remaining_header.lowcase_key,
+                                           x_remaining_header.key.len);
+    x_reset_header.hash =
+        ngx_hash_key(x_reset_header.lowcase_key, x_reset_header.key.len);
+    x_retry_after_header.hash = ngx_hash_key(x_retry_after_header.lowcase_key,
+                                             x_retry_after_header.key.len);
+}
+
+/*
+ * The ctx of the main request, found through its pool cleanup once an
+ * internal redirect wiped it, or from a subrequest, which shares the pool.
+ */
+ngx_http_rate_limit_ctx_t *
+ngx_http_rate_limit_main_ctx(ngx_http_request_t *r)
+{
+    ngx_pool_cleanup_t *cln;
+
+    /* Reference: ngx_http_realip_get_module_ctx */
+
+    if (!r->internal) {
+        return NULL;
+    }
+
+    for (cln = r->pool->cleanup; cln; cln = cln->next) {
+        if (cln->handler == ngx_http_rate_limit_ctx_cleanup) {
+            return cln->data;
+        }
+    }
+
+    return NULL;
+}
+
+static void
+ngx_http_rate_limit_ctx_cleanup(void *data)
+{
+    /* only marks the ctx of the main request, see above */
 }
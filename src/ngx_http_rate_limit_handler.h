@@ -4,5 +4,10 @@
 #include "ngx_http_rate_limit_module.h"
 
 ngx_int_t ngx_http_rate_limit_handler(ngx_http_request_t *r);
+void ngx_http_rate_limit_set_headers(ngx_http_request_t *r,
+                                     ngx_http_rate_limit_ctx_t *ctx);
+void ngx_http_rate_limit_clear_headers(ngx_http_request_t *r);
+void ngx_http_rate_limit_headers_init(void);
+ngx_http_rate_limit_ctx_t *ngx_http_rate_limit_main_ctx(ngx_http_request_t *r);
 
 #endif /* NGX_HTTP_RATE_LIMIT_HANDLER_H */
@@ -0,0 +1,454 @@
+#include "ngx_http_rate_limit_handshake.h"
+
+typedef struct {
+    ngx_http_upstream_srv_conf_t  *upstream;
+    ngx_http_upstream_init_peer_pt original_init_peer;
+} ngx_http_rate_limit_handshake_t;
+
+typedef struct {
+    ngx_http_request_t *request;
+
+    /* the handshake, put in front of the command on a new connection */
+    ngx_chain_t *chain;
+
+    void *data;
+
+    ngx_event_get_peer_pt  original_get_peer;
+    ngx_event_free_peer_pt original_free_peer;
+
+#if (NGX_HTTP_SSL)
+    ngx_event_set_peer_session_pt  original_set_session;
+    ngx_event_save_peer_session_pt original_save_session;
+#endif
+} ngx_http_rate_limit_handshake_peer_data_t;
+
+static size_t ngx_http_rate_limit_handshake_size(ngx_str_t *args,
+                                                 ngx_uint_t n);
+static u_char *ngx_http_rate_limit_handshake_write(u_char *p, ngx_str_t *args,
+                                                   ngx_uint_t n);
+static ngx_int_t ngx_http_rate_limit_handshake_add(
+        ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_rate_limit_handshake_init_peer(
+        ngx_http_request_t *r, ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_rate_limit_handshake_get_peer(
+        ngx_peer_connection_t *pc, void *data);
+static void ngx_http_rate_limit_handshake_free_peer(ngx_peer_connection_t *pc,
+                                                    void *data,
+                                                    ngx_uint_t state);
+#if (NGX_HTTP_SSL)
+static ngx_int_t ngx_http_rate_limit_handshake_set_session(
+        ngx_peer_connection_t *pc, void *data);
+static void ngx_http_rate_limit_handshake_save_session(
+        ngx_peer_connection_t *pc, void *data);
+#endif
+
+char *
+ngx_http_rate_limit_redis_auth(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_rate_limit_loc_conf_t *rlcf = conf;
+
+    ngx_str_t *value;
+
+    if (rlcf->redis_password.data) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (cf->args->nelts == 3) {
+        rlcf->redis_user = value[1];
+        rlcf->redis_password = value[2];
+
+    } else {
+        ngx_str_set(&rlcf->redis_user, "");
+        rlcf->redis_password = value[1];
+    }
+
+    if (rlcf->redis_password.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "empty password");
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+/*
+ * Builds the commands sent once on each new connection to redis:
+ * "HELLO 3 [AUTH user password]" or "AUTH [user] password", then
+ * "SELECT db" unless it is 0.
+ */
+ngx_int_t
+ngx_http_rate_limit_handshake_merge(ngx_conf_t *cf,
+                                    ngx_http_rate_limit_loc_conf_t *prev,
+                                    ngx_http_rate_limit_loc_conf_t *conf)
+{
+    size_t                           len;
+    u_char                          *p, db[NGX_INT_T_LEN];
+    ngx_str_t                        hello[5], auth[3], sel[2];
+    ngx_uint_t                       nhello, nauth, nsel;
+    ngx_http_rate_limit_main_conf_t *rlmcf;
+
+    if (conf->redis_password.data == NULL) {
+        conf->redis_user = prev->redis_user;
+        conf->redis_password = prev->redis_password;
+    }
+
+    ngx_conf_merge_value(conf->redis_db, prev->redis_db, 0);
+    ngx_conf_merge_value(conf->redis_hello, prev->redis_hello, 0);
+
+    nhello = 0;
+    nauth = 0;
+    nsel = 0;
+
+    if (conf->redis_hello) {
+        ngx_str_set(&hello[0], "HELLO");
+        ngx_str_set(&hello[1], "3");
+        nhello = 2;
+
+        if (conf->redis_password.len) {
+            ngx_str_set(&hello[2], "AUTH");
+            hello[3] = conf->redis_user;
+            hello[4] = conf->redis_password;
+            nhello = 5;
+
+            /* HELLO has no form without a user name */
+            if (hello[3].len == 0) {
+                ngx_str_set(&hello[3], "default");
+            }
+        }
+
+    } else if (conf->redis_password.len) {
+        ngx_str_set(&auth[0], "AUTH");
+        nauth = 1;
+
+        if (conf->redis_user.len) {
+            auth[nauth++] = conf->redis_user;
+        }
+
+        auth[nauth++] = conf->redis_password;
+    }
+
+    if (conf->redis_db) {
+        ngx_str_set(&sel[0], "SELECT");
+        sel[1].data = db;
+        sel[1].len = ngx_sprintf(db, "%i", conf->redis_db) - db;
+        nsel = 2;
+    }
+
+    len = ngx_http_rate_limit_handshake_size(hello, nhello) +
+          ngx_http_rate_limit_handshake_size(auth, nauth) +
+          ngx_http_rate_limit_handshake_size(sel, nsel);
+
+    if (len == 0) {
+        return NGX_OK;
+    }
+
+    p = ngx_pnalloc(cf->pool, len);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    conf->handshake.data = p;
+
+    p = ngx_http_rate_limit_handshake_write(p, hello, nhello);
+    p = ngx_http_rate_limit_handshake_write(p, auth, nauth);
+    p = ngx_http_rate_limit_handshake_write(p, sel, nsel);
+
+    conf->handshake.len = p - conf->handshake.data;
+    conf->handshake_replies = (nhello != 0) + (nauth != 0) + (nsel != 0);
+
+    rlmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_rate_limit_module);
+    rlmcf->handshake = 1;
+
+    return NGX_OK;
+}
+
+static size_t
+ngx_http_rate_limit_handshake_size(ngx_str_t *args, ngx_uint_t n)
+{
+    size_t     len;
+    ngx_uint_t i;
+
+    if (n == 0) {
+        return 0;
+    }
+
+    len = sizeof("*\r\n") - 1 + ngx_rate_limit_num_size(n);
+
+    for (i = 0; i < n; i++) {
+        len += sizeof("$\r\n\r\n") - 1 + ngx_rate_limit_num_size(args[i].len) +
+               args[i].len;
+    }
+
+    return len;
+}
+
+static u_char *
+ngx_http_rate_limit_handshake_write(u_char *p, ngx_str_t *args, ngx_uint_t n)
+{
+    ngx_uint_t i;
+
+    if (n == 0) {
+        return p;
+    }
+
+    p = ngx_sprintf(p, "*%ui\r\n", n);
+
+    for (i = 0; i < n; i++) {
+        p = ngx_sprintf(p, "$%uz\r\n%V\r\n", args[i].len, &args[i]);
+    }
+
+    return p;
+}
+
+/*
+ * The handshake goes with the first command on a connection, which is only
+ * known once a peer is picked. The upstreams that may be used for checks
+ * are wrapped: the targets of rate_limit_pass, and the upstream blocks that
+ * a rate_limit_pass with variables can resolve to.
+ */
+ngx_int_t
+ngx_http_rate_limit_handshake_init(ngx_conf_t *cf)
+{
+    ngx_uint_t                        i;
+    ngx_http_upstream_srv_conf_t    **usp;
+    ngx_http_upstream_main_conf_t    *umcf;
+    ngx_http_rate_limit_main_conf_t  *rlmcf;
+
+    rlmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_rate_limit_module);
+
+    if (!rlmcf->handshake) {
+        return NGX_OK;
+    }
+
+    rlmcf->handshakes = ngx_array_create(
+            cf->pool, 4, sizeof(ngx_http_rate_limit_handshake_t));
+    if (rlmcf->handshakes == NULL) {
+        return NGX_ERROR;
+    }
+
+    usp = rlmcf->upstreams.elts;
+
+    for (i = 0; i < rlmcf->upstreams.nelts; i++) {
+        if (ngx_http_rate_limit_handshake_add(cf, usp[i]) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    umcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_upstream_module);
+
+    usp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+        if (usp[i]->servers == NULL) {
+            continue;
+        }
+
+        if (ngx_http_rate_limit_handshake_add(cf, usp[i]) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_rate_limit_handshake_add(ngx_conf_t *cf,
+                                  ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_uint_t                       i;
+    ngx_http_rate_limit_handshake_t *hs;
+    ngx_http_rate_limit_main_conf_t *rlmcf;
+
+    rlmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_rate_limit_module);
+
+    hs = rlmcf->handshakes->elts;
+
+    for (i = 0; i < rlmcf->handshakes->nelts; i++) {
+        if (hs[i].upstream == us) {
+            return NGX_OK;
+        }
+    }
+
+    hs = ngx_array_push(rlmcf->handshakes);
+    if (hs == NULL) {
+        return NGX_ERROR;
+    }
+
+    /* runs after rate_limit_prewarm, so its connections are seen as new */
+
+    hs->upstream = us;
+    hs->original_init_peer = us->peer.init;
+
+    us->peer.init = ngx_http_rate_limit_handshake_init_peer;
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_rate_limit_handshake_init_peer(ngx_http_request_t *r,
+                                        ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_uint_t                       i;
+    ngx_http_rate_limit_handshake_t *hs;
+    ngx_http_rate_limit_main_conf_t *rlmcf;
+
+    rlmcf = ngx_http_get_module_main_conf(r, ngx_http_rate_limit_module);
+
+    hs = rlmcf->handshakes->elts;
+
+    for (i = 0; i < rlmcf->handshakes->nelts; i++) {
+        if (hs[i].upstream == us) {
+            break;
+        }
+    }
+
+    if (hs[i].original_init_peer(r, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return ngx_http_rate_limit_handshake_wrap(r);
+}
+
+/* Puts the handshake in front of a check on a new connection of a peer */
+ngx_int_t
+ngx_http_rate_limit_handshake_wrap(ngx_http_request_t *r)
+{
+    ngx_buf_t                                 *b;
+    ngx_http_upstream_t                       *u;
+    ngx_http_rate_limit_loc_conf_t            *rlcf;
+    ngx_http_rate_limit_handshake_peer_data_t *hd;
+
+    u = r->upstream;
+
+    /* the upstream may be shared with proxy_pass and friends */
+    if (u->output.tag != (ngx_buf_tag_t) &ngx_http_rate_limit_module) {
+        return NGX_OK;
+    }
+
+    rlcf = ngx_http_get_module_loc_conf(r, ngx_http_rate_limit_module);
+
+    if (rlcf->handshake.len == 0) {
+        return NGX_OK;
+    }
+
+    hd = ngx_palloc(r->pool,
+                    sizeof(ngx_http_rate_limit_handshake_peer_data_t));
+    if (hd == NULL) {
+        return NGX_ERROR;
+    }
+
+    hd->chain = ngx_alloc_chain_link(r->pool);
+    if (hd->chain == NULL) {
+        return NGX_ERROR;
+    }
+
+    b = ngx_calloc_buf(r->pool);
+    if (b == NULL) {
+        return NGX_ERROR;
+    }
+
+    b->pos = rlcf->handshake.data;
+    b->last = b->pos + rlcf->handshake.len;
+    b->memory = 1;
+
+    hd->chain->buf = b;
+    hd->chain->next = NULL;
+
+    hd->request = r;
+
+    hd->data = u->peer.data;
+    hd->original_get_peer = u->peer.get;
+    hd->original_free_peer = u->peer.free;
+
+    u->peer.data = hd;
+    u->peer.get = ngx_http_rate_limit_handshake_get_peer;
+    u->peer.free = ngx_http_rate_limit_handshake_free_peer;
+
+#if (NGX_HTTP_SSL)
+    hd->original_set_session = u->peer.set_session;
+    hd->original_save_session = u->peer.save_session;
+
+    u->peer.set_session = ngx_http_rate_limit_handshake_set_session;
+    u->peer.save_session = ngx_http_rate_limit_handshake_save_session;
+#endif
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_rate_limit_handshake_get_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_rate_limit_handshake_peer_data_t *hd = data;
+
+    ngx_int_t                       rc;
+    ngx_http_upstream_t            *u;
+    ngx_http_rate_limit_ctx_t      *ctx;
+    ngx_http_rate_limit_loc_conf_t *rlcf;
+
+    rc = hd->original_get_peer(pc, hd->data);
+
+    if (rc != NGX_OK && rc != NGX_DONE) {
+        return rc;
+    }
+
+    /*
+     * NGX_DONE is a cached connection; one that served a request before
+     * went through the handshake already, one of rate_limit_prewarm did not
+     */
+    if (rc == NGX_DONE && pc->connection->requests) {
+        return rc;
+    }
+
+    u = hd->request->upstream;
+
+    if (u->request_bufs == hd->chain) {
+        return rc;
+    }
+
+    ctx = ngx_http_get_module_ctx(hd->request, ngx_http_rate_limit_module);
+    rlcf = ngx_http_get_module_loc_conf(hd->request,
+                                        ngx_http_rate_limit_module);
+
+    hd->chain->next = u->request_bufs;
+    u->request_bufs = hd->chain;
+
+    ctx->handshake = rlcf->handshake_replies;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "rate limit: handshake on new connection, %ui replies",
+                   ctx->handshake);
+
+    return rc;
+}
+
+static void
+ngx_http_rate_limit_handshake_free_peer(ngx_peer_connection_t *pc, void *data,
+                                        ngx_uint_t state)
+{
+    ngx_http_rate_limit_handshake_peer_data_t *hd = data;
+
+    hd->original_free_peer(pc, hd->data, state);
+}
+
+#if (NGX_HTTP_SSL)
+
+static ngx_int_t
+ngx_http_rate_limit_handshake_set_session(ngx_peer_connection_t *pc,
+                                          void *data)
+{
+    ngx_http_rate_limit_handshake_peer_data_t *hd = data;
+
+    return hd->original_set_session(pc, hd->data);
+}
+
+static void
+ngx_http_rate_limit_handshake_save_session(ngx_peer_connection_t *pc,
+                                           void *data)
+{
+    ngx_http_rate_limit_handshake_peer_data_t *hd = data;
+
+    hd->original_save_session(pc, hd->data);
+}
+
+#endif
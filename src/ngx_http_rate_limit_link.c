@@ -0,0 +1,309 @@
+#include "ngx_http_rate_limit_link.h"
+
+static void ngx_http_rate_limit_link_write_handler(ngx_event_t *ev);
+static void ngx_http_rate_limit_link_read_handler(ngx_event_t *ev);
+static void ngx_http_rate_limit_link_retry(ngx_http_rate_limit_link_t *link);
+static void ngx_http_rate_limit_link_timer_handler(ngx_event_t *ev);
+
+/*
+ * Connects to the next peer of the upstream that is not down, and queues
+ * the handshake. Without a peer, it is tried again after link->retry.
+ */
+void
+ngx_http_rate_limit_link_connect(ngx_http_rate_limit_link_t *link)
+{
+    ngx_int_t                     rc;
+    ngx_uint_t                    i;
+    ngx_connection_t             *c;
+    ngx_peer_connection_t         pc;
+    ngx_http_upstream_rr_peer_t  *peer;
+    ngx_http_upstream_rr_peers_t *peers;
+
+    peers = link->upstream->peer.data;
+
+    if (peers == NULL) {
+        ngx_http_rate_limit_link_retry(link);
+        return;
+    }
+
+    ngx_memzero(&pc, sizeof(ngx_peer_connection_t));
+
+    /* Reference: ngx_http_upstream_get_round_robin_peer */
+    ngx_http_upstream_rr_peers_rlock(peers);
+
+    /* the peers of a zone are a list in shared memory, not an array */
+    peer = peers->peer;
+
+    for (i = peers->number ? link->next++ % peers->number : 0; i; i--) {
+        peer = peer->next;
+    }
+
+    for (i = 0; i < peers->number; i++) {
+        if (!peer->down) {
+            pc.sockaddr = peer->sockaddr;
+            pc.socklen = peer->socklen;
+            pc.name = &peer->name;
+            break;
+        }
+
+        peer = peer->next ? peer->next : peers->peer;
+    }
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    if (pc.sockaddr == NULL) {
+        ngx_http_rate_limit_link_retry(link);
+        return;
+    }
+
+    pc.get = ngx_event_get_peer;
+    pc.log = ngx_cycle->log;
+    pc.log_error = NGX_ERROR_ERR;
+
+    rc = ngx_event_connect_peer(&pc);
+
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+        if (pc.connection) {
+            ngx_close_connection(pc.connection);
+        }
+
+        ngx_http_rate_limit_link_retry(link);
+        return;
+    }
+
+    c = pc.connection;
+    c->data = link;
+
+    /* closed on a graceful shutdown like a keepalive connection */
+    c->idle = 1;
+
+    c->read->handler = ngx_http_rate_limit_link_read_handler;
+    c->write->handler = ngx_http_rate_limit_link_write_handler;
+
+    link->connection = c;
+    link->connected = 0;
+
+    link->out->pos = link->out->start;
+    link->out->last = ngx_cpymem(link->out->start, link->handshake.data,
+                                 link->handshake.len);
+
+    link->in->pos = link->in->start;
+    link->in->last = link->in->start;
+
+    if (rc == NGX_AGAIN) {
+        ngx_add_timer(c->write, link->connect_timeout);
+        return;
+    }
+
+    link->connected = 1;
+
+    ngx_http_rate_limit_link_flush(link);
+}
+
+void
+ngx_http_rate_limit_link_flush(ngx_http_rate_limit_link_t *link)
+{
+    ssize_t           n;
+    ngx_buf_t        *b;
+    ngx_connection_t *c;
+
+    c = link->connection;
+    b = link->out;
+
+    while (b->pos < b->last) {
+        n = c->send(c, b->pos, b->last - b->pos);
+
+        if (n == NGX_AGAIN) {
+            break;
+        }
+
+        if (n == NGX_ERROR) {
+            ngx_http_rate_limit_link_close(link);
+            return;
+        }
+
+        b->pos += n;
+    }
+
+    /* keep what is left at the start, to make room for more */
+    b->last = ngx_movemem(b->start, b->pos, b->last - b->pos);
+    b->pos = b->start;
+
+    if (b->last != b->start) {
+        ngx_add_timer(c->write, link->send_timeout);
+
+    } else if (c->write->timer_set) {
+        ngx_del_timer(c->write);
+    }
+
+    if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+        ngx_http_rate_limit_link_close(link);
+    }
+}
+
+void
+ngx_http_rate_limit_link_close(ngx_http_rate_limit_link_t *link)
+{
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "rate limit: close link %p", link->connection);
+
+    if (link->lost && link->out->last != link->out->pos) {
+        ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                      "rate limit: %s lost with the connection to redis",
+                      link->lost);
+    }
+
+    ngx_close_connection(link->connection);
+
+    link->connection = NULL;
+    link->connected = 0;
+
+    link->out->pos = link->out->start;
+    link->out->last = link->out->start;
+
+    ngx_http_rate_limit_link_retry(link);
+}
+
+static void
+ngx_http_rate_limit_link_write_handler(ngx_event_t *ev)
+{
+    ngx_connection_t           *c;
+    ngx_http_rate_limit_link_t *link;
+
+    c = ev->data;
+    link = c->data;
+
+    if (ev->timedout) {
+        ngx_connection_error(c, NGX_ETIMEDOUT, "redis timed out");
+        ngx_http_rate_limit_link_close(link);
+        return;
+    }
+
+    if (!link->connected) {
+        if (ngx_rate_limit_test_connect(c) != NGX_OK) {
+            ngx_http_rate_limit_link_close(link);
+            return;
+        }
+
+        link->connected = 1;
+    }
+
+    ngx_http_rate_limit_link_flush(link);
+}
+
+static void
+ngx_http_rate_limit_link_read_handler(ngx_event_t *ev)
+{
+    u_char                     *p, *lf;
+    ssize_t                     n;
+    ngx_int_t                   rc;
+    ngx_str_t                   value;
+    ngx_buf_t                  *b;
+    ngx_connection_t           *c;
+    ngx_http_rate_limit_link_t *link;
+
+    c = ev->data;
+    link = c->data;
+    b = link->in;
+
+    if (c->close) {
+        ngx_http_rate_limit_link_close(link);
+        return;
+    }
+
+    for (;;) {
+        n = c->recv(c, b->last, b->end - b->last);
+
+        if (n == NGX_AGAIN) {
+            break;
+        }
+
+        if (n == NGX_ERROR || n == 0) {
+            ngx_http_rate_limit_link_close(link);
+            return;
+        }
+
+        b->last += n;
+
+        for (;;) {
+            p = b->pos;
+
+            rc = ngx_rate_limit_redis_skip_reply(b);
+
+            if (rc == NGX_AGAIN) {
+                break;
+            }
+
+            if (rc == NGX_ERROR) {
+                ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                              "rate limit: redis sent invalid response");
+                ngx_http_rate_limit_link_close(link);
+                return;
+            }
+
+            if (rc == NGX_DECLINED) {
+                /* the line of the error, without its type and CRLF */
+                lf = ngx_strlchr(b->pos, b->last, LF);
+
+                value.data = p + 1;
+                value.len = lf - p - 2;
+
+                b->pos = lf + 1;
+
+            } else {
+                value.data = p;
+                value.len = b->pos - p;
+            }
+
+            if (link->reply(link, &value, rc) == NGX_ERROR) {
+                ngx_http_rate_limit_link_close(link);
+                return;
+            }
+        }
+
+        b->last = ngx_movemem(b->start, b->pos, b->last - b->pos);
+        b->pos = b->start;
+
+        if (b->last == b->end) {
+            ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                          "rate limit: redis sent too large response");
+            ngx_http_rate_limit_link_close(link);
+            return;
+        }
+    }
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        ngx_http_rate_limit_link_close(link);
+    }
+}
+
+static void
+ngx_http_rate_limit_link_retry(ngx_http_rate_limit_link_t *link)
+{
+    if (link->retry == 0 || ngx_exiting || ngx_terminate || ngx_quit) {
+        return;
+    }
+
+    if (link->timer.handler == NULL) {
+        link->timer.handler = ngx_http_rate_limit_link_timer_handler;
+        link->timer.data = link;
+        link->timer.log = ngx_cycle->log;
+        link->timer.cancelable = 1;
+    }
+
+    ngx_add_timer(&link->timer, link->retry);
+}
+
+static void
+ngx_http_rate_limit_link_timer_handler(ngx_event_t *ev)
+{
+    ngx_http_rate_limit_link_t *link;
+
+    link = ev->data;
+
+    if (ngx_exiting || ngx_terminate || ngx_quit) {
+        return;
+    }
+
+    ngx_http_rate_limit_link_connect(link);
+}
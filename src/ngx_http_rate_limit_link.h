@@ -0,0 +1,47 @@
+#ifndef NGX_HTTP_RATE_LIMIT_LINK_H
+#define NGX_HTTP_RATE_LIMIT_LINK_H
+
+#include "ngx_http_rate_limit_module.h"
+
+typedef struct ngx_http_rate_limit_link_s ngx_http_rate_limit_link_t;
+
+/*
+ * A complete reply, or the line of an error with NGX_DECLINED. Returning
+ * NGX_ERROR closes the connection.
+ */
+typedef ngx_int_t (*ngx_http_rate_limit_link_reply_pt)(
+        ngx_http_rate_limit_link_t *link, ngx_str_t *value, ngx_int_t rc);
+
+/* A connection of a worker to redis, outside of any request */
+struct ngx_http_rate_limit_link_s {
+    ngx_http_upstream_srv_conf_t *upstream;
+
+    ngx_msec_t connect_timeout;
+    ngx_msec_t send_timeout;
+
+    /* sent first on every new connection */
+    ngx_str_t handshake;
+
+    ngx_connection_t *connection;
+    ngx_uint_t        connected;
+    ngx_uint_t        next;
+
+    ngx_buf_t *out;
+    ngx_buf_t *in;
+
+    ngx_http_rate_limit_link_reply_pt  reply;
+    void                              *data;
+
+    /* what is lost with commands still queued, NULL to not warn */
+    char *lost;
+
+    /* to connect again after a failure, 0 to wait for the next command */
+    ngx_msec_t  retry;
+    ngx_event_t timer;
+};
+
+void ngx_http_rate_limit_link_connect(ngx_http_rate_limit_link_t *link);
+void ngx_http_rate_limit_link_flush(ngx_http_rate_limit_link_t *link);
+void ngx_http_rate_limit_link_close(ngx_http_rate_limit_link_t *link);
+
+#endif /* NGX_HTTP_RATE_LIMIT_LINK_H */
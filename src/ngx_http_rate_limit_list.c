@@ -0,0 +1,568 @@
+#include "ngx_http_rate_limit_list.h"
+
+/* about 0.8% false positives with 10 bits per key and 7 hash functions */
+#define NGX_HTTP_RATE_LIMIT_BLOOM_BITS 10
+#define NGX_HTTP_RATE_LIMIT_BLOOM_HASHES 7
+
+struct ngx_http_rate_limit_list_s {
+    ngx_str_t file;
+
+    /* network prefixes */
+    ngx_radix_tree_t *tree;
+#if (NGX_HAVE_INET6)
+    ngx_radix_tree_t *tree6;
+#endif
+
+    /* single addresses, sorted */
+    uint32_t  *hosts;
+    ngx_uint_t nhosts;
+#if (NGX_HAVE_INET6)
+    u_char    *hosts6;
+    ngx_uint_t nhosts6;
+#endif
+
+    /* opaque keys, sorted, with a bloom filter in front of them */
+    ngx_str_t *keys;
+    ngx_uint_t nkeys;
+    uint64_t  *bloom;
+    ngx_uint_t nbits;
+};
+
+static ngx_http_rate_limit_list_t *ngx_http_rate_limit_list_load(
+        ngx_conf_t *cf, ngx_str_t *file);
+static ngx_int_t ngx_http_rate_limit_list_add(ngx_conf_t *cf,
+                                              ngx_http_rate_limit_list_t *list,
+                                              ngx_str_t *line,
+                                              ngx_array_t *keys,
+                                              ngx_array_t *hosts,
+                                              ngx_array_t *hosts6);
+static void ngx_http_rate_limit_bloom_hash(ngx_str_t *key, uint32_t *h1,
+                                           uint32_t *h2);
+static int ngx_libc_cdecl ngx_http_rate_limit_cmp_keys(const void *one,
+                                                       const void *two);
+static int ngx_libc_cdecl ngx_http_rate_limit_cmp_hosts(const void *one,
+                                                        const void *two);
+#if (NGX_HAVE_INET6)
+static int ngx_libc_cdecl ngx_http_rate_limit_cmp_hosts6(const void *one,
+                                                         const void *two);
+#endif
+
+char *
+ngx_http_rate_limit_list(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    char *p = conf;
+
+    ngx_str_t                       *value, file;
+    ngx_uint_t                       i;
+    ngx_http_rate_limit_list_t     **field, **lists, **list;
+    ngx_http_rate_limit_main_conf_t *rlmcf;
+
+    field = (ngx_http_rate_limit_list_t **) (p + cmd->offset);
+
+    if (*field != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        *field = NULL;
+        return NGX_CONF_OK;
+    }
+
+    file = value[1];
+
+    if (ngx_conf_full_name(cf->cycle, &file, 1) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    rlmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_rate_limit_module);
+
+    /* the same file is loaded only once per configuration */
+
+    lists = rlmcf->lists.elts;
+
+    for (i = 0; i < rlmcf->lists.nelts; i++) {
+        if (lists[i]->file.len == file.len &&
+            ngx_strncmp(lists[i]->file.data, file.data, file.len) == 0) {
+            *field = lists[i];
+            return NGX_CONF_OK;
+        }
+    }
+
+    list = ngx_array_push(&rlmcf->lists);
+    if (list == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    *list = ngx_http_rate_limit_list_load(cf, &file);
+    if (*list == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    *field = *list;
+
+    return NGX_CONF_OK;
+}
+
+static ngx_http_rate_limit_list_t *
+ngx_http_rate_limit_list_load(ngx_conf_t *cf, ngx_str_t *file)
+{
+    u_char                     *start, *end, *p, *last;
+    size_t                      size;
+    ngx_fd_t                    fd;
+    ngx_str_t                   line;
+    ngx_uint_t                  n;
+    ngx_array_t                 keys, hosts, hosts6;
+    ngx_file_info_t             fi;
+    ngx_http_rate_limit_list_t *list;
+
+    fd = ngx_open_file(file->data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+    if (fd == NGX_INVALID_FILE) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno,
+                           ngx_open_file_n " \"%s\" failed", file->data);
+        return NULL;
+    }
+
+    list = NULL;
+    start = NULL;
+    size = 0;
+
+    if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno,
+                           ngx_fd_info_n " \"%s\" failed", file->data);
+        goto done;
+    }
+
+    size = (size_t) ngx_file_size(&fi);
+
+    if (size) {
+        /* the file is parsed in place, without reading it into memory */
+        start = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (start == MAP_FAILED) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno,
+                               "mmap(\"%s\") failed", file->data);
+            start = NULL;
+            goto done;
+        }
+    }
+
+    end = start + size;
+
+    /* every line holds at most one key, this sizes the bloom filter */
+
+    n = 1;
+
+    for (p = start; p < end; p = last + 1) {
+        last = ngx_strlchr(p, end, LF);
+        if (last == NULL) {
+            break;
+        }
+
+        n++;
+    }
+
+    list = ngx_pcalloc(cf->pool, sizeof(ngx_http_rate_limit_list_t));
+    if (list == NULL) {
+        goto done;
+    }
+
+    list->file = *file;
+    list->nbits = ngx_align(n * NGX_HTTP_RATE_LIMIT_BLOOM_BITS, 64);
+
+    list->bloom = ngx_pcalloc(cf->pool, list->nbits / 8);
+    if (list->bloom == NULL) {
+        list = NULL;
+        goto done;
+    }
+
+    if (ngx_array_init(&keys, cf->temp_pool, 64, sizeof(ngx_str_t)) !=
+            NGX_OK ||
+        ngx_array_init(&hosts, cf->temp_pool, 1024, sizeof(uint32_t)) !=
+            NGX_OK ||
+        ngx_array_init(&hosts6, cf->temp_pool, 64, 16) != NGX_OK) {
+        list = NULL;
+        goto done;
+    }
+
+    for (p = start; p < end; p = last + 1) {
+        last = ngx_strlchr(p, end, LF);
+        if (last == NULL) {
+            last = end;
+        }
+
+        line.data = p;
+        line.len = last - p;
+
+        while (line.len && (line.data[0] == ' ' || line.data[0] == '\t')) {
+            line.data++;
+            line.len--;
+        }
+
+        while (line.len &&
+               (line.data[line.len - 1] == ' ' ||
+                line.data[line.len - 1] == '\t' ||
+                line.data[line.len - 1] == CR)) {
+            line.len--;
+        }
+
+        if (line.len == 0 || line.data[0] == '#') {
+            continue;
+        }
+
+        if (ngx_http_rate_limit_list_add(cf, list, &line, &keys, &hosts,
+                                         &hosts6) != NGX_OK) {
+            list = NULL;
+            goto done;
+        }
+    }
+
+    if (keys.nelts) {
+        list->keys = ngx_palloc(cf->pool, keys.nelts * sizeof(ngx_str_t));
+        if (list->keys == NULL) {
+            list = NULL;
+            goto done;
+        }
+
+        ngx_memcpy(list->keys, keys.elts, keys.nelts * sizeof(ngx_str_t));
+        list->nkeys = keys.nelts;
+
+        ngx_qsort(list->keys, list->nkeys, sizeof(ngx_str_t),
+                  ngx_http_rate_limit_cmp_keys);
+    }
+
+    if (hosts.nelts) {
+        list->hosts = ngx_palloc(cf->pool, hosts.nelts * sizeof(uint32_t));
+        if (list->hosts == NULL) {
+            list = NULL;
+            goto done;
+        }
+
+        ngx_memcpy(list->hosts, hosts.elts, hosts.nelts * sizeof(uint32_t));
+        list->nhosts = hosts.nelts;
+
+        ngx_qsort(list->hosts, list->nhosts, sizeof(uint32_t),
+                  ngx_http_rate_limit_cmp_hosts);
+    }
+
+#if (NGX_HAVE_INET6)
+    if (hosts6.nelts) {
+        list->hosts6 = ngx_palloc(cf->pool, hosts6.nelts * 16);
+        if (list->hosts6 == NULL) {
+            list = NULL;
+            goto done;
+        }
+
+        ngx_memcpy(list->hosts6, hosts6.elts, hosts6.nelts * 16);
+        list->nhosts6 = hosts6.nelts;
+
+        ngx_qsort(list->hosts6, list->nhosts6, 16,
+                  ngx_http_rate_limit_cmp_hosts6);
+    }
+#endif
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, cf->log, 0,
+                   "rate limit list \"%V\": %ui lines", file, n);
+
+done:
+
+    if (start && munmap(start, size) == -1) {
+        ngx_conf_log_error(NGX_LOG_ALERT, cf, ngx_errno,
+                           "munmap(\"%s\") failed", file->data);
+    }
+
+    if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+        ngx_conf_log_error(NGX_LOG_ALERT, cf, ngx_errno,
+                           ngx_close_file_n " \"%s\" failed", file->data);
+    }
+
+    return list;
+}
+
+static ngx_int_t
+ngx_http_rate_limit_list_add(ngx_conf_t *cf, ngx_http_rate_limit_list_t *list,
+                             ngx_str_t *line, ngx_array_t *keys,
+                             ngx_array_t *hosts, ngx_array_t *hosts6)
+{
+    uint32_t   h1, h2, *host;
+    uint64_t   bit;
+    ngx_int_t  rc;
+    ngx_str_t *key;
+    ngx_uint_t i;
+    ngx_cidr_t cidr;
+#if (NGX_HAVE_INET6)
+    u_char *host6;
+#endif
+
+    rc = ngx_ptocidr(line, &cidr);
+
+    if (rc == NGX_ERROR) {
+        /* not an address, an opaque key, copied out of the mapping */
+
+        key = ngx_array_push(keys);
+        if (key == NULL) {
+            return NGX_ERROR;
+        }
+
+        key->len = line->len;
+        key->data = ngx_pstrdup(cf->pool, line);
+        if (key->data == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_http_rate_limit_bloom_hash(line, &h1, &h2);
+
+        for (i = 0; i < NGX_HTTP_RATE_LIMIT_BLOOM_HASHES; i++) {
+            bit = ((uint64_t) h1 + i * (uint64_t) h2) % list->nbits;
+            list->bloom[bit / 64] |= (uint64_t) 1 << (bit % 64);
+        }
+
+        return NGX_OK;
+    }
+
+    if (rc == NGX_DONE) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "low address bits of %V are meaningless", line);
+    }
+
+    switch (cidr.family) {
+
+#if (NGX_HAVE_INET6)
+    case AF_INET6:
+
+        for (i = 0; i < 16; i++) {
+            if (cidr.u.in6.mask.s6_addr[i] != 0xff) {
+                break;
+            }
+        }
+
+        if (i == 16) {
+            host6 = ngx_array_push(hosts6);
+            if (host6 == NULL) {
+                return NGX_ERROR;
+            }
+
+            ngx_memcpy(host6, cidr.u.in6.addr.s6_addr, 16);
+
+            return NGX_OK;
+        }
+
+        if (list->tree6 == NULL) {
+            list->tree6 = ngx_radix_tree_create(cf->pool, -1);
+            if (list->tree6 == NULL) {
+                return NGX_ERROR;
+            }
+        }
+
+        rc = ngx_radix128tree_insert(list->tree6, cidr.u.in6.addr.s6_addr,
+                                     cidr.u.in6.mask.s6_addr, 1);
+        break;
+#endif
+
+    default: /* AF_INET */
+
+        if (cidr.u.in.mask == 0xffffffff) {
+            host = ngx_array_push(hosts);
+            if (host == NULL) {
+                return NGX_ERROR;
+            }
+
+            *host = ntohl(cidr.u.in.addr);
+
+            return NGX_OK;
+        }
+
+        if (list->tree == NULL) {
+            list->tree = ngx_radix_tree_create(cf->pool, -1);
+            if (list->tree == NULL) {
+                return NGX_ERROR;
+            }
+        }
+
+        rc = ngx_radix32tree_insert(list->tree, ntohl(cidr.u.in.addr),
+                                    ntohl(cidr.u.in.mask), 1);
+        break;
+    }
+
+    /* NGX_BUSY means a duplicate prefix, which is harmless */
+
+    return rc == NGX_ERROR ? NGX_ERROR : NGX_OK;
+}
+
+ngx_int_t
+ngx_http_rate_limit_list_match_addr(ngx_http_rate_limit_list_t *list,
+                                    ngx_connection_t *c)
+{
+    uint32_t            addr;
+    ngx_uint_t          lo, hi, mid;
+    struct sockaddr_in *sin;
+#if (NGX_HAVE_INET6)
+    u_char              *p;
+    ngx_int_t            rc;
+    struct sockaddr_in6 *sin6;
+#endif
+
+    switch (c->sockaddr->sa_family) {
+
+#if (NGX_HAVE_INET6)
+    case AF_INET6:
+        sin6 = (struct sockaddr_in6 *) c->sockaddr;
+        p = sin6->sin6_addr.s6_addr;
+
+        if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+            addr = (uint32_t) p[12] << 24;
+            addr += p[13] << 16;
+            addr += p[14] << 8;
+            addr += p[15];
+
+            break;
+        }
+
+        if (list->tree6 &&
+            ngx_radix128tree_find(list->tree6, p) != NGX_RADIX_NO_VALUE) {
+            return NGX_OK;
+        }
+
+        lo = 0;
+        hi = list->nhosts6;
+
+        while (lo < hi) {
+            mid = lo + (hi - lo) / 2;
+            rc = ngx_memcmp(p, list->hosts6 + mid * 16, 16);
+
+            if (rc == 0) {
+                return NGX_OK;
+            }
+
+            if (rc < 0) {
+                hi = mid;
+
+            } else {
+                lo = mid + 1;
+            }
+        }
+
+        return NGX_DECLINED;
+#endif
+
+#if (NGX_HAVE_UNIX_DOMAIN)
+    case AF_UNIX:
+        return NGX_DECLINED;
+#endif
+
+    default: /* AF_INET */
+        sin = (struct sockaddr_in *) c->sockaddr;
+        addr = ntohl(sin->sin_addr.s_addr);
+        break;
+    }
+
+    if (list->tree &&
+        ngx_radix32tree_find(list->tree, addr) != NGX_RADIX_NO_VALUE) {
+        return NGX_OK;
+    }
+
+    lo = 0;
+    hi = list->nhosts;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+
+        if (list->hosts[mid] == addr) {
+            return NGX_OK;
+        }
+
+        if (addr < list->hosts[mid]) {
+            hi = mid;
+
+        } else {
+            lo = mid + 1;
+        }
+    }
+
+    return NGX_DECLINED;
+}
+
+ngx_int_t
+ngx_http_rate_limit_list_match_key(ngx_http_rate_limit_list_t *list,
+                                   ngx_str_t *key)
+{
+    uint32_t   h1, h2;
+    uint64_t   bit;
+    ngx_int_t  rc;
+    ngx_uint_t i, lo, hi, mid;
+
+    /* most keys are not listed, the bloom filter turns them away cheaply */
+
+    ngx_http_rate_limit_bloom_hash(key, &h1, &h2);
+
+    for (i = 0; i < NGX_HTTP_RATE_LIMIT_BLOOM_HASHES; i++) {
+        bit = ((uint64_t) h1 + i * (uint64_t) h2) % list->nbits;
+
+        if (!(list->bloom[bit / 64] & ((uint64_t) 1 << (bit % 64)))) {
+            return NGX_DECLINED;
+        }
+    }
+
+    /* a possible match, confirmed against the keys themselves */
+
+    lo = 0;
+    hi = list->nkeys;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        rc = ngx_http_rate_limit_cmp_keys(key, &list->keys[mid]);
+
+        if (rc == 0) {
+            return NGX_OK;
+        }
+
+        if (rc < 0) {
+            hi = mid;
+
+        } else {
+            lo = mid + 1;
+        }
+    }
+
+    return NGX_DECLINED;
+}
+
+static void
+ngx_http_rate_limit_bloom_hash(ngx_str_t *key, uint32_t *h1, uint32_t *h2)
+{
+    /* double hashing: probe i uses h1 + i * h2 */
+    *h1 = ngx_crc32_short(key->data, key->len);
+    *h2 = ngx_murmur_hash2(key->data, key->len) | 1;
+}
+
+static int ngx_libc_cdecl
+ngx_http_rate_limit_cmp_keys(const void *one, const void *two)
+{
+    ngx_str_t *a, *b;
+
+    a = (ngx_str_t *) one;
+    b = (ngx_str_t *) two;
+
+    return (int) ngx_memn2cmp(a->data, b->data, a->len, b->len);
+}
+
+static int ngx_libc_cdecl
+ngx_http_rate_limit_cmp_hosts(const void *one, const void *two)
+{
+    uint32_t a, b;
+
+    a = *(uint32_t *) one;
+    b = *(uint32_t *) two;
+
+    return (a > b) - (a < b);
+}
+
+#if (NGX_HAVE_INET6)
+
+static int ngx_libc_cdecl
+ngx_http_rate_limit_cmp_hosts6(const void *one, const void *two)
+{
+    return ngx_memcmp(one, two, 16);
+}
+
+#endif
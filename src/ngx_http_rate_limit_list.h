@@ -0,0 +1,12 @@
+#ifndef NGX_HTTP_RATE_LIMIT_LIST_H
+#define NGX_HTTP_RATE_LIMIT_LIST_H
+
+#include "ngx_http_rate_limit_module.h"
+
+char *ngx_http_rate_limit_list(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+ngx_int_t ngx_http_rate_limit_list_match_addr(ngx_http_rate_limit_list_t *list,
+                                              ngx_connection_t *c);
+ngx_int_t ngx_http_rate_limit_list_match_key(ngx_http_rate_limit_list_t *list,
+                                             ngx_str_t *key);
+
+#endif /* NGX_HTTP_RATE_LIMIT_LIST_H */
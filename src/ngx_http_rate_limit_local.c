@@ -0,0 +1,1221 @@
+#include "ngx_http_rate_limit_local.h"
+#include "ngx_http_rate_limit_adaptive.h"
+#include "ngx_http_rate_limit_policy.h"
+#include "ngx_rate_limit_gcra.h"
+
+#include <ngx_sha1.h>
+
+/* "RLG2", bumped whenever the datagram format changes */
+#define NGX_HTTP_RATE_LIMIT_GOSSIP_MAGIC 0x32474c52
+
+/* a datagram fits into a single packet on most networks */
+#define NGX_HTTP_RATE_LIMIT_GOSSIP_SIZE 1400
+
+/* the magic and the time it was sent, in usec, increasing per sender */
+#define NGX_HTTP_RATE_LIMIT_GOSSIP_HEADER (4 + 8)
+
+/* an HMAC-SHA1 of the rest closes the datagram with a secret */
+#define NGX_HTTP_RATE_LIMIT_GOSSIP_MAC 20
+
+/* how far the clocks of signed peers may be apart, in usec */
+#define NGX_HTTP_RATE_LIMIT_GOSSIP_SKEW 10000000
+
+/* interval, quantity and key length, followed by the key */
+#define NGX_HTTP_RATE_LIMIT_GOSSIP_RECORD (8 + 4 + 2)
+
+typedef struct {
+    u_char  color;
+    u_char  dummy;
+    u_short len;
+
+    ngx_queue_t queue;
+
+    /* linked while units consumed here have not been gossiped yet */
+    ngx_queue_t dirty;
+    uint32_t    pending;
+
+    uint64_t tat;
+    uint64_t interval;
+
+    u_char data[1];
+} ngx_http_rate_limit_local_node_t;
+
+typedef struct {
+    ngx_rbtree_t      rbtree;
+    ngx_rbtree_node_t sentinel;
+    ngx_queue_t       queue;
+    ngx_queue_t       dirty;
+} ngx_http_rate_limit_local_sh_t;
+
+typedef struct {
+    ngx_http_rate_limit_local_sh_t *sh;
+    ngx_slab_pool_t                *shpool;
+
+    /* gossip, NULL if the node is on its own */
+    ngx_addr_t *listen;
+    ngx_array_t peers; /* ngx_addr_t */
+    ngx_msec_t  interval;
+
+    /* the secret, hashed with the inner and outer pads of HMAC */
+    ngx_flag_t secret;
+    ngx_sha1_t inner;
+    ngx_sha1_t outer;
+
+    /* in the worker that gossips */
+    ngx_connection_t *connection;
+    ngx_event_t       timer;
+
+    /* the time of the last datagram sent, and accepted from each peer */
+    uint64_t  sent;
+    uint64_t *seen;
+} ngx_http_rate_limit_local_ctx_t;
+
+static ngx_int_t ngx_http_rate_limit_local_init_zone(ngx_shm_zone_t *shm_zone,
+                                                     void *data);
+static void ngx_http_rate_limit_local_rbtree_insert_value(
+        ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node,
+        ngx_rbtree_node_t *sentinel);
+static ngx_http_rate_limit_local_node_t *ngx_http_rate_limit_local_lookup(
+        ngx_http_rate_limit_local_ctx_t *ctx, ngx_str_t *key, uint32_t hash);
+static ngx_http_rate_limit_local_node_t *ngx_http_rate_limit_local_node(
+        ngx_http_rate_limit_local_ctx_t *ctx, ngx_str_t *key, uint64_t now);
+static void ngx_http_rate_limit_local_expire(
+        ngx_http_rate_limit_local_ctx_t *ctx, ngx_uint_t n, uint64_t now);
+static uint64_t ngx_http_rate_limit_local_now(void);
+static ngx_int_t ngx_http_rate_limit_gossip_listen(
+        ngx_cycle_t *cycle, ngx_http_rate_limit_local_ctx_t *ctx);
+static void ngx_http_rate_limit_gossip_timer_handler(ngx_event_t *ev);
+static void ngx_http_rate_limit_gossip_flush(
+        ngx_http_rate_limit_local_ctx_t *ctx);
+static void ngx_http_rate_limit_gossip_send(
+        ngx_http_rate_limit_local_ctx_t *ctx, u_char *buf, size_t len);
+static void ngx_http_rate_limit_gossip_read_handler(ngx_event_t *rev);
+static void ngx_http_rate_limit_gossip_merge(
+        ngx_http_rate_limit_local_ctx_t *ctx, uint64_t *seen, u_char *p,
+        size_t size);
+static void ngx_http_rate_limit_gossip_secret(
+        ngx_http_rate_limit_local_ctx_t *ctx, ngx_str_t *secret);
+static void ngx_http_rate_limit_gossip_mac(ngx_http_rate_limit_local_ctx_t *ctx,
+                                           u_char *p, size_t len, u_char *mac);
+static uint64_t *ngx_http_rate_limit_gossip_peer(
+        ngx_http_rate_limit_local_ctx_t *ctx, struct sockaddr *sockaddr,
+        socklen_t socklen);
+static u_char *ngx_http_rate_limit_gossip_put(u_char *p, uint64_t value,
+                                              size_t n);
+static uint64_t ngx_http_rate_limit_gossip_get(u_char *p, size_t n);
+static ngx_int_t ngx_http_rate_limit_local_addr(ngx_conf_t *cf,
+                                                ngx_str_t *value,
+                                                ngx_uint_t listen,
+                                                ngx_array_t *addrs);
+
+static ngx_int_t
+ngx_http_rate_limit_local_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_rate_limit_local_ctx_t *octx = data;
+
+    size_t                           len;
+    ngx_http_rate_limit_local_ctx_t *ctx;
+
+    ctx = shm_zone->data;
+
+    if (octx) {
+        /* the gossip settings may change, the state is kept */
+        ctx->sh = octx->sh;
+        ctx->shpool = octx->shpool;
+
+        return NGX_OK;
+    }
+
+    ctx->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        ctx->sh = ctx->shpool->data;
+
+        return NGX_OK;
+    }
+
+    ctx->sh = ngx_slab_alloc(ctx->shpool,
+                             sizeof(ngx_http_rate_limit_local_sh_t));
+    if (ctx->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->shpool->data = ctx->sh;
+
+    ngx_rbtree_init(&ctx->sh->rbtree, &ctx->sh->sentinel,
+                    ngx_http_rate_limit_local_rbtree_insert_value);
+
+    ngx_queue_init(&ctx->sh->queue);
+    ngx_queue_init(&ctx->sh->dirty);
+
+    len = sizeof(" in rate_limit_local_zone \"\"") + shm_zone->shm.name.len;
+
+    ctx->shpool->log_ctx = ngx_slab_alloc(ctx->shpool, len);
+    if (ctx->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(ctx->shpool->log_ctx, " in rate_limit_local_zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    ctx->shpool->log_nomem = 0;
+
+    return NGX_OK;
+}
+
+/* Reference: ngx_http_limit_req_rbtree_insert_value */
+static void
+ngx_http_rate_limit_local_rbtree_insert_value(ngx_rbtree_node_t *temp,
+                                              ngx_rbtree_node_t *node,
+                                              ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t               **p;
+    ngx_http_rate_limit_local_node_t *lrn, *lrnt;
+
+    for (;;) {
+
+        if (node->key < temp->key) {
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            lrn = (ngx_http_rate_limit_local_node_t *) &node->color;
+            lrnt = (ngx_http_rate_limit_local_node_t *) &temp->color;
+
+            p = (ngx_memn2cmp(lrn->data, lrnt->data, lrn->len, lrnt->len) < 0)
+                    ? &temp->left
+                    : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+static ngx_http_rate_limit_local_node_t *
+ngx_http_rate_limit_local_lookup(ngx_http_rate_limit_local_ctx_t *ctx,
+                                 ngx_str_t *key, uint32_t hash)
+{
+    ngx_int_t                         rc;
+    ngx_rbtree_node_t                *node, *sentinel;
+    ngx_http_rate_limit_local_node_t *lr;
+
+    node = ctx->sh->rbtree.root;
+    sentinel = ctx->sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* hash == node->key */
+
+        lr = (ngx_http_rate_limit_local_node_t *) &node->color;
+
+        rc = ngx_memn2cmp(key->data, lr->data, key->len, (size_t) lr->len);
+
+        if (rc == 0) {
+            return lr;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+/* Finds or creates the node of a key, the zone must be locked */
+static ngx_http_rate_limit_local_node_t *
+ngx_http_rate_limit_local_node(ngx_http_rate_limit_local_ctx_t *ctx,
+                               ngx_str_t *key, uint64_t now)
+{
+    size_t                            size;
+    uint32_t                          hash;
+    ngx_rbtree_node_t                *node;
+    ngx_http_rate_limit_local_node_t *lr;
+
+    hash = ngx_crc32_short(key->data, key->len);
+
+    lr = ngx_http_rate_limit_local_lookup(ctx, key, hash);
+
+    if (lr) {
+        ngx_queue_remove(&lr->queue);
+        ngx_queue_insert_head(&ctx->sh->queue, &lr->queue);
+
+        return lr;
+    }
+
+    size = offsetof(ngx_rbtree_node_t, color) +
+           offsetof(ngx_http_rate_limit_local_node_t, data) + key->len;
+
+    node = ngx_slab_alloc_locked(ctx->shpool, size);
+
+    if (node == NULL) {
+        ngx_http_rate_limit_local_expire(ctx, 0, now);
+
+        node = ngx_slab_alloc_locked(ctx->shpool, size);
+        if (node == NULL) {
+            return NULL;
+        }
+    }
+
+    node->key = hash;
+
+    lr = (ngx_http_rate_limit_local_node_t *) &node->color;
+
+    lr->len = (u_short) key->len;
+    lr->pending = 0;
+    lr->tat = 0;
+    lr->interval = 0;
+
+    ngx_memcpy(lr->data, key->data, key->len);
+
+    ngx_rbtree_insert(&ctx->sh->rbtree, node);
+
+    ngx_queue_insert_head(&ctx->sh->queue, &lr->queue);
+
+    return lr;
+}
+
+/*
+ * Reference: ngx_http_limit_req_expire
+ *
+ * n == 0 frees the least recently used node whatever its state, then
+ * up to two more nodes that have become empty.
+ */
+static void
+ngx_http_rate_limit_local_expire(ngx_http_rate_limit_local_ctx_t *ctx,
+                                 ngx_uint_t n, uint64_t now)
+{
+    ngx_queue_t                      *q;
+    ngx_rbtree_node_t                *node;
+    ngx_http_rate_limit_local_node_t *lr;
+
+    while (n < 3) {
+
+        if (ngx_queue_empty(&ctx->sh->queue)) {
+            return;
+        }
+
+        q = ngx_queue_last(&ctx->sh->queue);
+
+        lr = ngx_queue_data(q, ngx_http_rate_limit_local_node_t, queue);
+
+        if (n++ != 0) {
+            if (lr->tat > now || lr->pending) {
+                return;
+            }
+        }
+
+        ngx_queue_remove(q);
+
+        if (lr->pending) {
+            ngx_queue_remove(&lr->dirty);
+        }
+
+        node = (ngx_rbtree_node_t *) ((u_char *) lr -
+                                      offsetof(ngx_rbtree_node_t, color));
+
+        ngx_rbtree_delete(&ctx->sh->rbtree, node);
+
+        ngx_slab_free_locked(ctx->shpool, node);
+    }
+}
+
+static uint64_t
+ngx_http_rate_limit_local_now(void)
+{
+    ngx_time_t *tp;
+
+    tp = ngx_timeofday();
+
+    return (uint64_t) tp->sec * 1000000 + (uint64_t) tp->msec * 1000;
+}
+
+ngx_int_t
+ngx_http_rate_limit_local_account(ngx_http_request_t *r,
+                                  ngx_http_rate_limit_ctx_t *ctx)
+{
+    uint64_t                          now, interval;
+    ngx_rate_limit_rule_t             rule;
+    ngx_rate_limit_gcra_t             res;
+    ngx_http_rate_limit_loc_conf_t   *rlcf;
+    ngx_http_rate_limit_local_ctx_t  *lctx;
+    ngx_http_rate_limit_local_node_t *lr;
+
+    rlcf = ngx_http_get_module_loc_conf(r, ngx_http_rate_limit_module);
+
+    lctx = rlcf->local_zone->data;
+
+    rule = rlcf->rule;
+
+    if (rlcf->policy_zone) {
+        ngx_http_rate_limit_policy_apply(r, &rule);
+    }
+
+    if (rlcf->adaptive_zone) {
+        ngx_http_rate_limit_adaptive_apply(rlcf->adaptive_zone, &rule);
+    }
+
+    interval = ngx_rate_limit_gcra_interval(rule.requests,
+                                            (uint64_t) rule.period * 1000);
+
+    now = ngx_http_rate_limit_local_now();
+
+    ngx_shmtx_lock(&lctx->shpool->mutex);
+
+    ngx_http_rate_limit_local_expire(lctx, 1, now);
+
+    lr = ngx_http_rate_limit_local_node(lctx, &ctx->key, now);
+
+    if (lr == NULL) {
+        ngx_shmtx_unlock(&lctx->shpool->mutex);
+
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                      "could not allocate node%s", lctx->shpool->log_ctx);
+        return NGX_ERROR;
+    }
+
+    lr->interval = interval;
+
+    ngx_rate_limit_gcra(&lr->tat, now, interval, rule.burst, rule.quantity,
+                        &res);
+
+    if (!res.limited && rule.quantity && lctx->listen) {
+        /* the other nodes are told about it with the next gossip */
+
+        if (lr->pending == 0) {
+            ngx_queue_insert_tail(&lctx->sh->dirty, &lr->dirty);
+        }
+
+        if (lr->pending > NGX_MAX_UINT32_VALUE - rule.quantity) {
+            lr->pending = NGX_MAX_UINT32_VALUE;
+
+        } else {
+            lr->pending += rule.quantity;
+        }
+    }
+
+    ngx_shmtx_unlock(&lctx->shpool->mutex);
+
+    ctx->reply.limited = res.limited;
+    ctx->reply.limit = (ngx_uint_t) res.limit;
+    ctx->reply.remaining = (ngx_uint_t) res.remaining;
+    ctx->reply.reset = (ngx_uint_t) ((res.reset + 999999) / 1000000);
+
+    if (res.retry_after < 0) {
+        ctx->reply.retry_after = -1;
+
+    } else {
+        ctx->reply.retry_after =
+            (ngx_int_t) ((res.retry_after + 999999) / 1000000);
+    }
+
+    ngx_log_debug4(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "rate limit local: key \"%V\" limited %d, remaining %uL, "
+                   "reset %uL",
+                   &ctx->key, res.limited, res.remaining, res.reset);
+
+    return res.limited ? NGX_BUSY : NGX_OK;
+}
+
+ngx_int_t
+ngx_http_rate_limit_local_init_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                       i;
+    ngx_shm_zone_t                 **zones;
+    ngx_http_rate_limit_local_ctx_t *ctx;
+    ngx_http_rate_limit_main_conf_t *rlmcf;
+
+    if (ngx_process != NGX_PROCESS_WORKER &&
+        ngx_process != NGX_PROCESS_SINGLE) {
+        return NGX_OK;
+    }
+
+    /* one worker gossips for the whole node */
+    if (ngx_process == NGX_PROCESS_WORKER && ngx_worker != 0) {
+        return NGX_OK;
+    }
+
+    rlmcf = ngx_http_cycle_get_module_main_conf(cycle,
+                                                ngx_http_rate_limit_module);
+
+    if (rlmcf == NULL) {
+        return NGX_OK;
+    }
+
+    zones = rlmcf->locals.elts;
+
+    for (i = 0; i < rlmcf->locals.nelts; i++) {
+        ctx = zones[i]->data;
+
+        if (ctx->listen == NULL) {
+            continue;
+        }
+
+        ctx->seen = ngx_pcalloc(cycle->pool,
+                                ctx->peers.nelts * sizeof(uint64_t));
+        if (ctx->seen == NULL) {
+            return NGX_ERROR;
+        }
+
+        if (ngx_http_rate_limit_gossip_listen(cycle, ctx) != NGX_OK) {
+            /* the node keeps limiting on its own */
+            continue;
+        }
+
+        ctx->timer.handler = ngx_http_rate_limit_gossip_timer_handler;
+        ctx->timer.data = ctx;
+        ctx->timer.log = cycle->log;
+        ctx->timer.cancelable = 1;
+
+        ngx_add_timer(&ctx->timer, ctx->interval);
+    }
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_rate_limit_gossip_listen(ngx_cycle_t *cycle,
+                                  ngx_http_rate_limit_local_ctx_t *ctx)
+{
+    ngx_socket_t      s;
+    ngx_connection_t *c;
+
+#if (NGX_HAVE_REUSEPORT)
+    int reuseport;
+#endif
+
+    s = ngx_socket(ctx->listen->sockaddr->sa_family, SOCK_DGRAM, 0);
+
+    if (s == (ngx_socket_t) -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_socket_errno,
+                      ngx_socket_n " failed");
+        return NGX_ERROR;
+    }
+
+#if (NGX_HAVE_REUSEPORT)
+
+    /* the previous worker keeps its socket while it shuts down */
+
+    reuseport = 1;
+
+    if (setsockopt(s, SOL_SOCKET, SO_REUSEPORT, (const void *) &reuseport,
+                   sizeof(int)) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_socket_errno,
+                      "setsockopt(SO_REUSEPORT) %V failed",
+                      &ctx->listen->name);
+        goto failed;
+    }
+
+#endif
+
+    if (ngx_nonblocking(s) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_socket_errno,
+                      ngx_nonblocking_n " failed");
+        goto failed;
+    }
+
+    if (bind(s, ctx->listen->sockaddr, ctx->listen->socklen) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_socket_errno,
+                      "bind() to %V failed", &ctx->listen->name);
+        goto failed;
+    }
+
+    c = ngx_get_connection(s, cycle->log);
+    if (c == NULL) {
+        goto failed;
+    }
+
+    c->type = SOCK_DGRAM;
+    c->data = ctx;
+
+    c->read->handler = ngx_http_rate_limit_gossip_read_handler;
+    c->read->log = cycle->log;
+    c->write->handler = ngx_http_empty_handler;
+    c->write->log = cycle->log;
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        ngx_close_connection(c);
+        return NGX_ERROR;
+    }
+
+    ctx->connection = c;
+
+    return NGX_OK;
+
+failed:
+
+    if (ngx_close_socket(s) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_socket_errno,
+                      ngx_close_socket_n " failed");
+    }
+
+    return NGX_ERROR;
+}
+
+static void
+ngx_http_rate_limit_gossip_timer_handler(ngx_event_t *ev)
+{
+    ngx_http_rate_limit_local_ctx_t *ctx;
+
+    ctx = ev->data;
+
+    if (ctx->connection == NULL) {
+        return;
+    }
+
+    ngx_http_rate_limit_gossip_flush(ctx);
+
+    if (ngx_exiting || ngx_terminate) {
+        ngx_close_connection(ctx->connection);
+        ctx->connection = NULL;
+        return;
+    }
+
+    ngx_add_timer(ev, ctx->interval);
+}
+
+/*
+ * Sends the units consumed by this node since the last gossip. Each peer
+ * adds them to its own state, so all nodes converge to the total.
+ */
+static void
+ngx_http_rate_limit_gossip_flush(ngx_http_rate_limit_local_ctx_t *ctx)
+{
+    u_char                            buf[NGX_HTTP_RATE_LIMIT_GOSSIP_SIZE];
+    u_char                           *p, *start, *last;
+    ngx_queue_t                      *q;
+    ngx_http_rate_limit_local_node_t *lr;
+
+    start = buf + NGX_HTTP_RATE_LIMIT_GOSSIP_HEADER;
+    last = buf + NGX_HTTP_RATE_LIMIT_GOSSIP_SIZE;
+
+    if (ctx->secret) {
+        last -= NGX_HTTP_RATE_LIMIT_GOSSIP_MAC;
+    }
+
+    (void) ngx_http_rate_limit_gossip_put(buf, NGX_HTTP_RATE_LIMIT_GOSSIP_MAGIC,
+                                          4);
+
+    p = start;
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    while (!ngx_queue_empty(&ctx->sh->dirty)) {
+
+        q = ngx_queue_head(&ctx->sh->dirty);
+        lr = ngx_queue_data(q, ngx_http_rate_limit_local_node_t, dirty);
+
+        ngx_queue_remove(q);
+
+        if ((size_t) (last - p) < NGX_HTTP_RATE_LIMIT_GOSSIP_RECORD + lr->len) {
+
+            if (p > start) {
+                ngx_http_rate_limit_gossip_send(ctx, buf, p - buf);
+                p = start;
+            }
+
+            if ((size_t) (last - p) <
+                NGX_HTTP_RATE_LIMIT_GOSSIP_RECORD + lr->len) {
+                /* the key alone does not fit into a datagram */
+                lr->pending = 0;
+                continue;
+            }
+        }
+
+        p = ngx_http_rate_limit_gossip_put(p, lr->interval, 8);
+        p = ngx_http_rate_limit_gossip_put(p, lr->pending, 4);
+        p = ngx_http_rate_limit_gossip_put(p, lr->len, 2);
+        p = ngx_cpymem(p, lr->data, lr->len);
+
+        lr->pending = 0;
+    }
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    if (p > start) {
+        ngx_http_rate_limit_gossip_send(ctx, buf, p - buf);
+    }
+}
+
+static void
+ngx_http_rate_limit_gossip_send(ngx_http_rate_limit_local_ctx_t *ctx,
+                                u_char *buf, size_t len)
+{
+    uint64_t    now;
+    ngx_uint_t  i;
+    ngx_addr_t *peer;
+
+    now = ngx_http_rate_limit_local_now();
+
+    /* the clock has a resolution of 1ms, several datagrams may share it */
+    ctx->sent = ngx_max(now, ctx->sent + 1);
+
+    (void) ngx_http_rate_limit_gossip_put(buf + 4, ctx->sent, 8);
+
+    /* flush() left room for the MAC after the records */
+
+    if (ctx->secret) {
+        ngx_http_rate_limit_gossip_mac(ctx, buf, len, buf + len);
+        len += NGX_HTTP_RATE_LIMIT_GOSSIP_MAC;
+    }
+
+    peer = ctx->peers.elts;
+
+    for (i = 0; i < ctx->peers.nelts; i++) {
+        if (sendto(ctx->connection->fd, buf, len, 0, peer[i].sockaddr,
+                   peer[i].socklen) == -1) {
+            ngx_log_error(NGX_LOG_INFO, ctx->connection->log,
+                          ngx_socket_errno, "sendto() to %V failed",
+                          &peer[i].name);
+        }
+    }
+}
+
+static void
+ngx_http_rate_limit_gossip_read_handler(ngx_event_t *rev)
+{
+    u_char                           buf[NGX_HTTP_RATE_LIMIT_GOSSIP_SIZE];
+    ssize_t                          n;
+    ngx_err_t                        err;
+    socklen_t                        socklen;
+    uint64_t                        *seen;
+    ngx_sockaddr_t                   sa;
+    ngx_connection_t                *c;
+    ngx_http_rate_limit_local_ctx_t *ctx;
+
+    c = rev->data;
+    ctx = c->data;
+
+    for (;;) {
+        socklen = sizeof(ngx_sockaddr_t);
+
+        n = recvfrom(c->fd, buf, NGX_HTTP_RATE_LIMIT_GOSSIP_SIZE, 0,
+                     &sa.sockaddr, &socklen);
+
+        if (n == -1) {
+            err = ngx_socket_errno;
+
+            if (err == NGX_EAGAIN) {
+                break;
+            }
+
+            if (err == NGX_EINTR) {
+                continue;
+            }
+
+            ngx_log_error(NGX_LOG_ALERT, rev->log, err, "recvfrom() failed");
+            break;
+        }
+
+        seen = ngx_http_rate_limit_gossip_peer(ctx, &sa.sockaddr, socklen);
+
+        if (seen == NULL) {
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, rev->log, 0,
+                           "rate limit gossip: datagram from unknown peer");
+            continue;
+        }
+
+        ngx_http_rate_limit_gossip_merge(ctx, seen, buf, n);
+    }
+
+    if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+        ngx_close_connection(c);
+        ctx->connection = NULL;
+    }
+}
+
+static void
+ngx_http_rate_limit_gossip_merge(ngx_http_rate_limit_local_ctx_t *ctx,
+                                 uint64_t *seen, u_char *p, size_t size)
+{
+    u_char                            mac[NGX_HTTP_RATE_LIMIT_GOSSIP_MAC];
+    u_char                           *last, diff;
+    uint64_t                          now, sent, interval, quantity;
+    ngx_str_t                         key;
+    ngx_uint_t                        i;
+    ngx_http_rate_limit_local_node_t *lr;
+
+    if (size < NGX_HTTP_RATE_LIMIT_GOSSIP_HEADER ||
+        ngx_http_rate_limit_gossip_get(p, 4) !=
+            NGX_HTTP_RATE_LIMIT_GOSSIP_MAGIC) {
+        return;
+    }
+
+    now = ngx_http_rate_limit_local_now();
+
+    if (ctx->secret) {
+        if (size < NGX_HTTP_RATE_LIMIT_GOSSIP_HEADER +
+                       NGX_HTTP_RATE_LIMIT_GOSSIP_MAC) {
+            return;
+        }
+
+        size -= NGX_HTTP_RATE_LIMIT_GOSSIP_MAC;
+
+        ngx_http_rate_limit_gossip_mac(ctx, p, size, mac);
+
+        /* compared in constant time */
+        diff = 0;
+
+        for (i = 0; i < NGX_HTTP_RATE_LIMIT_GOSSIP_MAC; i++) {
+            diff |= (u_char) (mac[i] ^ p[size + i]);
+        }
+
+        if (diff) {
+            ngx_log_error(NGX_LOG_INFO, ctx->connection->log, 0,
+                          "rate limit gossip: datagram with an invalid MAC");
+            return;
+        }
+
+        sent = ngx_http_rate_limit_gossip_get(p + 4, 8);
+
+        if (sent + NGX_HTTP_RATE_LIMIT_GOSSIP_SKEW < now ||
+            sent > now + NGX_HTTP_RATE_LIMIT_GOSSIP_SKEW) {
+            ngx_log_error(NGX_LOG_INFO, ctx->connection->log, 0,
+                          "rate limit gossip: stale datagram, or the clocks "
+                          "of the peers are apart");
+            return;
+        }
+
+        /*
+         * a peer sends increasing times, so a datagram replayed later is not
+         * counted again; one that arrives out of order is dropped as well
+         */
+
+        if (sent <= *seen) {
+            ngx_log_error(NGX_LOG_INFO, ctx->connection->log, 0,
+                          "rate limit gossip: replayed datagram");
+            return;
+        }
+
+        *seen = sent;
+    }
+
+    last = p + size;
+    p += NGX_HTTP_RATE_LIMIT_GOSSIP_HEADER;
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    while ((size_t) (last - p) >= NGX_HTTP_RATE_LIMIT_GOSSIP_RECORD) {
+
+        interval = ngx_http_rate_limit_gossip_get(p, 8);
+        quantity = ngx_http_rate_limit_gossip_get(p + 8, 4);
+        key.len = (size_t) ngx_http_rate_limit_gossip_get(p + 12, 2);
+
+        p += NGX_HTTP_RATE_LIMIT_GOSSIP_RECORD;
+
+        if ((size_t) (last - p) < key.len) {
+            break;
+        }
+
+        key.data = p;
+        p += key.len;
+
+        if (key.len == 0 || interval == 0) {
+            continue;
+        }
+
+        lr = ngx_http_rate_limit_local_node(ctx, &key, now);
+        if (lr == NULL) {
+            break;
+        }
+
+        if (lr->interval == 0) {
+            lr->interval = interval;
+        }
+
+        /* consumed elsewhere, so not passed on again */
+        ngx_rate_limit_gcra_merge(&lr->tat, now, interval, quantity);
+    }
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+}
+
+/* Returns where the time of the last datagram of the peer is kept */
+static uint64_t *
+ngx_http_rate_limit_gossip_peer(ngx_http_rate_limit_local_ctx_t *ctx,
+                                struct sockaddr *sockaddr, socklen_t socklen)
+{
+    ngx_uint_t  i;
+    ngx_addr_t *peer;
+
+    peer = ctx->peers.elts;
+
+    for (i = 0; i < ctx->peers.nelts; i++) {
+        if (ngx_cmp_sockaddr(sockaddr, socklen, peer[i].sockaddr,
+                             peer[i].socklen, 1) == NGX_OK) {
+            return &ctx->seen[i];
+        }
+    }
+
+    return NULL;
+}
+
+/* Reference: RFC 2104, the pads are hashed once at configuration time */
+static void
+ngx_http_rate_limit_gossip_secret(ngx_http_rate_limit_local_ctx_t *ctx,
+                                  ngx_str_t *secret)
+{
+    u_char     key[64], pad[64];
+    ngx_uint_t i;
+    ngx_sha1_t sha1;
+
+    ngx_memzero(key, sizeof(key));
+
+    if (secret->len > sizeof(key)) {
+        ngx_sha1_init(&sha1);
+        ngx_sha1_update(&sha1, secret->data, secret->len);
+        ngx_sha1_final(key, &sha1);
+
+    } else {
+        ngx_memcpy(key, secret->data, secret->len);
+    }
+
+    for (i = 0; i < sizeof(key); i++) {
+        pad[i] = key[i] ^ 0x36;
+    }
+
+    ngx_sha1_init(&ctx->inner);
+    ngx_sha1_update(&ctx->inner, pad, sizeof(pad));
+
+    for (i = 0; i < sizeof(key); i++) {
+        pad[i] = key[i] ^ 0x5c;
+    }
+
+    ngx_sha1_init(&ctx->outer);
+    ngx_sha1_update(&ctx->outer, pad, sizeof(pad));
+
+    ctx->secret = 1;
+}
+
+static void
+ngx_http_rate_limit_gossip_mac(ngx_http_rate_limit_local_ctx_t *ctx,
+                               u_char *p, size_t len, u_char *mac)
+{
+    u_char     digest[NGX_HTTP_RATE_LIMIT_GOSSIP_MAC];
+    ngx_sha1_t sha1;
+
+    sha1 = ctx->inner;
+    ngx_sha1_update(&sha1, p, len);
+    ngx_sha1_final(digest, &sha1);
+
+    sha1 = ctx->outer;
+    ngx_sha1_update(&sha1, digest, sizeof(digest));
+    ngx_sha1_final(mac, &sha1);
+}
+
+/* Integers are sent in network byte order */
+static u_char *
+ngx_http_rate_limit_gossip_put(u_char *p, uint64_t value, size_t n)
+{
+    size_t i;
+
+    for (i = n; i-- > 0; /* void */) {
+        p[i] = (u_char) (value & 0xff);
+        value >>= 8;
+    }
+
+    return p + n;
+}
+
+static uint64_t
+ngx_http_rate_limit_gossip_get(u_char *p, size_t n)
+{
+    uint64_t value;
+
+    value = 0;
+
+    while (n--) {
+        value = (value << 8) | *p++;
+    }
+
+    return value;
+}
+
+static ngx_int_t
+ngx_http_rate_limit_local_addr(ngx_conf_t *cf, ngx_str_t *value,
+                               ngx_uint_t listen, ngx_array_t *addrs)
+{
+    ngx_uint_t  i;
+    ngx_url_t   u;
+    ngx_addr_t *addr;
+
+    ngx_memzero(&u, sizeof(ngx_url_t));
+
+    u.url = *value;
+    u.listen = listen;
+
+    if (ngx_parse_url(cf->pool, &u) != NGX_OK) {
+        if (u.err) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "%s in \"%V\"", u.err,
+                               &u.url);
+        }
+
+        return NGX_ERROR;
+    }
+
+    if (u.no_port || u.naddrs == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "no address and port in \"%V\"", &u.url);
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < u.naddrs; i++) {
+        addr = ngx_array_push(addrs);
+        if (addr == NULL) {
+            return NGX_ERROR;
+        }
+
+        *addr = u.addrs[i];
+
+        if (listen) {
+            break;
+        }
+    }
+
+    return NGX_OK;
+}
+
+char *
+ngx_http_rate_limit_local_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    u_char                          *p;
+    ssize_t                          size;
+    ngx_str_t                       *value, name, s;
+    ngx_int_t                        interval;
+    ngx_uint_t                       i;
+    ngx_array_t                      listen;
+    ngx_shm_zone_t                  *shm_zone, **zone;
+    ngx_http_rate_limit_local_ctx_t *ctx;
+    ngx_http_rate_limit_main_conf_t *rlmcf;
+
+    value = cf->args->elts;
+
+    ctx = ngx_pcalloc(cf->pool, sizeof(ngx_http_rate_limit_local_ctx_t));
+    if (ctx == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_array_init(&ctx->peers, cf->pool, 4, sizeof(ngx_addr_t)) !=
+        NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_array_init(&listen, cf->pool, 1, sizeof(ngx_addr_t)) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_str_null(&name);
+
+    size = 0;
+    interval = 100;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "zone=", 5) == 0) {
+
+            name.data = value[i].data + 5;
+
+            p = (u_char *) ngx_strchr(name.data, ':');
+
+            if (p == NULL) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid zone size \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            name.len = p - name.data;
+
+            s.data = p + 1;
+            s.len = value[i].data + value[i].len - s.data;
+
+            size = ngx_parse_size(&s);
+
+            if (size == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid zone size \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            if (size < (ssize_t) (8 * ngx_pagesize)) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "zone \"%V\" is too small", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "listen=", 7) == 0) {
+
+            s.len = value[i].len - 7;
+            s.data = value[i].data + 7;
+
+            if (listen.nelts) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "duplicate \"listen\" parameter");
+                return NGX_CONF_ERROR;
+            }
+
+            if (ngx_http_rate_limit_local_addr(cf, &s, 1, &listen) !=
+                NGX_OK) {
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "peer=", 5) == 0) {
+
+            s.len = value[i].len - 5;
+            s.data = value[i].data + 5;
+
+            if (ngx_http_rate_limit_local_addr(cf, &s, 0, &ctx->peers) !=
+                NGX_OK) {
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "secret=", 7) == 0) {
+
+            s.len = value[i].len - 7;
+            s.data = value[i].data + 7;
+
+            if (s.len == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid secret \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            ngx_http_rate_limit_gossip_secret(ctx, &s);
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "interval=", 9) == 0) {
+
+            s.len = value[i].len - 9;
+            s.data = value[i].data + 9;
+
+            interval = ngx_parse_time(&s, 0);
+            if (interval <= 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid interval time \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"",
+                           &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (name.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must have \"zone\" parameter",
+                           &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    if (listen.nelts != (ctx->peers.nelts ? 1 : 0)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must have both \"listen\" and \"peer\" "
+                           "parameters to gossip",
+                           &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    if (listen.nelts) {
+        ctx->listen = listen.elts;
+    }
+
+    ctx->interval = interval;
+
+    shm_zone = ngx_shared_memory_add(cf, &name, size,
+                                     &ngx_http_rate_limit_module);
+    if (shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (shm_zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "duplicate zone \"%V\"",
+                           &name);
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone->init = ngx_http_rate_limit_local_init_zone;
+    shm_zone->data = ctx;
+
+    rlmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_rate_limit_module);
+
+    zone = ngx_array_push(&rlmcf->locals);
+    if (zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    *zone = shm_zone;
+
+    return NGX_CONF_OK;
+}
+
+char *
+ngx_http_rate_limit_local(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_rate_limit_loc_conf_t *rlcf = conf;
+
+    ngx_str_t *value, name;
+
+    if (rlcf->local_zone != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        rlcf->local_zone = NULL;
+        return NGX_CONF_OK;
+    }
+
+    if (ngx_strncmp(value[1].data, "zone=", 5) != 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"",
+                           &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    name.len = value[1].len - 5;
+    name.data = value[1].data + 5;
+
+    rlcf->local_zone = ngx_shared_memory_add(cf, &name, 0,
+                                             &ngx_http_rate_limit_module);
+    if (rlcf->local_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    rlcf->configured = 1;
+
+    return NGX_CONF_OK;
+}
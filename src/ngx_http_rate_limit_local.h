@@ -0,0 +1,14 @@
+#ifndef NGX_HTTP_RATE_LIMIT_LOCAL_H
+#define NGX_HTTP_RATE_LIMIT_LOCAL_H
+
+#include "ngx_http_rate_limit_module.h"
+
+char *ngx_http_rate_limit_local_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+                                     void *conf);
+char *ngx_http_rate_limit_local(ngx_conf_t *cf, ngx_command_t *cmd,
+                                void *conf);
+ngx_int_t ngx_http_rate_limit_local_init_process(ngx_cycle_t *cycle);
+ngx_int_t ngx_http_rate_limit_local_account(ngx_http_request_t *r,
+                                            ngx_http_rate_limit_ctx_t *ctx);
+
+#endif /* NGX_HTTP_RATE_LIMIT_LOCAL_H */
@@ -0,0 +1,612 @@
+#include "ngx_http_rate_limit_log.h"
+#include "ngx_http_rate_limit_util.h"
+
+typedef struct {
+    u_char  color;
+    u_char  level;
+    u_short len;
+
+    ngx_queue_t queue;
+
+    /* rejections since the last summary */
+    ngx_uint_t count;
+
+    u_char data[1];
+} ngx_http_rate_limit_log_node_t;
+
+typedef struct {
+    ngx_rbtree_t      rbtree;
+    ngx_rbtree_node_t sentinel;
+    ngx_queue_t       queue;
+} ngx_http_rate_limit_log_sh_t;
+
+typedef struct {
+    ngx_http_rate_limit_log_sh_t *sh;
+    ngx_slab_pool_t              *shpool;
+
+    ngx_msec_t interval;
+
+    /* in the worker that writes the summaries */
+    ngx_event_t timer;
+} ngx_http_rate_limit_log_ctx_t;
+
+/* a summary line, copied out of the zone before it is written */
+typedef struct {
+    ngx_str_t  key;
+    ngx_uint_t count;
+    ngx_uint_t level;
+} ngx_http_rate_limit_log_summary_t;
+
+static ngx_int_t ngx_http_rate_limit_log_init_zone(ngx_shm_zone_t *shm_zone,
+                                                   void *data);
+static void ngx_http_rate_limit_log_rbtree_insert_value(
+        ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node,
+        ngx_rbtree_node_t *sentinel);
+static ngx_http_rate_limit_log_node_t *ngx_http_rate_limit_log_lookup(
+        ngx_http_rate_limit_log_ctx_t *ctx, ngx_str_t *key, uint32_t hash);
+static ngx_uint_t ngx_http_rate_limit_log_count(
+        ngx_http_rate_limit_log_ctx_t *ctx, ngx_str_t *key, ngx_uint_t level);
+static void ngx_http_rate_limit_log_timer_handler(ngx_event_t *ev);
+static void ngx_http_rate_limit_log_free(ngx_http_rate_limit_log_ctx_t *ctx,
+                                         ngx_http_rate_limit_log_node_t *ln);
+
+static ngx_int_t
+ngx_http_rate_limit_log_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_rate_limit_log_ctx_t *octx = data;
+
+    size_t                         len;
+    ngx_http_rate_limit_log_ctx_t *ctx;
+
+    ctx = shm_zone->data;
+
+    if (octx) {
+        /* the interval may change, the counts are kept */
+        ctx->sh = octx->sh;
+        ctx->shpool = octx->shpool;
+
+        return NGX_OK;
+    }
+
+    ctx->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        ctx->sh = ctx->shpool->data;
+
+        return NGX_OK;
+    }
+
+    ctx->sh = ngx_slab_alloc(ctx->shpool,
+                             sizeof(ngx_http_rate_limit_log_sh_t));
+    if (ctx->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->shpool->data = ctx->sh;
+
+    ngx_rbtree_init(&ctx->sh->rbtree, &ctx->sh->sentinel,
+                    ngx_http_rate_limit_log_rbtree_insert_value);
+
+    ngx_queue_init(&ctx->sh->queue);
+
+    len = sizeof(" in rate_limit_log_zone \"\"") + shm_zone->shm.name.len;
+
+    ctx->shpool->log_ctx = ngx_slab_alloc(ctx->shpool, len);
+    if (ctx->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(ctx->shpool->log_ctx, " in rate_limit_log_zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    ctx->shpool->log_nomem = 0;
+
+    return NGX_OK;
+}
+
+/* Reference: ngx_http_limit_req_rbtree_insert_value */
+static void
+ngx_http_rate_limit_log_rbtree_insert_value(ngx_rbtree_node_t *temp,
+                                            ngx_rbtree_node_t *node,
+                                            ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t             **p;
+    ngx_http_rate_limit_log_node_t *ln, *lnt;
+
+    for (;;) {
+
+        if (node->key < temp->key) {
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            ln = (ngx_http_rate_limit_log_node_t *) &node->color;
+            lnt = (ngx_http_rate_limit_log_node_t *) &temp->color;
+
+            p = (ngx_memn2cmp(ln->data, lnt->data, ln->len, lnt->len) < 0)
+                    ? &temp->left
+                    : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+static ngx_http_rate_limit_log_node_t *
+ngx_http_rate_limit_log_lookup(ngx_http_rate_limit_log_ctx_t *ctx,
+                               ngx_str_t *key, uint32_t hash)
+{
+    ngx_int_t                       rc;
+    ngx_rbtree_node_t              *node, *sentinel;
+    ngx_http_rate_limit_log_node_t *ln;
+
+    node = ctx->sh->rbtree.root;
+    sentinel = ctx->sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* hash == node->key */
+
+        ln = (ngx_http_rate_limit_log_node_t *) &node->color;
+
+        rc = ngx_memn2cmp(key->data, ln->data, key->len, (size_t) ln->len);
+
+        if (rc == 0) {
+            return ln;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+/*
+ * Counts a rejection of a key, returns the count since the last summary,
+ * or 0 if the zone has no room for the key.
+ */
+static ngx_uint_t
+ngx_http_rate_limit_log_count(ngx_http_rate_limit_log_ctx_t *ctx,
+                              ngx_str_t *key, ngx_uint_t level)
+{
+    size_t                          size;
+    uint32_t                        hash;
+    ngx_uint_t                      count;
+    ngx_rbtree_node_t              *node;
+    ngx_http_rate_limit_log_node_t *ln;
+
+    hash = ngx_crc32_short(key->data, key->len);
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    ln = ngx_http_rate_limit_log_lookup(ctx, key, hash);
+
+    if (ln) {
+        count = ++ln->count;
+
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+        return count;
+    }
+
+    size = offsetof(ngx_rbtree_node_t, color) +
+           offsetof(ngx_http_rate_limit_log_node_t, data) + key->len;
+
+    node = ngx_slab_alloc_locked(ctx->shpool, size);
+
+    if (node == NULL) {
+        /* the key is logged line by line until the next summary */
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        return 0;
+    }
+
+    node->key = hash;
+
+    ln = (ngx_http_rate_limit_log_node_t *) &node->color;
+
+    ln->level = (u_char) level;
+    ln->len = (u_short) key->len;
+    ln->count = 1;
+
+    ngx_memcpy(ln->data, key->data, key->len);
+
+    ngx_rbtree_insert(&ctx->sh->rbtree, node);
+
+    ngx_queue_insert_head(&ctx->sh->queue, &ln->queue);
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    return 1;
+}
+
+/* Logs a rejection, line by line or in the summaries of rate_limit_log */
+void
+ngx_http_rate_limit_log_limited(ngx_http_request_t *r, ngx_str_t *key)
+{
+    ngx_str_t                       text;
+    ngx_uint_t                      n;
+    ngx_http_rate_limit_loc_conf_t *rlcf;
+
+    rlcf = ngx_http_get_module_loc_conf(r, ngx_http_rate_limit_module);
+
+    /* counted in text as well, so that the summaries print it */
+    if (ngx_http_rate_limit_log_key(r, key, &text) != NGX_OK) {
+        return;
+    }
+
+    if (rlcf->log_zone) {
+        n = ngx_http_rate_limit_log_count(rlcf->log_zone->data, &text,
+                                          rlcf->limit_log_level);
+
+        /* with sample, the first rejection of an interval and every nth */
+        if (n != 0 && (rlcf->log_sample == 0 || (n - 1) % rlcf->log_sample)) {
+            return;
+        }
+    }
+
+    ngx_log_error(rlcf->limit_log_level, r->connection->log, 0,
+                  "rate limit exceeded for key \"%V\"", &text);
+}
+
+ngx_int_t
+ngx_http_rate_limit_log_init_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                       i;
+    ngx_shm_zone_t                 **zones;
+    ngx_http_rate_limit_log_ctx_t   *ctx;
+    ngx_http_rate_limit_main_conf_t *rlmcf;
+
+    if (ngx_process != NGX_PROCESS_WORKER &&
+        ngx_process != NGX_PROCESS_SINGLE) {
+        return NGX_OK;
+    }
+
+    /* one worker writes the summaries of the whole node */
+    if (ngx_process == NGX_PROCESS_WORKER && ngx_worker != 0) {
+        return NGX_OK;
+    }
+
+    rlmcf = ngx_http_cycle_get_module_main_conf(cycle,
+                                                ngx_http_rate_limit_module);
+
+    if (rlmcf == NULL) {
+        return NGX_OK;
+    }
+
+    zones = rlmcf->logs.elts;
+
+    for (i = 0; i < rlmcf->logs.nelts; i++) {
+        ctx = zones[i]->data;
+
+        ctx->timer.handler = ngx_http_rate_limit_log_timer_handler;
+        ctx->timer.data = ctx;
+        ctx->timer.log = cycle->log;
+        ctx->timer.cancelable = 1;
+
+        ngx_add_timer(&ctx->timer, ctx->interval);
+    }
+
+    return NGX_OK;
+}
+
+static void
+ngx_http_rate_limit_log_timer_handler(ngx_event_t *ev)
+{
+    ngx_uint_t                         i;
+    ngx_pool_t                        *pool;
+    ngx_array_t                        summaries;
+    ngx_queue_t                       *q, *next;
+    ngx_http_rate_limit_log_ctx_t     *ctx;
+    ngx_http_rate_limit_log_node_t    *ln;
+    ngx_http_rate_limit_log_summary_t *s;
+
+    ctx = ev->data;
+
+    if (ngx_exiting) {
+        return;
+    }
+
+    ngx_add_timer(ev, ctx->interval);
+
+    pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, ev->log);
+    if (pool == NULL) {
+        return;
+    }
+
+    if (ngx_array_init(&summaries, pool, 64,
+                       sizeof(ngx_http_rate_limit_log_summary_t)) != NGX_OK) {
+        ngx_destroy_pool(pool);
+        return;
+    }
+
+    /* copied out, so that no request waits on the writes */
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    for (q = ngx_queue_head(&ctx->sh->queue);
+         q != ngx_queue_sentinel(&ctx->sh->queue);
+         q = next) {
+
+        next = ngx_queue_next(q);
+
+        ln = ngx_queue_data(q, ngx_http_rate_limit_log_node_t, queue);
+
+        s = ngx_array_push(&summaries);
+        if (s == NULL) {
+            break;
+        }
+
+        s->key.data = ngx_pnalloc(pool, ln->len);
+        if (s->key.data == NULL) {
+            summaries.nelts--;
+            break;
+        }
+
+        s->key.len = ngx_cpymem(s->key.data, ln->data, ln->len) - s->key.data;
+        s->count = ln->count;
+        s->level = ln->level;
+
+        /* counted again from the next rejection */
+        ngx_http_rate_limit_log_free(ctx, ln);
+    }
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    s = summaries.elts;
+
+    for (i = 0; i < summaries.nelts; i++) {
+        ngx_log_error(s[i].level, ev->log, 0,
+                      "rate limit: key \"%V\" limited %ui times in the last "
+                      "%Ms",
+                      &s[i].key, s[i].count, ctx->interval / 1000);
+    }
+
+    ngx_destroy_pool(pool);
+}
+
+/* Removes a key from the zone, which must be locked */
+static void
+ngx_http_rate_limit_log_free(ngx_http_rate_limit_log_ctx_t *ctx,
+                             ngx_http_rate_limit_log_node_t *ln)
+{
+    ngx_rbtree_node_t *node;
+
+    ngx_queue_remove(&ln->queue);
+
+    node = (ngx_rbtree_node_t *) ((u_char *) ln -
+                                  offsetof(ngx_rbtree_node_t, color));
+
+    ngx_rbtree_delete(&ctx->sh->rbtree, node);
+
+    ngx_slab_free_locked(ctx->shpool, node);
+}
+
+char *
+ngx_http_rate_limit_log_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    u_char                          *p;
+    ssize_t                          size;
+    ngx_str_t                       *value, name, s;
+    ngx_int_t                        interval;
+    ngx_uint_t                       i;
+    ngx_shm_zone_t                  *shm_zone, **zone;
+    ngx_http_rate_limit_log_ctx_t   *ctx;
+    ngx_http_rate_limit_main_conf_t *rlmcf;
+
+    value = cf->args->elts;
+
+    ctx = ngx_pcalloc(cf->pool, sizeof(ngx_http_rate_limit_log_ctx_t));
+    if (ctx == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_str_null(&name);
+
+    size = 0;
+    interval = 10000;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "zone=", 5) == 0) {
+
+            name.data = value[i].data + 5;
+
+            p = (u_char *) ngx_strchr(name.data, ':');
+
+            if (p == NULL) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid zone size \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            name.len = p - name.data;
+
+            s.data = p + 1;
+            s.len = value[i].data + value[i].len - s.data;
+
+            size = ngx_parse_size(&s);
+
+            if (size == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid zone size \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            if (size < (ssize_t) (8 * ngx_pagesize)) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "zone \"%V\" is too small", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "interval=", 9) == 0) {
+
+            s.len = value[i].len - 9;
+            s.data = value[i].data + 9;
+
+            /* the summaries count in whole seconds */
+            interval = ngx_parse_time(&s, 0);
+            if (interval < 1000 || interval % 1000) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid interval time \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"",
+                           &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (name.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must have \"zone\" parameter",
+                           &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    ctx->interval = interval;
+
+    shm_zone = ngx_shared_memory_add(cf, &name, size,
+                                     &ngx_http_rate_limit_module);
+    if (shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (shm_zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "duplicate zone \"%V\"",
+                           &name);
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone->init = ngx_http_rate_limit_log_init_zone;
+    shm_zone->data = ctx;
+
+    rlmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_rate_limit_module);
+
+    zone = ngx_array_push(&rlmcf->logs);
+    if (zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    *zone = shm_zone;
+
+    return NGX_CONF_OK;
+}
+
+char *
+ngx_http_rate_limit_log(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_rate_limit_loc_conf_t *rlcf = conf;
+
+    ngx_str_t  *value, name;
+    ngx_int_t   n;
+    ngx_uint_t  i;
+
+    if (rlcf->log_zone != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        if (cf->args->nelts != 2) {
+            return "takes no parameters with \"off\"";
+        }
+
+        rlcf->log_zone = NULL;
+        return NGX_CONF_OK;
+    }
+
+    ngx_str_null(&name);
+
+    rlcf->log_sample = 0;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "zone=", 5) == 0) {
+            name.len = value[i].len - 5;
+            name.data = value[i].data + 5;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "sample=", 7) == 0) {
+            n = ngx_atoi(value[i].data + 7, value[i].len - 7);
+
+            if (n == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid sample value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            rlcf->log_sample = (ngx_uint_t) n;
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"",
+                           &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (name.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must have \"zone\" parameter",
+                           &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    rlcf->log_zone = ngx_shared_memory_add(cf, &name, 0,
+                                           &ngx_http_rate_limit_module);
+    if (rlcf->log_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+ngx_int_t
+ngx_http_rate_limit_log_merge(ngx_conf_t *cf,
+                              ngx_http_rate_limit_loc_conf_t *prev,
+                              ngx_http_rate_limit_loc_conf_t *conf)
+{
+    ngx_conf_merge_ptr_value(conf->log_zone, prev->log_zone, NULL);
+    ngx_conf_merge_uint_value(conf->log_sample, prev->log_sample, 0);
+
+    if (conf->log_zone && conf->log_zone->data == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "unknown rate_limit_log_zone \"%V\"",
+                           &conf->log_zone->shm.name);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
@@ -0,0 +1,15 @@
+#ifndef NGX_HTTP_RATE_LIMIT_LOG_H
+#define NGX_HTTP_RATE_LIMIT_LOG_H
+
+#include "ngx_http_rate_limit_module.h"
+
+char *ngx_http_rate_limit_log_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+                                   void *conf);
+char *ngx_http_rate_limit_log(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+ngx_int_t ngx_http_rate_limit_log_merge(
+        ngx_conf_t *cf, ngx_http_rate_limit_loc_conf_t *prev,
+        ngx_http_rate_limit_loc_conf_t *conf);
+void ngx_http_rate_limit_log_limited(ngx_http_request_t *r, ngx_str_t *key);
+ngx_int_t ngx_http_rate_limit_log_init_process(ngx_cycle_t *cycle);
+
+#endif /* NGX_HTTP_RATE_LIMIT_LOG_H */
@@ -0,0 +1,247 @@
+#include "ngx_http_rate_limit_memcached.h"
+
+#include <ngx_md5.h>
+
+/*
+ * A fixed window per key. Unless it exists, the counter of the current
+ * window is created to expire with the window, then incremented by the
+ * quantity, all in one round trip:
+ *
+ *     add <key>:<window> 0 <ttl> 1 noreply\r\n0\r\n
+ *     incr <key>:<window> <quantity>\r\n
+ *
+ * Only incr replies, with the count of the window so far. The window
+ * allows requests + burst units, units of rejected requests included.
+ */
+
+/* longer keys, and those with spaces or control chars, are hashed */
+#define NGX_HTTP_RATE_LIMIT_MEMCACHED_KEY_LEN 200
+
+/* the longest relative expiration, memcached takes more as a Unix time */
+#define NGX_HTTP_RATE_LIMIT_MEMCACHED_RELATIVE (60 * 60 * 24 * 30)
+
+static size_t ngx_http_rate_limit_memcached_command_size(
+        ngx_http_rate_limit_ctx_t *ctx);
+static u_char *ngx_http_rate_limit_memcached_write_command(
+        u_char *p, ngx_http_rate_limit_ctx_t *ctx);
+static ngx_flag_t ngx_http_rate_limit_memcached_test_reply(u_char ch);
+static ngx_int_t ngx_http_rate_limit_memcached_parse_reply(
+        ngx_http_rate_limit_ctx_t *ctx, ngx_buf_t *b);
+static void ngx_http_rate_limit_memcached_decide(
+        ngx_http_rate_limit_ctx_t *ctx);
+static ngx_flag_t ngx_http_rate_limit_memcached_plain(ngx_str_t *key);
+static uint64_t ngx_http_rate_limit_memcached_window(
+        ngx_http_rate_limit_ctx_t *ctx, ngx_uint_t *left);
+static ngx_uint_t ngx_http_rate_limit_memcached_exptime(
+        ngx_http_rate_limit_ctx_t *ctx, ngx_uint_t left);
+
+ngx_http_rate_limit_backend_t ngx_http_rate_limit_memcached_backend = {
+    ngx_string("memcached"),
+    ngx_http_rate_limit_memcached_command_size,
+    ngx_http_rate_limit_memcached_write_command,
+    ngx_http_rate_limit_memcached_test_reply,
+    ngx_http_rate_limit_memcached_parse_reply,
+    ngx_http_rate_limit_memcached_decide
+};
+
+static size_t
+ngx_http_rate_limit_memcached_command_size(ngx_http_rate_limit_ctx_t *ctx)
+{
+    size_t     key;
+    uint64_t   window;
+    ngx_uint_t left, exptime;
+
+    window = ngx_http_rate_limit_memcached_window(ctx, &left);
+    exptime = ngx_http_rate_limit_memcached_exptime(ctx, left);
+
+    key = ngx_http_rate_limit_memcached_plain(&ctx->key) ? ctx->key.len
+                                                          : 2 * 16;
+
+    key += sizeof(":") - 1 + ngx_rate_limit_num_size(window);
+
+    return sizeof("add ") - 1 + key + sizeof(" 0 ") - 1
+           + ngx_rate_limit_num_size(exptime)
+           + sizeof(" 1 noreply" CRLF "0" CRLF "incr ") - 1 + key
+           + sizeof(" ") - 1 + ngx_rate_limit_num_size(ctx->rule.quantity)
+           + sizeof(CRLF) - 1;
+}
+
+static u_char *
+ngx_http_rate_limit_memcached_write_command(u_char *p,
+                                            ngx_http_rate_limit_ctx_t *ctx)
+{
+    u_char     *key, hash[16];
+    size_t      len;
+    uint64_t    window;
+    ngx_md5_t   md5;
+    ngx_uint_t  left;
+
+    window = ngx_http_rate_limit_memcached_window(ctx, &left);
+
+    p = ngx_cpymem(p, "add ", sizeof("add ") - 1);
+
+    key = p;
+
+    if (ngx_http_rate_limit_memcached_plain(&ctx->key)) {
+        p = ngx_cpymem(p, ctx->key.data, ctx->key.len);
+
+    } else {
+        ngx_md5_init(&md5);
+        ngx_md5_update(&md5, ctx->key.data, ctx->key.len);
+        ngx_md5_final(hash, &md5);
+
+        p = ngx_hex_dump(p, hash, 16);
+    }
+
+    p = ngx_sprintf(p, ":%uL", window);
+
+    len = p - key;
+
+    p = ngx_sprintf(p, " 0 %ui 1 noreply" CRLF "0" CRLF "incr ",
+                    ngx_http_rate_limit_memcached_exptime(ctx, left));
+
+    p = ngx_cpymem(p, key, len);
+
+    return ngx_sprintf(p, " %ui" CRLF, ctx->rule.quantity);
+}
+
+static ngx_flag_t
+ngx_http_rate_limit_memcached_test_reply(u_char ch)
+{
+    /* NOT_FOUND, ERROR or one of the *_ERROR replies otherwise */
+    return ch >= '0' && ch <= '9';
+}
+
+static ngx_int_t
+ngx_http_rate_limit_memcached_parse_reply(ngx_http_rate_limit_ctx_t *ctx,
+                                          ngx_buf_t *b)
+{
+    u_char                  ch, *p;
+    ngx_rate_limit_reply_t *rp;
+
+    enum {
+        sw_count = 0,
+        sw_almost_done
+    } state;
+
+    rp = &ctx->reply;
+    state = rp->state;
+
+    /* Example response:
+     * "16\r\n"
+     */
+
+    for (p = b->pos; p < b->last; p++) {
+        ch = *p;
+
+        switch (state) {
+
+        case sw_count:
+            /* the count is kept in remaining until decided on */
+            if (ch == CR) {
+                state = sw_almost_done;
+                break;
+            }
+
+            if (ch < '0' || ch > '9' ||
+                rp->remaining >= NGX_MAX_UINT_T_VALUE / 10) {
+                return NGX_ERROR;
+            }
+
+            rp->remaining = rp->remaining * 10 + (ch - '0');
+
+            break;
+
+        case sw_almost_done:
+            /* End of memcached response */
+            switch (ch) {
+            case LF:
+                goto done;
+            default:
+                return NGX_ERROR;
+            }
+        }
+    }
+
+    b->pos = p;
+    rp->state = state;
+
+    return NGX_AGAIN;
+
+done:
+
+    b->pos = p + 1;
+    rp->state = sw_count;
+
+    return NGX_OK;
+}
+
+static void
+ngx_http_rate_limit_memcached_decide(ngx_http_rate_limit_ctx_t *ctx)
+{
+    ngx_uint_t              count, left;
+    ngx_rate_limit_reply_t *rp;
+
+    rp = &ctx->reply;
+    count = rp->remaining;
+
+    (void) ngx_http_rate_limit_memcached_window(ctx, &left);
+
+    rp->limit = ctx->rule.requests + ctx->rule.burst;
+    rp->limited = count > rp->limit;
+    rp->remaining = rp->limited ? 0 : rp->limit - count;
+    rp->reset = (left + 999) / 1000;
+
+    /* the counter starts over with the next window */
+    rp->retry_after = rp->limited ? (ngx_int_t) rp->reset : -1;
+}
+
+static ngx_flag_t
+ngx_http_rate_limit_memcached_plain(ngx_str_t *key)
+{
+    u_char *p, *last;
+
+    if (key->len > NGX_HTTP_RATE_LIMIT_MEMCACHED_KEY_LEN) {
+        return 0;
+    }
+
+    last = key->data + key->len;
+
+    for (p = key->data; p < last; p++) {
+        if (*p <= ' ' || *p >= 0x7f) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* The window of the time the command was built at, and the msec left */
+static uint64_t
+ngx_http_rate_limit_memcached_window(ngx_http_rate_limit_ctx_t *ctx,
+                                     ngx_uint_t *left)
+{
+    uint64_t window;
+
+    window = ctx->time / ctx->rule.period;
+
+    *left = (ngx_uint_t) ((window + 1) * ctx->rule.period - ctx->time);
+
+    return window;
+}
+
+/* The counter outlives the window by a second at most */
+static ngx_uint_t
+ngx_http_rate_limit_memcached_exptime(ngx_http_rate_limit_ctx_t *ctx,
+                                      ngx_uint_t left)
+{
+    ngx_uint_t ttl;
+
+    ttl = (left + 999) / 1000 + 1;
+
+    if (ttl > NGX_HTTP_RATE_LIMIT_MEMCACHED_RELATIVE) {
+        return (ngx_uint_t) (ctx->time / 1000) + ttl;
+    }
+
+    return ttl;
+}
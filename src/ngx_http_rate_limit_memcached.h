@@ -0,0 +1,8 @@
+#ifndef NGX_HTTP_RATE_LIMIT_MEMCACHED_H
+#define NGX_HTTP_RATE_LIMIT_MEMCACHED_H
+
+#include "ngx_http_rate_limit_backend.h"
+
+extern ngx_http_rate_limit_backend_t ngx_http_rate_limit_memcached_backend;
+
+#endif /* NGX_HTTP_RATE_LIMIT_MEMCACHED_H */
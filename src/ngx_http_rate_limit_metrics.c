@@ -0,0 +1,165 @@
+#include "ngx_http_rate_limit_metrics.h"
+
+/* counters of all workers, in a zone of the module's own */
+typedef struct {
+    ngx_atomic_t ssl_handshakes;
+    ngx_atomic_t ssl_reused;
+} ngx_http_rate_limit_metrics_sh_t;
+
+static ngx_int_t ngx_http_rate_limit_metrics_init_zone(ngx_shm_zone_t *shm_zone,
+                                                       void *data);
+static ngx_int_t ngx_http_rate_limit_metrics_handler(ngx_http_request_t *r);
+
+static ngx_str_t ngx_http_rate_limit_metrics_name =
+    ngx_string("rate_limit_metrics");
+
+static ngx_int_t
+ngx_http_rate_limit_metrics_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_slab_pool_t                  *shpool;
+    ngx_http_rate_limit_metrics_sh_t *sh;
+
+    if (data) {
+        /* the counters survive a reload */
+        shm_zone->data = data;
+        return NGX_OK;
+    }
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        shm_zone->data = shpool->data;
+        return NGX_OK;
+    }
+
+    sh = ngx_slab_alloc(shpool, sizeof(ngx_http_rate_limit_metrics_sh_t));
+    if (sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(sh, sizeof(ngx_http_rate_limit_metrics_sh_t));
+
+    shpool->data = sh;
+    shm_zone->data = sh;
+
+    return NGX_OK;
+}
+
+char *
+ngx_http_rate_limit_metrics(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_core_loc_conf_t        *clcf;
+    ngx_http_rate_limit_main_conf_t *rlmcf;
+
+    rlmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_rate_limit_module);
+
+    if (rlmcf->metrics == NULL) {
+        rlmcf->metrics = ngx_shared_memory_add(
+                cf, &ngx_http_rate_limit_metrics_name, 8 * ngx_pagesize,
+                &ngx_http_rate_limit_module);
+        if (rlmcf->metrics == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        rlmcf->metrics->init = ngx_http_rate_limit_metrics_init_zone;
+    }
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_rate_limit_metrics_handler;
+
+    return NGX_CONF_OK;
+}
+
+/*
+ * Counts the TLS handshake of a connection to the backend, once its first
+ * check is answered. Later checks on the same connection made none.
+ */
+void
+ngx_http_rate_limit_metrics_ssl(ngx_http_request_t *r, ngx_connection_t *c)
+{
+#if (NGX_HTTP_SSL)
+    ngx_http_rate_limit_metrics_sh_t *sh;
+    ngx_http_rate_limit_main_conf_t  *rlmcf;
+
+    rlmcf = ngx_http_get_module_main_conf(r, ngx_http_rate_limit_module);
+
+    if (rlmcf->metrics == NULL || c == NULL || c->ssl == NULL ||
+        c->requests != 1) {
+        return;
+    }
+
+    sh = rlmcf->metrics->data;
+
+    (void) ngx_atomic_fetch_add(&sh->ssl_handshakes, 1);
+
+    if (SSL_session_reused(c->ssl->connection)) {
+        (void) ngx_atomic_fetch_add(&sh->ssl_reused, 1);
+    }
+#endif
+}
+
+/* The counters in the text format of Prometheus */
+static ngx_int_t
+ngx_http_rate_limit_metrics_handler(ngx_http_request_t *r)
+{
+    size_t                            len;
+    ngx_int_t                         rc;
+    ngx_buf_t                        *b;
+    ngx_chain_t                       out;
+    ngx_http_rate_limit_metrics_sh_t *sh;
+    ngx_http_rate_limit_main_conf_t  *rlmcf;
+
+    if (!(r->method & (NGX_HTTP_GET | NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    rlmcf = ngx_http_get_module_main_conf(r, ngx_http_rate_limit_module);
+
+    sh = rlmcf->metrics->data;
+
+    len = sizeof("# TYPE rate_limit_ssl_handshakes_total counter" LF
+                 "rate_limit_ssl_handshakes_total " LF
+                 "# TYPE rate_limit_ssl_handshakes_reused_total counter" LF
+                 "rate_limit_ssl_handshakes_reused_total " LF) - 1
+          + 2 * NGX_ATOMIC_T_LEN;
+
+    b = ngx_create_temp_buf(r->pool, len);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    b->last = ngx_sprintf(b->last,
+                          "# TYPE rate_limit_ssl_handshakes_total counter" LF
+                          "rate_limit_ssl_handshakes_total %uA" LF
+                          "# TYPE rate_limit_ssl_handshakes_reused_total "
+                          "counter" LF
+                          "rate_limit_ssl_handshakes_reused_total %uA" LF,
+                          sh->ssl_handshakes, sh->ssl_reused);
+
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    ngx_str_set(&r->headers_out.content_type, "text/plain; version=0.0.4");
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+    r->headers_out.content_type_lowcase = NULL;
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
@@ -0,0 +1,11 @@
+#ifndef NGX_HTTP_RATE_LIMIT_METRICS_H
+#define NGX_HTTP_RATE_LIMIT_METRICS_H
+
+#include "ngx_http_rate_limit_module.h"
+
+char *ngx_http_rate_limit_metrics(ngx_conf_t *cf, ngx_command_t *cmd,
+                                  void *conf);
+void ngx_http_rate_limit_metrics_ssl(ngx_http_request_t *r,
+                                     ngx_connection_t *c);
+
+#endif /* NGX_HTTP_RATE_LIMIT_METRICS_H */
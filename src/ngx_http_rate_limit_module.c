@@ -1,8 +1,31 @@
 #include "ngx_http_rate_limit_module.h"
+#include "ngx_http_rate_limit_adaptive.h"
+#include "ngx_http_rate_limit_backend.h"
 #include "ngx_http_rate_limit_handler.h"
+#include "ngx_http_rate_limit_block.h"
+#include "ngx_http_rate_limit_cache.h"
+#include "ngx_http_rate_limit_charge.h"
+#include "ngx_http_rate_limit_coalesce.h"
+#include "ngx_http_rate_limit_connection.h"
+#include "ngx_http_rate_limit_delay.h"
+#include "ngx_http_rate_limit_handshake.h"
+#include "ngx_http_rate_limit_list.h"
+#include "ngx_http_rate_limit_local.h"
+#include "ngx_http_rate_limit_log.h"
+#include "ngx_http_rate_limit_metrics.h"
+#include "ngx_http_rate_limit_policy.h"
+#include "ngx_http_rate_limit_prewarm.h"
+#include "ngx_http_rate_limit_replica.h"
+#include "ngx_http_rate_limit_sketch.h"
+#include "ngx_http_rate_limit_ssl.h"
+#include "ngx_http_rate_limit_state.h"
+#include "ngx_http_rate_limit_target.h"
 #include "ngx_http_rate_limit_util.h"
 
 static ngx_int_t ngx_http_rate_limit_init(ngx_conf_t *cf);
+static ngx_int_t ngx_http_rate_limit_init_process(ngx_cycle_t *cycle);
+static void ngx_http_rate_limit_exit_master(ngx_cycle_t *cycle);
+static void *ngx_http_rate_limit_create_main_conf(ngx_conf_t *cf);
 static void *ngx_http_rate_limit_create_loc_conf(ngx_conf_t *cf);
 static char *ngx_http_rate_limit_merge_loc_conf(ngx_conf_t *cf, void *parent,
                                                 void *child);
@@ -10,6 +33,10 @@ static char *ngx_http_rate_limit(ngx_conf_t *cf, ngx_command_t *cmd,
                                  void *conf);
 static char *ngx_http_rate_limit_pass(ngx_conf_t *cf, ngx_command_t *cmd,
                                       void *conf);
+static char *ngx_http_rate_limit_pass_replica(ngx_conf_t *cf,
+                                              ngx_command_t *cmd, void *conf);
+static char *ngx_http_rate_limit_address(ngx_conf_t *cf, ngx_command_t *cmd,
+                                         void *conf);
 
 static ngx_conf_enum_t ngx_http_rate_limit_log_levels[] = {
     { ngx_string("info"), NGX_LOG_INFO },
@@ -36,17 +63,53 @@ static ngx_command_t ngx_http_rate_limit_commands[] = {
       ngx_conf_set_str_slot, NGX_HTTP_LOC_CONF_OFFSET,
       offsetof(ngx_http_rate_limit_loc_conf_t, prefix), NULL },
 
+    { ngx_string("rate_limit_address"),
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF |
+          NGX_CONF_NOARGS | NGX_CONF_TAKE12,
+      ngx_http_rate_limit_address, NGX_HTTP_LOC_CONF_OFFSET, 0, NULL },
+
     { ngx_string("rate_limit_quantity"),
       NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF |
           NGX_CONF_TAKE1,
       ngx_conf_set_num_slot, NGX_HTTP_LOC_CONF_OFFSET,
-      offsetof(ngx_http_rate_limit_loc_conf_t, quantity), NULL },
+      offsetof(ngx_http_rate_limit_loc_conf_t, rule.quantity), NULL },
+
+    { ngx_string("rate_limit_charge"),
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF |
+          NGX_CONF_1MORE,
+      ngx_http_rate_limit_charge, NGX_HTTP_LOC_CONF_OFFSET, 0, NULL },
+
+    { ngx_string("rate_limit_cache"),
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF |
+          NGX_CONF_1MORE,
+      ngx_http_rate_limit_cache, NGX_HTTP_LOC_CONF_OFFSET, 0, NULL },
+
+    { ngx_string("rate_limit_connection_cache"),
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF |
+          NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot, NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_rate_limit_loc_conf_t, connection_cache), NULL },
 
     { ngx_string("rate_limit_pass"),
       NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF |
           NGX_CONF_TAKE1,
       ngx_http_rate_limit_pass, NGX_HTTP_LOC_CONF_OFFSET, 0, NULL },
 
+    { ngx_string("rate_limit_pass_replica"),
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF |
+          NGX_CONF_TAKE1,
+      ngx_http_rate_limit_pass_replica, NGX_HTTP_LOC_CONF_OFFSET, 0, NULL },
+
+    { ngx_string("rate_limit_backend"),
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF |
+          NGX_CONF_TAKE1,
+      ngx_http_rate_limit_backend, NGX_HTTP_LOC_CONF_OFFSET, 0, NULL },
+
+    { ngx_string("rate_limit_pass_keepalive"),
+      NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE12,
+      ngx_http_rate_limit_target_keepalive, NGX_HTTP_MAIN_CONF_OFFSET, 0,
+      NULL },
+
     { ngx_string("rate_limit_headers"),
       NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF |
           NGX_CONF_FLAG,
@@ -60,6 +123,15 @@ static ngx_command_t ngx_http_rate_limit_commands[] = {
       offsetof(ngx_http_rate_limit_loc_conf_t, limit_log_level),
       &ngx_http_rate_limit_log_levels },
 
+    { ngx_string("rate_limit_log_zone"),
+      NGX_HTTP_MAIN_CONF | NGX_CONF_1MORE,
+      ngx_http_rate_limit_log_zone, 0, 0, NULL },
+
+    { ngx_string("rate_limit_log"),
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF |
+          NGX_CONF_TAKE12,
+      ngx_http_rate_limit_log, NGX_HTTP_LOC_CONF_OFFSET, 0, NULL },
+
     { ngx_string("rate_limit_status"),
       NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF |
           NGX_CONF_TAKE1,
@@ -92,6 +164,170 @@ static ngx_command_t ngx_http_rate_limit_commands[] = {
       ngx_conf_set_msec_slot, NGX_HTTP_LOC_CONF_OFFSET,
       offsetof(ngx_http_rate_limit_loc_conf_t, upstream.read_timeout), NULL },
 
+    { ngx_string("rate_limit_sketch_zone"),
+      NGX_HTTP_MAIN_CONF | NGX_CONF_1MORE,
+      ngx_http_rate_limit_sketch_zone, 0, 0, NULL },
+
+    { ngx_string("rate_limit_sketch"),
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF |
+          NGX_CONF_TAKE2,
+      ngx_http_rate_limit_sketch, NGX_HTTP_LOC_CONF_OFFSET, 0, NULL },
+
+    { ngx_string("rate_limit_allow"),
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF |
+          NGX_CONF_TAKE1,
+      ngx_http_rate_limit_list, NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_rate_limit_loc_conf_t, allow), NULL },
+
+    { ngx_string("rate_limit_deny"),
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF |
+          NGX_CONF_TAKE1,
+      ngx_http_rate_limit_list, NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_rate_limit_loc_conf_t, deny), NULL },
+
+    { ngx_string("rate_limit_recheck"),
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF |
+          NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot, NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_rate_limit_loc_conf_t, recheck), NULL },
+
+    { ngx_string("rate_limit_coalesce"),
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF |
+          NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot, NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_rate_limit_loc_conf_t, coalesce), NULL },
+
+    { ngx_string("rate_limit_delay"),
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF |
+          NGX_CONF_TAKE12,
+      ngx_http_rate_limit_delay, NGX_HTTP_LOC_CONF_OFFSET, 0, NULL },
+
+    { ngx_string("rate_limit_adaptive_zone"),
+      NGX_HTTP_MAIN_CONF | NGX_CONF_1MORE,
+      ngx_http_rate_limit_adaptive_zone, 0, 0, NULL },
+
+    { ngx_string("rate_limit_adaptive"),
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF |
+          NGX_CONF_TAKE1,
+      ngx_http_rate_limit_adaptive, NGX_HTTP_LOC_CONF_OFFSET, 0, NULL },
+
+    { ngx_string("rate_limit_local_zone"),
+      NGX_HTTP_MAIN_CONF | NGX_CONF_1MORE,
+      ngx_http_rate_limit_local_zone, 0, 0, NULL },
+
+    { ngx_string("rate_limit_local"),
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF |
+          NGX_CONF_TAKE1,
+      ngx_http_rate_limit_local, NGX_HTTP_LOC_CONF_OFFSET, 0, NULL },
+
+    { ngx_string("rate_limit_block_zone"),
+      NGX_HTTP_MAIN_CONF | NGX_CONF_1MORE,
+      ngx_http_rate_limit_block_zone, 0, 0, NULL },
+
+    { ngx_string("rate_limit_block"),
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF |
+          NGX_CONF_TAKE1,
+      ngx_http_rate_limit_block, NGX_HTTP_LOC_CONF_OFFSET, 0, NULL },
+
+    { ngx_string("rate_limit_policy_zone"),
+      NGX_HTTP_MAIN_CONF | NGX_CONF_1MORE,
+      ngx_http_rate_limit_policy_zone, 0, 0, NULL },
+
+    { ngx_string("rate_limit_policy"),
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF |
+          NGX_CONF_TAKE1,
+      ngx_http_rate_limit_policy, NGX_HTTP_LOC_CONF_OFFSET, 0, NULL },
+
+    { ngx_string("rate_limit_policy_api"),
+      NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+      ngx_http_rate_limit_policy_api, NGX_HTTP_LOC_CONF_OFFSET, 0, NULL },
+
+    { ngx_string("rate_limit_redis_auth"),
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF |
+          NGX_CONF_TAKE12,
+      ngx_http_rate_limit_redis_auth, NGX_HTTP_LOC_CONF_OFFSET, 0, NULL },
+
+    { ngx_string("rate_limit_redis_db"),
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF |
+          NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot, NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_rate_limit_loc_conf_t, redis_db), NULL },
+
+    { ngx_string("rate_limit_redis_hello"),
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF |
+          NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot, NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_rate_limit_loc_conf_t, redis_hello), NULL },
+
+    { ngx_string("rate_limit_prewarm"),
+      NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE123,
+      ngx_http_rate_limit_prewarm, NGX_HTTP_MAIN_CONF_OFFSET, 0, NULL },
+
+#if (NGX_HTTP_SSL)
+
+    { ngx_string("rate_limit_ssl"),
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF |
+          NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot, NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_rate_limit_loc_conf_t, ssl), NULL },
+
+    { ngx_string("rate_limit_ssl_session_reuse"),
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF |
+          NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot, NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_rate_limit_loc_conf_t, upstream.ssl_session_reuse),
+      NULL },
+
+    { ngx_string("rate_limit_ssl_name"),
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF |
+          NGX_CONF_TAKE1,
+      ngx_http_set_complex_value_slot, NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_rate_limit_loc_conf_t, upstream.ssl_name), NULL },
+
+    { ngx_string("rate_limit_ssl_server_name"),
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF |
+          NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot, NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_rate_limit_loc_conf_t, upstream.ssl_server_name),
+      NULL },
+
+    { ngx_string("rate_limit_ssl_verify"),
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF |
+          NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot, NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_rate_limit_loc_conf_t, upstream.ssl_verify), NULL },
+
+    { ngx_string("rate_limit_ssl_verify_depth"),
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF |
+          NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot, NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_rate_limit_loc_conf_t, ssl_verify_depth), NULL },
+
+    { ngx_string("rate_limit_ssl_trusted_certificate"),
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF |
+          NGX_CONF_TAKE1,
+      ngx_conf_set_str_slot, NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_rate_limit_loc_conf_t, ssl_trusted_certificate),
+      NULL },
+
+    { ngx_string("rate_limit_ssl_certificate"),
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF |
+          NGX_CONF_TAKE1,
+      ngx_conf_set_str_slot, NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_rate_limit_loc_conf_t, ssl_certificate), NULL },
+
+    { ngx_string("rate_limit_ssl_certificate_key"),
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF |
+          NGX_CONF_TAKE1,
+      ngx_conf_set_str_slot, NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_rate_limit_loc_conf_t, ssl_certificate_key), NULL },
+
+#endif
+
+    { ngx_string("rate_limit_metrics"),
+      NGX_HTTP_LOC_CONF | NGX_CONF_NOARGS,
+      ngx_http_rate_limit_metrics, NGX_HTTP_LOC_CONF_OFFSET, 0, NULL },
+
     ngx_null_command
 };
 
@@ -99,8 +335,8 @@ static ngx_http_module_t ngx_http_rate_limit_module_ctx = {
     NULL,                     /* preconfiguration */
     ngx_http_rate_limit_init, /* postconfiguration */
 
-    NULL, /* create main configuration */
-    NULL, /* init main configuration */
+    ngx_http_rate_limit_create_main_conf, /* create main configuration */
+    NULL,                                 /* init main configuration */
 
     NULL, /* create server configuration */
     NULL, /* merge server configuration */
@@ -111,19 +347,70 @@ static ngx_http_module_t ngx_http_rate_limit_module_ctx = {
 
 ngx_module_t ngx_http_rate_limit_module = {
     NGX_MODULE_V1,
-    &ngx_http_rate_limit_module_ctx, /* module context */
-    ngx_http_rate_limit_commands,    /* module directives */
-    NGX_HTTP_MODULE,                 /* module type */
-    NULL,                            /* init master */
-    NULL,                            /* init module */
-    NULL,                            /* init process */
-    NULL,                            /* init thread */
-    NULL,                            /* exit thread */
-    NULL,                            /* exit process */
-    NULL,                            /* exit master */
+    &ngx_http_rate_limit_module_ctx,  /* module context */
+    ngx_http_rate_limit_commands,     /* module directives */
+    NGX_HTTP_MODULE,                  /* module type */
+    NULL,                             /* init master */
+    NULL,                             /* init module */
+    ngx_http_rate_limit_init_process, /* init process */
+    NULL,                             /* init thread */
+    NULL,                             /* exit thread */
+    NULL,                             /* exit process */
+    ngx_http_rate_limit_exit_master,  /* exit master */
     NGX_MODULE_V1_PADDING
 };
 
+static void *
+ngx_http_rate_limit_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_http_rate_limit_main_conf_t *rlmcf;
+
+    rlmcf = ngx_pcalloc(cf->pool, sizeof(ngx_http_rate_limit_main_conf_t));
+    if (rlmcf == NULL) {
+        return NULL;
+    }
+
+    if (ngx_array_init(&rlmcf->lists, cf->pool, 4,
+                       sizeof(ngx_http_rate_limit_list_t *)) != NGX_OK) {
+        return NULL;
+    }
+
+    if (ngx_array_init(&rlmcf->upstreams, cf->pool, 4,
+                       sizeof(ngx_http_upstream_srv_conf_t *)) != NGX_OK) {
+        return NULL;
+    }
+
+    if (ngx_array_init(&rlmcf->states, cf->pool, 2,
+                       sizeof(ngx_http_rate_limit_state_t)) != NGX_OK) {
+        return NULL;
+    }
+
+    if (ngx_array_init(&rlmcf->locals, cf->pool, 2,
+                       sizeof(ngx_shm_zone_t *)) != NGX_OK) {
+        return NULL;
+    }
+
+    if (ngx_array_init(&rlmcf->logs, cf->pool, 2,
+                       sizeof(ngx_shm_zone_t *)) != NGX_OK) {
+        return NULL;
+    }
+
+    if (ngx_array_init(&rlmcf->blocks, cf->pool, 2,
+                       sizeof(ngx_shm_zone_t *)) != NGX_OK) {
+        return NULL;
+    }
+
+    if (ngx_array_init(&rlmcf->charges, cf->pool, 2,
+                       sizeof(ngx_http_rate_limit_charge_sink_t *)) != NGX_OK) {
+        return NULL;
+    }
+
+    rlmcf->target_keepalive = NGX_CONF_UNSET_UINT;
+    rlmcf->target_timeout = NGX_CONF_UNSET_MSEC;
+
+    return rlmcf;
+}
+
 static void *
 ngx_http_rate_limit_create_loc_conf(ngx_conf_t *cf)
 {
@@ -144,6 +431,15 @@ ngx_http_rate_limit_create_loc_conf(ngx_conf_t *cf)
      *     conf->upstream.location = NULL;
      *
      *     conf->prefix = { 0, NULL };
+     *
+     *     conf->sketch_zone = NULL;
+     *     conf->sketch_requests = 0;
+     *
+     *     conf->upstream.ssl = NULL;
+     *     conf->upstream.ssl_name = NULL;
+     *     conf->ssl_certificate = { 0, NULL };
+     *     conf->ssl_certificate_key = { 0, NULL };
+     *     conf->ssl_trusted_certificate = { 0, NULL };
      */
 
     conf->upstream.connect_timeout = NGX_CONF_UNSET_MSEC;
@@ -166,11 +462,51 @@ ngx_http_rate_limit_create_loc_conf(ngx_conf_t *cf)
     conf->upstream.pass_request_headers = 0;
     conf->upstream.pass_request_body = 0;
 
+    conf->backend = NGX_CONF_UNSET_PTR;
+    conf->replica_upstream = NGX_CONF_UNSET_PTR;
+
+    conf->address = NGX_CONF_UNSET;
+    conf->address_ipv4 = NGX_CONF_UNSET_UINT;
+    conf->address_ipv6 = NGX_CONF_UNSET_UINT;
+
     conf->enable_headers = NGX_CONF_UNSET;
     conf->status_code = NGX_CONF_UNSET_UINT;
     conf->limit_log_level = NGX_CONF_UNSET_UINT;
+    conf->log_zone = NGX_CONF_UNSET_PTR;
+    conf->log_sample = NGX_CONF_UNSET_UINT;
+
+    conf->rule.quantity = NGX_CONF_UNSET_UINT;
+
+    conf->allow = NGX_CONF_UNSET_PTR;
+    conf->deny = NGX_CONF_UNSET_PTR;
+
+    conf->coalesce = NGX_CONF_UNSET;
+    conf->recheck = NGX_CONF_UNSET;
+
+    conf->adaptive_zone = NGX_CONF_UNSET_PTR;
+
+    conf->delay = NGX_CONF_UNSET_MSEC;
+    conf->delay_queue = NGX_CONF_UNSET_UINT;
+
+    conf->local_zone = NGX_CONF_UNSET_PTR;
+    conf->block_zone = NGX_CONF_UNSET_PTR;
 
-    conf->quantity = NGX_CONF_UNSET_UINT;
+    conf->policy_zone = NGX_CONF_UNSET_PTR;
+
+    conf->redis_db = NGX_CONF_UNSET;
+    conf->redis_hello = NGX_CONF_UNSET;
+
+    conf->charge = NGX_CONF_UNSET_PTR;
+    conf->cache = NGX_CONF_UNSET_PTR;
+    conf->connection_cache = NGX_CONF_UNSET_MSEC;
+
+#if (NGX_HTTP_SSL)
+    conf->ssl = NGX_CONF_UNSET;
+    conf->ssl_verify_depth = NGX_CONF_UNSET_UINT;
+    conf->upstream.ssl_session_reuse = NGX_CONF_UNSET;
+    conf->upstream.ssl_server_name = NGX_CONF_UNSET;
+    conf->upstream.ssl_verify = NGX_CONF_UNSET;
+#endif
 
     return conf;
 }
@@ -198,6 +534,20 @@ ngx_http_rate_limit_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
         conf->upstream.upstream = prev->upstream.upstream;
     }
 
+    ngx_conf_merge_ptr_value(conf->replica_upstream, prev->replica_upstream,
+                             NULL);
+
+    /* the timeouts and buffers of the primary, another upstream */
+    if (conf->replica_upstream) {
+        conf->replica = ngx_palloc(cf->pool, sizeof(ngx_http_upstream_conf_t));
+        if (conf->replica == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        *conf->replica = conf->upstream;
+        conf->replica->upstream = conf->replica_upstream;
+    }
+
     ngx_conf_merge_value(conf->enable_headers, prev->enable_headers, 0);
     ngx_conf_merge_uint_value(conf->status_code, prev->status_code,
                               NGX_HTTP_TOO_MANY_REQUESTS);
@@ -205,7 +555,69 @@ ngx_http_rate_limit_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
                               NGX_LOG_ERR);
 
     ngx_conf_merge_str_value(conf->prefix, prev->prefix, "");
-    ngx_conf_merge_uint_value(conf->quantity, prev->quantity, 1);
+
+    ngx_conf_merge_value(conf->address, prev->address, 0);
+    ngx_conf_merge_uint_value(conf->address_ipv4, prev->address_ipv4, 32);
+    ngx_conf_merge_uint_value(conf->address_ipv6, prev->address_ipv6, 64);
+    ngx_conf_merge_uint_value(conf->rule.quantity, prev->rule.quantity, 1);
+
+    ngx_conf_merge_ptr_value(conf->allow, prev->allow, NULL);
+    ngx_conf_merge_ptr_value(conf->deny, prev->deny, NULL);
+
+    ngx_conf_merge_value(conf->coalesce, prev->coalesce, 0);
+    ngx_conf_merge_value(conf->recheck, prev->recheck, 0);
+
+    ngx_conf_merge_ptr_value(conf->adaptive_zone, prev->adaptive_zone, NULL);
+
+    ngx_conf_merge_msec_value(conf->delay, prev->delay, 0);
+    ngx_conf_merge_uint_value(conf->delay_queue, prev->delay_queue, 1024);
+
+    ngx_conf_merge_ptr_value(conf->local_zone, prev->local_zone, NULL);
+
+    ngx_conf_merge_ptr_value(conf->policy_zone, prev->policy_zone, NULL);
+
+    /* not inherited, the cached override is that of this location */
+    if (conf->policy_zone) {
+        conf->policy = ngx_http_rate_limit_policy_create_cache(cf);
+        if (conf->policy == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    if (ngx_http_rate_limit_handshake_merge(cf, prev, conf) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    /* after the handshake, which a new connection of it starts with */
+    if (ngx_http_rate_limit_charge_merge(cf, prev, conf) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_http_rate_limit_cache_merge(cf, prev, conf) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_http_rate_limit_connection_merge(cf, prev, conf) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_http_rate_limit_block_merge(cf, prev, conf) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_http_rate_limit_log_merge(cf, prev, conf) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    /* after the features that connect on their own */
+    if (ngx_http_rate_limit_ssl_merge(cf, prev, conf) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    /* last, the features above may need the redis protocol */
+    if (ngx_http_rate_limit_backend_merge(cf, prev, conf) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
 
     return NGX_CONF_OK;
 }
@@ -233,7 +645,7 @@ ngx_http_rate_limit(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     }
 
     requests = 1;
-    period = 60;
+    period = 60000;
     burst = 0;
 
     for (i = 2; i < cf->args->nelts; i++) {
@@ -255,7 +667,8 @@ ngx_http_rate_limit(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             s.len = value[i].len - 7;
             s.data = value[i].data + 7;
 
-            period = ngx_parse_time(&s, 1);
+            /* in msec, a rate of thousands a second needs it */
+            period = ngx_rate_limit_parse_period(&s);
             if (period <= 0) {
                 ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                                    "invalid period time \"%V\"", &value[i]);
@@ -282,9 +695,9 @@ ngx_http_rate_limit(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
-    lrcf->requests = requests;
-    lrcf->period = period;
-    lrcf->burst = burst;
+    lrcf->rule.requests = requests;
+    lrcf->rule.period = period;
+    lrcf->rule.burst = burst;
 
     return NGX_CONF_OK;
 }
@@ -341,11 +754,125 @@ ngx_http_rate_limit_pass(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
+    if (ngx_http_rate_limit_prewarm_add(cf, rlcf->upstream.upstream) !=
+        NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
     rlcf->configured = 1;
 
     return NGX_CONF_OK;
 }
 
+static char *
+ngx_http_rate_limit_pass_replica(ngx_conf_t *cf, ngx_command_t *cmd,
+                                 void *conf)
+{
+    ngx_http_rate_limit_loc_conf_t *rlcf = conf;
+
+    ngx_str_t *value;
+    ngx_url_t  url;
+
+    if (rlcf->replica_upstream != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        rlcf->replica_upstream = NULL;
+        return NGX_CONF_OK;
+    }
+
+    ngx_memzero(&url, sizeof(ngx_url_t));
+
+    url.url = value[1];
+    url.no_resolve = 1;
+
+    rlcf->replica_upstream = ngx_http_upstream_add(cf, &url, 0);
+    if (rlcf->replica_upstream == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_http_rate_limit_prewarm_add(cf, rlcf->replica_upstream) !=
+        NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_http_rate_limit_replica_add(cf, rlcf->replica_upstream) !=
+        NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_rate_limit_address(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_rate_limit_loc_conf_t *rlcf = conf;
+
+    ngx_str_t  *value;
+    ngx_int_t   bits;
+    ngx_uint_t  i;
+
+    if (rlcf->address != NGX_CONF_UNSET) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (cf->args->nelts > 1 && ngx_strcmp(value[1].data, "off") == 0) {
+        if (cf->args->nelts != 2) {
+            return "takes no parameters with \"off\"";
+        }
+
+        rlcf->address = 0;
+        return NGX_CONF_OK;
+    }
+
+    rlcf->address = 1;
+    rlcf->address_ipv4 = 32;
+    rlcf->address_ipv6 = 64;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "ipv4=", 5) == 0) {
+
+            bits = ngx_atoi(value[i].data + 5, value[i].len - 5);
+            if (bits <= 0 || bits > 32) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid ipv4 value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            rlcf->address_ipv4 = bits;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "ipv6=", 5) == 0) {
+
+            bits = ngx_atoi(value[i].data + 5, value[i].len - 5);
+            if (bits <= 0 || bits > 128) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid ipv6 value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            rlcf->address_ipv6 = bits;
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"",
+                           &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
 static ngx_int_t
 ngx_http_rate_limit_init(ngx_conf_t *cf)
 {
@@ -361,5 +888,69 @@ ngx_http_rate_limit_init(ngx_conf_t *cf)
 
     *h = ngx_http_rate_limit_handler;
 
-    return NGX_OK;
+    ngx_http_rate_limit_headers_init();
+
+    /* feedback for rate_limit_adaptive */
+    h = ngx_array_push(&cmcf->phases[NGX_HTTP_LOG_PHASE].handlers);
+
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    *h = ngx_http_rate_limit_adaptive_log_handler;
+
+    /* for rate_limit_charge */
+    h = ngx_array_push(&cmcf->phases[NGX_HTTP_LOG_PHASE].handlers);
+
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    *h = ngx_http_rate_limit_charge_log_handler;
+
+    if (ngx_http_rate_limit_prewarm_init(cf) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_http_rate_limit_handshake_init(cf) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return ngx_http_rate_limit_replica_init(cf);
+}
+
+static ngx_int_t
+ngx_http_rate_limit_init_process(ngx_cycle_t *cycle)
+{
+    if (ngx_http_rate_limit_coalesce_init_process(cycle) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_http_rate_limit_local_init_process(cycle) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_http_rate_limit_block_init_process(cycle) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_http_rate_limit_log_init_process(cycle) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_http_rate_limit_target_init_process(cycle) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_http_rate_limit_state_init_process(cycle) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return ngx_http_rate_limit_prewarm_init_process(cycle);
+}
+
+static void
+ngx_http_rate_limit_exit_master(ngx_cycle_t *cycle)
+{
+    ngx_http_rate_limit_state_exit_master(cycle);
 }
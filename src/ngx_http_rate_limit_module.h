@@ -5,8 +5,54 @@
 #include <ngx_core.h>
 #include <ngx_http.h>
 
+#include "ngx_rate_limit_redis.h"
+
 extern ngx_module_t ngx_http_rate_limit_module;
 
+typedef struct ngx_http_rate_limit_list_s ngx_http_rate_limit_list_t;
+typedef struct ngx_http_rate_limit_flight_s ngx_http_rate_limit_flight_t;
+typedef struct ngx_http_rate_limit_policy_cache_s
+    ngx_http_rate_limit_policy_cache_t;
+typedef struct ngx_http_rate_limit_charge_s ngx_http_rate_limit_charge_t;
+typedef struct ngx_http_rate_limit_charge_sink_s
+    ngx_http_rate_limit_charge_sink_t;
+typedef struct ngx_http_rate_limit_cache_s ngx_http_rate_limit_cache_t;
+typedef struct ngx_http_rate_limit_target_s ngx_http_rate_limit_target_t;
+typedef struct ngx_http_rate_limit_backend_s ngx_http_rate_limit_backend_t;
+
+typedef struct {
+    ngx_array_t lists; /* ngx_http_rate_limit_list_t * */
+
+    ngx_uint_t   prewarm;
+    ngx_msec_t   prewarm_ping;
+    ngx_msec_t   prewarm_timeout;
+    ngx_array_t  upstreams; /* ngx_http_upstream_srv_conf_t * */
+    ngx_array_t *pools;     /* ngx_http_rate_limit_prewarm_t */
+
+    ngx_array_t states; /* ngx_http_rate_limit_state_t */
+    ngx_array_t locals; /* ngx_shm_zone_t * */
+    ngx_array_t blocks; /* ngx_shm_zone_t * */
+    ngx_array_t logs;   /* ngx_shm_zone_t * */
+
+    ngx_flag_t   handshake;
+    ngx_array_t *handshakes; /* ngx_http_rate_limit_handshake_t */
+
+    ngx_array_t charges; /* ngx_http_rate_limit_charge_sink_t * */
+
+    /* upstreams of rate_limit_pass_replica, taken back on failure */
+    ngx_array_t *replicas; /* ngx_http_rate_limit_replica_t */
+
+    /* idle connections kept per resolved rate_limit_pass target */
+    ngx_uint_t target_keepalive;
+    ngx_msec_t target_timeout;
+
+    /* checked over TLS, not pre-warmed */
+    ngx_array_t *ssl_upstreams; /* ngx_http_upstream_srv_conf_t * */
+
+    /* for rate_limit_metrics, counters of all workers */
+    ngx_shm_zone_t *metrics;
+} ngx_http_rate_limit_main_conf_t;
+
 typedef struct {
     ngx_flag_t               configured;
     ngx_http_complex_value_t key;
@@ -14,33 +60,129 @@ typedef struct {
     ngx_http_upstream_conf_t  upstream;
     ngx_http_complex_value_t *complex_target; /* for rate_limit_pass */
 
+    /* for rate_limit_backend, the protocol of the checks */
+    ngx_http_rate_limit_backend_t *backend;
+
+    /* for rate_limit_pass_replica, checks with a quantity of 0 */
+    ngx_http_upstream_srv_conf_t *replica_upstream;
+    ngx_http_upstream_conf_t     *replica;
+
     ngx_flag_t enable_headers;
     ngx_uint_t status_code;
     ngx_uint_t limit_log_level;
 
-    ngx_str_t  prefix;
-    ngx_uint_t requests;
-    ngx_uint_t period;
-    ngx_uint_t burst;
-    ngx_uint_t quantity;
+    /* for rate_limit_log, rejections are summed up per key */
+    ngx_shm_zone_t *log_zone;
+    ngx_uint_t      log_sample;
+
+    ngx_str_t             prefix;
+    ngx_rate_limit_rule_t rule;
+
+    /* for rate_limit_address, the masked client address is the key */
+    ngx_flag_t address;
+    ngx_uint_t address_ipv4;
+    ngx_uint_t address_ipv6;
+
+    ngx_shm_zone_t *sketch_zone;
+    ngx_uint_t      sketch_requests;
+
+    ngx_http_rate_limit_list_t *allow;
+    ngx_http_rate_limit_list_t *deny;
+
+    ngx_flag_t coalesce;
+
+    /* check again after an internal redirect and in subrequests */
+    ngx_flag_t recheck;
+
+    ngx_shm_zone_t *adaptive_zone;
+
+    ngx_msec_t delay;
+    ngx_uint_t delay_queue;
+
+    ngx_shm_zone_t *local_zone;
+
+    /* for rate_limit_block, keys limited on any node */
+    ngx_shm_zone_t *block_zone;
+
+    ngx_shm_zone_t                     *policy_zone;
+    ngx_http_rate_limit_policy_cache_t *policy;
+    ngx_shm_zone_t                     *policy_api;
+
+    ngx_str_t  redis_user;
+    ngx_str_t  redis_password;
+    ngx_int_t  redis_db;
+    ngx_flag_t redis_hello;
+
+    /* sent ahead of the first command on a new connection */
+    ngx_str_t  handshake;
+    ngx_uint_t handshake_replies;
+
+    /* for rate_limit_charge, once the response is known */
+    ngx_http_rate_limit_charge_t      *charge;
+    ngx_http_rate_limit_charge_sink_t *charge_sink;
+
+    /* for rate_limit_cache, hits of proxy_cache are not checked */
+    ngx_http_rate_limit_cache_t *cache;
+
+    /* for rate_limit_connection_cache, the last decision is reused */
+    ngx_msec_t connection_cache;
+
+#if (NGX_HTTP_SSL)
+    /* for rate_limit_ssl, the rest is in upstream.ssl_* */
+    ngx_flag_t ssl;
+    ngx_str_t  ssl_certificate;
+    ngx_str_t  ssl_certificate_key;
+    ngx_str_t  ssl_trusted_certificate;
+    ngx_uint_t ssl_verify_depth;
+#endif
 } ngx_http_rate_limit_loc_conf_t;
 
 typedef struct {
     ngx_str_t key;
 
-    ngx_http_request_t *request;
+    /* the values of the X-RateLimit-* headers, NGX_INT_T_LEN each */
+    u_char *values;
 
-    /* used to parse the redis response */
-    ngx_uint_t state;
+    ngx_http_request_t *request;
 
     /* flag indicating whether the rate limit has been finalized */
     ngx_flag_t finalized;
 
-    /* parsed variables from the redis response */
-    ngx_uint_t limit;
-    ngx_uint_t remaining;
-    ngx_uint_t reset;
-    ngx_int_t  retry_after;
+    /* the outcome once finalized: 200, 429 or an upstream error */
+    ngx_uint_t status;
+
+    /* parsed variables from the backend response */
+    ngx_rate_limit_reply_t reply;
+
+    /* the rule sent with the command, and when it was built (epoch msec) */
+    ngx_rate_limit_rule_t rule;
+    uint64_t              time;
+
+    /* single-flight coalescing of checks for the same key */
+    ngx_http_rate_limit_flight_t *flight;
+    ngx_queue_t                   queue;
+    ngx_event_t                   wake;
+
+    /* waiting for the addresses of a rate_limit_pass target */
+    ngx_http_rate_limit_target_t *target;
+    ngx_queue_t                   target_queue;
+
+    /* units sent with the command if not rule.quantity, for a batch */
+    ngx_uint_t quantity;
+
+    /* time spent on the timer of rate_limit_delay */
+    ngx_msec_t delayed;
+
+    /* replies to the handshake still to be skipped */
+    ngx_uint_t handshake;
+
+    unsigned promoted : 1;
+    unsigned retry : 1;
+    unsigned resolved : 1;
+
+    /* the check went to the replica, or has to go to the primary */
+    unsigned replica : 1;
+    unsigned fallback : 1;
 } ngx_http_rate_limit_ctx_t;
 
 #endif /* NGX_HTTP_RATE_LIMIT_MODULE_H */
@@ -0,0 +1,806 @@
+#include "ngx_http_rate_limit_policy.h"
+#include "ngx_http_rate_limit_state.h"
+
+#define NGX_HTTP_RATE_LIMIT_POLICY_LOCATION 1
+#define NGX_HTTP_RATE_LIMIT_POLICY_PREFIX 2
+
+#define NGX_HTTP_RATE_LIMIT_POLICY_NAME_LEN 128
+
+/* fixed width, the table is written to the state file as is */
+typedef struct {
+    uint32_t kind;
+    uint32_t len;
+    u_char   name[NGX_HTTP_RATE_LIMIT_POLICY_NAME_LEN];
+
+    /* -1 keeps the configured value */
+    int64_t requests;
+    int64_t period; /* msec */
+    int64_t burst;
+} ngx_http_rate_limit_policy_entry_t;
+
+typedef struct {
+    /* bumped on every change, the workers only look up when it moved */
+    ngx_atomic_t version;
+
+    ngx_http_rate_limit_policy_entry_t entries[1];
+} ngx_http_rate_limit_policy_sh_t;
+
+typedef struct {
+    ngx_http_rate_limit_policy_sh_t *sh;
+    ngx_slab_pool_t                 *shpool;
+
+    ngx_uint_t max;
+
+    /* the file the overrides are written to, if any */
+    ngx_str_t state;
+
+    /* the version last written, in the worker that writes it */
+    ngx_atomic_uint_t saved;
+} ngx_http_rate_limit_policy_ctx_t;
+
+/* the override of a location as of a version, per worker */
+struct ngx_http_rate_limit_policy_cache_s {
+    ngx_atomic_uint_t version;
+    ngx_uint_t        found;
+
+    ngx_int_t requests;
+    ngx_int_t period;
+    ngx_int_t burst;
+};
+
+static ngx_int_t ngx_http_rate_limit_policy_init_zone(ngx_shm_zone_t *shm_zone,
+                                                      void *data);
+static void ngx_http_rate_limit_policy_state(
+        ngx_http_rate_limit_policy_ctx_t *ctx,
+        ngx_http_rate_limit_state_header_t *h);
+static ngx_int_t ngx_http_rate_limit_policy_save(ngx_shm_zone_t *shm_zone,
+                                                 ngx_str_t *path,
+                                                 ngx_log_t *log);
+static ngx_int_t ngx_http_rate_limit_policy_sync(ngx_shm_zone_t *shm_zone,
+                                                 ngx_str_t *path,
+                                                 ngx_log_t *log);
+static void ngx_http_rate_limit_policy_lookup(
+        ngx_http_request_t *r, ngx_http_rate_limit_policy_ctx_t *ctx,
+        ngx_http_rate_limit_policy_cache_t *cache);
+static ngx_int_t ngx_http_rate_limit_policy_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_rate_limit_policy_update(
+        ngx_http_request_t *r, ngx_http_rate_limit_policy_ctx_t *ctx);
+static ngx_int_t ngx_http_rate_limit_policy_arg(ngx_http_request_t *r,
+                                                char *name, ngx_str_t *value);
+static ngx_buf_t *ngx_http_rate_limit_policy_dump(
+        ngx_http_request_t *r, ngx_http_rate_limit_policy_ctx_t *ctx);
+
+static ngx_int_t
+ngx_http_rate_limit_policy_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_rate_limit_policy_ctx_t *octx = data;
+
+    size_t                              len, size;
+    ngx_http_rate_limit_policy_ctx_t   *ctx;
+    ngx_http_rate_limit_state_header_t  h;
+
+    ctx = shm_zone->data;
+
+    if (octx) {
+        /* the overrides survive a reload */
+        ctx->sh = octx->sh;
+        ctx->shpool = octx->shpool;
+
+        return NGX_OK;
+    }
+
+    ctx->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        ctx->sh = ctx->shpool->data;
+
+        return NGX_OK;
+    }
+
+    size = offsetof(ngx_http_rate_limit_policy_sh_t, entries) +
+           ctx->max * sizeof(ngx_http_rate_limit_policy_entry_t);
+
+    ctx->sh = ngx_slab_calloc(ctx->shpool, size);
+    if (ctx->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->shpool->data = ctx->sh;
+
+    ctx->sh->version = 1;
+
+    len = sizeof(" in rate_limit_policy_zone \"\"") + shm_zone->shm.name.len;
+
+    ctx->shpool->log_ctx = ngx_slab_alloc(ctx->shpool, len);
+    if (ctx->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(ctx->shpool->log_ctx, " in rate_limit_policy_zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    if (ctx->state.len == 0) {
+        return NGX_OK;
+    }
+
+    ngx_http_rate_limit_policy_state(ctx, &h);
+
+    if (ngx_http_rate_limit_state_read(&ctx->state, &h,
+                                       (u_char *) ctx->sh->entries,
+                                       shm_zone->shm.log) == NGX_OK) {
+        ngx_log_error(NGX_LOG_NOTICE, shm_zone->shm.log, 0,
+                      "loaded zone \"%V\" from \"%V\"", &shm_zone->shm.name,
+                      &ctx->state);
+    }
+
+    return NGX_OK;
+}
+
+static void
+ngx_http_rate_limit_policy_state(ngx_http_rate_limit_policy_ctx_t *ctx,
+                                 ngx_http_rate_limit_state_header_t *h)
+{
+    ngx_memzero(h, sizeof(ngx_http_rate_limit_state_header_t));
+
+    h->kind = NGX_HTTP_RATE_LIMIT_STATE_POLICY;
+    h->params[0] = ctx->max;
+    h->params[1] = sizeof(ngx_http_rate_limit_policy_entry_t);
+
+    /* periods are in msec, files that kept seconds are not loaded */
+    h->params[2] = 1000;
+    h->len = ctx->max * sizeof(ngx_http_rate_limit_policy_entry_t);
+}
+
+static ngx_int_t
+ngx_http_rate_limit_policy_save(ngx_shm_zone_t *shm_zone, ngx_str_t *path,
+                                ngx_log_t *log)
+{
+    ngx_http_rate_limit_policy_ctx_t   *ctx;
+    ngx_http_rate_limit_state_header_t  h;
+
+    ctx = shm_zone->data;
+
+    if (ctx->sh == NULL) {
+        return NGX_DECLINED;
+    }
+
+    ngx_http_rate_limit_policy_state(ctx, &h);
+
+    return ngx_http_rate_limit_state_write(path, &h,
+                                           (u_char *) ctx->sh->entries, log);
+}
+
+/* Writes a copy of the table taken under the lock, once it changed */
+static ngx_int_t
+ngx_http_rate_limit_policy_sync(ngx_shm_zone_t *shm_zone, ngx_str_t *path,
+                                ngx_log_t *log)
+{
+    u_char                             *data;
+    ngx_int_t                           rc;
+    ngx_atomic_uint_t                   version;
+    ngx_http_rate_limit_policy_ctx_t   *ctx;
+    ngx_http_rate_limit_state_header_t  h;
+
+    ctx = shm_zone->data;
+
+    if (ctx->sh == NULL || ctx->sh->version == ctx->saved) {
+        return NGX_DECLINED;
+    }
+
+    ngx_http_rate_limit_policy_state(ctx, &h);
+
+    data = ngx_alloc(h.len, log);
+    if (data == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    version = ctx->sh->version;
+    ngx_memcpy(data, ctx->sh->entries, h.len);
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    rc = ngx_http_rate_limit_state_write(path, &h, data, log);
+
+    if (rc == NGX_OK) {
+        ctx->saved = version;
+    }
+
+    ngx_free(data);
+
+    return rc;
+}
+
+ngx_http_rate_limit_policy_cache_t *
+ngx_http_rate_limit_policy_create_cache(ngx_conf_t *cf)
+{
+    /* version 0 is never used by a zone, the first request looks up */
+    return ngx_pcalloc(cf->pool, sizeof(ngx_http_rate_limit_policy_cache_t));
+}
+
+void
+ngx_http_rate_limit_policy_apply(ngx_http_request_t *r,
+                                 ngx_rate_limit_rule_t *rule)
+{
+    ngx_http_rate_limit_loc_conf_t     *rlcf;
+    ngx_http_rate_limit_policy_ctx_t   *ctx;
+    ngx_http_rate_limit_policy_cache_t *cache;
+
+    rlcf = ngx_http_get_module_loc_conf(r, ngx_http_rate_limit_module);
+
+    ctx = rlcf->policy_zone->data;
+    cache = rlcf->policy;
+
+    /* a word sized read, the table is only searched after a change */
+    if (cache->version != ctx->sh->version) {
+        ngx_http_rate_limit_policy_lookup(r, ctx, cache);
+    }
+
+    if (!cache->found) {
+        return;
+    }
+
+    if (cache->requests >= 0) {
+        rule->requests = cache->requests;
+    }
+
+    if (cache->period >= 0) {
+        rule->period = cache->period;
+    }
+
+    if (cache->burst >= 0) {
+        rule->burst = cache->burst;
+    }
+}
+
+/* an override of the location wins over one of its rate_limit_prefix */
+static void
+ngx_http_rate_limit_policy_lookup(ngx_http_request_t *r,
+                                  ngx_http_rate_limit_policy_ctx_t *ctx,
+                                  ngx_http_rate_limit_policy_cache_t *cache)
+{
+    ngx_str_t                          *name;
+    ngx_uint_t                          i;
+    ngx_http_core_loc_conf_t           *clcf;
+    ngx_http_rate_limit_loc_conf_t     *rlcf;
+    ngx_http_rate_limit_policy_entry_t *e, *found;
+
+    rlcf = ngx_http_get_module_loc_conf(r, ngx_http_rate_limit_module);
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    found = NULL;
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    for (i = 0; i < ctx->max; i++) {
+        e = &ctx->sh->entries[i];
+
+        if (e->kind == NGX_HTTP_RATE_LIMIT_POLICY_LOCATION) {
+            name = &clcf->name;
+
+        } else if (e->kind == NGX_HTTP_RATE_LIMIT_POLICY_PREFIX) {
+            name = &rlcf->prefix;
+
+        } else {
+            continue;
+        }
+
+        if (name->len != e->len ||
+            ngx_strncmp(name->data, e->name, e->len) != 0) {
+            continue;
+        }
+
+        found = e;
+
+        if (e->kind == NGX_HTTP_RATE_LIMIT_POLICY_LOCATION) {
+            break;
+        }
+    }
+
+    cache->found = (found != NULL);
+
+    if (found) {
+        cache->requests = (ngx_int_t) found->requests;
+        cache->period = (ngx_int_t) found->period;
+        cache->burst = (ngx_int_t) found->burst;
+    }
+
+    cache->version = ctx->sh->version;
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "rate limit policy of \"%V\" at version %uA: %ui",
+                   &clcf->name, cache->version, cache->found);
+}
+
+static ngx_int_t
+ngx_http_rate_limit_policy_handler(ngx_http_request_t *r)
+{
+    ngx_int_t                         rc;
+    ngx_buf_t                        *b;
+    ngx_chain_t                       out;
+    ngx_http_rate_limit_loc_conf_t   *rlcf;
+    ngx_http_rate_limit_policy_ctx_t *ctx;
+
+    if (!(r->method &
+          (NGX_HTTP_GET | NGX_HTTP_HEAD | NGX_HTTP_POST | NGX_HTTP_DELETE))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    rlcf = ngx_http_get_module_loc_conf(r, ngx_http_rate_limit_module);
+
+    ctx = rlcf->policy_api->data;
+
+    if (r->method & (NGX_HTTP_POST | NGX_HTTP_DELETE)) {
+        rc = ngx_http_rate_limit_policy_update(r, ctx);
+
+        if (rc != NGX_OK) {
+            return rc;
+        }
+    }
+
+    b = ngx_http_rate_limit_policy_dump(r, ctx);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ngx_str_set(&r->headers_out.content_type, "application/json");
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+    r->headers_out.content_type_lowcase = NULL;
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+/*
+ * POST ?location=/api/&requests=10&period=1m&burst=0 sets an override,
+ * DELETE ?location=/api/ removes it, prefix= matches rate_limit_prefix.
+ */
+static ngx_int_t
+ngx_http_rate_limit_policy_update(ngx_http_request_t *r,
+                                  ngx_http_rate_limit_policy_ctx_t *ctx)
+{
+    ngx_str_t                           name, value;
+    ngx_int_t                           requests, period, burst;
+    ngx_uint_t                          i, kind;
+    ngx_atomic_uint_t                   version;
+    ngx_http_rate_limit_policy_entry_t *e, *found, *slot;
+
+    if (ngx_http_rate_limit_policy_arg(r, "location", &name) == NGX_OK) {
+        kind = NGX_HTTP_RATE_LIMIT_POLICY_LOCATION;
+
+        if (ngx_http_rate_limit_policy_arg(r, "prefix", &value) == NGX_OK) {
+            return NGX_HTTP_BAD_REQUEST;
+        }
+
+    } else if (ngx_http_rate_limit_policy_arg(r, "prefix", &name) == NGX_OK) {
+        kind = NGX_HTTP_RATE_LIMIT_POLICY_PREFIX;
+
+    } else {
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    if (name.len == 0 || name.len > NGX_HTTP_RATE_LIMIT_POLICY_NAME_LEN) {
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    requests = -1;
+    period = -1;
+    burst = -1;
+
+    if (ngx_http_rate_limit_policy_arg(r, "requests", &value) == NGX_OK) {
+        requests = ngx_atoi(value.data, value.len);
+        if (requests <= 0) {
+            return NGX_HTTP_BAD_REQUEST;
+        }
+    }
+
+    if (ngx_http_rate_limit_policy_arg(r, "period", &value) == NGX_OK) {
+        period = ngx_rate_limit_parse_period(&value);
+        if (period <= 0) {
+            return NGX_HTTP_BAD_REQUEST;
+        }
+    }
+
+    if (ngx_http_rate_limit_policy_arg(r, "burst", &value) == NGX_OK) {
+        burst = ngx_atoi(value.data, value.len);
+        if (burst == NGX_ERROR) {
+            return NGX_HTTP_BAD_REQUEST;
+        }
+    }
+
+    if (r->method == NGX_HTTP_POST &&
+        requests == -1 && period == -1 && burst == -1) {
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    found = NULL;
+    slot = NULL;
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    for (i = 0; i < ctx->max; i++) {
+        e = &ctx->sh->entries[i];
+
+        if (e->kind == 0) {
+            if (slot == NULL) {
+                slot = e;
+            }
+
+            continue;
+        }
+
+        if (e->kind == kind && e->len == name.len &&
+            ngx_strncmp(e->name, name.data, name.len) == 0) {
+            found = e;
+            break;
+        }
+    }
+
+    if (r->method == NGX_HTTP_DELETE) {
+        if (found == NULL) {
+            ngx_shmtx_unlock(&ctx->shpool->mutex);
+            return NGX_HTTP_NOT_FOUND;
+        }
+
+        ngx_memzero(found, sizeof(ngx_http_rate_limit_policy_entry_t));
+
+    } else {
+        if (found == NULL) {
+            found = slot;
+        }
+
+        if (found == NULL) {
+            ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "rate limit policy table is full%s",
+                          ctx->shpool->log_ctx);
+            return NGX_HTTP_INSUFFICIENT_STORAGE;
+        }
+
+        found->kind = kind;
+        found->len = name.len;
+        ngx_memcpy(found->name, name.data, name.len);
+
+        found->requests = requests;
+        found->period = period;
+        found->burst = burst;
+    }
+
+    version = ++ctx->sh->version;
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0,
+                  "rate limit policy for %s \"%V\" %s, version %uA",
+                  kind == NGX_HTTP_RATE_LIMIT_POLICY_LOCATION ? "location"
+                                                              : "prefix",
+                  &name, r->method == NGX_HTTP_DELETE ? "removed" : "set",
+                  version);
+
+    /* the state file, if any, is written by one worker within a second */
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_rate_limit_policy_arg(ngx_http_request_t *r, char *name,
+                               ngx_str_t *value)
+{
+    u_char    *dst, *src;
+    ngx_str_t  arg;
+
+    if (ngx_http_arg(r, (u_char *) name, ngx_strlen(name), &arg) != NGX_OK) {
+        return NGX_DECLINED;
+    }
+
+    value->data = ngx_pnalloc(r->pool, arg.len);
+    if (value->data == NULL) {
+        return NGX_ERROR;
+    }
+
+    dst = value->data;
+    src = arg.data;
+
+    ngx_unescape_uri(&dst, &src, arg.len, NGX_UNESCAPE_URI);
+
+    value->len = dst - value->data;
+
+    return NGX_OK;
+}
+
+static ngx_buf_t *
+ngx_http_rate_limit_policy_dump(ngx_http_request_t *r,
+                                ngx_http_rate_limit_policy_ctx_t *ctx)
+{
+    size_t                              len;
+    ngx_buf_t                          *b;
+    ngx_uint_t                          i, n;
+    ngx_http_rate_limit_policy_entry_t *e, *entries;
+
+    entries = ngx_palloc(r->pool,
+                         ctx->max * sizeof(ngx_http_rate_limit_policy_entry_t));
+    if (entries == NULL) {
+        return NULL;
+    }
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    ngx_memcpy(entries, ctx->sh->entries,
+               ctx->max * sizeof(ngx_http_rate_limit_policy_entry_t));
+
+    n = ctx->sh->version;
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    len = sizeof("{\"version\":,\"policies\":[]}\n") + NGX_ATOMIC_T_LEN;
+
+    for (i = 0; i < ctx->max; i++) {
+        e = &entries[i];
+
+        if (e->kind == 0) {
+            continue;
+        }
+
+        len += sizeof("{\"location\":\"\",\"requests\":,\"period\":,"
+                      "\"burst\":},") +
+               e->len + ngx_escape_json(NULL, e->name, e->len) +
+               3 * NGX_INT64_LEN + sizeof(".000") - 1;
+    }
+
+    b = ngx_create_temp_buf(r->pool, len);
+    if (b == NULL) {
+        return NULL;
+    }
+
+    b->last = ngx_sprintf(b->last, "{\"version\":%ui,\"policies\":[", n);
+
+    n = 0;
+
+    for (i = 0; i < ctx->max; i++) {
+        e = &entries[i];
+
+        if (e->kind == 0) {
+            continue;
+        }
+
+        if (n++) {
+            *b->last++ = ',';
+        }
+
+        b->last = ngx_sprintf(b->last, "{\"%s\":\"",
+                              e->kind == NGX_HTTP_RATE_LIMIT_POLICY_LOCATION
+                                  ? "location"
+                                  : "prefix");
+        b->last = (u_char *) ngx_escape_json(b->last, e->name, e->len);
+        *b->last++ = '"';
+
+        if (e->requests >= 0) {
+            b->last = ngx_sprintf(b->last, ",\"requests\":%L", e->requests);
+        }
+
+        /* in seconds as before, with a fraction if there is one */
+        if (e->period >= 0 && e->period % 1000 == 0) {
+            b->last = ngx_sprintf(b->last, ",\"period\":%L",
+                                  e->period / 1000);
+
+        } else if (e->period >= 0) {
+            b->last = ngx_sprintf(b->last, ",\"period\":%L.%03L",
+                                  e->period / 1000, e->period % 1000);
+        }
+
+        if (e->burst >= 0) {
+            b->last = ngx_sprintf(b->last, ",\"burst\":%L", e->burst);
+        }
+
+        *b->last++ = '}';
+    }
+
+    b->last = ngx_cpymem(b->last, "]}\n", 3);
+
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    return b;
+}
+
+char *
+ngx_http_rate_limit_policy_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+                                void *conf)
+{
+    size_t                            size;
+    ngx_str_t                        *value, name, state, s;
+    ngx_int_t                         max;
+    ngx_uint_t                        i;
+    ngx_shm_zone_t                   *shm_zone;
+    ngx_http_rate_limit_policy_ctx_t *ctx;
+
+    value = cf->args->elts;
+
+    ngx_str_null(&name);
+    ngx_str_null(&state);
+
+    max = 64;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "zone=", 5) == 0) {
+
+            name.len = value[i].len - 5;
+            name.data = value[i].data + 5;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "max=", 4) == 0) {
+
+            s.len = value[i].len - 4;
+            s.data = value[i].data + 4;
+
+            max = ngx_atoi(s.data, s.len);
+            if (max <= 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid max value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "state=", 6) == 0) {
+
+            state.len = value[i].len - 6;
+            state.data = value[i].data + 6;
+
+            if (state.len == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid state file \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"",
+                           &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (name.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must have \"zone\" parameter",
+                           &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    ctx = ngx_pcalloc(cf->pool, sizeof(ngx_http_rate_limit_policy_ctx_t));
+    if (ctx == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ctx->max = max;
+
+    size = ngx_align(max * sizeof(ngx_http_rate_limit_policy_entry_t),
+                     ngx_pagesize) +
+           8 * ngx_pagesize;
+
+    shm_zone = ngx_shared_memory_add(cf, &name, size,
+                                     &ngx_http_rate_limit_module);
+    if (shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (shm_zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "duplicate zone \"%V\"",
+                           &name);
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone->init = ngx_http_rate_limit_policy_init_zone;
+    shm_zone->data = ctx;
+
+    if (state.len) {
+        if (ngx_http_rate_limit_state_add(cf, &state, shm_zone,
+                                          ngx_http_rate_limit_policy_save,
+                                          ngx_http_rate_limit_policy_sync) !=
+            NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
+
+        ctx->state = state;
+    }
+
+    return NGX_CONF_OK;
+}
+
+char *
+ngx_http_rate_limit_policy(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_rate_limit_loc_conf_t *rlcf = conf;
+
+    ngx_str_t *value, name;
+
+    if (rlcf->policy_zone != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        rlcf->policy_zone = NULL;
+        return NGX_CONF_OK;
+    }
+
+    if (ngx_strncmp(value[1].data, "zone=", 5) != 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"",
+                           &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    name.len = value[1].len - 5;
+    name.data = value[1].data + 5;
+
+    rlcf->policy_zone = ngx_shared_memory_add(cf, &name, 0,
+                                              &ngx_http_rate_limit_module);
+    if (rlcf->policy_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+char *
+ngx_http_rate_limit_policy_api(ngx_conf_t *cf, ngx_command_t *cmd,
+                               void *conf)
+{
+    ngx_http_rate_limit_loc_conf_t *rlcf = conf;
+
+    ngx_str_t                *value, name;
+    ngx_http_core_loc_conf_t *clcf;
+
+    if (rlcf->policy_api) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strncmp(value[1].data, "zone=", 5) != 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"",
+                           &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    name.len = value[1].len - 5;
+    name.data = value[1].data + 5;
+
+    rlcf->policy_api = ngx_shared_memory_add(cf, &name, 0,
+                                             &ngx_http_rate_limit_module);
+    if (rlcf->policy_api == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_rate_limit_policy_handler;
+
+    return NGX_CONF_OK;
+}
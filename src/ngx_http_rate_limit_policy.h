@@ -0,0 +1,17 @@
+#ifndef NGX_HTTP_RATE_LIMIT_POLICY_H
+#define NGX_HTTP_RATE_LIMIT_POLICY_H
+
+#include "ngx_http_rate_limit_module.h"
+
+char *ngx_http_rate_limit_policy_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+                                      void *conf);
+char *ngx_http_rate_limit_policy(ngx_conf_t *cf, ngx_command_t *cmd,
+                                 void *conf);
+char *ngx_http_rate_limit_policy_api(ngx_conf_t *cf, ngx_command_t *cmd,
+                                     void *conf);
+ngx_http_rate_limit_policy_cache_t *ngx_http_rate_limit_policy_create_cache(
+        ngx_conf_t *cf);
+void ngx_http_rate_limit_policy_apply(ngx_http_request_t *r,
+                                      ngx_rate_limit_rule_t *rule);
+
+#endif /* NGX_HTTP_RATE_LIMIT_POLICY_H */
@@ -0,0 +1,882 @@
+#include "ngx_http_rate_limit_prewarm.h"
+#include "ngx_http_rate_limit_ssl.h"
+
+#define NGX_HTTP_RATE_LIMIT_PREWARM_FREE 0
+#define NGX_HTTP_RATE_LIMIT_PREWARM_CONNECTING 1
+#define NGX_HTTP_RATE_LIMIT_PREWARM_IDLE 2
+#define NGX_HTTP_RATE_LIMIT_PREWARM_PING 3
+
+typedef struct ngx_http_rate_limit_prewarm_s ngx_http_rate_limit_prewarm_t;
+
+typedef struct {
+    ngx_http_rate_limit_prewarm_t *prewarm;
+
+    ngx_queue_t       queue;
+    ngx_connection_t *connection;
+    ngx_uint_t        state;
+
+    socklen_t      socklen;
+    ngx_sockaddr_t sockaddr;
+
+    /* the reply to PING */
+    size_t received;
+    u_char buffer[64];
+} ngx_http_rate_limit_prewarm_item_t;
+
+struct ngx_http_rate_limit_prewarm_s {
+    ngx_http_upstream_srv_conf_t  *upstream;
+    ngx_http_upstream_init_peer_pt original_init_peer;
+
+    ngx_queue_t cache;
+    ngx_queue_t free;
+
+    ngx_http_rate_limit_prewarm_item_t *items;
+    ngx_uint_t                          nitems;
+
+    ngx_array_t addrs; /* ngx_addr_t */
+    ngx_uint_t  next;
+
+    /* connections established, reconnects included */
+    ngx_uint_t connected;
+
+    ngx_msec_t timeout;
+};
+
+typedef struct {
+    ngx_http_rate_limit_prewarm_t *prewarm;
+    ngx_http_upstream_t           *upstream;
+
+    void *data;
+
+    ngx_event_get_peer_pt  original_get_peer;
+    ngx_event_free_peer_pt original_free_peer;
+
+#if (NGX_HTTP_SSL)
+    ngx_event_set_peer_session_pt  original_set_session;
+    ngx_event_save_peer_session_pt original_save_session;
+#endif
+} ngx_http_rate_limit_prewarm_peer_data_t;
+
+static ngx_int_t ngx_http_rate_limit_prewarm_init_peer(
+        ngx_http_request_t *r, ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_rate_limit_prewarm_get_peer(ngx_peer_connection_t *pc,
+                                                      void *data);
+static void ngx_http_rate_limit_prewarm_free_peer(ngx_peer_connection_t *pc,
+                                                  void *data, ngx_uint_t state);
+#if (NGX_HTTP_SSL)
+static ngx_int_t ngx_http_rate_limit_prewarm_set_session(
+        ngx_peer_connection_t *pc, void *data);
+static void ngx_http_rate_limit_prewarm_save_session(ngx_peer_connection_t *pc,
+                                                     void *data);
+#endif
+static void ngx_http_rate_limit_prewarm_connect(
+        ngx_http_rate_limit_prewarm_item_t *item);
+static void ngx_http_rate_limit_prewarm_connect_handler(ngx_event_t *ev);
+static void ngx_http_rate_limit_prewarm_connected(
+        ngx_http_rate_limit_prewarm_item_t *item);
+static void ngx_http_rate_limit_prewarm_idle(
+        ngx_http_rate_limit_prewarm_item_t *item);
+static void ngx_http_rate_limit_prewarm_idle_handler(ngx_event_t *ev);
+static void ngx_http_rate_limit_prewarm_ping(
+        ngx_http_rate_limit_prewarm_item_t *item);
+static void ngx_http_rate_limit_prewarm_pong_handler(ngx_event_t *ev);
+static void ngx_http_rate_limit_prewarm_close(
+        ngx_http_rate_limit_prewarm_item_t *item);
+static void ngx_http_rate_limit_prewarm_dummy_handler(ngx_event_t *ev);
+static void ngx_http_rate_limit_prewarm_timer_handler(ngx_event_t *ev);
+
+static u_char ngx_http_rate_limit_ping[] = "*1\r\n$4\r\nPING\r\n";
+
+char *
+ngx_http_rate_limit_prewarm(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_rate_limit_main_conf_t *rlmcf = conf;
+
+    ngx_str_t  *value, s;
+    ngx_int_t   n;
+    ngx_msec_t  ping, timeout;
+    ngx_uint_t  i;
+
+    if (rlmcf->prewarm) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    n = ngx_atoi(value[1].data, value[1].len);
+    if (n <= 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid number of connections \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    ping = 30000;
+    timeout = 1000;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "ping=", 5) == 0) {
+
+            s.len = value[i].len - 5;
+            s.data = value[i].data + 5;
+
+            ping = ngx_parse_time(&s, 0);
+            if (ping == (ngx_msec_t) NGX_ERROR || ping == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid ping time \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "timeout=", 8) == 0) {
+
+            s.len = value[i].len - 8;
+            s.data = value[i].data + 8;
+
+            timeout = ngx_parse_time(&s, 0);
+            if (timeout == (ngx_msec_t) NGX_ERROR || timeout == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid timeout time \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"",
+                           &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    rlmcf->prewarm = n;
+    rlmcf->prewarm_ping = ping;
+    rlmcf->prewarm_timeout = timeout;
+
+    return NGX_CONF_OK;
+}
+
+ngx_int_t
+ngx_http_rate_limit_prewarm_add(ngx_conf_t *cf,
+                                ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_uint_t                        i;
+    ngx_http_upstream_srv_conf_t    **usp;
+    ngx_http_rate_limit_main_conf_t  *rlmcf;
+
+    rlmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_rate_limit_module);
+
+    usp = rlmcf->upstreams.elts;
+
+    for (i = 0; i < rlmcf->upstreams.nelts; i++) {
+        if (usp[i] == us) {
+            return NGX_OK;
+        }
+    }
+
+    usp = ngx_array_push(&rlmcf->upstreams);
+    if (usp == NULL) {
+        return NGX_ERROR;
+    }
+
+    *usp = us;
+
+    return NGX_OK;
+}
+
+ngx_int_t
+ngx_http_rate_limit_prewarm_init(ngx_conf_t *cf)
+{
+    ngx_uint_t                          i, j, k;
+    ngx_addr_t                         *addr;
+    ngx_http_upstream_server_t         *server;
+    ngx_http_upstream_srv_conf_t      **usp;
+    ngx_http_rate_limit_prewarm_t      *pw;
+    ngx_http_rate_limit_main_conf_t    *rlmcf;
+    ngx_http_rate_limit_prewarm_item_t *item;
+
+    rlmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_rate_limit_module);
+
+    if (rlmcf->prewarm == 0 || rlmcf->upstreams.nelts == 0) {
+        return NGX_OK;
+    }
+
+    rlmcf->pools = ngx_array_create(cf->pool, rlmcf->upstreams.nelts,
+                                    sizeof(ngx_http_rate_limit_prewarm_t));
+    if (rlmcf->pools == NULL) {
+        return NGX_ERROR;
+    }
+
+    usp = rlmcf->upstreams.elts;
+
+    for (i = 0; i < rlmcf->upstreams.nelts; i++) {
+
+        /* an implicit upstream, such as "rate_limit_pass host:port" */
+        if (usp[i]->servers == NULL) {
+            continue;
+        }
+
+        /* the pings are sent in plain text */
+        if (ngx_http_rate_limit_ssl_upstream(rlmcf, usp[i])) {
+            continue;
+        }
+
+        pw = ngx_array_push(rlmcf->pools);
+        if (pw == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_memzero(pw, sizeof(ngx_http_rate_limit_prewarm_t));
+
+        if (ngx_array_init(&pw->addrs, cf->pool, 4, sizeof(ngx_addr_t)) !=
+            NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        server = usp[i]->servers->elts;
+
+        for (j = 0; j < usp[i]->servers->nelts; j++) {
+            if (server[j].down || server[j].backup) {
+                continue;
+            }
+
+            for (k = 0; k < server[j].naddrs; k++) {
+                addr = ngx_array_push(&pw->addrs);
+                if (addr == NULL) {
+                    return NGX_ERROR;
+                }
+
+                *addr = server[j].addrs[k];
+            }
+        }
+
+        pw->upstream = usp[i];
+        pw->timeout = rlmcf->prewarm_timeout;
+
+        pw->nitems = rlmcf->prewarm;
+        pw->items = ngx_pcalloc(cf->pool,
+                                pw->nitems *
+                                    sizeof(ngx_http_rate_limit_prewarm_item_t));
+        if (pw->items == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_queue_init(&pw->cache);
+        ngx_queue_init(&pw->free);
+
+        item = pw->items;
+
+        for (j = 0; j < pw->nitems; j++) {
+            item[j].prewarm = pw;
+            ngx_queue_insert_tail(&pw->free, &item[j].queue);
+        }
+
+        /* runs after the balancer and the keepalive module are set up */
+
+        pw->original_init_peer = usp[i]->peer.init;
+        usp[i]->peer.init = ngx_http_rate_limit_prewarm_init_peer;
+    }
+
+    return NGX_OK;
+}
+
+ngx_int_t
+ngx_http_rate_limit_prewarm_init_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                          i, j;
+    ngx_event_t                        *ev;
+    ngx_http_rate_limit_prewarm_t      *pw;
+    ngx_http_rate_limit_main_conf_t    *rlmcf;
+    ngx_http_rate_limit_prewarm_item_t *item;
+
+    if (ngx_process != NGX_PROCESS_WORKER &&
+        ngx_process != NGX_PROCESS_SINGLE) {
+        return NGX_OK;
+    }
+
+    rlmcf = ngx_http_cycle_get_module_main_conf(cycle,
+                                                ngx_http_rate_limit_module);
+
+    if (rlmcf == NULL || rlmcf->pools == NULL) {
+        return NGX_OK;
+    }
+
+    pw = rlmcf->pools->elts;
+
+    for (i = 0; i < rlmcf->pools->nelts; i++) {
+        if (pw[i].addrs.nelts == 0) {
+            continue;
+        }
+
+        for (j = 0; j < pw[i].nitems; j++) {
+            item = &pw[i].items[j];
+            ngx_http_rate_limit_prewarm_connect(item);
+        }
+    }
+
+    ev = ngx_pcalloc(cycle->pool, sizeof(ngx_event_t));
+    if (ev == NULL) {
+        return NGX_ERROR;
+    }
+
+    ev->handler = ngx_http_rate_limit_prewarm_timer_handler;
+    ev->data = rlmcf;
+    ev->log = cycle->log;
+    ev->cancelable = 1;
+
+    ngx_add_timer(ev, rlmcf->prewarm_ping);
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_rate_limit_prewarm_init_peer(ngx_http_request_t *r,
+                                      ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_uint_t                               i;
+    ngx_http_upstream_t                     *u;
+    ngx_http_rate_limit_prewarm_t           *pw;
+    ngx_http_rate_limit_main_conf_t         *rlmcf;
+    ngx_http_rate_limit_prewarm_peer_data_t *pd;
+
+    rlmcf = ngx_http_get_module_main_conf(r, ngx_http_rate_limit_module);
+
+    pw = rlmcf->pools->elts;
+
+    for (i = 0; i < rlmcf->pools->nelts; i++) {
+        if (pw[i].upstream == us) {
+            break;
+        }
+    }
+
+    pw = &pw[i];
+
+    if (pw->original_init_peer(r, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    u = r->upstream;
+
+    /* the upstream may be shared with proxy_pass and friends */
+    if (u->output.tag != (ngx_buf_tag_t) &ngx_http_rate_limit_module) {
+        return NGX_OK;
+    }
+
+    pd = ngx_palloc(r->pool, sizeof(ngx_http_rate_limit_prewarm_peer_data_t));
+    if (pd == NULL) {
+        return NGX_ERROR;
+    }
+
+    pd->prewarm = pw;
+    pd->upstream = u;
+
+    pd->data = u->peer.data;
+    pd->original_get_peer = u->peer.get;
+    pd->original_free_peer = u->peer.free;
+
+    u->peer.data = pd;
+    u->peer.get = ngx_http_rate_limit_prewarm_get_peer;
+    u->peer.free = ngx_http_rate_limit_prewarm_free_peer;
+
+#if (NGX_HTTP_SSL)
+    pd->original_set_session = u->peer.set_session;
+    pd->original_save_session = u->peer.save_session;
+
+    u->peer.set_session = ngx_http_rate_limit_prewarm_set_session;
+    u->peer.save_session = ngx_http_rate_limit_prewarm_save_session;
+#endif
+
+    return NGX_OK;
+}
+
+/* Reference: ngx_http_upstream_get_keepalive_peer */
+static ngx_int_t
+ngx_http_rate_limit_prewarm_get_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_rate_limit_prewarm_peer_data_t *pd = data;
+
+    ngx_int_t                           rc;
+    ngx_queue_t                        *q;
+    ngx_connection_t                   *c;
+    ngx_http_rate_limit_prewarm_t      *pw;
+    ngx_http_rate_limit_prewarm_item_t *item;
+
+    rc = pd->original_get_peer(pc, pd->data);
+
+    /* NGX_DONE is a connection from the keepalive cache */
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    pw = pd->prewarm;
+
+    for (q = ngx_queue_head(&pw->cache); q != ngx_queue_sentinel(&pw->cache);
+         q = ngx_queue_next(q)) {
+        item = ngx_queue_data(q, ngx_http_rate_limit_prewarm_item_t, queue);
+
+        if (ngx_memn2cmp((u_char *) &item->sockaddr, (u_char *) pc->sockaddr,
+                         item->socklen, pc->socklen) == 0) {
+            goto found;
+        }
+    }
+
+    return NGX_OK;
+
+found:
+
+    ngx_queue_remove(q);
+    ngx_queue_insert_head(&pw->free, q);
+
+    c = item->connection;
+
+    item->connection = NULL;
+    item->state = NGX_HTTP_RATE_LIMIT_PREWARM_FREE;
+
+    c->idle = 0;
+    c->sent = 0;
+    c->data = NULL;
+    c->log = pc->log;
+    c->read->log = pc->log;
+    c->write->log = pc->log;
+
+    if (c->pool) {
+        c->pool->log = pc->log;
+    }
+
+    if (c->read->timer_set) {
+        ngx_del_timer(c->read);
+    }
+
+    pc->connection = c;
+    pc->cached = 1;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "rate limit: get prewarmed connection %p", c);
+
+    return NGX_DONE;
+}
+
+/* Reference: ngx_http_upstream_free_keepalive_peer */
+static void
+ngx_http_rate_limit_prewarm_free_peer(ngx_peer_connection_t *pc, void *data,
+                                      ngx_uint_t state)
+{
+    ngx_http_rate_limit_prewarm_peer_data_t *pd = data;
+
+    ngx_queue_t                        *q;
+    ngx_connection_t                   *c;
+    ngx_http_upstream_t                *u;
+    ngx_http_rate_limit_prewarm_t      *pw;
+    ngx_http_rate_limit_prewarm_item_t *item;
+
+    pw = pd->prewarm;
+    u = pd->upstream;
+    c = pc->connection;
+
+    if (state & NGX_PEER_FAILED || c == NULL || c->read->eof ||
+        c->read->error || c->read->timedout || c->write->error ||
+        c->write->timedout) {
+        goto invalid;
+    }
+
+    if (!u->keepalive || ngx_terminate || ngx_exiting) {
+        goto invalid;
+    }
+
+    /* when the pool is full, the keepalive cache (if any) takes over */
+    if (ngx_queue_empty(&pw->free)) {
+        goto invalid;
+    }
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        goto invalid;
+    }
+
+    q = ngx_queue_head(&pw->free);
+    ngx_queue_remove(q);
+
+    item = ngx_queue_data(q, ngx_http_rate_limit_prewarm_item_t, queue);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "rate limit: keep prewarmed connection %p", c);
+
+    if (c->read->timer_set) {
+        ngx_del_timer(c->read);
+    }
+
+    if (c->write->timer_set) {
+        ngx_del_timer(c->write);
+    }
+
+    c->read->delayed = 0;
+
+    item->connection = c;
+    item->socklen = pc->socklen;
+    ngx_memcpy(&item->sockaddr, pc->sockaddr, pc->socklen);
+
+    pc->connection = NULL;
+
+    ngx_http_rate_limit_prewarm_idle(item);
+
+invalid:
+
+    pd->original_free_peer(pc, pd->data, state);
+}
+
+#if (NGX_HTTP_SSL)
+
+static ngx_int_t
+ngx_http_rate_limit_prewarm_set_session(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_rate_limit_prewarm_peer_data_t *pd = data;
+
+    return pd->original_set_session(pc, pd->data);
+}
+
+static void
+ngx_http_rate_limit_prewarm_save_session(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_rate_limit_prewarm_peer_data_t *pd = data;
+
+    pd->original_save_session(pc, pd->data);
+}
+
+#endif
+
+static void
+ngx_http_rate_limit_prewarm_connect(ngx_http_rate_limit_prewarm_item_t *item)
+{
+    ngx_int_t                      rc;
+    ngx_addr_t                    *addr;
+    ngx_connection_t              *c;
+    ngx_peer_connection_t          pc;
+    ngx_http_rate_limit_prewarm_t *pw;
+
+    pw = item->prewarm;
+
+    addr = pw->addrs.elts;
+    addr = &addr[pw->next++ % pw->addrs.nelts];
+
+    ngx_memzero(&pc, sizeof(ngx_peer_connection_t));
+
+    pc.sockaddr = addr->sockaddr;
+    pc.socklen = addr->socklen;
+    pc.name = &addr->name;
+    pc.get = ngx_event_get_peer;
+    pc.log = ngx_cycle->log;
+    pc.log_error = NGX_ERROR_ERR;
+
+    rc = ngx_event_connect_peer(&pc);
+
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+        if (pc.connection) {
+            ngx_close_connection(pc.connection);
+        }
+
+        /* retried on the next ping */
+        return;
+    }
+
+    c = pc.connection;
+    c->data = item;
+
+    ngx_queue_remove(&item->queue);
+
+    item->connection = c;
+    item->state = NGX_HTTP_RATE_LIMIT_PREWARM_CONNECTING;
+    item->socklen = addr->socklen;
+    ngx_memcpy(&item->sockaddr, addr->sockaddr, addr->socklen);
+
+    c->read->handler = ngx_http_rate_limit_prewarm_connect_handler;
+    c->write->handler = ngx_http_rate_limit_prewarm_connect_handler;
+
+    if (rc == NGX_AGAIN) {
+        ngx_add_timer(c->write, pw->timeout);
+        return;
+    }
+
+    ngx_http_rate_limit_prewarm_connected(item);
+}
+
+static void
+ngx_http_rate_limit_prewarm_connect_handler(ngx_event_t *ev)
+{
+    ngx_connection_t                   *c;
+    ngx_http_rate_limit_prewarm_item_t *item;
+
+    c = ev->data;
+    item = c->data;
+
+    if (ev->timedout) {
+        ngx_connection_error(c, NGX_ETIMEDOUT, "redis timed out");
+        ngx_http_rate_limit_prewarm_close(item);
+        return;
+    }
+
+    if (ngx_rate_limit_test_connect(c) != NGX_OK) {
+        ngx_http_rate_limit_prewarm_close(item);
+        return;
+    }
+
+    if (c->write->timer_set) {
+        ngx_del_timer(c->write);
+    }
+
+    ngx_http_rate_limit_prewarm_connected(item);
+}
+
+static void
+ngx_http_rate_limit_prewarm_connected(ngx_http_rate_limit_prewarm_item_t *item)
+{
+    ngx_http_rate_limit_prewarm_t *pw;
+
+    pw = item->prewarm;
+
+    /* once per worker, when the pool is first full */
+    if (++pw->connected == pw->nitems) {
+        ngx_log_error(NGX_LOG_INFO, ngx_cycle->log, 0,
+                      "rate limit: %ui connections to upstream \"%V\" "
+                      "are ready", pw->nitems, &pw->upstream->host);
+    }
+
+    ngx_http_rate_limit_prewarm_idle(item);
+}
+
+static void
+ngx_http_rate_limit_prewarm_idle(ngx_http_rate_limit_prewarm_item_t *item)
+{
+    ngx_connection_t *c;
+
+    c = item->connection;
+
+    item->state = NGX_HTTP_RATE_LIMIT_PREWARM_IDLE;
+    ngx_queue_insert_head(&item->prewarm->cache, &item->queue);
+
+    c->idle = 1;
+    c->data = item;
+    c->log = ngx_cycle->log;
+    c->read->log = ngx_cycle->log;
+    c->write->log = ngx_cycle->log;
+
+    if (c->pool) {
+        c->pool->log = ngx_cycle->log;
+    }
+
+    c->read->handler = ngx_http_rate_limit_prewarm_idle_handler;
+    c->write->handler = ngx_http_rate_limit_prewarm_dummy_handler;
+
+    if (c->read->ready) {
+        ngx_http_rate_limit_prewarm_idle_handler(c->read);
+        return;
+    }
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        ngx_http_rate_limit_prewarm_close(item);
+    }
+}
+
+/* Reference: ngx_http_upstream_keepalive_close_handler */
+static void
+ngx_http_rate_limit_prewarm_idle_handler(ngx_event_t *ev)
+{
+    int               n;
+    char              buf[1];
+    ngx_connection_t *c;
+
+    c = ev->data;
+
+    if (c->close || ev->timedout) {
+        goto close;
+    }
+
+    n = recv(c->fd, buf, 1, MSG_PEEK);
+
+    if (n == -1 && ngx_socket_errno == NGX_EAGAIN) {
+        ev->ready = 0;
+
+        if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+            goto close;
+        }
+
+        return;
+    }
+
+close:
+
+    ngx_http_rate_limit_prewarm_close(c->data);
+}
+
+static void
+ngx_http_rate_limit_prewarm_ping(ngx_http_rate_limit_prewarm_item_t *item)
+{
+    ssize_t           n;
+    ngx_connection_t *c;
+
+    c = item->connection;
+
+    n = c->send(c, ngx_http_rate_limit_ping,
+                sizeof(ngx_http_rate_limit_ping) - 1);
+
+    /* the command is smaller than any socket buffer */
+    if (n != sizeof(ngx_http_rate_limit_ping) - 1) {
+        ngx_http_rate_limit_prewarm_close(item);
+        return;
+    }
+
+    ngx_queue_remove(&item->queue);
+
+    item->state = NGX_HTTP_RATE_LIMIT_PREWARM_PING;
+    item->received = 0;
+
+    c->idle = 0;
+    c->read->handler = ngx_http_rate_limit_prewarm_pong_handler;
+
+    ngx_add_timer(c->read, item->prewarm->timeout);
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        ngx_http_rate_limit_prewarm_close(item);
+    }
+}
+
+static void
+ngx_http_rate_limit_prewarm_pong_handler(ngx_event_t *ev)
+{
+    ssize_t                             n;
+    ngx_connection_t                   *c;
+    ngx_http_rate_limit_prewarm_item_t *item;
+
+    c = ev->data;
+    item = c->data;
+
+    if (ev->timedout) {
+        ngx_connection_error(c, NGX_ETIMEDOUT, "redis timed out");
+        ngx_http_rate_limit_prewarm_close(item);
+        return;
+    }
+
+    n = c->recv(c, item->buffer + item->received,
+                sizeof(item->buffer) - item->received);
+
+    if (n == NGX_AGAIN) {
+        if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+            ngx_http_rate_limit_prewarm_close(item);
+        }
+
+        return;
+    }
+
+    if (n == NGX_ERROR || n == 0) {
+        ngx_http_rate_limit_prewarm_close(item);
+        return;
+    }
+
+    item->received += n;
+
+    /*
+     * "+PONG", or an error such as "-NOAUTH" before the connection is
+     * authenticated: either way the server is alive.
+     */
+
+    if (item->buffer[0] != '+' && item->buffer[0] != '-') {
+        ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                      "rate limit: redis sent invalid response to PING");
+        ngx_http_rate_limit_prewarm_close(item);
+        return;
+    }
+
+    if (item->buffer[item->received - 1] != LF) {
+        if (item->received == sizeof(item->buffer)) {
+            ngx_http_rate_limit_prewarm_close(item);
+        }
+
+        return;
+    }
+
+    if (c->read->timer_set) {
+        ngx_del_timer(c->read);
+    }
+
+    ngx_http_rate_limit_prewarm_idle(item);
+}
+
+static void
+ngx_http_rate_limit_prewarm_close(ngx_http_rate_limit_prewarm_item_t *item)
+{
+    ngx_connection_t *c;
+
+    c = item->connection;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "rate limit: close prewarmed connection %p", c);
+
+    if (item->state == NGX_HTTP_RATE_LIMIT_PREWARM_IDLE) {
+        ngx_queue_remove(&item->queue);
+    }
+
+    if (c->pool) {
+        ngx_destroy_pool(c->pool);
+    }
+
+    ngx_close_connection(c);
+
+    item->connection = NULL;
+    item->state = NGX_HTTP_RATE_LIMIT_PREWARM_FREE;
+
+    ngx_queue_insert_tail(&item->prewarm->free, &item->queue);
+}
+
+static void
+ngx_http_rate_limit_prewarm_dummy_handler(ngx_event_t *ev)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "rate limit: prewarm dummy handler");
+}
+
+static void
+ngx_http_rate_limit_prewarm_timer_handler(ngx_event_t *ev)
+{
+    ngx_uint_t                          i, j;
+    ngx_http_rate_limit_prewarm_t      *pw;
+    ngx_http_rate_limit_main_conf_t    *rlmcf;
+    ngx_http_rate_limit_prewarm_item_t *item;
+
+    if (ngx_exiting || ngx_terminate) {
+        return;
+    }
+
+    rlmcf = ev->data;
+
+    pw = rlmcf->pools->elts;
+
+    for (i = 0; i < rlmcf->pools->nelts; i++) {
+        if (pw[i].addrs.nelts == 0) {
+            continue;
+        }
+
+        /*
+         * Dead connections were closed by ping failures or by the server,
+         * open new ones to replace them.
+         */
+
+        for (j = 0; j < pw[i].nitems; j++) {
+            item = &pw[i].items[j];
+
+            switch (item->state) {
+
+            case NGX_HTTP_RATE_LIMIT_PREWARM_IDLE:
+                ngx_http_rate_limit_prewarm_ping(item);
+                break;
+
+            case NGX_HTTP_RATE_LIMIT_PREWARM_FREE:
+                ngx_http_rate_limit_prewarm_connect(item);
+                break;
+
+            default: /* a connect or a PING is in progress */
+                break;
+            }
+        }
+    }
+
+    ngx_add_timer(ev, rlmcf->prewarm_ping);
+}
@@ -0,0 +1,13 @@
+#ifndef NGX_HTTP_RATE_LIMIT_PREWARM_H
+#define NGX_HTTP_RATE_LIMIT_PREWARM_H
+
+#include "ngx_http_rate_limit_module.h"
+
+char *ngx_http_rate_limit_prewarm(ngx_conf_t *cf, ngx_command_t *cmd,
+                                  void *conf);
+ngx_int_t ngx_http_rate_limit_prewarm_add(ngx_conf_t *cf,
+                                          ngx_http_upstream_srv_conf_t *us);
+ngx_int_t ngx_http_rate_limit_prewarm_init(ngx_conf_t *cf);
+ngx_int_t ngx_http_rate_limit_prewarm_init_process(ngx_cycle_t *cycle);
+
+#endif /* NGX_HTTP_RATE_LIMIT_PREWARM_H */
@@ -0,0 +1,297 @@
+#include "ngx_http_rate_limit_replica.h"
+#include "ngx_http_rate_limit_upstream.h"
+
+typedef struct {
+    ngx_http_upstream_srv_conf_t  *upstream;
+    ngx_http_upstream_init_peer_pt original_init_peer;
+} ngx_http_rate_limit_replica_t;
+
+typedef struct {
+    ngx_http_request_t *request;
+
+    void *data;
+
+    ngx_event_get_peer_pt  original_get_peer;
+    ngx_event_free_peer_pt original_free_peer;
+
+#if (NGX_HTTP_SSL)
+    ngx_event_set_peer_session_pt  original_set_session;
+    ngx_event_save_peer_session_pt original_save_session;
+#endif
+} ngx_http_rate_limit_replica_peer_data_t;
+
+static ngx_int_t ngx_http_rate_limit_replica_init_peer(
+        ngx_http_request_t *r, ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_rate_limit_replica_get_peer(
+        ngx_peer_connection_t *pc, void *data);
+static void ngx_http_rate_limit_replica_free_peer(ngx_peer_connection_t *pc,
+                                                  void *data,
+                                                  ngx_uint_t state);
+#if (NGX_HTTP_SSL)
+static ngx_int_t ngx_http_rate_limit_replica_set_session(
+        ngx_peer_connection_t *pc, void *data);
+static void ngx_http_rate_limit_replica_save_session(
+        ngx_peer_connection_t *pc, void *data);
+#endif
+static void ngx_http_rate_limit_replica_failed(ngx_http_request_t *r);
+static void ngx_http_rate_limit_replica_wake_handler(ngx_event_t *ev);
+static void ngx_http_rate_limit_replica_cleanup(void *data);
+
+ngx_int_t
+ngx_http_rate_limit_replica_add(ngx_conf_t *cf,
+                                ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_uint_t                       i;
+    ngx_http_rate_limit_replica_t   *rs;
+    ngx_http_rate_limit_main_conf_t *rlmcf;
+
+    rlmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_rate_limit_module);
+
+    if (rlmcf->replicas == NULL) {
+        rlmcf->replicas = ngx_array_create(
+                cf->pool, 2, sizeof(ngx_http_rate_limit_replica_t));
+        if (rlmcf->replicas == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    rs = rlmcf->replicas->elts;
+
+    for (i = 0; i < rlmcf->replicas->nelts; i++) {
+        if (rs[i].upstream == us) {
+            return NGX_OK;
+        }
+    }
+
+    rs = ngx_array_push(rlmcf->replicas);
+    if (rs == NULL) {
+        return NGX_ERROR;
+    }
+
+    rs->upstream = us;
+    rs->original_init_peer = NULL;
+
+    return NGX_OK;
+}
+
+/*
+ * A replica that cannot be connected to fails in the upstream module, which
+ * would answer the client with a 502. The upstreams of rate_limit_pass_replica
+ * are wrapped to take such a check back, so that it goes to the primary.
+ */
+ngx_int_t
+ngx_http_rate_limit_replica_init(ngx_conf_t *cf)
+{
+    ngx_uint_t                       i;
+    ngx_http_rate_limit_replica_t   *rs;
+    ngx_http_rate_limit_main_conf_t *rlmcf;
+
+    rlmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_rate_limit_module);
+
+    if (rlmcf->replicas == NULL) {
+        return NGX_OK;
+    }
+
+    rs = rlmcf->replicas->elts;
+
+    for (i = 0; i < rlmcf->replicas->nelts; i++) {
+
+        /* runs after rate_limit_prewarm and the handshake, see there */
+
+        rs[i].original_init_peer = rs[i].upstream->peer.init;
+        rs[i].upstream->peer.init = ngx_http_rate_limit_replica_init_peer;
+    }
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_rate_limit_replica_init_peer(ngx_http_request_t *r,
+                                      ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_uint_t                               i;
+    ngx_pool_cleanup_t                      *cln;
+    ngx_http_upstream_t                     *u;
+    ngx_http_rate_limit_ctx_t               *ctx;
+    ngx_http_rate_limit_replica_t           *rs;
+    ngx_http_rate_limit_main_conf_t         *rlmcf;
+    ngx_http_rate_limit_replica_peer_data_t *rd;
+
+    rlmcf = ngx_http_get_module_main_conf(r, ngx_http_rate_limit_module);
+
+    rs = rlmcf->replicas->elts;
+
+    for (i = 0; i < rlmcf->replicas->nelts; i++) {
+        if (rs[i].upstream == us) {
+            break;
+        }
+    }
+
+    if (rs[i].original_init_peer(r, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    u = r->upstream;
+
+    /* the upstream may be shared with proxy_pass and friends */
+    if (u->output.tag != (ngx_buf_tag_t) &ngx_http_rate_limit_module) {
+        return NGX_OK;
+    }
+
+    /* or be the primary of another location */
+    ctx = ngx_http_get_module_ctx(r, ngx_http_rate_limit_module);
+
+    if (ctx == NULL || !ctx->replica) {
+        return NGX_OK;
+    }
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_http_rate_limit_replica_cleanup;
+    cln->data = ctx;
+
+    rd = ngx_palloc(r->pool, sizeof(ngx_http_rate_limit_replica_peer_data_t));
+    if (rd == NULL) {
+        return NGX_ERROR;
+    }
+
+    rd->request = r;
+
+    rd->data = u->peer.data;
+    rd->original_get_peer = u->peer.get;
+    rd->original_free_peer = u->peer.free;
+
+    u->peer.data = rd;
+    u->peer.get = ngx_http_rate_limit_replica_get_peer;
+    u->peer.free = ngx_http_rate_limit_replica_free_peer;
+
+#if (NGX_HTTP_SSL)
+    rd->original_set_session = u->peer.set_session;
+    rd->original_save_session = u->peer.save_session;
+
+    u->peer.set_session = ngx_http_rate_limit_replica_set_session;
+    u->peer.save_session = ngx_http_rate_limit_replica_save_session;
+#endif
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_rate_limit_replica_get_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_rate_limit_replica_peer_data_t *rd = data;
+
+    ngx_int_t rc;
+
+    rc = rd->original_get_peer(pc, rd->data);
+
+    if (rc == NGX_BUSY) {
+        /* no live peers, the upstream module goes on with a 502 */
+        ngx_http_rate_limit_replica_failed(rd->request);
+    }
+
+    return rc;
+}
+
+static void
+ngx_http_rate_limit_replica_free_peer(ngx_peer_connection_t *pc, void *data,
+                                      ngx_uint_t state)
+{
+    ngx_http_rate_limit_replica_peer_data_t *rd = data;
+
+    rd->original_free_peer(pc, rd->data, state);
+
+    /* only ngx_http_upstream_next() frees a failed peer */
+    if (state & NGX_PEER_FAILED) {
+        pc->sockaddr = NULL;
+
+        ngx_http_rate_limit_replica_failed(rd->request);
+    }
+}
+
+#if (NGX_HTTP_SSL)
+
+static ngx_int_t
+ngx_http_rate_limit_replica_set_session(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_rate_limit_replica_peer_data_t *rd = data;
+
+    return rd->original_set_session(pc, rd->data);
+}
+
+static void
+ngx_http_rate_limit_replica_save_session(ngx_peer_connection_t *pc,
+                                         void *data)
+{
+    ngx_http_rate_limit_replica_peer_data_t *rd = data;
+
+    rd->original_save_session(pc, rd->data);
+}
+
+#endif
+
+/*
+ * Finalizes the upstream ahead of the upstream module, which then only
+ * drops its reference to the request, see ngx_http_upstream_finalize_request.
+ * The phase handler runs again and checks on the primary.
+ */
+static void
+ngx_http_rate_limit_replica_failed(ngx_http_request_t *r)
+{
+    ngx_http_upstream_t       *u;
+    ngx_http_rate_limit_ctx_t *ctx;
+
+    u = r->upstream;
+
+    if (u->cleanup == NULL) {
+        return;
+    }
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_rate_limit_module);
+
+    ngx_http_rate_limit_finalize_upstream_request(r, u, NGX_DECLINED);
+
+    ctx->status = NGX_HTTP_BAD_GATEWAY;
+
+    ctx->wake.handler = ngx_http_rate_limit_replica_wake_handler;
+    ctx->wake.data = r;
+    ctx->wake.log = r->connection->log;
+
+    ngx_post_event(&ctx->wake, &ngx_posted_events);
+}
+
+/* Reference: ngx_http_limit_req_delay */
+static void
+ngx_http_rate_limit_replica_wake_handler(ngx_event_t *ev)
+{
+    ngx_connection_t   *c;
+    ngx_http_request_t *r;
+
+    r = ev->data;
+    c = r->connection;
+
+    ngx_http_set_log_request(c->log, r);
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "rate limit: replica unreachable");
+
+    r->read_event_handler = ngx_http_block_reading;
+    r->write_event_handler = ngx_http_core_run_phases;
+
+    ngx_http_core_run_phases(r);
+
+    ngx_http_run_posted_requests(c);
+}
+
+static void
+ngx_http_rate_limit_replica_cleanup(void *data)
+{
+    ngx_http_rate_limit_ctx_t *ctx = data;
+
+    if (ctx->wake.posted) {
+        ngx_delete_posted_event(&ctx->wake);
+    }
+}
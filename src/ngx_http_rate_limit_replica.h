@@ -0,0 +1,10 @@
+#ifndef NGX_HTTP_RATE_LIMIT_REPLICA_H
+#define NGX_HTTP_RATE_LIMIT_REPLICA_H
+
+#include "ngx_http_rate_limit_module.h"
+
+ngx_int_t ngx_http_rate_limit_replica_add(ngx_conf_t *cf,
+                                          ngx_http_upstream_srv_conf_t *us);
+ngx_int_t ngx_http_rate_limit_replica_init(ngx_conf_t *cf);
+
+#endif /* NGX_HTTP_RATE_LIMIT_REPLICA_H */
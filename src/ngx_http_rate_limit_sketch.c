@@ -0,0 +1,586 @@
+#include "ngx_http_rate_limit_sketch.h"
+#include "ngx_http_rate_limit_state.h"
+
+typedef struct {
+    ngx_uint_t width;
+    ngx_uint_t depth;
+    ngx_uint_t slots;
+    ngx_msec_t slot_len;
+
+    /* start of each slot, in units of slot_len since the epoch */
+    uint64_t *epoch;
+
+    /* slots x depth x width counters */
+    uint32_t *counter;
+} ngx_http_rate_limit_sketch_sh_t;
+
+typedef struct {
+    ngx_http_rate_limit_sketch_sh_t *sh;
+    ngx_slab_pool_t                 *shpool;
+
+    ngx_uint_t width;
+    ngx_uint_t depth;
+    ngx_uint_t slots;
+    ngx_msec_t period;
+
+    /* the snapshot file, if any */
+    ngx_str_t state;
+} ngx_http_rate_limit_sketch_ctx_t;
+
+static ngx_int_t ngx_http_rate_limit_sketch_init_zone(ngx_shm_zone_t *shm_zone,
+                                                      void *data);
+static size_t ngx_http_rate_limit_sketch_size(
+        ngx_http_rate_limit_sketch_ctx_t *ctx);
+static void ngx_http_rate_limit_sketch_state(
+        ngx_http_rate_limit_sketch_ctx_t *ctx,
+        ngx_http_rate_limit_state_header_t *h);
+static void ngx_http_rate_limit_sketch_load(ngx_shm_zone_t *shm_zone);
+static ngx_int_t ngx_http_rate_limit_sketch_save(ngx_shm_zone_t *shm_zone,
+                                                 ngx_str_t *path,
+                                                 ngx_log_t *log);
+
+static size_t
+ngx_http_rate_limit_sketch_size(ngx_http_rate_limit_sketch_ctx_t *ctx)
+{
+    return sizeof(ngx_http_rate_limit_sketch_sh_t) +
+           ctx->slots * sizeof(uint64_t) +
+           ctx->slots * ctx->depth * ctx->width * sizeof(uint32_t);
+}
+
+static ngx_int_t
+ngx_http_rate_limit_sketch_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_rate_limit_sketch_ctx_t *octx = data;
+
+    size_t                            len;
+    u_char                           *p;
+    ngx_http_rate_limit_sketch_ctx_t *ctx;
+
+    ctx = shm_zone->data;
+
+    if (octx) {
+        if (ctx->width != octx->width || ctx->depth != octx->depth ||
+            ctx->slots != octx->slots || ctx->period != octx->period) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "rate_limit_sketch_zone \"%V\" uses different "
+                          "parameters than previously configured",
+                          &shm_zone->shm.name);
+            return NGX_ERROR;
+        }
+
+        ctx->sh = octx->sh;
+        ctx->shpool = octx->shpool;
+
+        return NGX_OK;
+    }
+
+    ctx->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        ctx->sh = ctx->shpool->data;
+
+        return NGX_OK;
+    }
+
+    ctx->sh = ngx_slab_calloc(ctx->shpool,
+                              ngx_http_rate_limit_sketch_size(ctx));
+    if (ctx->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->shpool->data = ctx->sh;
+
+    ctx->sh->width = ctx->width;
+    ctx->sh->depth = ctx->depth;
+    ctx->sh->slots = ctx->slots;
+    ctx->sh->slot_len = ctx->period / ctx->slots;
+
+    p = (u_char *) ctx->sh + sizeof(ngx_http_rate_limit_sketch_sh_t);
+    ctx->sh->epoch = (uint64_t *) p;
+
+    p += ctx->slots * sizeof(uint64_t);
+    ctx->sh->counter = (uint32_t *) p;
+
+    len = sizeof(" in rate_limit_sketch_zone \"\"") + shm_zone->shm.name.len;
+
+    ctx->shpool->log_ctx = ngx_slab_alloc(ctx->shpool, len);
+    if (ctx->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(ctx->shpool->log_ctx, " in rate_limit_sketch_zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    if (ctx->state.len) {
+        ngx_http_rate_limit_sketch_load(shm_zone);
+    }
+
+    return NGX_OK;
+}
+
+/* epoch and counters are laid out one after another */
+static void
+ngx_http_rate_limit_sketch_state(ngx_http_rate_limit_sketch_ctx_t *ctx,
+                                 ngx_http_rate_limit_state_header_t *h)
+{
+    ngx_memzero(h, sizeof(ngx_http_rate_limit_state_header_t));
+
+    h->kind = NGX_HTTP_RATE_LIMIT_STATE_SKETCH;
+    h->params[0] = ctx->width;
+    h->params[1] = ctx->depth;
+    h->params[2] = ctx->slots;
+    h->params[3] = ctx->period;
+    h->len = ngx_http_rate_limit_sketch_size(ctx) -
+             sizeof(ngx_http_rate_limit_sketch_sh_t);
+}
+
+static void
+ngx_http_rate_limit_sketch_load(ngx_shm_zone_t *shm_zone)
+{
+    uint64_t                            cur;
+    ngx_uint_t                          s, dropped;
+    ngx_time_t                         *tp;
+    ngx_http_rate_limit_sketch_sh_t    *sh;
+    ngx_http_rate_limit_sketch_ctx_t   *ctx;
+    ngx_http_rate_limit_state_header_t  h;
+
+    ctx = shm_zone->data;
+    sh = ctx->sh;
+
+    ngx_http_rate_limit_sketch_state(ctx, &h);
+
+    if (ngx_http_rate_limit_state_read(&ctx->state, &h, (u_char *) sh->epoch,
+                                       shm_zone->shm.log) != NGX_OK) {
+        return;
+    }
+
+    /* sub-windows that have expired meanwhile are dropped */
+
+    tp = ngx_timeofday();
+    cur = ((uint64_t) tp->sec * 1000 + tp->msec) / sh->slot_len;
+
+    dropped = 0;
+
+    for (s = 0; s < sh->slots; s++) {
+        if (sh->epoch[s] + sh->slots > cur) {
+            continue;
+        }
+
+        ngx_memzero(&sh->counter[s * sh->depth * sh->width],
+                    sh->depth * sh->width * sizeof(uint32_t));
+        sh->epoch[s] = 0;
+
+        dropped++;
+    }
+
+    ngx_log_error(NGX_LOG_NOTICE, shm_zone->shm.log, 0,
+                  "loaded zone \"%V\" from \"%V\", %ui of %ui slots expired",
+                  &shm_zone->shm.name, &ctx->state, dropped, sh->slots);
+}
+
+static ngx_int_t
+ngx_http_rate_limit_sketch_save(ngx_shm_zone_t *shm_zone, ngx_str_t *path,
+                                ngx_log_t *log)
+{
+    ngx_http_rate_limit_sketch_ctx_t   *ctx;
+    ngx_http_rate_limit_state_header_t  h;
+
+    ctx = shm_zone->data;
+
+    if (ctx->sh == NULL) {
+        return NGX_DECLINED;
+    }
+
+    ngx_http_rate_limit_sketch_state(ctx, &h);
+
+    return ngx_http_rate_limit_state_write(path, &h,
+                                           (u_char *) ctx->sh->epoch, log);
+}
+
+ngx_int_t
+ngx_http_rate_limit_sketch_account(ngx_http_request_t *r,
+                                   ngx_http_rate_limit_ctx_t *ctx)
+{
+    uint32_t                          h1, h2, *row, *counter;
+    uint64_t                          now, cur, idx, best, total, end;
+    ngx_int_t                         rc;
+    ngx_uint_t                        d, s, age, requests, quantity;
+    ngx_uint_t                        pos[NGX_HTTP_RATE_LIMIT_SKETCH_DEPTH];
+    ngx_time_t                       *tp;
+    ngx_http_rate_limit_sketch_sh_t  *sh;
+    ngx_http_rate_limit_sketch_ctx_t *sctx;
+    ngx_http_rate_limit_loc_conf_t   *rlcf;
+
+    rlcf = ngx_http_get_module_loc_conf(r, ngx_http_rate_limit_module);
+
+    sctx = rlcf->sketch_zone->data;
+    sh = sctx->sh;
+
+    requests = rlcf->sketch_requests;
+    quantity = rlcf->rule.quantity;
+
+    tp = ngx_timeofday();
+    now = (uint64_t) tp->sec * 1000 + tp->msec;
+
+    /* double hashing: row d uses h1 + d * h2 */
+    h1 = ngx_crc32_short(ctx->key.data, ctx->key.len);
+    h2 = ngx_murmur_hash2(ctx->key.data, ctx->key.len) | 1;
+
+    for (d = 0; d < sh->depth; d++) {
+        pos[d] = (h1 + d * h2) % sh->width;
+    }
+
+    ngx_shmtx_lock(&sctx->shpool->mutex);
+
+    cur = now / sh->slot_len;
+    s = cur % sh->slots;
+
+    if (sh->epoch[s] != cur) {
+        /* the slot is reused for a new sub-window */
+        ngx_memzero(&sh->counter[s * sh->depth * sh->width],
+                    sh->depth * sh->width * sizeof(uint32_t));
+        sh->epoch[s] = cur;
+    }
+
+    /* the estimate is the smallest row sum over the live slots */
+
+    best = (uint64_t) -1;
+    row = NULL;
+
+    for (d = 0; d < sh->depth; d++) {
+        total = 0;
+
+        for (s = 0; s < sh->slots; s++) {
+            if (sh->epoch[s] + sh->slots <= cur) {
+                continue;
+            }
+
+            total += sh->counter[(s * sh->depth + d) * sh->width + pos[d]];
+        }
+
+        if (total < best) {
+            best = total;
+            row = &sh->counter[d * sh->width + pos[d]];
+        }
+    }
+
+    ctx->reply.limit = requests;
+
+    if (best + quantity <= requests) {
+        s = cur % sh->slots;
+
+        for (d = 0; d < sh->depth; d++) {
+            counter = &sh->counter[(s * sh->depth + d) * sh->width + pos[d]];
+
+            if (*counter > NGX_MAX_UINT32_VALUE - quantity) {
+                *counter = NGX_MAX_UINT32_VALUE;
+
+            } else {
+                *counter += quantity;
+            }
+        }
+
+        best += quantity;
+
+        ctx->reply.remaining = requests - best;
+        ctx->reply.retry_after = -1;
+
+        rc = NGX_OK;
+
+    } else {
+        ctx->reply.remaining = best < requests ? requests - best : 0;
+        ctx->reply.retry_after = 0;
+
+        rc = NGX_BUSY;
+    }
+
+    /*
+     * Walk the live slots of the best row from the oldest to the newest:
+     * the retry time is when enough of them have expired for the quantity
+     * to fit, the reset time is when the newest non-empty one expires.
+     */
+
+    end = 0;
+    total = best;
+
+    for (age = sh->slots; age-- > 0; /* void */) {
+        if (cur < age) {
+            continue;
+        }
+
+        idx = cur - age;
+        s = idx % sh->slots;
+
+        if (sh->epoch[s] != idx) {
+            continue;
+        }
+
+        counter = row + s * sh->depth * sh->width;
+
+        if (*counter == 0) {
+            continue;
+        }
+
+        end = (idx + sh->slots) * sh->slot_len;
+
+        if (rc == NGX_BUSY && ctx->reply.retry_after == 0) {
+            total -= ngx_min(total, *counter);
+
+            if (total + quantity <= requests) {
+                ctx->reply.retry_after = (end - now + 999) / 1000;
+            }
+        }
+    }
+
+    ngx_shmtx_unlock(&sctx->shpool->mutex);
+
+    ctx->reply.reset = end > now ? (end - now + 999) / 1000 : 0;
+
+    if (rc == NGX_BUSY && ctx->reply.retry_after == 0) {
+        /* the quantity does not fit into an empty window */
+        ctx->reply.retry_after = (sctx->period + 999) / 1000;
+    }
+
+    ngx_log_debug4(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "rate limit sketch: key \"%V\" estimate %uL of %ui, "
+                   "reset %ui",
+                   &ctx->key, best, requests, ctx->reply.reset);
+
+    return rc;
+}
+
+char *
+ngx_http_rate_limit_sketch_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    size_t                            size;
+    ngx_str_t                        *value, name, state, s;
+    ngx_int_t                         width, depth, slots, period;
+    ngx_uint_t                        i;
+    ngx_shm_zone_t                   *shm_zone;
+    ngx_http_rate_limit_sketch_ctx_t *ctx;
+
+    value = cf->args->elts;
+
+    ngx_str_null(&name);
+    ngx_str_null(&state);
+
+    width = 2048;
+    depth = 4;
+    slots = 10;
+    period = 60000;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "zone=", 5) == 0) {
+
+            name.len = value[i].len - 5;
+            name.data = value[i].data + 5;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "width=", 6) == 0) {
+
+            width = ngx_atoi(value[i].data + 6, value[i].len - 6);
+            if (width <= 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid width value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "depth=", 6) == 0) {
+
+            depth = ngx_atoi(value[i].data + 6, value[i].len - 6);
+            if (depth <= 0 || depth > NGX_HTTP_RATE_LIMIT_SKETCH_DEPTH) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid depth value \"%V\", "
+                                   "it must be between 1 and %d",
+                                   &value[i],
+                                   NGX_HTTP_RATE_LIMIT_SKETCH_DEPTH);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "slots=", 6) == 0) {
+
+            slots = ngx_atoi(value[i].data + 6, value[i].len - 6);
+            if (slots <= 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid slots value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "period=", 7) == 0) {
+
+            s.len = value[i].len - 7;
+            s.data = value[i].data + 7;
+
+            period = ngx_parse_time(&s, 0);
+            if (period <= 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid period time \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "state=", 6) == 0) {
+
+            state.len = value[i].len - 6;
+            state.data = value[i].data + 6;
+
+            if (state.len == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid state file \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"",
+                           &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (name.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must have \"zone\" parameter",
+                           &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    if (period / slots == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "period is too short for %i slots", slots);
+        return NGX_CONF_ERROR;
+    }
+
+    ctx = ngx_pcalloc(cf->pool, sizeof(ngx_http_rate_limit_sketch_ctx_t));
+    if (ctx == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ctx->width = width;
+    ctx->depth = depth;
+    ctx->slots = slots;
+    ctx->period = period;
+
+    /*
+     * The zone never grows: it holds the counters and a margin
+     * for the slab allocator bookkeeping.
+     */
+
+    size = ngx_http_rate_limit_sketch_size(ctx);
+    size = ngx_align(size + size / 64, ngx_pagesize) + 8 * ngx_pagesize;
+
+    shm_zone = ngx_shared_memory_add(cf, &name, size,
+                                     &ngx_http_rate_limit_module);
+    if (shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (shm_zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "duplicate zone \"%V\"",
+                           &name);
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone->init = ngx_http_rate_limit_sketch_init_zone;
+    shm_zone->data = ctx;
+
+    if (state.len) {
+        if (ngx_http_rate_limit_state_add(cf, &state, shm_zone,
+                                          ngx_http_rate_limit_sketch_save,
+                                          NULL) != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
+
+        ctx->state = state;
+    }
+
+    return NGX_CONF_OK;
+}
+
+char *
+ngx_http_rate_limit_sketch(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_rate_limit_loc_conf_t *rlcf = conf;
+
+    ngx_str_t      *value, name;
+    ngx_int_t       requests;
+    ngx_uint_t      i;
+    ngx_shm_zone_t *shm_zone;
+
+    if (rlcf->sketch_zone) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    shm_zone = NULL;
+    requests = 0;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "zone=", 5) == 0) {
+
+            name.len = value[i].len - 5;
+            name.data = value[i].data + 5;
+
+            shm_zone = ngx_shared_memory_add(cf, &name, 0,
+                                             &ngx_http_rate_limit_module);
+            if (shm_zone == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "requests=", 9) == 0) {
+
+            requests = ngx_atoi(value[i].data + 9, value[i].len - 9);
+            if (requests <= 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid requests value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"",
+                           &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (shm_zone == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must have \"zone\" parameter",
+                           &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    if (requests == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must have \"requests\" parameter",
+                           &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    rlcf->sketch_zone = shm_zone;
+    rlcf->sketch_requests = requests;
+
+    rlcf->configured = 1;
+
+    return NGX_CONF_OK;
+}
@@ -0,0 +1,15 @@
+#ifndef NGX_HTTP_RATE_LIMIT_SKETCH_H
+#define NGX_HTTP_RATE_LIMIT_SKETCH_H
+
+#include "ngx_http_rate_limit_module.h"
+
+#define NGX_HTTP_RATE_LIMIT_SKETCH_DEPTH 8
+
+char *ngx_http_rate_limit_sketch_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+                                      void *conf);
+char *ngx_http_rate_limit_sketch(ngx_conf_t *cf, ngx_command_t *cmd,
+                                 void *conf);
+ngx_int_t ngx_http_rate_limit_sketch_account(ngx_http_request_t *r,
+                                             ngx_http_rate_limit_ctx_t *ctx);
+
+#endif /* NGX_HTTP_RATE_LIMIT_SKETCH_H */
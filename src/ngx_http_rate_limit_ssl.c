@@ -0,0 +1,244 @@
+#include "ngx_http_rate_limit_ssl.h"
+
+#if (NGX_HTTP_SSL)
+static ngx_int_t ngx_http_rate_limit_ssl_create(
+        ngx_conf_t *cf, ngx_http_rate_limit_loc_conf_t *conf);
+static ngx_int_t ngx_http_rate_limit_ssl_add_upstream(
+        ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *us);
+#endif
+
+/*
+ * The checks go through the upstream module, which does the handshake and
+ * reuses sessions through the balancer. Charges, rate_limit_block and
+ * rate_limit_prewarm connect on their own, in plain text.
+ */
+ngx_int_t
+ngx_http_rate_limit_ssl_merge(ngx_conf_t *cf,
+                              ngx_http_rate_limit_loc_conf_t *prev,
+                              ngx_http_rate_limit_loc_conf_t *conf)
+{
+#if (NGX_HTTP_SSL)
+    char       *directive;
+    ngx_flag_t  preserve;
+
+    /* the context of the parent is shared unless this level changes it */
+    preserve = conf->ssl_certificate.data == NULL &&
+               conf->ssl_certificate_key.data == NULL &&
+               conf->ssl_trusted_certificate.data == NULL &&
+               conf->ssl_verify_depth == NGX_CONF_UNSET_UINT &&
+               conf->upstream.ssl_verify == NGX_CONF_UNSET &&
+               conf->upstream.ssl_session_reuse == NGX_CONF_UNSET;
+
+    ngx_conf_merge_value(conf->ssl, prev->ssl, 0);
+    ngx_conf_merge_value(conf->upstream.ssl_session_reuse,
+                         prev->upstream.ssl_session_reuse, 1);
+    ngx_conf_merge_value(conf->upstream.ssl_server_name,
+                         prev->upstream.ssl_server_name, 0);
+    ngx_conf_merge_value(conf->upstream.ssl_verify, prev->upstream.ssl_verify,
+                         0);
+    ngx_conf_merge_uint_value(conf->ssl_verify_depth, prev->ssl_verify_depth,
+                              1);
+    ngx_conf_merge_str_value(conf->ssl_certificate, prev->ssl_certificate, "");
+    ngx_conf_merge_str_value(conf->ssl_certificate_key,
+                             prev->ssl_certificate_key, "");
+    ngx_conf_merge_str_value(conf->ssl_trusted_certificate,
+                             prev->ssl_trusted_certificate, "");
+
+    if (conf->upstream.ssl_name == NULL) {
+        conf->upstream.ssl_name = prev->upstream.ssl_name;
+    }
+
+    if (!conf->ssl) {
+        return NGX_OK;
+    }
+
+    if (conf->charge) {
+        directive = "rate_limit_charge";
+
+    } else if (conf->connection_cache) {
+        directive = "rate_limit_connection_cache";
+
+    } else if (conf->block_zone && conf->upstream.upstream) {
+        directive = "rate_limit_block";
+
+    } else {
+        directive = NULL;
+    }
+
+    if (directive) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%s\" cannot be used with \"rate_limit_ssl\"",
+                           directive);
+        return NGX_ERROR;
+    }
+
+    if (preserve && prev->upstream.ssl) {
+        conf->upstream.ssl = prev->upstream.ssl;
+
+    } else {
+        if (ngx_http_rate_limit_ssl_create(cf, conf) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        /* for the other locations of the same server */
+        if (preserve) {
+            prev->upstream.ssl = conf->upstream.ssl;
+        }
+    }
+
+    /* copied from the primary before the settings above were merged */
+    if (conf->replica) {
+        conf->replica->ssl = conf->upstream.ssl;
+        conf->replica->ssl_session_reuse = conf->upstream.ssl_session_reuse;
+        conf->replica->ssl_name = conf->upstream.ssl_name;
+        conf->replica->ssl_server_name = conf->upstream.ssl_server_name;
+        conf->replica->ssl_verify = conf->upstream.ssl_verify;
+    }
+
+    if (conf->upstream.upstream &&
+        ngx_http_rate_limit_ssl_add_upstream(cf, conf->upstream.upstream) !=
+            NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (conf->replica_upstream &&
+        ngx_http_rate_limit_ssl_add_upstream(cf, conf->replica_upstream) !=
+            NGX_OK) {
+        return NGX_ERROR;
+    }
+#endif
+
+    return NGX_OK;
+}
+
+/* Whether checks go to the upstream over TLS, it is not pre-warmed then */
+ngx_flag_t
+ngx_http_rate_limit_ssl_upstream(ngx_http_rate_limit_main_conf_t *rlmcf,
+                                 ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_uint_t                     i;
+    ngx_http_upstream_srv_conf_t **usp;
+
+    if (rlmcf->ssl_upstreams == NULL) {
+        return 0;
+    }
+
+    usp = rlmcf->ssl_upstreams->elts;
+
+    for (i = 0; i < rlmcf->ssl_upstreams->nelts; i++) {
+        if (usp[i] == us) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+#if (NGX_HTTP_SSL)
+
+/* Reference: ngx_http_proxy_set_ssl */
+static ngx_int_t
+ngx_http_rate_limit_ssl_create(ngx_conf_t *cf,
+                               ngx_http_rate_limit_loc_conf_t *conf)
+{
+    ngx_ssl_t          *ssl;
+    ngx_pool_cleanup_t *cln;
+
+    ssl = ngx_pcalloc(cf->pool, sizeof(ngx_ssl_t));
+    if (ssl == NULL) {
+        return NGX_ERROR;
+    }
+
+    ssl->log = cf->log;
+
+    if (ngx_ssl_create(ssl, NGX_SSL_TLSv1_2 | NGX_SSL_TLSv1_3, NULL) !=
+        NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    cln = ngx_pool_cleanup_add(cf->pool, 0);
+    if (cln == NULL) {
+        ngx_ssl_cleanup_ctx(ssl);
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_ssl_cleanup_ctx;
+    cln->data = ssl;
+
+    conf->upstream.ssl = ssl;
+
+    /* Redis asks for a client certificate unless tls-auth-clients is no */
+    if (conf->ssl_certificate.len) {
+        if (conf->ssl_certificate_key.len == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "no \"rate_limit_ssl_certificate_key\" is "
+                               "defined for certificate \"%V\"",
+                               &conf->ssl_certificate);
+            return NGX_ERROR;
+        }
+
+        if (ngx_ssl_certificate(cf, ssl, &conf->ssl_certificate,
+                                &conf->ssl_certificate_key, NULL) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    if (conf->upstream.ssl_verify) {
+        if (conf->ssl_trusted_certificate.len == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "no \"rate_limit_ssl_trusted_certificate\" for "
+                               "\"rate_limit_ssl_verify\"");
+            return NGX_ERROR;
+        }
+
+        if (ngx_ssl_trusted_certificate(cf, ssl,
+                                        &conf->ssl_trusted_certificate,
+                                        conf->ssl_verify_depth) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+#if defined(nginx_version) && nginx_version >= 1023000
+    /* sessions are handed to the balancer as they are issued */
+    if (ngx_ssl_client_session_cache(cf, ssl,
+                                     conf->upstream.ssl_session_reuse) !=
+        NGX_OK) {
+        return NGX_ERROR;
+    }
+#endif
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_rate_limit_ssl_add_upstream(ngx_conf_t *cf,
+                                     ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_http_upstream_srv_conf_t    **usp;
+    ngx_http_rate_limit_main_conf_t  *rlmcf;
+
+    rlmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_rate_limit_module);
+
+    if (ngx_http_rate_limit_ssl_upstream(rlmcf, us)) {
+        return NGX_OK;
+    }
+
+    if (rlmcf->ssl_upstreams == NULL) {
+        rlmcf->ssl_upstreams = ngx_array_create(
+                cf->pool, 2, sizeof(ngx_http_upstream_srv_conf_t *));
+        if (rlmcf->ssl_upstreams == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    usp = ngx_array_push(rlmcf->ssl_upstreams);
+    if (usp == NULL) {
+        return NGX_ERROR;
+    }
+
+    *usp = us;
+
+    return NGX_OK;
+}
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef NGX_HTTP_RATE_LIMIT_SSL_H
+#define NGX_HTTP_RATE_LIMIT_SSL_H
+
+#include "ngx_http_rate_limit_module.h"
+
+ngx_int_t ngx_http_rate_limit_ssl_merge(ngx_conf_t *cf,
+                                        ngx_http_rate_limit_loc_conf_t *prev,
+                                        ngx_http_rate_limit_loc_conf_t *conf);
+ngx_flag_t ngx_http_rate_limit_ssl_upstream(
+        ngx_http_rate_limit_main_conf_t *rlmcf,
+        ngx_http_upstream_srv_conf_t *us);
+
+#endif /* NGX_HTTP_RATE_LIMIT_SSL_H */
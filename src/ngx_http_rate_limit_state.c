@@ -0,0 +1,328 @@
+#include "ngx_http_rate_limit_state.h"
+
+/* "RLS1", bumped whenever the header changes */
+#define NGX_HTTP_RATE_LIMIT_STATE_MAGIC 0x31534c52
+
+/* how often changed zones are written while nginx runs, in msec */
+#define NGX_HTTP_RATE_LIMIT_STATE_SYNC 1000
+
+static void ngx_http_rate_limit_state_sync_handler(ngx_event_t *ev);
+
+/* temporary files of this process, each write gets its own */
+static ngx_uint_t ngx_http_rate_limit_state_temps;
+
+ngx_int_t
+ngx_http_rate_limit_state_add(ngx_conf_t *cf, ngx_str_t *path,
+                              ngx_shm_zone_t *zone,
+                              ngx_http_rate_limit_state_save_pt save,
+                              ngx_http_rate_limit_state_save_pt sync)
+{
+    ngx_uint_t                       i;
+    ngx_http_rate_limit_state_t     *state;
+    ngx_http_rate_limit_main_conf_t *rlmcf;
+
+    if (ngx_conf_full_name(cf->cycle, path, 0) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    rlmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_rate_limit_module);
+
+    state = rlmcf->states.elts;
+
+    for (i = 0; i < rlmcf->states.nelts; i++) {
+        if (state[i].path.len == path->len &&
+            ngx_strncmp(state[i].path.data, path->data, path->len) == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "state file \"%V\" is already used by zone "
+                               "\"%V\"",
+                               path, &state[i].zone->shm.name);
+            return NGX_ERROR;
+        }
+    }
+
+    state = ngx_array_push(&rlmcf->states);
+    if (state == NULL) {
+        return NGX_ERROR;
+    }
+
+    state->path = *path;
+    state->zone = zone;
+    state->save = save;
+    state->sync = sync;
+
+    return NGX_OK;
+}
+
+/*
+ * Copies the data of a state file into the zone. Returns NGX_DECLINED
+ * if there is no such file or it was written for a different layout.
+ */
+ngx_int_t
+ngx_http_rate_limit_state_read(ngx_str_t *path,
+                               ngx_http_rate_limit_state_header_t *h,
+                               u_char *data, ngx_log_t *log)
+{
+    size_t                              size;
+    u_char                             *start;
+    ngx_fd_t                            fd;
+    ngx_int_t                           rc;
+    ngx_file_info_t                     fi;
+    ngx_http_rate_limit_state_header_t *fh;
+
+    fd = ngx_open_file(path->data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+
+    if (fd == NGX_INVALID_FILE) {
+        if (ngx_errno == NGX_ENOENT) {
+            return NGX_DECLINED;
+        }
+
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_open_file_n " \"%V\" failed", path);
+        return NGX_ERROR;
+    }
+
+    rc = NGX_ERROR;
+    start = NULL;
+    size = 0;
+
+    if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_fd_info_n " \"%V\" failed", path);
+        goto done;
+    }
+
+    size = (size_t) ngx_file_size(&fi);
+
+    if (size != sizeof(ngx_http_rate_limit_state_header_t) + h->len) {
+        ngx_log_error(NGX_LOG_NOTICE, log, 0,
+                      "ignoring state file \"%V\" of a different size", path);
+        rc = NGX_DECLINED;
+        size = 0;
+        goto done;
+    }
+
+    start = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (start == MAP_FAILED) {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno, "mmap(\"%V\") failed",
+                      path);
+        start = NULL;
+        goto done;
+    }
+
+    fh = (ngx_http_rate_limit_state_header_t *) start;
+
+    if (fh->magic != NGX_HTTP_RATE_LIMIT_STATE_MAGIC || fh->kind != h->kind ||
+        fh->len != h->len ||
+        ngx_memcmp(fh->params, h->params, sizeof(h->params)) != 0) {
+        ngx_log_error(NGX_LOG_NOTICE, log, 0,
+                      "ignoring state file \"%V\" written with different "
+                      "parameters",
+                      path);
+        rc = NGX_DECLINED;
+        goto done;
+    }
+
+    ngx_memcpy(data, start + sizeof(ngx_http_rate_limit_state_header_t),
+               h->len);
+
+    h->saved = fh->saved;
+
+    rc = NGX_OK;
+
+done:
+
+    if (start && munmap(start, size) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno, "munmap(\"%V\") failed",
+                      path);
+    }
+
+    if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_close_file_n " \"%V\" failed", path);
+    }
+
+    return rc;
+}
+
+ngx_int_t
+ngx_http_rate_limit_state_write(ngx_str_t *path,
+                                ngx_http_rate_limit_state_header_t *h,
+                                u_char *data, ngx_log_t *log)
+{
+    u_char     *temp;
+    ssize_t     n;
+    ngx_fd_t    fd;
+    ngx_int_t   rc;
+    ngx_time_t *tp;
+
+    /*
+     * Written aside and renamed, a crash never leaves half a file. The
+     * name is unique, so a worker that is shutting down and its successor
+     * never write into the same file.
+     */
+
+    temp = ngx_alloc(path->len + 1 + NGX_INT64_LEN + 1 + NGX_INT_T_LEN
+                         + sizeof(".tmp"),
+                     log);
+    if (temp == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(temp, "%V.%P.%ui.tmp%Z", path, ngx_pid,
+                ngx_http_rate_limit_state_temps++);
+
+    fd = ngx_open_file(temp, NGX_FILE_WRONLY, NGX_FILE_TRUNCATE,
+                       NGX_FILE_DEFAULT_ACCESS);
+
+    if (fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_open_file_n " \"%s\" failed", temp);
+        ngx_free(temp);
+        return NGX_ERROR;
+    }
+
+    tp = ngx_timeofday();
+
+    h->magic = NGX_HTTP_RATE_LIMIT_STATE_MAGIC;
+    h->saved = (uint64_t) tp->sec * 1000 + tp->msec;
+
+    rc = NGX_ERROR;
+
+    n = ngx_write_fd(fd, h, sizeof(ngx_http_rate_limit_state_header_t));
+
+    if (n == (ssize_t) sizeof(ngx_http_rate_limit_state_header_t)) {
+        n = ngx_write_fd(fd, data, h->len);
+
+        if (n == (ssize_t) h->len) {
+            rc = NGX_OK;
+        }
+    }
+
+    if (rc != NGX_OK) {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_write_fd_n " \"%s\" failed", temp);
+    }
+
+    if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", temp);
+    }
+
+    if (rc == NGX_OK && ngx_rename_file(temp, path->data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_rename_file_n " \"%s\" to \"%V\" failed", temp,
+                      path);
+        rc = NGX_ERROR;
+    }
+
+    if (rc != NGX_OK && ngx_delete_file(temp) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed", temp);
+    }
+
+    ngx_free(temp);
+
+    return rc;
+}
+
+/* Zones that change at runtime are written by a single worker */
+ngx_int_t
+ngx_http_rate_limit_state_init_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                       i;
+    ngx_event_t                     *ev;
+    ngx_http_rate_limit_state_t     *state;
+    ngx_http_rate_limit_main_conf_t *rlmcf;
+
+    if (ngx_process != NGX_PROCESS_WORKER &&
+        ngx_process != NGX_PROCESS_SINGLE) {
+        return NGX_OK;
+    }
+
+    if (ngx_process == NGX_PROCESS_WORKER && ngx_worker != 0) {
+        return NGX_OK;
+    }
+
+    rlmcf = ngx_http_cycle_get_module_main_conf(cycle,
+                                                ngx_http_rate_limit_module);
+    if (rlmcf == NULL) {
+        return NGX_OK;
+    }
+
+    state = rlmcf->states.elts;
+
+    for (i = 0; i < rlmcf->states.nelts; i++) {
+        if (state[i].sync) {
+            break;
+        }
+    }
+
+    if (i == rlmcf->states.nelts) {
+        return NGX_OK;
+    }
+
+    ev = ngx_pcalloc(cycle->pool, sizeof(ngx_event_t));
+    if (ev == NULL) {
+        return NGX_ERROR;
+    }
+
+    ev->handler = ngx_http_rate_limit_state_sync_handler;
+    ev->data = rlmcf;
+    ev->log = cycle->log;
+    ev->cancelable = 1;
+
+    ngx_add_timer(ev, NGX_HTTP_RATE_LIMIT_STATE_SYNC);
+
+    return NGX_OK;
+}
+
+static void
+ngx_http_rate_limit_state_sync_handler(ngx_event_t *ev)
+{
+    ngx_uint_t                       i;
+    ngx_http_rate_limit_state_t     *state;
+    ngx_http_rate_limit_main_conf_t *rlmcf;
+
+    rlmcf = ev->data;
+
+    state = rlmcf->states.elts;
+
+    for (i = 0; i < rlmcf->states.nelts; i++) {
+        if (state[i].sync) {
+            /* a failed write is tried again on the next tick */
+            (void) state[i].sync(state[i].zone, &state[i].path, ev->log);
+        }
+    }
+
+    if (ngx_exiting || ngx_terminate) {
+        return;
+    }
+
+    ngx_add_timer(ev, NGX_HTTP_RATE_LIMIT_STATE_SYNC);
+}
+
+/* the workers are gone, the zones are written without locking */
+void
+ngx_http_rate_limit_state_exit_master(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                       i;
+    ngx_http_rate_limit_state_t     *state;
+    ngx_http_rate_limit_main_conf_t *rlmcf;
+
+    rlmcf = ngx_http_cycle_get_module_main_conf(cycle,
+                                                ngx_http_rate_limit_module);
+    if (rlmcf == NULL) {
+        return;
+    }
+
+    state = rlmcf->states.elts;
+
+    for (i = 0; i < rlmcf->states.nelts; i++) {
+        if (state[i].save(state[i].zone, &state[i].path, cycle->log) ==
+            NGX_OK) {
+            ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0,
+                          "saved zone \"%V\" to \"%V\"",
+                          &state[i].zone->shm.name, &state[i].path);
+        }
+    }
+}
@@ -0,0 +1,50 @@
+#ifndef NGX_HTTP_RATE_LIMIT_STATE_H
+#define NGX_HTTP_RATE_LIMIT_STATE_H
+
+#include "ngx_http_rate_limit_module.h"
+
+#define NGX_HTTP_RATE_LIMIT_STATE_SKETCH 1
+#define NGX_HTTP_RATE_LIMIT_STATE_ADAPTIVE 2
+#define NGX_HTTP_RATE_LIMIT_STATE_POLICY 3
+
+typedef struct {
+    uint32_t magic;
+    uint32_t kind;
+
+    /* the layout of the zone, a file is only loaded if they match */
+    uint64_t params[4];
+
+    /* when the file was written, in msec since the epoch */
+    uint64_t saved;
+
+    /* the length of the data that follows */
+    uint64_t len;
+} ngx_http_rate_limit_state_header_t;
+
+typedef ngx_int_t (*ngx_http_rate_limit_state_save_pt)(ngx_shm_zone_t *zone,
+                                                       ngx_str_t *path,
+                                                       ngx_log_t *log);
+
+typedef struct {
+    ngx_str_t                         path;
+    ngx_shm_zone_t                   *zone;
+    ngx_http_rate_limit_state_save_pt save;
+
+    /* writes the zone while nginx runs if it changed, NULL if never */
+    ngx_http_rate_limit_state_save_pt sync;
+} ngx_http_rate_limit_state_t;
+
+ngx_int_t ngx_http_rate_limit_state_add(ngx_conf_t *cf, ngx_str_t *path,
+                                        ngx_shm_zone_t *zone,
+                                        ngx_http_rate_limit_state_save_pt save,
+                                        ngx_http_rate_limit_state_save_pt sync);
+ngx_int_t ngx_http_rate_limit_state_read(ngx_str_t *path,
+                                         ngx_http_rate_limit_state_header_t *h,
+                                         u_char *data, ngx_log_t *log);
+ngx_int_t ngx_http_rate_limit_state_write(
+        ngx_str_t *path, ngx_http_rate_limit_state_header_t *h, u_char *data,
+        ngx_log_t *log);
+ngx_int_t ngx_http_rate_limit_state_init_process(ngx_cycle_t *cycle);
+void ngx_http_rate_limit_state_exit_master(ngx_cycle_t *cycle);
+
+#endif /* NGX_HTTP_RATE_LIMIT_STATE_H */
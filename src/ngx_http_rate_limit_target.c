@@ -0,0 +1,838 @@
+#include "ngx_http_rate_limit_target.h"
+#include "ngx_http_rate_limit_handshake.h"
+
+/* addresses kept per target, the rest of a longer answer is ignored */
+#define NGX_HTTP_RATE_LIMIT_TARGET_ADDRS 8
+
+typedef struct {
+    socklen_t      socklen;
+    ngx_sockaddr_t sockaddr;
+
+    ngx_str_t name;
+    u_char    name_data[NGX_SOCKADDR_STRLEN];
+} ngx_http_rate_limit_target_addr_t;
+
+typedef struct {
+    ngx_http_rate_limit_target_t *target;
+
+    ngx_queue_t       queue;
+    ngx_connection_t *connection;
+
+    socklen_t      socklen;
+    ngx_sockaddr_t sockaddr;
+} ngx_http_rate_limit_target_item_t;
+
+/*
+ * A host:port given by the variables of rate_limit_pass, with the
+ * addresses it resolved to and the idle connections to them. Targets are
+ * kept by each worker for its lifetime.
+ */
+struct ngx_http_rate_limit_target_s {
+    ngx_str_node_t sn;
+
+    ngx_str_t host;
+    in_port_t port;
+
+    /* handed to ngx_http_upstream_init() as u->conf->upstream */
+    ngx_http_upstream_srv_conf_t upstream;
+
+    ngx_http_rate_limit_target_addr_t addrs[NGX_HTTP_RATE_LIMIT_TARGET_ADDRS];
+    ngx_uint_t                        naddrs;
+    ngx_uint_t                        next;
+
+    /* when the addresses are to be resolved again */
+    time_t expires;
+
+    /* requests waiting for the first answer of the resolver */
+    ngx_queue_t waiters;
+
+    ngx_queue_t                        cache;
+    ngx_queue_t                        free;
+    ngx_http_rate_limit_target_item_t *items;
+
+    ngx_msec_t timeout;
+
+#if (NGX_HTTP_SSL)
+    /* the last session, offered to whichever address is picked */
+    ngx_ssl_session_t *ssl_session;
+#endif
+
+    unsigned resolving : 1;
+};
+
+typedef struct {
+    ngx_http_rate_limit_target_t *target;
+    ngx_http_upstream_t          *upstream;
+
+    /* the address tried, a copy that outlives a change of the answer */
+    socklen_t      socklen;
+    ngx_sockaddr_t sockaddr;
+
+    ngx_str_t name;
+    u_char    name_data[NGX_SOCKADDR_STRLEN];
+} ngx_http_rate_limit_target_peer_data_t;
+
+static ngx_http_rate_limit_target_t *ngx_http_rate_limit_target_create(
+        ngx_http_request_t *r, ngx_str_t *name, uint32_t hash);
+static ngx_int_t ngx_http_rate_limit_target_resolve(
+        ngx_http_request_t *r, ngx_http_rate_limit_target_t *t);
+static void ngx_http_rate_limit_target_resolve_handler(
+        ngx_resolver_ctx_t *rctx);
+static void ngx_http_rate_limit_target_set_addrs(
+        ngx_http_rate_limit_target_t *t, ngx_addr_t *addrs, ngx_uint_t n);
+static ngx_int_t ngx_http_rate_limit_target_init_peer(
+        ngx_http_request_t *r, ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_rate_limit_target_get_peer(ngx_peer_connection_t *pc,
+                                                     void *data);
+static void ngx_http_rate_limit_target_free_peer(ngx_peer_connection_t *pc,
+                                                 void *data, ngx_uint_t state);
+#if (NGX_HTTP_SSL)
+static ngx_int_t ngx_http_rate_limit_target_set_session(
+        ngx_peer_connection_t *pc, void *data);
+static void ngx_http_rate_limit_target_save_session(ngx_peer_connection_t *pc,
+                                                    void *data);
+#endif
+static void ngx_http_rate_limit_target_idle(
+        ngx_http_rate_limit_target_item_t *item);
+static void ngx_http_rate_limit_target_idle_handler(ngx_event_t *ev);
+static void ngx_http_rate_limit_target_close(
+        ngx_http_rate_limit_target_item_t *item);
+static void ngx_http_rate_limit_target_dummy_handler(ngx_event_t *ev);
+static void ngx_http_rate_limit_target_wake_handler(ngx_event_t *ev);
+static void ngx_http_rate_limit_target_cleanup(void *data);
+
+static ngx_rbtree_t      ngx_http_rate_limit_targets;
+static ngx_rbtree_node_t ngx_http_rate_limit_targets_sentinel;
+
+char *
+ngx_http_rate_limit_target_keepalive(ngx_conf_t *cf, ngx_command_t *cmd,
+                                     void *conf)
+{
+    ngx_http_rate_limit_main_conf_t *rlmcf = conf;
+
+    ngx_str_t  *value, s;
+    ngx_int_t   n;
+    ngx_msec_t  timeout;
+
+    if (rlmcf->target_keepalive != NGX_CONF_UNSET_UINT) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    n = ngx_atoi(value[1].data, value[1].len);
+    if (n == NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid number of connections \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    timeout = 60000;
+
+    if (cf->args->nelts == 3) {
+
+        if (ngx_strncmp(value[2].data, "timeout=", 8) != 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+
+        s.len = value[2].len - 8;
+        s.data = value[2].data + 8;
+
+        timeout = ngx_parse_time(&s, 0);
+        if (timeout == (ngx_msec_t) NGX_ERROR || timeout == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid timeout time \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    rlmcf->target_keepalive = n;
+    rlmcf->target_timeout = timeout;
+
+    return NGX_CONF_OK;
+}
+
+ngx_int_t
+ngx_http_rate_limit_target_init_process(ngx_cycle_t *cycle)
+{
+    ngx_http_rate_limit_main_conf_t *rlmcf;
+
+    ngx_rbtree_init(&ngx_http_rate_limit_targets,
+                    &ngx_http_rate_limit_targets_sentinel,
+                    ngx_str_rbtree_insert_value);
+
+    rlmcf = ngx_http_cycle_get_module_main_conf(cycle,
+                                                ngx_http_rate_limit_module);
+
+    if (rlmcf == NULL) {
+        return NGX_OK;
+    }
+
+    ngx_conf_init_uint_value(rlmcf->target_keepalive, 16);
+    ngx_conf_init_msec_value(rlmcf->target_timeout, 60000);
+
+    return NGX_OK;
+}
+
+/*
+ * Find the upstream for a host:port target that is not the name of an
+ * upstream block. Returns NGX_OK with *us set, NGX_AGAIN when the request
+ * waits for the resolver, or NGX_ERROR.
+ */
+ngx_int_t
+ngx_http_rate_limit_target(ngx_http_request_t *r,
+                           ngx_http_rate_limit_ctx_t *ctx, ngx_str_t *target,
+                           ngx_http_upstream_srv_conf_t **us)
+{
+    uint32_t                      hash;
+    ngx_pool_cleanup_t           *cln;
+    ngx_http_rate_limit_target_t *t;
+
+    hash = ngx_crc32_short(target->data, target->len);
+
+    t = (ngx_http_rate_limit_target_t *) ngx_str_rbtree_lookup(
+            &ngx_http_rate_limit_targets, target, hash);
+
+    if (t == NULL) {
+        t = ngx_http_rate_limit_target_create(r, target, hash);
+        if (t == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    if (!t->resolving && t->expires <= ngx_time()) {
+
+        /* a failure leaves the last known addresses in use */
+        (void) ngx_http_rate_limit_target_resolve(r, t);
+    }
+
+    if (t->naddrs) {
+        /* while a new answer is on its way, the previous one is used */
+        *us = &t->upstream;
+        return NGX_OK;
+    }
+
+    if (!t->resolving) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "rate limit: no addresses for \"%V\"", target);
+        return NGX_ERROR;
+    }
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_http_rate_limit_target_cleanup;
+    cln->data = ctx;
+
+    ctx->wake.handler = ngx_http_rate_limit_target_wake_handler;
+    ctx->wake.data = r;
+    ctx->wake.log = r->connection->log;
+
+    ctx->target = t;
+    ngx_queue_insert_tail(&t->waiters, &ctx->target_queue);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "rate limit: waiting for \"%V\" to be resolved", target);
+
+    ngx_http_set_ctx(r, ctx, ngx_http_rate_limit_module);
+
+    /* Reference: ngx_http_limit_req_handler */
+    r->read_event_handler = ngx_http_test_reading;
+    r->write_event_handler = ngx_http_core_run_phases;
+
+    return NGX_AGAIN;
+}
+
+static ngx_http_rate_limit_target_t *
+ngx_http_rate_limit_target_create(ngx_http_request_t *r, ngx_str_t *name,
+                                  uint32_t hash)
+{
+    u_char                          *p;
+    ngx_url_t                        url;
+    ngx_uint_t                       i;
+    ngx_http_rate_limit_target_t    *t;
+    ngx_http_rate_limit_main_conf_t *rlmcf;
+
+    rlmcf = ngx_http_get_module_main_conf(r, ngx_http_rate_limit_module);
+
+    t = ngx_pcalloc(ngx_cycle->pool,
+                    sizeof(ngx_http_rate_limit_target_t) + name->len);
+    if (t == NULL) {
+        return NULL;
+    }
+
+    p = (u_char *) t + sizeof(ngx_http_rate_limit_target_t);
+    ngx_memcpy(p, name->data, name->len);
+
+    ngx_memzero(&url, sizeof(ngx_url_t));
+
+    url.url.len = name->len;
+    url.url.data = p;
+    url.default_port = 6379;
+    url.no_resolve = 1;
+
+    if (ngx_parse_url(r->pool, &url) != NGX_OK) {
+        if (url.err) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "rate limit: %s in \"rate_limit_pass\" target "
+                          "\"%V\"", url.err, name);
+        }
+
+        return NULL;
+    }
+
+    t->sn.node.key = hash;
+    t->sn.str = url.url;
+
+    t->host = url.host;
+    t->port = url.port;
+
+    t->upstream.host = url.host;
+    t->upstream.port = url.port;
+    t->upstream.peer.init = ngx_http_rate_limit_target_init_peer;
+    t->upstream.peer.data = t;
+
+    ngx_queue_init(&t->waiters);
+    ngx_queue_init(&t->cache);
+    ngx_queue_init(&t->free);
+
+    t->timeout = rlmcf->target_timeout;
+
+    if (rlmcf->target_keepalive) {
+        t->items = ngx_pcalloc(ngx_cycle->pool,
+                               rlmcf->target_keepalive *
+                                   sizeof(ngx_http_rate_limit_target_item_t));
+        if (t->items == NULL) {
+            return NULL;
+        }
+
+        for (i = 0; i < rlmcf->target_keepalive; i++) {
+            t->items[i].target = t;
+            ngx_queue_insert_tail(&t->free, &t->items[i].queue);
+        }
+    }
+
+    /* a unix socket has nothing to resolve */
+    if (url.naddrs) {
+        ngx_http_rate_limit_target_set_addrs(t, url.addrs, url.naddrs);
+        t->expires = NGX_MAX_TIME_T_VALUE;
+    }
+
+    ngx_rbtree_insert(&ngx_http_rate_limit_targets, &t->sn.node);
+
+    return t;
+}
+
+/* Reference: ngx_http_upstream_init_request */
+static ngx_int_t
+ngx_http_rate_limit_target_resolve(ngx_http_request_t *r,
+                                   ngx_http_rate_limit_target_t *t)
+{
+    ngx_resolver_ctx_t       *rctx, temp;
+    ngx_http_core_loc_conf_t *clcf;
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    temp.name = t->host;
+
+    rctx = ngx_resolve_start(clcf->resolver, &temp);
+    if (rctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (rctx == NGX_NO_RESOLVER) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "rate limit: no resolver defined to resolve %V",
+                      &t->host);
+        return NGX_ERROR;
+    }
+
+    rctx->name = t->host;
+    rctx->handler = ngx_http_rate_limit_target_resolve_handler;
+    rctx->data = t;
+    rctx->timeout = clcf->resolver_timeout;
+
+    t->resolving = 1;
+
+    /* an address, or an answer in the cache, is handled right away */
+    if (ngx_resolve_name(rctx) != NGX_OK) {
+        t->resolving = 0;
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+static void
+ngx_http_rate_limit_target_resolve_handler(ngx_resolver_ctx_t *rctx)
+{
+    ngx_http_rate_limit_target_t *t = rctx->data;
+
+    ngx_queue_t               *q;
+    ngx_http_rate_limit_ctx_t *ctx;
+
+    t->resolving = 0;
+
+    if (rctx->state) {
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                      "rate limit: %V could not be resolved (%i: %s)",
+                      &rctx->name, rctx->state,
+                      ngx_resolver_strerror(rctx->state));
+
+        /* the last known addresses stay, asked again in a second */
+        t->expires = ngx_time() + 1;
+
+        goto done;
+    }
+
+    ngx_http_rate_limit_target_set_addrs(t, rctx->addrs, rctx->naddrs);
+
+    if (rctx->quick) {
+        t->expires = NGX_MAX_TIME_T_VALUE;
+
+#if defined(nginx_version) && nginx_version >= 1027003
+    } else if (rctx->valid) {
+        /* the TTL of the answer, or the valid= of the resolver directive */
+        t->expires = rctx->valid;
+#endif
+
+    } else {
+        /* asked every second, answered from the cache of the resolver */
+        t->expires = ngx_time() + 1;
+    }
+
+done:
+
+    ngx_resolve_name_done(rctx);
+
+    while (!ngx_queue_empty(&t->waiters)) {
+        q = ngx_queue_head(&t->waiters);
+        ngx_queue_remove(q);
+
+        ctx = ngx_queue_data(q, ngx_http_rate_limit_ctx_t, target_queue);
+
+        ctx->target = NULL;
+        ctx->resolved = 1;
+
+        ngx_post_event(&ctx->wake, &ngx_posted_events);
+    }
+}
+
+static void
+ngx_http_rate_limit_target_set_addrs(ngx_http_rate_limit_target_t *t,
+                                     ngx_addr_t *addrs, ngx_uint_t n)
+{
+    ngx_uint_t                         i, j;
+    ngx_queue_t                       *q, *next;
+    ngx_http_rate_limit_target_addr_t *addr;
+    ngx_http_rate_limit_target_item_t *item;
+
+    n = ngx_min(n, NGX_HTTP_RATE_LIMIT_TARGET_ADDRS);
+
+    for (i = 0; i < n; i++) {
+        addr = &t->addrs[i];
+
+        addr->socklen = addrs[i].socklen;
+        ngx_memcpy(&addr->sockaddr, addrs[i].sockaddr, addr->socklen);
+
+        if (addr->sockaddr.sockaddr.sa_family != AF_UNIX) {
+            ngx_inet_set_port(&addr->sockaddr.sockaddr, t->port);
+        }
+
+        addr->name.data = addr->name_data;
+        addr->name.len = ngx_sock_ntop(&addr->sockaddr.sockaddr,
+                                       addr->socklen, addr->name_data,
+                                       NGX_SOCKADDR_STRLEN, 1);
+    }
+
+    t->naddrs = n;
+
+    /* idle connections to an address that is gone are closed */
+
+    for (q = ngx_queue_head(&t->cache); q != ngx_queue_sentinel(&t->cache);
+         q = next) {
+        next = ngx_queue_next(q);
+        item = ngx_queue_data(q, ngx_http_rate_limit_target_item_t, queue);
+
+        for (j = 0; j < n; j++) {
+            if (ngx_memn2cmp((u_char *) &item->sockaddr,
+                             (u_char *) &t->addrs[j].sockaddr, item->socklen,
+                             t->addrs[j].socklen) == 0) {
+                break;
+            }
+        }
+
+        if (j == n) {
+            ngx_http_rate_limit_target_close(item);
+        }
+    }
+}
+
+static ngx_int_t
+ngx_http_rate_limit_target_init_peer(ngx_http_request_t *r,
+                                     ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_http_upstream_t                    *u;
+    ngx_http_rate_limit_target_t           *t;
+    ngx_http_rate_limit_target_peer_data_t *pd;
+
+    t = us->peer.data;
+    u = r->upstream;
+
+    pd = ngx_palloc(r->pool, sizeof(ngx_http_rate_limit_target_peer_data_t));
+    if (pd == NULL) {
+        return NGX_ERROR;
+    }
+
+    pd->target = t;
+    pd->upstream = u;
+
+    u->peer.data = pd;
+    u->peer.get = ngx_http_rate_limit_target_get_peer;
+    u->peer.free = ngx_http_rate_limit_target_free_peer;
+    u->peer.tries = t->naddrs;
+
+#if (NGX_HTTP_SSL)
+    u->peer.set_session = ngx_http_rate_limit_target_set_session;
+    u->peer.save_session = ngx_http_rate_limit_target_save_session;
+#endif
+
+    return ngx_http_rate_limit_handshake_wrap(r);
+}
+
+/* Reference: ngx_http_upstream_get_keepalive_peer */
+static ngx_int_t
+ngx_http_rate_limit_target_get_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_rate_limit_target_peer_data_t *pd = data;
+
+    ngx_queue_t                       *q;
+    ngx_connection_t                  *c;
+    ngx_http_rate_limit_target_t      *t;
+    ngx_http_rate_limit_target_addr_t *addr;
+    ngx_http_rate_limit_target_item_t *item;
+
+    t = pd->target;
+
+    if (t->naddrs == 0) {
+        return NGX_BUSY;
+    }
+
+    addr = &t->addrs[t->next++ % t->naddrs];
+
+    pd->socklen = addr->socklen;
+    ngx_memcpy(&pd->sockaddr, &addr->sockaddr, addr->socklen);
+
+    pd->name.len = addr->name.len;
+    pd->name.data = pd->name_data;
+    ngx_memcpy(pd->name_data, addr->name.data, addr->name.len);
+
+    pc->sockaddr = &pd->sockaddr.sockaddr;
+    pc->socklen = pd->socklen;
+    pc->name = &pd->name;
+
+    pc->cached = 0;
+    pc->connection = NULL;
+
+    for (q = ngx_queue_head(&t->cache); q != ngx_queue_sentinel(&t->cache);
+         q = ngx_queue_next(q)) {
+        item = ngx_queue_data(q, ngx_http_rate_limit_target_item_t, queue);
+
+        if (ngx_memn2cmp((u_char *) &item->sockaddr, (u_char *) pc->sockaddr,
+                         item->socklen, pc->socklen) == 0) {
+            goto found;
+        }
+    }
+
+    return NGX_OK;
+
+found:
+
+    ngx_queue_remove(q);
+    ngx_queue_insert_head(&t->free, q);
+
+    c = item->connection;
+
+    item->connection = NULL;
+
+    c->idle = 0;
+    c->sent = 0;
+    c->data = NULL;
+    c->log = pc->log;
+    c->read->log = pc->log;
+    c->write->log = pc->log;
+
+    if (c->pool) {
+        c->pool->log = pc->log;
+    }
+
+    if (c->read->timer_set) {
+        ngx_del_timer(c->read);
+    }
+
+    pc->connection = c;
+    pc->cached = 1;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "rate limit: get cached connection %p to %V", c,
+                   pc->name);
+
+    return NGX_DONE;
+}
+
+/* Reference: ngx_http_upstream_free_keepalive_peer */
+static void
+ngx_http_rate_limit_target_free_peer(ngx_peer_connection_t *pc, void *data,
+                                     ngx_uint_t state)
+{
+    ngx_http_rate_limit_target_peer_data_t *pd = data;
+
+    ngx_queue_t                       *q;
+    ngx_connection_t                  *c;
+    ngx_http_upstream_t               *u;
+    ngx_http_rate_limit_target_t      *t;
+    ngx_http_rate_limit_target_item_t *item;
+
+    t = pd->target;
+    u = pd->upstream;
+    c = pc->connection;
+
+    if (t->items == NULL) {
+        goto invalid;
+    }
+
+    if (state & NGX_PEER_FAILED || c == NULL || c->read->eof ||
+        c->read->error || c->read->timedout || c->write->error ||
+        c->write->timedout) {
+        goto invalid;
+    }
+
+    if (!u->keepalive || ngx_terminate || ngx_exiting) {
+        goto invalid;
+    }
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        goto invalid;
+    }
+
+    if (ngx_queue_empty(&t->free)) {
+        /* the connection idle for the longest time makes room */
+        q = ngx_queue_last(&t->cache);
+        item = ngx_queue_data(q, ngx_http_rate_limit_target_item_t, queue);
+
+        ngx_http_rate_limit_target_close(item);
+    }
+
+    q = ngx_queue_head(&t->free);
+    ngx_queue_remove(q);
+
+    item = ngx_queue_data(q, ngx_http_rate_limit_target_item_t, queue);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "rate limit: keep connection %p", c);
+
+    if (c->read->timer_set) {
+        ngx_del_timer(c->read);
+    }
+
+    if (c->write->timer_set) {
+        ngx_del_timer(c->write);
+    }
+
+    c->read->delayed = 0;
+
+    item->connection = c;
+    item->socklen = pc->socklen;
+    ngx_memcpy(&item->sockaddr, pc->sockaddr, pc->socklen);
+
+    pc->connection = NULL;
+
+    ngx_http_rate_limit_target_idle(item);
+
+invalid:
+
+    if (pc->tries) {
+        pc->tries--;
+    }
+}
+
+#if (NGX_HTTP_SSL)
+
+static ngx_int_t
+ngx_http_rate_limit_target_set_session(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_rate_limit_target_peer_data_t *pd = data;
+
+    if (pd->target->ssl_session == NULL) {
+        return NGX_OK;
+    }
+
+    return ngx_ssl_set_session(pc->connection, pd->target->ssl_session);
+}
+
+static void
+ngx_http_rate_limit_target_save_session(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_rate_limit_target_peer_data_t *pd = data;
+
+    ngx_ssl_session_t            *session;
+    ngx_http_rate_limit_target_t *t;
+
+    t = pd->target;
+
+    session = ngx_ssl_get_session(pc->connection);
+
+    if (session == NULL) {
+        return;
+    }
+
+    if (t->ssl_session) {
+        ngx_ssl_free_session(t->ssl_session);
+    }
+
+    t->ssl_session = session;
+}
+
+#endif
+
+static void
+ngx_http_rate_limit_target_idle(ngx_http_rate_limit_target_item_t *item)
+{
+    ngx_connection_t *c;
+
+    c = item->connection;
+
+    ngx_queue_insert_head(&item->target->cache, &item->queue);
+
+    c->idle = 1;
+    c->data = item;
+    c->log = ngx_cycle->log;
+    c->read->log = ngx_cycle->log;
+    c->write->log = ngx_cycle->log;
+
+    if (c->pool) {
+        c->pool->log = ngx_cycle->log;
+    }
+
+    c->read->handler = ngx_http_rate_limit_target_idle_handler;
+    c->write->handler = ngx_http_rate_limit_target_dummy_handler;
+
+    ngx_add_timer(c->read, item->target->timeout);
+
+    if (c->read->ready) {
+        ngx_http_rate_limit_target_idle_handler(c->read);
+    }
+}
+
+/* Reference: ngx_http_upstream_keepalive_close_handler */
+static void
+ngx_http_rate_limit_target_idle_handler(ngx_event_t *ev)
+{
+    int               n;
+    char              buf[1];
+    ngx_connection_t *c;
+
+    c = ev->data;
+
+    if (c->close || ev->timedout) {
+        goto close;
+    }
+
+    n = recv(c->fd, buf, 1, MSG_PEEK);
+
+    if (n == -1 && ngx_socket_errno == NGX_EAGAIN) {
+        ev->ready = 0;
+
+        if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+            goto close;
+        }
+
+        return;
+    }
+
+close:
+
+    ngx_http_rate_limit_target_close(c->data);
+}
+
+static void
+ngx_http_rate_limit_target_close(ngx_http_rate_limit_target_item_t *item)
+{
+    ngx_connection_t *c;
+
+    c = item->connection;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "rate limit: close cached connection %p", c);
+
+    ngx_queue_remove(&item->queue);
+
+#if (NGX_HTTP_SSL)
+    if (c->ssl) {
+        /* a quiet shutdown, which never waits */
+        c->ssl->no_wait_shutdown = 1;
+        c->ssl->no_send_shutdown = 1;
+
+        (void) ngx_ssl_shutdown(c);
+    }
+#endif
+
+    if (c->pool) {
+        ngx_destroy_pool(c->pool);
+    }
+
+    ngx_close_connection(c);
+
+    item->connection = NULL;
+
+    ngx_queue_insert_tail(&item->target->free, &item->queue);
+}
+
+static void
+ngx_http_rate_limit_target_dummy_handler(ngx_event_t *ev)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "rate limit: target dummy handler");
+}
+
+/* Reference: ngx_http_limit_req_delay */
+static void
+ngx_http_rate_limit_target_wake_handler(ngx_event_t *ev)
+{
+    ngx_connection_t   *c;
+    ngx_http_request_t *r;
+
+    r = ev->data;
+    c = r->connection;
+
+    ngx_http_set_log_request(c->log, r);
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "rate limit: target resolved");
+
+    r->read_event_handler = ngx_http_block_reading;
+    r->write_event_handler = ngx_http_core_run_phases;
+
+    ngx_http_core_run_phases(r);
+
+    ngx_http_run_posted_requests(c);
+}
+
+static void
+ngx_http_rate_limit_target_cleanup(void *data)
+{
+    ngx_http_rate_limit_ctx_t *ctx = data;
+
+    if (ctx->target) {
+        ngx_queue_remove(&ctx->target_queue);
+        ctx->target = NULL;
+    }
+
+    if (ctx->wake.posted) {
+        ngx_delete_posted_event(&ctx->wake);
+    }
+}
@@ -0,0 +1,14 @@
+#ifndef NGX_HTTP_RATE_LIMIT_TARGET_H
+#define NGX_HTTP_RATE_LIMIT_TARGET_H
+
+#include "ngx_http_rate_limit_module.h"
+
+char *ngx_http_rate_limit_target_keepalive(ngx_conf_t *cf, ngx_command_t *cmd,
+                                           void *conf);
+ngx_int_t ngx_http_rate_limit_target(ngx_http_request_t *r,
+                                     ngx_http_rate_limit_ctx_t *ctx,
+                                     ngx_str_t *target,
+                                     ngx_http_upstream_srv_conf_t **us);
+ngx_int_t ngx_http_rate_limit_target_init_process(ngx_cycle_t *cycle);
+
+#endif /* NGX_HTTP_RATE_LIMIT_TARGET_H */
@@ -1,4 +1,6 @@
 #include "ngx_http_rate_limit_upstream.h"
+#include "ngx_http_rate_limit_module.h"
+#include "ngx_rate_limit_redis.h"
 
 /* Reference: ngx_http_upstream_finalize_request */
 void
@@ -6,6 +8,8 @@ ngx_http_rate_limit_finalize_upstream_request(ngx_http_request_t *r,
                                               ngx_http_upstream_t *u,
                                               ngx_int_t rc)
 {
+    ngx_http_rate_limit_ctx_t *ctx;
+
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "finalize http rate limit request: %i", rc);
 
@@ -48,6 +52,13 @@ ngx_http_rate_limit_finalize_upstream_request(ngx_http_request_t *r,
         ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                        "close redis connection: %d", u->peer.connection->fd);
 
+#if (NGX_HTTP_SSL)
+        if (u->peer.connection->ssl) {
+            u->peer.connection->ssl->no_wait_shutdown = 1;
+            (void) ngx_ssl_shutdown(u->peer.connection);
+        }
+#endif
+
         if (u->peer.connection->pool) {
             ngx_destroy_pool(u->peer.connection->pool);
         }
@@ -64,61 +75,21 @@ ngx_http_rate_limit_finalize_upstream_request(ngx_http_request_t *r,
         return;
     }
 
-    r->connection->log->action = "sending to client";
-
-    ngx_http_finalize_request(r, rc);
-
-    ngx_http_core_run_phases(r);
-}
-
-/* Reference: ngx_http_upstream_test_connect */
-static ngx_int_t
-ngx_http_rate_limit_test_connect(ngx_connection_t *c)
-{
-    int       err;
-    socklen_t len;
-
-#if (NGX_HAVE_KQUEUE)
-
-    if (ngx_event_flags & NGX_USE_KQUEUE_EVENT) {
-        if (c->write->pending_eof || c->read->pending_eof) {
-            if (c->write->pending_eof) {
-                err = c->write->kq_errno;
-
-            } else {
-                err = c->read->kq_errno;
-            }
+    if (rc != 0 && rc != NGX_DONE) {
+        ctx = ngx_http_get_module_ctx(r, ngx_http_rate_limit_module);
 
-            c->log->action = "connecting to redis";
-            (void) ngx_connection_error(
-                c, err, "kevent() reported that connect() failed");
-            return NGX_ERROR;
+        if (ctx != NULL && ctx->replica) {
+            /* not for the client, the phase handler asks the primary */
+            ctx->status = NGX_HTTP_BAD_GATEWAY;
+            rc = NGX_DONE;
         }
+    }
 
-    } else
-#endif
-    {
-        err = 0;
-        len = sizeof(int);
-
-        /*
-         * BSDs and Linux return 0 and set a pending error in err
-         * Solaris returns -1 and sets errno
-         */
-
-        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len) ==
-            -1) {
-            err = ngx_socket_errno;
-        }
+    r->connection->log->action = "sending to client";
 
-        if (err) {
-            c->log->action = "connecting to redis";
-            (void) ngx_connection_error(c, err, "connect() failed");
-            return NGX_ERROR;
-        }
-    }
+    ngx_http_finalize_request(r, rc);
 
-    return NGX_OK;
+    ngx_http_core_run_phases(r);
 }
 
 /* Reference: ngx_http_upstream_process_non_buffered_request */
@@ -344,7 +315,7 @@ ngx_http_rate_limit_rev_handler(ngx_http_request_t *r, ngx_http_upstream_t *u)
         return;
     }
 
-    if (!u->request_sent && ngx_http_rate_limit_test_connect(c) != NGX_OK) {
+    if (!u->request_sent && ngx_rate_limit_test_connect(c) != NGX_OK) {
         /* Ensure u->reinit_request always gets called for upstream_next */
         /*u->request_sent = 1;
 
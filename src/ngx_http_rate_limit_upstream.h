@@ -3,6 +3,9 @@
 
 #include <ngx_http.h>
 
+void ngx_http_rate_limit_finalize_upstream_request(ngx_http_request_t *r,
+                                                   ngx_http_upstream_t *u,
+                                                   ngx_int_t rc);
 void ngx_http_rate_limit_rev_handler(ngx_http_request_t *r,
                                      ngx_http_upstream_t *u);
 
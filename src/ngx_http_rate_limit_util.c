@@ -1,6 +1,7 @@
 #include "ngx_http_rate_limit_util.h"
-
-static size_t ngx_get_num_size(uint64_t i);
+#include "ngx_http_rate_limit_adaptive.h"
+#include "ngx_http_rate_limit_backend.h"
+#include "ngx_http_rate_limit_policy.h"
 
 ngx_http_upstream_srv_conf_t *
 ngx_http_rate_limit_upstream_add(ngx_http_request_t *r, ngx_url_t *url)
@@ -48,24 +49,13 @@ ngx_http_rate_limit_upstream_add(ngx_http_request_t *r, ngx_url_t *url)
     return NULL;
 }
 
-static size_t
-ngx_get_num_size(uint64_t i)
-{
-    size_t n = 0;
-
-    do {
-        i = i / 10;
-        n++;
-    } while (i > 0);
-
-    return n;
-}
-
 ngx_int_t
 ngx_http_rate_limit_build_command(ngx_http_request_t *r, ngx_buf_t **b)
 {
-    size_t                          len, arg_len;
+    size_t                          len;
     u_char                         *p;
+    ngx_time_t                     *tp;
+    ngx_rate_limit_rule_t           rule;
     ngx_http_rate_limit_ctx_t      *ctx;
     ngx_http_rate_limit_loc_conf_t *rlcf;
 
@@ -76,128 +66,35 @@ ngx_http_rate_limit_build_command(ngx_http_request_t *r, ngx_buf_t **b)
         return NGX_ERROR;
     }
 
-    /* Accumulate buffer size. */
-    len = 0;
-
-    /* Example command:
-     * "*5\r\n$11\r\nRATER.LIMIT\r\n$7\r\nuser123\r\n$2\r\n15\r\n$2\r\n30\r\n$2\r\n60\r\n"
-     */
-
-    /*The arity of the command */
-    len += sizeof("*6") - 1;
-    len += sizeof("\r\n") - 1;
-
-    /* The length of the first argument in bytes */
-    len += sizeof("$11") - 1;
-    len += sizeof("\r\n") - 1;
-
-    /* Command name */
-    len += sizeof("RATER.LIMIT") - 1;
-    len += sizeof("\r\n") - 1;
-
-    /* <key> */
-    len += sizeof("$") - 1;
-    len += ngx_get_num_size(ctx->key.len);
-    len += sizeof("\r\n") - 1;
-    len += ctx->key.len;
-    len += sizeof("\r\n") - 1;
-
-    /* <max_burst> */
-    arg_len = ngx_get_num_size(rlcf->burst);
-    len += sizeof("$") - 1;
-    len += ngx_get_num_size(arg_len);
-    len += sizeof("\r\n") - 1;
-    len += arg_len;
-    len += sizeof("\r\n") - 1;
-
-    /* <count per period> */
-    arg_len = ngx_get_num_size(rlcf->requests);
-    len += sizeof("$") - 1;
-    len += ngx_get_num_size(arg_len);
-    len += sizeof("\r\n") - 1;
-    len += arg_len;
-    len += sizeof("\r\n") - 1;
-
-    /* <period> */
-    arg_len = ngx_get_num_size(rlcf->period);
-    len += sizeof("$") - 1;
-    len += ngx_get_num_size(arg_len);
-    len += sizeof("\r\n") - 1;
-    len += arg_len;
-    len += sizeof("\r\n") - 1;
-
-    /* [<quantity>] */
-    if (rlcf->quantity != 1) {
-        arg_len = ngx_get_num_size(rlcf->quantity);
-        len += sizeof("$") - 1;
-        len += ngx_get_num_size(arg_len);
-        len += sizeof("\r\n") - 1;
-        len += arg_len;
-        len += sizeof("\r\n") - 1;
+    rule = rlcf->rule;
+
+    /* a coalesced batch is charged at once */
+    if (ctx->quantity) {
+        rule.quantity = ctx->quantity;
     }
 
+    if (rlcf->policy_zone) {
+        ngx_http_rate_limit_policy_apply(r, &rule);
+    }
+
+    if (rlcf->adaptive_zone) {
+        ngx_http_rate_limit_adaptive_apply(rlcf->adaptive_zone, &rule);
+    }
+
+    /* the same on every node, for backends counting in fixed windows */
+    tp = ngx_timeofday();
+
+    ctx->rule = rule;
+    ctx->time = (uint64_t) tp->sec * 1000 + tp->msec;
+
+    len = rlcf->backend->command_size(ctx);
+
     *b = ngx_create_temp_buf(r->pool, len);
     if (*b == NULL) {
         return NGX_ERROR;
     }
 
-    p = (*b)->last;
-
-    *p++ = '*';
-    *p++ = rlcf->quantity != 1 ? '6' : '5';
-    *p++ = '\r';
-    *p++ = '\n';
-
-    *p++ = '$';
-    *p++ = '1';
-    *p++ = '1';
-    *p++ = '\r';
-    *p++ = '\n';
-    p = ngx_cpymem(p, "RATER.LIMIT", sizeof("RATER.LIMIT") - 1);
-    *p++ = '\r';
-    *p++ = '\n';
-
-    *p++ = '$';
-    p = ngx_sprintf(p, "%uz", ctx->key.len);
-    *p++ = '\r';
-    *p++ = '\n';
-    p = ngx_copy(p, ctx->key.data, ctx->key.len);
-    *p++ = '\r';
-    *p++ = '\n';
-
-    *p++ = '$';
-    p = ngx_sprintf(p, "%uz", ngx_get_num_size(rlcf->burst));
-    *p++ = '\r';
-    *p++ = '\n';
-    p = ngx_sprintf(p, "%d", rlcf->burst);
-    *p++ = '\r';
-    *p++ = '\n';
-
-    *p++ = '$';
-    p = ngx_sprintf(p, "%uz", ngx_get_num_size(rlcf->requests));
-    *p++ = '\r';
-    *p++ = '\n';
-    p = ngx_sprintf(p, "%d", rlcf->requests);
-    *p++ = '\r';
-    *p++ = '\n';
-
-    *p++ = '$';
-    p = ngx_sprintf(p, "%uz", ngx_get_num_size(rlcf->period));
-    *p++ = '\r';
-    *p++ = '\n';
-    p = ngx_sprintf(p, "%d", rlcf->period);
-    *p++ = '\r';
-    *p++ = '\n';
-
-    if (rlcf->quantity != 1) {
-        *p++ = '$';
-        p = ngx_sprintf(p, "%uz", ngx_get_num_size(rlcf->quantity));
-        *p++ = '\r';
-        *p++ = '\n';
-        p = ngx_sprintf(p, "%d", rlcf->quantity);
-        *p++ = '\r';
-        *p++ = '\n';
-    }
+    p = rlcf->backend->write_command((*b)->last, ctx);
 
     if (p - (*b)->pos != (ssize_t) len) {
         ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
@@ -212,34 +109,147 @@ ngx_http_rate_limit_build_command(ngx_http_request_t *r, ngx_buf_t **b)
     return NGX_OK;
 }
 
+/*
+ * Write the client address masked to the prefix length of its family, as
+ * a family byte followed by the bytes the prefix covers.
+ */
+u_char *
+ngx_http_rate_limit_address_key(ngx_http_request_t *r, u_char *p)
+{
+    u_char                         *addr;
+    ngx_uint_t                      bits, n;
+    struct sockaddr_in             *sin;
+#if (NGX_HAVE_INET6)
+    struct sockaddr_in6            *sin6;
+#endif
+    ngx_http_rate_limit_loc_conf_t *rlcf;
+
+    rlcf = ngx_http_get_module_loc_conf(r, ngx_http_rate_limit_module);
+
+    switch (r->connection->sockaddr->sa_family) {
+
+    case AF_INET:
+        sin = (struct sockaddr_in *) r->connection->sockaddr;
+        addr = (u_char *) &sin->sin_addr.s_addr;
+        bits = rlcf->address_ipv4;
+        *p++ = 4;
+        break;
+
+#if (NGX_HAVE_INET6)
+    case AF_INET6:
+        sin6 = (struct sockaddr_in6 *) r->connection->sockaddr;
+        addr = sin6->sin6_addr.s6_addr;
+
+        if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+            addr += 12;
+            bits = rlcf->address_ipv4;
+            *p++ = 4;
+            break;
+        }
+
+        bits = rlcf->address_ipv6;
+        *p++ = 6;
+        break;
+#endif
+
+    default: /* AF_UNIX */
+        *p++ = 0;
+        return p;
+    }
+
+    n = bits / 8;
+    p = ngx_cpymem(p, addr, n);
+
+    if (bits % 8) {
+        *p++ = addr[n] & (u_char) (0xff << (8 - bits % 8));
+    }
+
+    return p;
+}
+
+/*
+ * The key as it is logged. The address of rate_limit_address is printed as
+ * a network, "192.0.2.0/24", behind the prefix; other keys are kept as is.
+ */
 ngx_int_t
-ngx_set_custom_header(ngx_http_request_t *r, ngx_str_t *key, ngx_uint_t value)
+ngx_http_rate_limit_log_key(ngx_http_request_t *r, ngx_str_t *key,
+                            ngx_str_t *text)
 {
-    ngx_table_elt_t *h;
+    u_char                         *p, *addr;
+    u_char                          bytes[16];
+    size_t                          skip;
+    ngx_uint_t                      bits;
+    ngx_http_rate_limit_loc_conf_t *rlcf;
 
-    h = ngx_list_push(&r->headers_out.headers);
-    if (h == NULL) {
-        return NGX_ERROR;
+    rlcf = ngx_http_get_module_loc_conf(r, ngx_http_rate_limit_module);
+
+    skip = rlcf->prefix.len ? rlcf->prefix.len + 1 : 0;
+
+    if (!rlcf->address || key->len <= skip) {
+        *text = *key;
+        return NGX_OK;
     }
 
-    /* Mark the header as not deleted. */
-    h->hash = 1;
-    h->key = *key;
+    addr = key->data + skip;
 
-    h->value.data = ngx_pnalloc(r->pool, ngx_get_num_size(value));
-    if (h->value.data == NULL) {
-        h->hash = 0;
+    text->data = ngx_pnalloc(r->pool, skip + NGX_INET6_ADDRSTRLEN +
+                                          sizeof("/128") - 1);
+    if (text->data == NULL) {
         return NGX_ERROR;
     }
 
-    h->value.len = ngx_sprintf(h->value.data, "%ui", value) - h->value.data;
+    p = ngx_cpymem(text->data, key->data, skip);
+
+    /* the bytes the prefix does not cover are zero */
+    ngx_memzero(bytes, sizeof(bytes));
+    ngx_memcpy(bytes, addr + 1, ngx_min(key->len - skip - 1, sizeof(bytes)));
+
+    switch (addr[0]) {
+
+    case 4:
+        bits = rlcf->address_ipv4;
+        p += ngx_inet_ntop(AF_INET, bytes, p, NGX_INET_ADDRSTRLEN);
+        break;
+
+#if (NGX_HAVE_INET6)
+    case 6:
+        bits = rlcf->address_ipv6;
+        p += ngx_inet_ntop(AF_INET6, bytes, p, NGX_INET6_ADDRSTRLEN);
+        break;
+#endif
 
-    h->lowcase_key = ngx_pnalloc(r->pool, h->key.len);
-    if (h->lowcase_key == NULL) {
+    default: /* AF_UNIX */
+        p = ngx_cpymem(p, "unix:", sizeof("unix:") - 1);
+        text->len = p - text->data;
+        return NGX_OK;
+    }
+
+    p = ngx_sprintf(p, "/%ui", bits);
+
+    text->len = p - text->data;
+
+    return NGX_OK;
+}
+
+/* The value is printed to buf, which has room for NGX_INT_T_LEN */
+ngx_int_t
+ngx_set_custom_header(ngx_http_request_t *r,
+                      ngx_http_rate_limit_header_t *header, u_char *buf,
+                      ngx_uint_t value)
+{
+    ngx_table_elt_t *h;
+
+    h = ngx_list_push(&r->headers_out.headers);
+    if (h == NULL) {
         return NGX_ERROR;
     }
 
-    ngx_strlow(h->lowcase_key, h->key.data, h->key.len);
+    h->hash = header->hash;
+    h->key = header->key;
+    h->lowcase_key = header->lowcase_key;
+
+    h->value.data = buf;
+    h->value.len = ngx_sprintf(buf, "%ui", value) - buf;
 
     return NGX_OK;
 }
@@ -3,11 +3,25 @@
 
 #include "ngx_http_rate_limit_module.h"
 
+/* the family and at most 16 bytes of a masked address */
+#define NGX_HTTP_RATE_LIMIT_ADDRESS_LEN 17
+
+/* a response header of which the key is shared by all requests */
+typedef struct {
+    ngx_str_t   key;
+    u_char     *lowcase_key;
+    ngx_uint_t  hash;
+} ngx_http_rate_limit_header_t;
+
 ngx_http_upstream_srv_conf_t *ngx_http_rate_limit_upstream_add(
         ngx_http_request_t *r, ngx_url_t *url);
 ngx_int_t ngx_http_rate_limit_build_command(ngx_http_request_t *r,
                                             ngx_buf_t **b);
-ngx_int_t ngx_set_custom_header(ngx_http_request_t *r, ngx_str_t *key,
-                                ngx_uint_t value);
+u_char *ngx_http_rate_limit_address_key(ngx_http_request_t *r, u_char *p);
+ngx_int_t ngx_http_rate_limit_log_key(ngx_http_request_t *r, ngx_str_t *key,
+                                      ngx_str_t *text);
+ngx_int_t ngx_set_custom_header(ngx_http_request_t *r,
+                                ngx_http_rate_limit_header_t *header,
+                                u_char *buf, ngx_uint_t value);
 
 #endif /* NGX_HTTP_RATE_LIMIT_UTIL_H */
@@ -0,0 +1,81 @@
+#ifndef NGX_RATE_LIMIT_GCRA_H
+#define NGX_RATE_LIMIT_GCRA_H
+
+#include <stdint.h>
+
+/*
+ * The generic cell rate algorithm of the redis-rate-limiter module, on plain
+ * integers so that it does not depend on nginx. All times are in
+ * microseconds, the state of a key is its theoretical arrival time (TAT).
+ */
+
+typedef struct {
+    int      limited;
+    uint64_t limit;
+    uint64_t remaining;
+
+    /* until the state of the key is empty again */
+    uint64_t reset;
+
+    /* until the quantity fits, -1 if it was allowed or never fits */
+    int64_t retry_after;
+} ngx_rate_limit_gcra_t;
+
+/* The time it takes to replenish one unit */
+static inline uint64_t
+ngx_rate_limit_gcra_interval(uint64_t requests, uint64_t period)
+{
+    uint64_t interval;
+
+    interval = requests ? period / requests : period;
+
+    return interval ? interval : 1;
+}
+
+static inline void
+ngx_rate_limit_gcra(uint64_t *tat, uint64_t now, uint64_t interval,
+                    uint64_t burst, uint64_t quantity,
+                    ngx_rate_limit_gcra_t *res)
+{
+    uint64_t tolerance, increment, base, next, ttl;
+
+    tolerance = interval * (burst + 1);
+    increment = interval * quantity;
+
+    base = (*tat > now) ? *tat : now;
+    next = base + increment;
+
+    res->limit = burst + 1;
+
+    if (next > now + tolerance) {
+        res->limited = 1;
+        res->retry_after = (increment <= tolerance)
+                               ? (int64_t) (next - tolerance - now)
+                               : -1;
+        ttl = base - now;
+
+    } else {
+        res->limited = 0;
+        res->retry_after = -1;
+        ttl = next - now;
+
+        *tat = next;
+    }
+
+    res->remaining = (ttl < tolerance) ? (tolerance - ttl) / interval : 0;
+    res->reset = ttl;
+}
+
+/* Units consumed elsewhere, e.g. by another node, are charged as is */
+static inline void
+ngx_rate_limit_gcra_merge(uint64_t *tat, uint64_t now, uint64_t interval,
+                          uint64_t quantity)
+{
+    uint64_t base;
+
+    base = (*tat > now) ? *tat : now;
+
+    *tat = base + interval * quantity;
+}
+
+#endif /* NGX_RATE_LIMIT_GCRA_H */
@@ -0,0 +1,583 @@
+#include "ngx_rate_limit_redis.h"
+
+static size_t ngx_rate_limit_redis_num_arg_size(ngx_uint_t n);
+static u_char *ngx_rate_limit_redis_write_num_arg(u_char *p, ngx_uint_t n);
+static void ngx_rate_limit_redis_rate(ngx_rate_limit_rule_t *rule,
+                                      ngx_uint_t *requests,
+                                      ngx_uint_t *period);
+
+/*
+ * Parses a period into msec. A value without a unit is in seconds, as it
+ * was before periods went below a second; milliseconds take "ms".
+ */
+ngx_int_t
+ngx_rate_limit_parse_period(ngx_str_t *s)
+{
+    ngx_int_t period;
+
+    if (s->len > 2 && s->data[s->len - 2] == 'm' &&
+        s->data[s->len - 1] == 's') {
+        return ngx_parse_time(s, 0);
+    }
+
+    period = ngx_parse_time(s, 1);
+
+    if (period == NGX_ERROR || period > NGX_MAX_INT_T_VALUE / 1000) {
+        return NGX_ERROR;
+    }
+
+    return period * 1000;
+}
+
+size_t
+ngx_rate_limit_num_size(uint64_t i)
+{
+    size_t n = 0;
+
+    do {
+        i = i / 10;
+        n++;
+    } while (i > 0);
+
+    return n;
+}
+
+static size_t
+ngx_rate_limit_redis_num_arg_size(ngx_uint_t n)
+{
+    size_t len, arg_len;
+
+    arg_len = ngx_rate_limit_num_size(n);
+
+    len = sizeof("$") - 1;
+    len += ngx_rate_limit_num_size(arg_len);
+    len += sizeof("\r\n") - 1;
+    len += arg_len;
+    len += sizeof("\r\n") - 1;
+
+    return len;
+}
+
+static u_char *
+ngx_rate_limit_redis_write_num_arg(u_char *p, ngx_uint_t n)
+{
+    *p++ = '$';
+    p = ngx_sprintf(p, "%uz", ngx_rate_limit_num_size(n));
+    *p++ = '\r';
+    *p++ = '\n';
+    p = ngx_sprintf(p, "%ui", n);
+    *p++ = '\r';
+    *p++ = '\n';
+
+    return p;
+}
+
+/*
+ * RATER.LIMIT takes the period in whole seconds. One with a fraction of a
+ * second is sent in msec instead, along with a count scaled by as much: the
+ * emission interval, period / count, is all that GCRA goes by, so the
+ * limit, the burst and the reply stay the same.
+ */
+static void
+ngx_rate_limit_redis_rate(ngx_rate_limit_rule_t *rule, ngx_uint_t *requests,
+                          ngx_uint_t *period)
+{
+    if (rule->period % 1000 == 0) {
+        *requests = rule->requests;
+        *period = rule->period / 1000;
+        return;
+    }
+
+    *requests = rule->requests * 1000;
+    *period = rule->period;
+}
+
+size_t
+ngx_rate_limit_redis_command_size(ngx_str_t *key, ngx_rate_limit_rule_t *rule)
+{
+    size_t     len;
+    ngx_uint_t requests, period;
+
+    ngx_rate_limit_redis_rate(rule, &requests, &period);
+
+    /* Accumulate buffer size. */
+    len = 0;
+
+    /* Example command:
+     * "*5\r\n$11\r\nRATER.LIMIT\r\n$7\r\nuser123\r\n$2\r\n15\r\n$2\r\n30\r\n$2\r\n60\r\n"
+     */
+
+    /*The arity of the command */
+    len += sizeof("*6") - 1;
+    len += sizeof("\r\n") - 1;
+
+    /* The length of the first argument in bytes */
+    len += sizeof("$11") - 1;
+    len += sizeof("\r\n") - 1;
+
+    /* Command name */
+    len += sizeof("RATER.LIMIT") - 1;
+    len += sizeof("\r\n") - 1;
+
+    /* <key> */
+    len += sizeof("$") - 1;
+    len += ngx_rate_limit_num_size(key->len);
+    len += sizeof("\r\n") - 1;
+    len += key->len;
+    len += sizeof("\r\n") - 1;
+
+    /* <max_burst> */
+    len += ngx_rate_limit_redis_num_arg_size(rule->burst);
+
+    /* <count per period> */
+    len += ngx_rate_limit_redis_num_arg_size(requests);
+
+    /* <period> */
+    len += ngx_rate_limit_redis_num_arg_size(period);
+
+    /* [<quantity>] */
+    if (rule->quantity != 1) {
+        len += ngx_rate_limit_redis_num_arg_size(rule->quantity);
+    }
+
+    return len;
+}
+
+u_char *
+ngx_rate_limit_redis_write_command(u_char *p, ngx_str_t *key,
+                                   ngx_rate_limit_rule_t *rule)
+{
+    ngx_uint_t requests, period;
+
+    ngx_rate_limit_redis_rate(rule, &requests, &period);
+
+    *p++ = '*';
+    *p++ = rule->quantity != 1 ? '6' : '5';
+    *p++ = '\r';
+    *p++ = '\n';
+
+    *p++ = '$';
+    *p++ = '1';
+    *p++ = '1';
+    *p++ = '\r';
+    *p++ = '\n';
+    p = ngx_cpymem(p, "RATER.LIMIT", sizeof("RATER.LIMIT") - 1);
+    *p++ = '\r';
+    *p++ = '\n';
+
+    *p++ = '$';
+    p = ngx_sprintf(p, "%uz", key->len);
+    *p++ = '\r';
+    *p++ = '\n';
+    p = ngx_copy(p, key->data, key->len);
+    *p++ = '\r';
+    *p++ = '\n';
+
+    p = ngx_rate_limit_redis_write_num_arg(p, rule->burst);
+    p = ngx_rate_limit_redis_write_num_arg(p, requests);
+    p = ngx_rate_limit_redis_write_num_arg(p, period);
+
+    if (rule->quantity != 1) {
+        p = ngx_rate_limit_redis_write_num_arg(p, rule->quantity);
+    }
+
+    return p;
+}
+
+ngx_int_t
+ngx_rate_limit_redis_parse_reply(ngx_rate_limit_reply_t *rp, ngx_buf_t *b)
+{
+    u_char ch, *p;
+
+    enum {
+        sw_start = 0,
+        sw_arity,
+        sw_CRLF1,
+        sw_ARG1,
+        sw_CRLF2,
+        sw_ARG2,
+        sw_LF1,
+        sw_ARG3,
+        sw_LF2,
+        sw_ARG4,
+        sw_ALLOWED,
+        sw_LF3,
+        sw_ARG5,
+        sw_almost_done
+    } state;
+
+    state = rp->state;
+
+    /* Example response:
+     * "*5\r\n:0\r\n:16\r\n:15\r\n:-1\r\n:2\r\n"
+     */
+
+    for (p = b->pos; p < b->last; p++) {
+        ch = *p;
+
+        switch (state) {
+
+        case sw_start:
+            /* we are always expecting a multi bulk reply */
+            switch (ch) {
+            case '*':
+                state = sw_arity;
+                break;
+            default:
+                return NGX_ERROR;
+            }
+            break;
+
+        case sw_arity:
+            /* our bulk length must always be 5 */
+            switch (ch) {
+            case '5':
+                state = sw_CRLF1;
+                break;
+            default:
+                return NGX_ERROR;
+            }
+            break;
+
+        case sw_CRLF1:
+            switch (ch) {
+            case CR:
+                break;
+            case LF:
+                state = sw_ARG1;
+                break;
+            default:
+                return NGX_ERROR;
+            }
+            break;
+
+        case sw_ARG1:
+            /* 0 indicates the action is allowed
+             * 1 indicates that the action was limited/blocked */
+            switch (ch) {
+            case ':':
+                break;
+            case '0':
+                rp->limited = 0;
+                state = sw_CRLF2;
+                break;
+            case '1':
+                rp->limited = 1;
+                state = sw_CRLF2;
+                break;
+            default:
+                return NGX_ERROR;
+            }
+            break;
+
+        case sw_CRLF2:
+            switch (ch) {
+            case CR:
+                break;
+            case LF:
+                state = sw_ARG2;
+                break;
+            default:
+                return NGX_ERROR;
+            }
+            break;
+
+        case sw_ARG2:
+            /* X-RateLimit-Limit HTTP header */
+            if (ch == ':') {
+                break;
+            }
+
+            if (ch == CR) {
+                state = sw_LF1;
+                break;
+            }
+
+            if (ch < '0' || ch > '9') {
+                return NGX_ERROR;
+            }
+
+            rp->limit = rp->limit * 10 + (ch - '0');
+
+            break;
+
+        case sw_LF1:
+            switch (ch) {
+            case LF:
+                state = sw_ARG3;
+                break;
+            default:
+                return NGX_ERROR;
+            }
+            break;
+
+        case sw_ARG3:
+            /* X-RateLimit-Remaining HTTP header */
+            if (ch == ':') {
+                break;
+            }
+
+            if (ch == CR) {
+                state = sw_LF2;
+                break;
+            }
+
+            if (ch < '0' || ch > '9') {
+                return NGX_ERROR;
+            }
+
+            rp->remaining = rp->remaining * 10 + (ch - '0');
+
+            break;
+
+        case sw_LF2:
+            switch (ch) {
+            case LF:
+                state = sw_ARG4;
+                break;
+            default:
+                return NGX_ERROR;
+            }
+            break;
+
+        case sw_ARG4:
+            /* The number of seconds until the user should retry,
+             * and always -1 if the action was allowed. */
+            if (ch == ':') {
+                break;
+            }
+
+            if (ch == '-') {
+                state = sw_ALLOWED;
+                break;
+            }
+
+            if (ch == CR) {
+                state = sw_LF3;
+                break;
+            }
+
+            if (ch < '0' || ch > '9') {
+                return NGX_ERROR;
+            }
+
+            rp->retry_after = rp->retry_after * 10 + (ch - '0');
+
+            break;
+
+        case sw_ALLOWED:
+            switch (ch) {
+            case '1':
+                rp->retry_after = -1;
+                break;
+            case CR:
+                state = sw_LF3;
+                break;
+            default:
+                return NGX_ERROR;
+            }
+            break;
+
+        case sw_LF3:
+            switch (ch) {
+            case LF:
+                state = sw_ARG5;
+                break;
+            default:
+                return NGX_ERROR;
+            }
+            break;
+
+        case sw_ARG5:
+            /* X-RateLimit-Reset HTTP header */
+            if (ch == ':') {
+                break;
+            }
+
+            if (ch == CR) {
+                state = sw_almost_done;
+                break;
+            }
+
+            if (ch < '0' || ch > '9') {
+                return NGX_ERROR;
+            }
+
+            rp->reset = rp->reset * 10 + (ch - '0');
+
+            break;
+
+        case sw_almost_done:
+            /* End of redis response */
+            switch (ch) {
+            case LF:
+                goto done;
+            default:
+                return NGX_ERROR;
+            }
+        }
+    }
+
+    b->pos = p;
+    rp->state = state;
+
+    return NGX_AGAIN;
+
+done:
+
+    b->pos = p + 1;
+    rp->state = sw_start;
+
+    return NGX_OK;
+}
+
+/*
+ * Skips one complete reply of any type, such as the replies to AUTH, SELECT
+ * and HELLO. Returns NGX_DECLINED, with b->pos left at it, for an error.
+ */
+ngx_int_t
+ngx_rate_limit_redis_skip_reply(ngx_buf_t *b)
+{
+    u_char     *p, *lf;
+    ngx_int_t   n;
+    ngx_uint_t  pending;
+
+    p = b->pos;
+
+    /* the number of values still to come, nested ones included */
+    pending = 1;
+
+    while (pending) {
+        lf = ngx_strlchr(p, b->last, LF);
+        if (lf == NULL) {
+            return NGX_AGAIN;
+        }
+
+        if (lf - p < 2 || lf[-1] != CR) {
+            return NGX_ERROR;
+        }
+
+        pending--;
+
+        /* the length or count, "-1" is a null of RESP2 */
+        n = ngx_atoi(p + 1, lf - p - 2);
+
+        switch (*p) {
+
+        case '-':
+        case '!':
+            return NGX_DECLINED;
+
+        case '+':
+        case ':':
+        case '_':
+        case '#':
+        case ',':
+        case '(':
+            break;
+
+        case '$':
+        case '=':
+            if (n == NGX_ERROR) {
+                if (lf - p == 4 && p[1] == '-' && p[2] == '1') {
+                    break;
+                }
+
+                return NGX_ERROR;
+            }
+
+            if (b->last - lf <= n + 2) {
+                return NGX_AGAIN;
+            }
+
+            lf += n + 2;
+
+            if (*lf != LF) {
+                return NGX_ERROR;
+            }
+
+            break;
+
+        case '*':
+        case '~':
+        case '>':
+        case '%':
+        case '|':
+            if (n == NGX_ERROR) {
+                if (lf - p == 4 && p[1] == '-' && p[2] == '1') {
+                    break;
+                }
+
+                return NGX_ERROR;
+            }
+
+            /* a map has pairs, attributes precede the actual value */
+            if (*p == '%' || *p == '|') {
+                n *= 2;
+            }
+
+            pending += n + (*p == '|');
+
+            break;
+
+        default:
+            return NGX_ERROR;
+        }
+
+        p = lf + 1;
+    }
+
+    b->pos = p;
+
+    return NGX_OK;
+}
+
+/* Reference: ngx_http_upstream_test_connect */
+ngx_int_t
+ngx_rate_limit_test_connect(ngx_connection_t *c)
+{
+    int       err;
+    socklen_t len;
+
+#if (NGX_HAVE_KQUEUE)
+
+    if (ngx_event_flags & NGX_USE_KQUEUE_EVENT) {
+        if (c->write->pending_eof || c->read->pending_eof) {
+            if (c->write->pending_eof) {
+                err = c->write->kq_errno;
+
+            } else {
+                err = c->read->kq_errno;
+            }
+
+            c->log->action = "connecting to redis";
+            (void) ngx_connection_error(
+                c, err, "kevent() reported that connect() failed");
+            return NGX_ERROR;
+        }
+
+    } else
+#endif
+    {
+        err = 0;
+        len = sizeof(int);
+
+        /*
+         * BSDs and Linux return 0 and set a pending error in err
+         * Solaris returns -1 and sets errno
+         */
+
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len) ==
+            -1) {
+            err = ngx_socket_errno;
+        }
+
+        if (err) {
+            c->log->action = "connecting to redis";
+            (void) ngx_connection_error(c, err, "connect() failed");
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
@@ -0,0 +1,39 @@
+#ifndef NGX_RATE_LIMIT_REDIS_H
+#define NGX_RATE_LIMIT_REDIS_H
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+/* The parameters of a RATER.LIMIT command */
+typedef struct {
+    ngx_uint_t requests;
+    ngx_uint_t period; /* msec */
+    ngx_uint_t burst;
+    ngx_uint_t quantity;
+} ngx_rate_limit_rule_t;
+
+/* A parsed RATER.LIMIT reply */
+typedef struct {
+    /* used to parse the redis response */
+    ngx_uint_t state;
+
+    ngx_flag_t limited;
+    ngx_uint_t limit;
+    ngx_uint_t remaining;
+    ngx_uint_t reset;
+    ngx_int_t  retry_after;
+} ngx_rate_limit_reply_t;
+
+ngx_int_t ngx_rate_limit_parse_period(ngx_str_t *s);
+size_t ngx_rate_limit_num_size(uint64_t i);
+size_t ngx_rate_limit_redis_command_size(ngx_str_t *key,
+                                         ngx_rate_limit_rule_t *rule);
+u_char *ngx_rate_limit_redis_write_command(u_char *p, ngx_str_t *key,
+                                           ngx_rate_limit_rule_t *rule);
+ngx_int_t ngx_rate_limit_redis_parse_reply(ngx_rate_limit_reply_t *rp,
+                                           ngx_buf_t *b);
+ngx_int_t ngx_rate_limit_redis_skip_reply(ngx_buf_t *b);
+ngx_int_t ngx_rate_limit_test_connect(ngx_connection_t *c);
+
+#endif /* NGX_RATE_LIMIT_REDIS_H */
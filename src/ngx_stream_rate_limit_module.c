@@ -0,0 +1,777 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+
+#include "ngx_rate_limit_redis.h"
+
+typedef struct {
+    ngx_stream_complex_value_t *key;
+
+    ngx_stream_upstream_srv_conf_t *upstream;
+
+    ngx_flag_t preread;
+    ngx_uint_t status_code;
+    ngx_uint_t limit_log_level;
+    ngx_msec_t connect_timeout;
+    ngx_msec_t timeout;
+
+    ngx_str_t             prefix;
+    ngx_rate_limit_rule_t rule;
+} ngx_stream_rate_limit_srv_conf_t;
+
+typedef struct {
+    ngx_str_t key;
+
+    ngx_stream_session_t *session;
+
+    ngx_peer_connection_t peer;
+
+    ngx_buf_t *request;
+    ngx_buf_t *response;
+
+    /* flag indicating whether the rate limit has been finalized */
+    ngx_flag_t finalized;
+
+    /* the result returned to the phase engine */
+    ngx_int_t rc;
+
+    /* parsed variables from the redis response */
+    ngx_rate_limit_reply_t reply;
+} ngx_stream_rate_limit_ctx_t;
+
+static ngx_int_t ngx_stream_rate_limit_preaccess_handler(
+        ngx_stream_session_t *s);
+static ngx_int_t ngx_stream_rate_limit_preread_handler(ngx_stream_session_t *s);
+static ngx_int_t ngx_stream_rate_limit_handler(ngx_stream_session_t *s);
+static ngx_int_t ngx_stream_rate_limit_connect(
+        ngx_stream_session_t *s, ngx_stream_rate_limit_ctx_t *ctx);
+static void ngx_stream_rate_limit_write_handler(ngx_event_t *wev);
+static void ngx_stream_rate_limit_read_handler(ngx_event_t *rev);
+static void ngx_stream_rate_limit_finalize(ngx_stream_rate_limit_ctx_t *ctx,
+                                           ngx_int_t rc);
+static void ngx_stream_rate_limit_close(ngx_stream_rate_limit_ctx_t *ctx,
+                                        ngx_uint_t state);
+static void ngx_stream_rate_limit_cleanup(void *data);
+static void *ngx_stream_rate_limit_create_srv_conf(ngx_conf_t *cf);
+static char *ngx_stream_rate_limit_merge_srv_conf(ngx_conf_t *cf, void *parent,
+                                                  void *child);
+static char *ngx_stream_rate_limit(ngx_conf_t *cf, ngx_command_t *cmd,
+                                   void *conf);
+static char *ngx_stream_rate_limit_pass(ngx_conf_t *cf, ngx_command_t *cmd,
+                                        void *conf);
+static ngx_int_t ngx_stream_rate_limit_init(ngx_conf_t *cf);
+
+static ngx_conf_enum_t ngx_stream_rate_limit_log_levels[] = {
+    { ngx_string("info"), NGX_LOG_INFO },
+    { ngx_string("notice"), NGX_LOG_NOTICE },
+    { ngx_string("warn"), NGX_LOG_WARN },
+    { ngx_string("error"), NGX_LOG_ERR },
+    { ngx_null_string, 0 }
+};
+
+static ngx_conf_num_bounds_t ngx_stream_rate_limit_status_bounds = {
+    ngx_conf_check_num_bounds, 400, 599
+};
+
+static ngx_command_t ngx_stream_rate_limit_commands[] = {
+
+    { ngx_string("rate_limit"),
+      NGX_STREAM_MAIN_CONF | NGX_STREAM_SRV_CONF | NGX_CONF_TAKE1234,
+      ngx_stream_rate_limit, NGX_STREAM_SRV_CONF_OFFSET, 0, NULL },
+
+    { ngx_string("rate_limit_prefix"),
+      NGX_STREAM_MAIN_CONF | NGX_STREAM_SRV_CONF | NGX_CONF_TAKE1,
+      ngx_conf_set_str_slot, NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_rate_limit_srv_conf_t, prefix), NULL },
+
+    { ngx_string("rate_limit_quantity"),
+      NGX_STREAM_MAIN_CONF | NGX_STREAM_SRV_CONF | NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot, NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_rate_limit_srv_conf_t, rule.quantity), NULL },
+
+    { ngx_string("rate_limit_pass"),
+      NGX_STREAM_MAIN_CONF | NGX_STREAM_SRV_CONF | NGX_CONF_TAKE1,
+      ngx_stream_rate_limit_pass, NGX_STREAM_SRV_CONF_OFFSET, 0, NULL },
+
+    { ngx_string("rate_limit_preread"),
+      NGX_STREAM_MAIN_CONF | NGX_STREAM_SRV_CONF | NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot, NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_rate_limit_srv_conf_t, preread), NULL },
+
+    { ngx_string("rate_limit_log_level"),
+      NGX_STREAM_MAIN_CONF | NGX_STREAM_SRV_CONF | NGX_CONF_TAKE1,
+      ngx_conf_set_enum_slot, NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_rate_limit_srv_conf_t, limit_log_level),
+      &ngx_stream_rate_limit_log_levels },
+
+    { ngx_string("rate_limit_status"),
+      NGX_STREAM_MAIN_CONF | NGX_STREAM_SRV_CONF | NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot, NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_rate_limit_srv_conf_t, status_code),
+      &ngx_stream_rate_limit_status_bounds },
+
+    { ngx_string("rate_limit_connect_timeout"),
+      NGX_STREAM_MAIN_CONF | NGX_STREAM_SRV_CONF | NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot, NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_rate_limit_srv_conf_t, connect_timeout), NULL },
+
+    { ngx_string("rate_limit_timeout"),
+      NGX_STREAM_MAIN_CONF | NGX_STREAM_SRV_CONF | NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot, NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_rate_limit_srv_conf_t, timeout), NULL },
+
+    ngx_null_command
+};
+
+static ngx_stream_module_t ngx_stream_rate_limit_module_ctx = {
+    NULL,                       /* preconfiguration */
+    ngx_stream_rate_limit_init, /* postconfiguration */
+
+    NULL, /* create main configuration */
+    NULL, /* init main configuration */
+
+    ngx_stream_rate_limit_create_srv_conf, /* create server configuration */
+    ngx_stream_rate_limit_merge_srv_conf   /* merge server configuration */
+};
+
+ngx_module_t ngx_stream_rate_limit_module = {
+    NGX_MODULE_V1,
+    &ngx_stream_rate_limit_module_ctx, /* module context */
+    ngx_stream_rate_limit_commands,    /* module directives */
+    NGX_STREAM_MODULE,                 /* module type */
+    NULL,                              /* init master */
+    NULL,                              /* init module */
+    NULL,                              /* init process */
+    NULL,                              /* init thread */
+    NULL,                              /* exit thread */
+    NULL,                              /* exit process */
+    NULL,                              /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+static ngx_int_t
+ngx_stream_rate_limit_preaccess_handler(ngx_stream_session_t *s)
+{
+    ngx_stream_rate_limit_srv_conf_t *rlscf;
+
+    rlscf = ngx_stream_get_module_srv_conf(s, ngx_stream_rate_limit_module);
+
+    if (rlscf->preread) {
+        return NGX_DECLINED;
+    }
+
+    return ngx_stream_rate_limit_handler(s);
+}
+
+static ngx_int_t
+ngx_stream_rate_limit_preread_handler(ngx_stream_session_t *s)
+{
+    ngx_stream_rate_limit_srv_conf_t *rlscf;
+
+    rlscf = ngx_stream_get_module_srv_conf(s, ngx_stream_rate_limit_module);
+
+    if (!rlscf->preread) {
+        return NGX_DECLINED;
+    }
+
+    return ngx_stream_rate_limit_handler(s);
+}
+
+static ngx_int_t
+ngx_stream_rate_limit_handler(ngx_stream_session_t *s)
+{
+    size_t                            len;
+    u_char                           *p, *n;
+    ngx_connection_t                 *c;
+    ngx_pool_cleanup_t               *cln;
+    ngx_stream_rate_limit_ctx_t      *ctx;
+    ngx_stream_rate_limit_srv_conf_t *rlscf;
+
+    rlscf = ngx_stream_get_module_srv_conf(s, ngx_stream_rate_limit_module);
+
+    if (rlscf->key == NULL || rlscf->upstream == NULL) {
+        return NGX_DECLINED;
+    }
+
+    c = s->connection;
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_rate_limit_module);
+
+    /*
+     * NGX_DONE rather than NGX_AGAIN while redis is asked: in the preread
+     * phase, NGX_AGAIN arms preread_timeout and the phase is not entered
+     * again until more client data arrives or the timer skips it.
+     */
+
+    if (ctx != NULL) {
+        if (!ctx->finalized) {
+            return NGX_DONE;
+        }
+
+        return ctx->rc;
+    }
+
+    ctx = ngx_pcalloc(c->pool, sizeof(ngx_stream_rate_limit_ctx_t));
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_stream_complex_value(s, rlscf->key, &ctx->key) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (ctx->key.len == 0) {
+        return NGX_DECLINED;
+    }
+
+    len = rlscf->prefix.len;
+
+    if (len > 0) {
+        n = ngx_pnalloc(c->pool, len + ctx->key.len + 1);
+        if (n == NULL) {
+            return NGX_ERROR;
+        }
+
+        p = ngx_cpymem(n, rlscf->prefix.data, len);
+        *p++ = '_';
+        ngx_memcpy(p, ctx->key.data, ctx->key.len);
+
+        ctx->key.len += len + 1;
+        ctx->key.data = n;
+    }
+
+    if (ctx->key.len > 65535) {
+        ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                      "the value of the \"%V\" key "
+                      "is more than 65535 bytes: \"%V\"",
+                      &rlscf->key->value, &ctx->key);
+        return NGX_ERROR;
+    }
+
+    ctx->session = s;
+
+    len = ngx_rate_limit_redis_command_size(&ctx->key, &rlscf->rule);
+
+    ctx->request = ngx_create_temp_buf(c->pool, len);
+    if (ctx->request == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->request->last = ngx_rate_limit_redis_write_command(
+        ctx->request->last, &ctx->key, &rlscf->rule);
+
+    /* a reply is under 64 bytes */
+    ctx->response = ngx_create_temp_buf(c->pool, 128);
+    if (ctx->response == NULL) {
+        return NGX_ERROR;
+    }
+
+    cln = ngx_pool_cleanup_add(c->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_stream_rate_limit_cleanup;
+    cln->data = ctx;
+
+    ngx_stream_set_ctx(s, ctx, ngx_stream_rate_limit_module);
+
+    if (ngx_stream_rate_limit_connect(s, ctx) != NGX_OK) {
+        ngx_stream_set_ctx(s, NULL, ngx_stream_rate_limit_module);
+        return NGX_STREAM_INTERNAL_SERVER_ERROR;
+    }
+
+    return NGX_DONE;
+}
+
+static ngx_int_t
+ngx_stream_rate_limit_connect(ngx_stream_session_t *s,
+                              ngx_stream_rate_limit_ctx_t *ctx)
+{
+    ngx_int_t                         rc;
+    ngx_connection_t                 *pc;
+    ngx_stream_upstream_t            *u;
+    ngx_stream_rate_limit_srv_conf_t *rlscf;
+
+    rlscf = ngx_stream_get_module_srv_conf(s, ngx_stream_rate_limit_module);
+
+    /*
+     * The balancers keep their state in s->upstream, which is not
+     * created until the proxy module runs in the content phase.
+     */
+
+    u = ngx_pcalloc(s->connection->pool, sizeof(ngx_stream_upstream_t));
+    if (u == NULL) {
+        return NGX_ERROR;
+    }
+
+    u->peer.log = s->connection->log;
+    u->peer.log_error = NGX_ERROR_ERR;
+
+    s->upstream = u;
+
+    rc = rlscf->upstream->peer.init(s, rlscf->upstream);
+
+    s->upstream = NULL;
+
+    if (rc != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ctx->peer = u->peer;
+
+    rc = ngx_event_connect_peer(&ctx->peer);
+
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                      "rate limit: no live redis upstreams");
+
+        ngx_stream_rate_limit_close(ctx, NGX_PEER_FAILED);
+
+        return NGX_ERROR;
+    }
+
+    pc = ctx->peer.connection;
+
+    pc->data = ctx;
+    pc->log = s->connection->log;
+    pc->read->log = pc->log;
+    pc->write->log = pc->log;
+
+    pc->read->handler = ngx_stream_rate_limit_read_handler;
+    pc->write->handler = ngx_stream_rate_limit_write_handler;
+
+    if (rc == NGX_AGAIN) {
+        ngx_add_timer(pc->write, rlscf->connect_timeout);
+        return NGX_OK;
+    }
+
+    /* rc == NGX_OK */
+
+    ngx_stream_rate_limit_write_handler(pc->write);
+
+    return NGX_OK;
+}
+
+static void
+ngx_stream_rate_limit_write_handler(ngx_event_t *wev)
+{
+    ssize_t                           n;
+    ngx_buf_t                        *b;
+    ngx_connection_t                 *pc;
+    ngx_stream_rate_limit_ctx_t      *ctx;
+    ngx_stream_rate_limit_srv_conf_t *rlscf;
+
+    pc = wev->data;
+    ctx = pc->data;
+
+    rlscf = ngx_stream_get_module_srv_conf(ctx->session,
+                                           ngx_stream_rate_limit_module);
+
+    pc->log->action = "sending to redis";
+
+    if (wev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, pc->log, NGX_ETIMEDOUT, "redis timed out");
+        ngx_stream_rate_limit_finalize(ctx, NGX_STREAM_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    if (wev->timer_set) {
+        ngx_del_timer(wev);
+    }
+
+    b = ctx->request;
+
+    if (b->pos == b->start && ngx_rate_limit_test_connect(pc) != NGX_OK) {
+        ngx_stream_rate_limit_finalize(ctx, NGX_STREAM_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    while (b->pos < b->last) {
+        n = pc->send(pc, b->pos, b->last - b->pos);
+
+        if (n == NGX_AGAIN) {
+            ngx_add_timer(wev, rlscf->timeout);
+
+            if (ngx_handle_write_event(wev, 0) != NGX_OK) {
+                ngx_stream_rate_limit_finalize(
+                    ctx, NGX_STREAM_INTERNAL_SERVER_ERROR);
+            }
+
+            return;
+        }
+
+        if (n == NGX_ERROR) {
+            ngx_stream_rate_limit_finalize(ctx,
+                                           NGX_STREAM_INTERNAL_SERVER_ERROR);
+            return;
+        }
+
+        b->pos += n;
+    }
+
+    /* the whole command is sent, wait for the reply */
+
+    wev->handler = ngx_event_dummy;
+
+    if (!pc->read->timer_set) {
+        ngx_add_timer(pc->read, rlscf->timeout);
+    }
+
+    if (pc->read->ready) {
+        ngx_stream_rate_limit_read_handler(pc->read);
+        return;
+    }
+
+    if (ngx_handle_read_event(pc->read, 0) != NGX_OK) {
+        ngx_stream_rate_limit_finalize(ctx, NGX_STREAM_INTERNAL_SERVER_ERROR);
+    }
+}
+
+static void
+ngx_stream_rate_limit_read_handler(ngx_event_t *rev)
+{
+    ssize_t                      n;
+    ngx_int_t                    rc;
+    ngx_buf_t                   *b;
+    ngx_connection_t            *pc;
+    ngx_stream_rate_limit_ctx_t *ctx;
+
+    pc = rev->data;
+    ctx = pc->data;
+
+    pc->log->action = "reading from redis";
+
+    if (rev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, pc->log, NGX_ETIMEDOUT, "redis timed out");
+        ngx_stream_rate_limit_finalize(ctx, NGX_STREAM_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    b = ctx->response;
+
+    for (;;) {
+        if (b->last == b->end) {
+            ngx_log_error(NGX_LOG_ERR, pc->log, 0,
+                          "redis sent too big response");
+            ngx_stream_rate_limit_finalize(ctx,
+                                           NGX_STREAM_INTERNAL_SERVER_ERROR);
+            return;
+        }
+
+        n = pc->recv(pc, b->last, b->end - b->last);
+
+        if (n == NGX_AGAIN) {
+            if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+                ngx_stream_rate_limit_finalize(
+                    ctx, NGX_STREAM_INTERNAL_SERVER_ERROR);
+            }
+
+            return;
+        }
+
+        if (n == 0) {
+            ngx_log_error(NGX_LOG_ERR, pc->log, 0,
+                          "redis prematurely closed connection");
+        }
+
+        if (n == NGX_ERROR || n == 0) {
+            ngx_stream_rate_limit_finalize(ctx,
+                                           NGX_STREAM_INTERNAL_SERVER_ERROR);
+            return;
+        }
+
+        b->last += n;
+
+        rc = ngx_rate_limit_redis_parse_reply(&ctx->reply, b);
+
+        if (rc == NGX_AGAIN) {
+            continue;
+        }
+
+        if (rc == NGX_ERROR) {
+            ngx_log_error(NGX_LOG_ERR, pc->log, 0,
+                          "rate limit: redis sent invalid response");
+            ngx_stream_rate_limit_finalize(ctx,
+                                           NGX_STREAM_INTERNAL_SERVER_ERROR);
+            return;
+        }
+
+        /* rc == NGX_OK */
+
+        ngx_stream_rate_limit_finalize(ctx, NGX_DECLINED);
+        return;
+    }
+}
+
+static void
+ngx_stream_rate_limit_finalize(ngx_stream_rate_limit_ctx_t *ctx, ngx_int_t rc)
+{
+    ngx_stream_session_t             *s;
+    ngx_stream_rate_limit_srv_conf_t *rlscf;
+
+    s = ctx->session;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
+                   "finalize stream rate limit: %i", rc);
+
+    /* the balancer avoids a peer that timed out or failed for a while */
+    ngx_stream_rate_limit_close(ctx, rc == NGX_DECLINED ? 0 : NGX_PEER_FAILED);
+
+    rlscf = ngx_stream_get_module_srv_conf(s, ngx_stream_rate_limit_module);
+
+    if (rc == NGX_DECLINED && ctx->reply.limited) {
+        ngx_log_error(rlscf->limit_log_level, s->connection->log, 0,
+                      "rate limit exceeded for key \"%V\"", &ctx->key);
+
+        rc = rlscf->status_code;
+    }
+
+    ctx->rc = rc;
+    ctx->finalized = 1;
+
+    s->connection->log->action = "initializing session";
+
+    ngx_stream_core_run_phases(s);
+}
+
+/* Reference: ngx_stream_proxy_next_upstream */
+static void
+ngx_stream_rate_limit_close(ngx_stream_rate_limit_ctx_t *ctx, ngx_uint_t state)
+{
+    if (ctx->peer.sockaddr && ctx->peer.free) {
+        ctx->peer.free(&ctx->peer, ctx->peer.data, state);
+        ctx->peer.sockaddr = NULL;
+    }
+
+    if (ctx->peer.connection == NULL) {
+        return;
+    }
+
+    /* there is no keepalive cache for stream upstreams */
+
+    ngx_close_connection(ctx->peer.connection);
+    ctx->peer.connection = NULL;
+}
+
+static void
+ngx_stream_rate_limit_cleanup(void *data)
+{
+    ngx_stream_rate_limit_ctx_t *ctx = data;
+
+    ngx_stream_rate_limit_close(ctx, 0);
+}
+
+static void *
+ngx_stream_rate_limit_create_srv_conf(ngx_conf_t *cf)
+{
+    ngx_stream_rate_limit_srv_conf_t *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_stream_rate_limit_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->key = NULL;
+     *     conf->upstream = NULL;
+     *     conf->prefix = { 0, NULL };
+     */
+
+    conf->preread = NGX_CONF_UNSET;
+    conf->status_code = NGX_CONF_UNSET_UINT;
+    conf->limit_log_level = NGX_CONF_UNSET_UINT;
+    conf->connect_timeout = NGX_CONF_UNSET_MSEC;
+    conf->timeout = NGX_CONF_UNSET_MSEC;
+
+    conf->rule.quantity = NGX_CONF_UNSET_UINT;
+
+    return conf;
+}
+
+static char *
+ngx_stream_rate_limit_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_stream_rate_limit_srv_conf_t *prev = parent;
+    ngx_stream_rate_limit_srv_conf_t *conf = child;
+
+    if (conf->key == NULL) {
+        conf->key = prev->key;
+        conf->rule.requests = prev->rule.requests;
+        conf->rule.period = prev->rule.period;
+        conf->rule.burst = prev->rule.burst;
+    }
+
+    if (conf->upstream == NULL) {
+        conf->upstream = prev->upstream;
+    }
+
+    ngx_conf_merge_value(conf->preread, prev->preread, 0);
+    ngx_conf_merge_uint_value(conf->status_code, prev->status_code,
+                              NGX_STREAM_SERVICE_UNAVAILABLE);
+    ngx_conf_merge_uint_value(conf->limit_log_level, prev->limit_log_level,
+                              NGX_LOG_ERR);
+    ngx_conf_merge_msec_value(conf->connect_timeout, prev->connect_timeout,
+                              60000);
+    ngx_conf_merge_msec_value(conf->timeout, prev->timeout, 60000);
+
+    ngx_conf_merge_str_value(conf->prefix, prev->prefix, "");
+    ngx_conf_merge_uint_value(conf->rule.quantity, prev->rule.quantity, 1);
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_stream_rate_limit(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_stream_rate_limit_srv_conf_t *rlscf = conf;
+
+    ngx_str_t                          *value, s;
+    ngx_int_t                           requests, period, burst;
+    ngx_uint_t                          i;
+    ngx_stream_compile_complex_value_t  ccv;
+
+    if (rlscf->key) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    rlscf->key = ngx_palloc(cf->pool, sizeof(ngx_stream_complex_value_t));
+    if (rlscf->key == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_memzero(&ccv, sizeof(ngx_stream_compile_complex_value_t));
+
+    ccv.cf = cf;
+    ccv.value = &value[1];
+    ccv.complex_value = rlscf->key;
+
+    if (ngx_stream_compile_complex_value(&ccv) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    requests = 1;
+    period = 60000;
+    burst = 0;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "requests=", 9) == 0) {
+
+            requests = ngx_atoi(value[i].data + 9, value[i].len - 9);
+            if (requests <= 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid requests value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "period=", 7) == 0) {
+
+            s.len = value[i].len - 7;
+            s.data = value[i].data + 7;
+
+            /* in msec, a rate of thousands a second needs it */
+            period = ngx_rate_limit_parse_period(&s);
+            if (period <= 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid period time \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "burst=", 6) == 0) {
+
+            burst = ngx_atoi(value[i].data + 6, value[i].len - 6);
+            if (burst < 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid burst value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"",
+                           &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    rlscf->rule.requests = requests;
+    rlscf->rule.period = period;
+    rlscf->rule.burst = burst;
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_stream_rate_limit_pass(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_stream_rate_limit_srv_conf_t *rlscf = conf;
+
+    ngx_str_t *value;
+    ngx_url_t  url;
+
+    if (rlscf->upstream) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    ngx_memzero(&url, sizeof(ngx_url_t));
+
+    url.url = value[1];
+    url.no_resolve = 1;
+
+    rlscf->upstream = ngx_stream_upstream_add(cf, &url, 0);
+    if (rlscf->upstream == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+static ngx_int_t
+ngx_stream_rate_limit_init(ngx_conf_t *cf)
+{
+    ngx_array_t                 *handlers;
+    ngx_stream_handler_pt       *h;
+    ngx_stream_core_main_conf_t *cmcf;
+
+    cmcf = ngx_stream_conf_get_module_main_conf(cf, ngx_stream_core_module);
+
+    /* before the TLS handshake of "listen ... ssl" */
+    h = ngx_array_push(&cmcf->phases[NGX_STREAM_PREACCESS_PHASE].handlers);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    *h = ngx_stream_rate_limit_preaccess_handler;
+
+    /*
+     * After ssl_preread, for SNI based keys: handlers run in the reverse
+     * order of registration, so this one goes first in the array.
+     */
+    handlers = &cmcf->phases[NGX_STREAM_PREREAD_PHASE].handlers;
+
+    if (ngx_array_push(handlers) == NULL) {
+        return NGX_ERROR;
+    }
+
+    h = handlers->elts;
+
+    ngx_memmove(h + 1, h,
+                (handlers->nelts - 1) * sizeof(ngx_stream_handler_pt));
+
+    *h = ngx_stream_rate_limit_preread_handler;
+
+    return NGX_OK;
+}
@@ -0,0 +1,35 @@
+#!/usr/bin/env perl
+
+use Test::Nginx::Socket;
+
+plan tests => repeat_each() * (blocks() * 3);
+
+our $HttpConfig = qq{
+    rate_limit_adaptive_zone zone=backend latency=1s errors=5% interval=1ms;
+};
+
+no_long_string();
+#no_diff();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: backend errors cut the rate
+--- http_config eval: $::HttpConfig
+--- config
+    location /hit {
+        rate_limit_adaptive zone=backend;
+
+        proxy_pass http://127.0.0.1:$TEST_NGINX_SERVER_PORT/backend;
+    }
+
+    location /backend {
+        return 503;
+    }
+--- request
+    GET /hit
+--- response_body_like: 503 Service Temporarily Unavailable
+--- error_code: 503
+--- error_log
+adaptive rate limit "backend" is now 70.0% of the configured rate
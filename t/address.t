@@ -0,0 +1,119 @@
+#!/usr/bin/env perl
+
+use Test::Nginx::Socket;
+
+plan tests => repeat_each() * (blocks() * 3 + 2);
+
+$ENV{TEST_NGINX_REDIS_PORT} ||= 6379;
+
+our $HttpConfig = qq{
+    upstream redis {
+        server 127.0.0.1:$ENV{TEST_NGINX_REDIS_PORT};
+        keepalive 1024;
+    }
+};
+
+no_long_string();
+#no_diff();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: the network of the client is limited
+--- http_config eval: $::HttpConfig
+--- config
+    location /a {
+        rate_limit $remote_addr requests=1 period=1m burst=0;
+        rate_limit_prefix address;
+        rate_limit_address ipv4=24;
+        rate_limit_pass redis;
+
+        error_page 404 =200 @hit;
+    }
+
+    location /b {
+        rate_limit $remote_addr requests=1 period=1m burst=0;
+        rate_limit_prefix address;
+        rate_limit_address ipv4=8;
+        rate_limit_pass redis;
+
+        error_page 404 =200 @hit;
+    }
+
+    location @hit {
+        default_type text/plain;
+        return 200 "200 OK\n";
+    }
+--- request eval
+['GET /a', 'GET /b']
+--- error_code eval
+[200, 200]
+--- no_error_log
+[warn]
+
+=== TEST 2: an empty key is not limited
+--- http_config eval: $::HttpConfig
+--- config
+    location /a {
+        rate_limit "" requests=1 period=1m burst=0;
+        rate_limit_prefix address_empty;
+        rate_limit_address;
+        rate_limit_pass redis;
+
+        error_page 404 =200 @hit;
+    }
+
+    location @hit {
+        default_type text/plain;
+        return 200 "200 OK\n";
+    }
+--- request eval
+['GET /a', 'GET /a']
+--- error_code eval
+[200, 200]
+--- no_error_log
+[warn]
+
+=== TEST 3: IPv6 clients are limited per /64
+--- http_config eval: $::HttpConfig
+--- config
+    location = /a {
+        proxy_set_header X-Real-IP 2001:db8:1:2::1;
+        proxy_pass http://127.0.0.1:$TEST_NGINX_SERVER_PORT/limit;
+    }
+
+    location = /b {
+        proxy_set_header X-Real-IP 2001:db8:1:2::ffff;
+        proxy_pass http://127.0.0.1:$TEST_NGINX_SERVER_PORT/limit;
+    }
+
+    location = /c {
+        proxy_set_header X-Real-IP 2001:db8:1:3::1;
+        proxy_pass http://127.0.0.1:$TEST_NGINX_SERVER_PORT/limit;
+    }
+
+    location = /limit {
+        set_real_ip_from 127.0.0.1;
+        real_ip_header X-Real-IP;
+
+        rate_limit $remote_addr requests=1 period=1m burst=0;
+        rate_limit_prefix address6;
+        rate_limit_address ipv6=64;
+        rate_limit_pass redis;
+
+        error_page 404 =200 @hit;
+    }
+
+    location @hit {
+        default_type text/plain;
+        return 200 "200 OK\n";
+    }
+--- request eval
+['GET /a', 'GET /b', 'GET /c']
+--- error_code eval
+[200, 429, 200]
+--- error_log
+rate limit exceeded for key "address6_2001:db8:1:2::/64"
+--- no_error_log
+[warn]
@@ -0,0 +1,160 @@
+#!/usr/bin/env perl
+
+use Test::Nginx::Socket;
+use IO::Socket::INET;
+use Time::HiRes qw(sleep);
+
+plan tests => repeat_each() * (blocks() * 3 + 2);
+
+$ENV{TEST_NGINX_REDIS_PORT} ||= 6379;
+
+our $HttpConfig = qq{
+    upstream redis {
+        server 127.0.0.1:$ENV{TEST_NGINX_REDIS_PORT};
+        keepalive 16;
+    }
+
+    rate_limit_block_zone zone=blocks:1m channel=rate_limit:test;
+};
+
+# Publishes a message to the channel of the zone, as another node would,
+# once the worker of nginx has subscribed to it
+sub publish {
+    my ($message) = @_;
+
+    my $channel = 'rate_limit:test';
+    my $command = "*3\r\n\$7\r\nPUBLISH\r\n"
+                . '$' . length($channel) . "\r\n$channel\r\n"
+                . '$' . length($message) . "\r\n$message\r\n";
+
+    my $redis = IO::Socket::INET->new(
+        PeerAddr => '127.0.0.1',
+        PeerPort => $ENV{TEST_NGINX_REDIS_PORT},
+        Proto    => 'tcp',
+    ) or die "cannot connect to redis: $!";
+
+    for (1 .. 50) {
+        print $redis $command;
+
+        my $reply = <$redis>;
+
+        # the number of subscribers that got the message
+        return if defined $reply && $reply =~ /^:([1-9]\d*)/;
+
+        sleep 0.1;
+    }
+
+    die "nobody subscribed to $channel";
+}
+
+no_long_string();
+#no_diff();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: a limited key is rejected without asking redis
+--- http_config eval: $::HttpConfig
+--- config
+    location /a {
+        rate_limit $remote_addr requests=1 period=1m burst=0;
+        rate_limit_prefix block;
+        rate_limit_block zone=blocks;
+        rate_limit_log_level info;
+        rate_limit_pass redis;
+
+        error_page 404 =200 @hit;
+    }
+
+    # the same key, with nothing but the zone to answer for it
+    location /b {
+        rate_limit $remote_addr requests=1 period=1m burst=0;
+        rate_limit_prefix block;
+        rate_limit_block zone=blocks;
+        rate_limit_log_level info;
+        rate_limit_pass 127.0.0.1:1;
+
+        error_page 404 =200 @hit;
+    }
+
+    location @hit {
+        default_type text/plain;
+        return 200 "200 OK\n";
+    }
+--- pipelined_requests eval
+["GET /a", "GET /a", "GET /b"]
+--- error_code eval
+[200, 429, 429]
+--- no_error_log
+[error]
+
+=== TEST 2: rate_limit_block off
+--- http_config eval: $::HttpConfig
+--- config
+    location /a {
+        rate_limit $remote_addr requests=1 period=1m burst=0;
+        rate_limit_prefix block_off;
+        rate_limit_block zone=blocks;
+        rate_limit_log_level info;
+        rate_limit_pass redis;
+
+        error_page 404 =200 @hit;
+    }
+
+    location /b {
+        rate_limit $remote_addr requests=1 period=1m burst=0;
+        rate_limit_prefix block_off;
+        rate_limit_block off;
+        rate_limit_pass 127.0.0.1:1;
+
+        error_page 404 =200 @hit;
+    }
+
+    location @hit {
+        default_type text/plain;
+        return 200 "200 OK\n";
+    }
+--- pipelined_requests eval
+["GET /a", "GET /a", "GET /b"]
+--- error_code eval
+[200, 429, 502]
+--- error_log
+connect() failed
+
+=== TEST 3: a key published by another node is rejected
+--- http_config eval: $::HttpConfig
+--- config
+    # the subscription is made on the upstream of this location
+    location /a {
+        rate_limit $remote_addr requests=1 period=1m burst=0;
+        rate_limit_prefix block_published;
+        rate_limit_block zone=blocks;
+        rate_limit_pass redis;
+
+        error_page 404 =200 @hit;
+    }
+
+    location /b {
+        rate_limit $remote_addr requests=1 period=1m burst=0;
+        rate_limit_prefix block_published;
+        rate_limit_block zone=blocks;
+        rate_limit_log_level info;
+        rate_limit_pass 127.0.0.1:1;
+
+        error_page 404 =200 @hit;
+    }
+
+    location @hit {
+        default_type text/plain;
+        return 200 "200 OK\n";
+    }
+--- init
+main::publish("60 block_published_127.0.0.1");
+--- request
+    GET /b
+--- error_code: 429
+--- error_log
+rate limit exceeded for key "block_published_127.0.0.1"
+--- no_error_log
+[error]
@@ -0,0 +1,73 @@
+#!/usr/bin/env perl
+
+use Test::Nginx::Socket;
+
+plan tests => repeat_each() * 8;
+
+$ENV{TEST_NGINX_REDIS_PORT} ||= 6379;
+
+our $HttpConfig = qq{
+    upstream redis {
+        server 127.0.0.1:$ENV{TEST_NGINX_REDIS_PORT};
+        keepalive 1024;
+    }
+
+    proxy_cache_path \$TEST_NGINX_HTML_DIR/cache keys_zone=images:1m;
+};
+
+no_long_string();
+#no_diff();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: cache hits are not checked
+--- http_config eval: $::HttpConfig
+--- config
+    location /img/ {
+        rate_limit $remote_addr requests=1 period=1m burst=0;
+        rate_limit_prefix cache;
+        rate_limit_cache zone=images key=$uri;
+        rate_limit_pass redis;
+
+        proxy_cache images;
+        proxy_cache_key $uri;
+        proxy_cache_valid 200 1m;
+        proxy_pass http://127.0.0.1:$TEST_NGINX_SERVER_PORT/origin/;
+    }
+
+    location /origin/ {
+        default_type text/plain;
+        return 200 "image\n";
+    }
+--- request eval
+['GET /img/a', 'GET /img/a', 'GET /img/a']
+--- response_body eval
+["image\n", "image\n", "image\n"]
+--- error_code eval
+[200, 200, 200]
+
+=== TEST 2: cache misses are checked
+--- http_config eval: $::HttpConfig
+--- config
+    location /img/ {
+        rate_limit $remote_addr requests=1 period=1m burst=0;
+        rate_limit_prefix cache_miss;
+        rate_limit_cache zone=images key=$uri;
+        rate_limit_pass redis;
+
+        proxy_cache images;
+        proxy_cache_key $uri;
+        proxy_cache_valid 200 1m;
+        proxy_pass http://127.0.0.1:$TEST_NGINX_SERVER_PORT/origin/;
+    }
+
+    location /origin/ {
+        default_type text/plain;
+        return 200 "image\n";
+    }
+--- request eval
+['GET /img/b', 'GET /img/c']
+--- error_code eval
+[200, 429]
@@ -0,0 +1,60 @@
+#!/usr/bin/env perl
+
+use Test::Nginx::Socket;
+
+plan tests => repeat_each() * 11;
+
+$ENV{TEST_NGINX_REDIS_PORT} ||= 6379;
+
+our $HttpConfig = qq{
+    upstream redis {
+        server 127.0.0.1:$ENV{TEST_NGINX_REDIS_PORT};
+        keepalive 1024;
+    }
+};
+
+no_long_string();
+#no_diff();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: failed responses are charged afterwards
+--- http_config eval: $::HttpConfig
+--- config
+    location /login {
+        rate_limit $remote_addr requests=2 period=1m burst=1;
+        rate_limit_prefix charge;
+        rate_limit_quantity 0;
+        rate_limit_charge 1 status=401,403,4xx;
+        rate_limit_pass redis;
+    }
+--- request eval
+['GET /login', 'GET /login', 'GET /login']
+--- error_code eval
+[404, 404, 429]
+--- no_error_log
+[warn]
+
+=== TEST 2: other responses are not charged
+--- http_config eval: $::HttpConfig
+--- config
+    location /t/ {
+        rate_limit $remote_addr requests=1 period=1m burst=0;
+        rate_limit_prefix charge_ok;
+        rate_limit_quantity 0;
+        rate_limit_charge 1 status=4xx;
+        rate_limit_pass redis;
+    }
+--- user_files
+>>> t/a.txt
+hello
+--- request eval
+['GET /t/a.txt', 'GET /t/a.txt', 'GET /t/a.txt']
+--- response_body eval
+["hello\n", "hello\n", "hello\n"]
+--- error_code eval
+[200, 200, 200]
+--- no_error_log
+[error]
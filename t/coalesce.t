@@ -0,0 +1,89 @@
+#!/usr/bin/env perl
+
+use Test::Nginx::Socket;
+
+plan tests => repeat_each() * 8;
+
+$ENV{TEST_NGINX_REDIS_PORT} ||= 6379;
+
+our $HttpConfig = qq{
+    upstream redis {
+       server 127.0.0.1:$ENV{TEST_NGINX_REDIS_PORT};
+
+       keepalive 16;
+    }
+};
+
+no_long_string();
+#no_diff();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: coalesced check
+--- http_config eval: $::HttpConfig
+--- config
+    location /hit {
+        rate_limit $remote_addr requests=100 period=1m burst=99;
+        rate_limit_quantity 0;
+        rate_limit_coalesce on;
+        rate_limit_pass redis;
+        rate_limit_headers on;
+
+        error_page 404 =200 @hit;
+    }
+
+    location @hit {
+        default_type text/plain;
+        return 200 "200 OK\n";
+    }
+--- request
+    GET /hit
+--- response_headers
+X-RateLimit-Limit: 100
+X-RateLimit-Remaining: 100
+--- response_body_like: 200 OK
+--- error_code: 200
+--- no_error_log
+[error]
+
+=== TEST 2: concurrent checks share one reply
+--- http_config eval: $::HttpConfig
+--- config
+    location = /ssi {
+        ssi on;
+        default_type text/html;
+        return 200 '<!--# include virtual="/hit" --><!--# include virtual="/hit" --><!--# include virtual="/hit" -->';
+    }
+
+    # a mock that allows everything, with nothing left over
+    location /hit {
+        rate_limit "coalesce_mock" requests=100 period=1m burst=99;
+        rate_limit_coalesce on;
+        rate_limit_pass 127.0.0.1:19470;
+        rate_limit_log_level info;
+
+        error_page 404 = @hit;
+        error_page 429 = @limited;
+    }
+
+    location @hit {
+        return 200 "ok\n";
+    }
+
+    location @limited {
+        return 200 "limited\n";
+    }
+--- tcp_listen: 19470
+--- tcp_reply eval
+"*5\r\n:0\r\n:100\r\n:0\r\n:-1\r\n:0\r\n"
+--- request
+    GET /ssi
+--- response_body
+ok
+limited
+limited
+--- error_code: 200
+--- no_error_log
+[error]
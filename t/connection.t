@@ -0,0 +1,79 @@
+#!/usr/bin/env perl
+
+use Test::Nginx::Socket;
+
+plan tests => repeat_each() * 11;
+
+# a mock that answers the first RATER.LIMIT only, on a kept-alive
+# connection; later checks that reach it time out
+our $HttpConfig = qq{
+    upstream mock {
+        server 127.0.0.1:19480;
+        keepalive 1;
+    }
+};
+
+no_long_string();
+#no_diff();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: a rejection is reused on the connection
+--- http_config eval: $::HttpConfig
+--- config
+    location /hit {
+        rate_limit $remote_addr requests=1 period=1m burst=0;
+        rate_limit_connection_cache 1s;
+        rate_limit_read_timeout 500ms;
+        rate_limit_log_level info;
+        rate_limit_pass mock;
+
+        error_page 404 =200 @hit;
+    }
+
+    location @hit {
+        default_type text/plain;
+        return 200 "200 OK\n";
+    }
+--- tcp_listen: 19480
+--- tcp_no_close
+--- tcp_reply eval
+"*5\r\n:1\r\n:1\r\n:0\r\n:60\r\n:60\r\n"
+--- pipelined_requests eval
+["GET /hit", "GET /hit", "GET /hit"]
+--- error_code eval
+[429, 429, 429]
+--- no_error_log
+[error]
+
+=== TEST 2: approvals are taken from the cached remaining units
+--- http_config eval: $::HttpConfig
+--- config
+    location /hit {
+        rate_limit $remote_addr requests=10 period=1m burst=9;
+        rate_limit_connection_cache 1s;
+        rate_limit_read_timeout 500ms;
+        rate_limit_headers on;
+        rate_limit_pass mock;
+
+        error_page 404 =200 @hit;
+    }
+
+    location @hit {
+        default_type text/plain;
+        return 200 "$sent_http_x_ratelimit_remaining\n";
+    }
+--- tcp_listen: 19480
+--- tcp_no_close
+--- tcp_reply eval
+"*5\r\n:0\r\n:10\r\n:9\r\n:-1\r\n:6\r\n"
+--- pipelined_requests eval
+["GET /hit", "GET /hit", "GET /hit"]
+--- response_body eval
+["9\n", "8\n", "7\n"]
+--- error_code eval
+[200, 200, 200]
+--- no_error_log
+[error]
@@ -0,0 +1,70 @@
+#!/usr/bin/env perl
+
+use Test::Nginx::Socket;
+
+plan tests => repeat_each() * (blocks() * 5);
+
+$ENV{TEST_NGINX_REDIS_PORT} ||= 6379;
+
+our $HttpConfig = qq{
+    upstream redis {
+       server 127.0.0.1:$ENV{TEST_NGINX_REDIS_PORT};
+
+       keepalive 16;
+    }
+};
+
+no_long_string();
+#no_diff();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: delayed instead of rejected
+--- http_config eval: $::HttpConfig
+--- config
+    location /hit {
+        rate_limit $remote_addr requests=1 period=1s;
+        rate_limit_prefix delay;
+        rate_limit_delay max=2s;
+        rate_limit_pass redis;
+
+        error_page 404 =200 @hit;
+    }
+
+    location @hit {
+        default_type text/plain;
+        return 200 "200 OK\n";
+    }
+--- request eval
+['GET /hit', 'GET /hit']
+--- response_body_like eval
+['200 OK', '200 OK']
+--- error_code eval
+[200, 200]
+--- no_error_log
+rate limit exceeded
+
+=== TEST 2: retry_after over the bound
+--- http_config eval: $::HttpConfig
+--- config
+    location /hit {
+        rate_limit $remote_addr requests=1 period=1m;
+        rate_limit_prefix delay_max;
+        rate_limit_delay max=2s queue=10;
+        rate_limit_pass redis;
+
+        error_page 404 =200 @hit;
+    }
+
+    location @hit {
+        default_type text/plain;
+        return 200 "200 OK\n";
+    }
+--- request eval
+['GET /hit', 'GET /hit']
+--- response_body_like eval
+['200 OK', '429 Too Many Requests']
+--- error_code eval
+[200, 429]
@@ -0,0 +1,76 @@
+#!/usr/bin/env perl
+
+use Test::Nginx::Socket;
+
+plan tests => repeat_each() * 8;
+
+$ENV{TEST_NGINX_REDIS_PORT} ||= 6379;
+
+our $HttpConfig = qq{
+    upstream redis {
+        server 127.0.0.1:$ENV{TEST_NGINX_REDIS_PORT};
+        keepalive 1024;
+    }
+
+    # connections of a pool share one handshake
+    upstream redis_db1 {
+        server 127.0.0.1:$ENV{TEST_NGINX_REDIS_PORT};
+        keepalive 1024;
+    }
+};
+
+no_long_string();
+#no_diff();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: select a database over RESP3
+--- http_config eval: $::HttpConfig
+--- config
+    location /a {
+        rate_limit $remote_addr requests=2 period=1m burst=1;
+        rate_limit_prefix handshake;
+        rate_limit_pass redis;
+        rate_limit_headers on;
+
+        error_page 404 =200 @hit;
+    }
+
+    location /b {
+        rate_limit $remote_addr requests=2 period=1m burst=1;
+        rate_limit_prefix handshake;
+        rate_limit_redis_db 1;
+        rate_limit_redis_hello on;
+        rate_limit_pass redis_db1;
+        rate_limit_headers on;
+
+        error_page 404 =200 @hit;
+    }
+
+    location @hit {
+        default_type text/plain;
+        return 200 "200 OK\n";
+    }
+--- request eval
+['GET /a', 'GET /a', 'GET /b']
+--- response_headers eval
+['X-RateLimit-Remaining: 1', 'X-RateLimit-Remaining: 0',
+ 'X-RateLimit-Remaining: 1']
+--- error_code eval
+[200, 200, 200]
+
+=== TEST 2: a rejected password fails the check
+--- http_config eval: $::HttpConfig
+--- config
+    location /hit {
+        rate_limit $remote_addr requests=2 period=1m burst=1;
+        rate_limit_redis_auth wrong;
+        rate_limit_pass redis;
+    }
+--- request
+GET /hit
+--- error_code: 500
+--- error_log
+redis rejected the handshake
@@ -0,0 +1,99 @@
+#!/usr/bin/env perl
+
+use Test::Nginx::Socket;
+
+plan tests => repeat_each() * (blocks() * 3);
+
+our $HttpConfig = qq{
+    rate_limit_sketch_zone zone=flood width=64 depth=2 slots=4 period=1m;
+};
+
+no_long_string();
+#no_diff();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: denied address
+--- http_config eval: $::HttpConfig
+--- config
+    location /hit {
+        rate_limit $remote_addr;
+        rate_limit_sketch zone=flood requests=100;
+        rate_limit_deny $TEST_NGINX_HTML_DIR/deny.txt;
+
+        error_page 404 =200 @hit;
+    }
+
+    location @hit {
+        default_type text/plain;
+        return 200 "200 OK\n";
+    }
+--- user_files
+>>> deny.txt
+# known bad networks
+10.0.0.0/8
+127.0.0.0/8
+bad-api-key
+--- request
+    GET /hit
+--- response_body_like: 429 Too Many Requests
+--- error_code: 429
+--- error_log: rate limit denied client address
+
+=== TEST 2: allowed key
+--- http_config eval: $::HttpConfig
+--- config
+    location /hit {
+        rate_limit "tenant-a";
+        rate_limit_sketch zone=flood requests=1;
+        rate_limit_quantity 2;
+        rate_limit_allow $TEST_NGINX_HTML_DIR/allow.txt;
+
+        error_page 404 =200 @hit;
+    }
+
+    location @hit {
+        default_type text/plain;
+        return 200 "200 OK\n";
+    }
+--- user_files
+>>> allow.txt
+192.0.2.1
+tenant-a
+--- request
+    GET /hit
+--- response_body_like: 200 OK
+--- error_code: 200
+--- no_error_log
+rate limit exceeded
+
+=== TEST 3: unlisted key
+--- http_config eval: $::HttpConfig
+--- config
+    location /hit {
+        rate_limit "tenant-b";
+        rate_limit_sketch zone=flood requests=1;
+        rate_limit_quantity 2;
+        rate_limit_allow $TEST_NGINX_HTML_DIR/allow.txt;
+
+        error_page 404 =200 @hit;
+    }
+
+    location @hit {
+        default_type text/plain;
+        return 200 "200 OK\n";
+    }
+--- user_files
+>>> allow.txt
+192.0.2.1
+tenant-a
+tenant-bb
+tenant-
+--- request
+    GET /hit
+--- response_body_like: 429 Too Many Requests
+--- error_code: 429
+--- no_error_log
+[error]
@@ -0,0 +1,190 @@
+#!/usr/bin/env perl
+
+use Test::Nginx::Socket;
+use IO::Socket::INET;
+use Digest::SHA qw(hmac_sha1);
+use Time::HiRes qw(time sleep);
+
+plan tests => repeat_each() * 25;
+
+our $HttpConfig = qq{
+    rate_limit_local_zone zone=a:1m listen=127.0.0.1:19461
+                          peer=127.0.0.1:19462 interval=1ms secret=s3cr3t;
+    rate_limit_local_zone zone=b:1m listen=127.0.0.1:19462
+                          peer=127.0.0.1:19461 interval=1ms secret=s3cr3t;
+
+    rate_limit_local_zone zone=e:1m listen=127.0.0.1:19465
+                          peer=127.0.0.1:19466 interval=1ms secret=s3cr3t;
+
+    rate_limit_local_zone zone=c:1m listen=127.0.0.1:19463
+                          peer=127.0.0.1:19464 interval=1ms secret=one;
+    rate_limit_local_zone zone=d:1m listen=127.0.0.1:19464
+                          peer=127.0.0.1:19463 interval=1ms secret=two;
+
+    # holds the last request for a while, so the gossip is received first
+    limit_req_zone \$server_name zone=pace:1m rate=5r/s;
+};
+
+# Sends the same signed datagram several times, as the peer of zone e,
+# consuming the given units of a key with 2 requests per minute
+sub replay {
+    my ($key, $quantity, $times) = @_;
+
+    my $datagram = pack('N Q> Q> N n', 0x32474c52, int(time * 1000000),
+                        30000000, $quantity, length($key)) . $key;
+
+    $datagram .= hmac_sha1($datagram, 's3cr3t');
+
+    my $peer = IO::Socket::INET->new(
+        LocalAddr => '127.0.0.1:19466',
+        PeerAddr  => '127.0.0.1:19465',
+        Proto     => 'udp',
+    ) or die "cannot bind the peer: $!";
+
+    for (1 .. $times) {
+        $peer->send($datagram);
+    }
+
+    close $peer;
+
+    # the worker merges them before the request
+    sleep(0.1);
+}
+
+no_long_string();
+#no_diff();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: local limit without redis
+--- http_config eval: $::HttpConfig
+--- config
+    location /hit {
+        rate_limit $remote_addr requests=2 period=1m burst=1;
+        rate_limit_prefix local;
+        rate_limit_local zone=a;
+        rate_limit_headers on;
+
+        error_page 404 =200 @hit;
+    }
+
+    location @hit {
+        default_type text/plain;
+        return 200 "200 OK\n";
+    }
+--- request eval
+['GET /hit', 'GET /hit', 'GET /hit']
+--- response_headers eval
+['X-RateLimit-Remaining: 1', 'X-RateLimit-Remaining: 0', 'Retry-After: 30']
+--- response_body_like eval
+['200 OK', '200 OK', '429 Too Many Requests']
+--- error_code eval
+[200, 200, 429]
+
+=== TEST 2: consumption is gossiped to the peers
+--- http_config eval: $::HttpConfig
+--- config
+    location /a {
+        limit_req zone=pace burst=10 nodelay;
+
+        rate_limit $remote_addr requests=2 period=1m burst=1;
+        rate_limit_prefix gossip;
+        rate_limit_local zone=a;
+
+        error_page 404 =200 @hit;
+    }
+
+    location /b {
+        limit_req zone=pace burst=10;
+        recursive_error_pages on;
+
+        error_page 404 = @b;
+    }
+
+    location @b {
+        rate_limit $remote_addr requests=2 period=1m burst=1;
+        rate_limit_prefix gossip;
+        rate_limit_local zone=b;
+
+        error_page 404 =200 @hit;
+    }
+
+    location @hit {
+        default_type text/plain;
+        return 200 "200 OK\n";
+    }
+--- request eval
+['GET /a', 'GET /a', 'GET /b']
+--- response_body_like eval
+['200 OK', '200 OK', '429 Too Many Requests']
+--- error_code eval
+[200, 200, 429]
+
+=== TEST 3: datagrams signed with another secret are dropped
+--- http_config eval: $::HttpConfig
+--- config
+    location /c {
+        limit_req zone=pace burst=10 nodelay;
+
+        rate_limit $remote_addr requests=2 period=1m burst=1;
+        rate_limit_prefix gossip;
+        rate_limit_local zone=c;
+
+        error_page 404 =200 @hit;
+    }
+
+    location /d {
+        limit_req zone=pace burst=10;
+        recursive_error_pages on;
+
+        error_page 404 = @d;
+    }
+
+    location @d {
+        rate_limit $remote_addr requests=2 period=1m burst=1;
+        rate_limit_prefix gossip;
+        rate_limit_local zone=d;
+
+        error_page 404 =200 @hit;
+    }
+
+    location @hit {
+        default_type text/plain;
+        return 200 "200 OK\n";
+    }
+--- request eval
+['GET /c', 'GET /c', 'GET /d']
+--- response_body_like eval
+['200 OK', '200 OK', '200 OK']
+--- error_code eval
+[200, 200, 200]
+--- error_log
+rate limit gossip: datagram with an invalid MAC
+
+=== TEST 4: a replayed datagram is counted once
+--- http_config eval: $::HttpConfig
+--- config
+    location /e {
+        rate_limit $remote_addr requests=2 period=1m burst=1;
+        rate_limit_prefix replay;
+        rate_limit_local zone=e;
+        rate_limit_headers on;
+
+        error_page 404 =200 @hit;
+    }
+
+    location @hit {
+        default_type text/plain;
+        return 200 "200 OK\n";
+    }
+--- init
+main::replay("replay_127.0.0.1", 1, 3);
+--- request
+    GET /e
+--- response_headers
+X-RateLimit-Remaining: 0
+--- error_code: 200
+--- error_log
+rate limit gossip: replayed datagram
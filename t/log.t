@@ -0,0 +1,74 @@
+#!/usr/bin/env perl
+
+use Test::Nginx::Socket;
+
+plan tests => repeat_each() * 10;
+
+$ENV{TEST_NGINX_REDIS_PORT} ||= 6379;
+
+our $HttpConfig = qq{
+    upstream redis {
+        server 127.0.0.1:$ENV{TEST_NGINX_REDIS_PORT};
+        keepalive 16;
+    }
+
+    rate_limit_log_zone zone=rejections:1m interval=1s;
+};
+
+no_long_string();
+#no_diff();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: rejections are summed up
+--- http_config eval: $::HttpConfig
+--- config
+    location /hit {
+        rate_limit $remote_addr requests=1 period=1m burst=0;
+        rate_limit_prefix log_summary;
+        rate_limit_log zone=rejections;
+        rate_limit_pass redis;
+
+        error_page 404 =200 @hit;
+    }
+
+    location @hit {
+        default_type text/plain;
+        return 200 "200 OK\n";
+    }
+--- pipelined_requests eval
+["GET /hit", "GET /hit", "GET /hit"]
+--- error_code eval
+[200, 429, 429]
+--- wait: 1.5
+--- error_log
+rate limit: key "log_summary_127.0.0.1" limited 2 times
+--- no_error_log
+rate limit exceeded
+
+=== TEST 2: sampled rejections are logged
+--- http_config eval: $::HttpConfig
+--- config
+    location /hit {
+        rate_limit $remote_addr requests=1 period=1m burst=0;
+        rate_limit_prefix log_sample;
+        rate_limit_log zone=rejections sample=1;
+        rate_limit_pass redis;
+
+        error_page 404 =200 @hit;
+    }
+
+    location @hit {
+        default_type text/plain;
+        return 200 "200 OK\n";
+    }
+--- pipelined_requests eval
+["GET /hit", "GET /hit", "GET /hit"]
+--- error_code eval
+[200, 429, 429]
+--- error_log
+rate limit exceeded for key
+--- no_error_log
+[error]
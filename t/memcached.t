@@ -0,0 +1,160 @@
+#!/usr/bin/env perl
+
+use Test::Nginx::Socket;
+
+plan tests => repeat_each() * 16;
+
+$ENV{TEST_NGINX_REDIS_PORT} ||= 6379;
+$ENV{TEST_NGINX_MEMCACHED_PORT} ||= 11211;
+
+# the keys of this run, the counters of earlier ones may still be there
+$ENV{TEST_NGINX_RUN_ID} = time() . "_$$";
+
+# Waits for the next window when the current one is about to end, so that
+# the requests of a test are all counted in the same one
+sub same_window {
+    my ($period) = @_;
+
+    my $left = $period - time() % $period;
+
+    sleep $left if $left < 3;
+}
+
+our $HttpConfig = qq{
+    upstream memcached {
+        server 127.0.0.1:$ENV{TEST_NGINX_MEMCACHED_PORT};
+        keepalive 16;
+    }
+
+    upstream redis {
+        server 127.0.0.1:$ENV{TEST_NGINX_REDIS_PORT};
+    }
+};
+
+no_long_string();
+#no_diff();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: the window allows requests + burst units
+--- http_config eval: $::HttpConfig
+--- init
+main::same_window(3600);
+--- config
+    location /hit {
+        rate_limit $TEST_NGINX_RUN_ID:$connection requests=2 period=1h burst=1;
+        rate_limit_prefix memcached_window;
+        rate_limit_log_level info;
+        rate_limit_backend memcached;
+        rate_limit_pass memcached;
+
+        error_page 404 =200 @hit;
+    }
+
+    location @hit {
+        default_type text/plain;
+        return 200 "200 OK\n";
+    }
+--- pipelined_requests eval
+["GET /hit", "GET /hit", "GET /hit", "GET /hit"]
+--- error_code eval
+[200, 200, 200, 429]
+--- no_error_log
+[error]
+
+=== TEST 2: headers of a quota check
+--- http_config eval: $::HttpConfig
+--- config
+    location /quota {
+        rate_limit $pid:$connection requests=5 period=1h burst=2;
+        rate_limit_prefix memcached_quota;
+        rate_limit_quantity 0;
+        rate_limit_backend memcached;
+        rate_limit_pass memcached;
+        rate_limit_headers on;
+
+        error_page 404 =200 @quota;
+    }
+
+    location @quota {
+        default_type text/plain;
+        return 200 "$sent_http_x_ratelimit_limit $sent_http_x_ratelimit_remaining\n";
+    }
+--- request
+GET /quota
+--- error_code: 200
+--- response_body
+7 7
+--- no_error_log
+[error]
+
+=== TEST 3: binary keys are hashed
+--- http_config eval: $::HttpConfig
+--- config
+    location /hit {
+        rate_limit $remote_addr requests=10 period=1m burst=9;
+        rate_limit_address;
+        rate_limit_prefix memcached_address;
+        rate_limit_backend memcached;
+        rate_limit_pass memcached;
+
+        error_page 404 =200 @hit;
+    }
+
+    location @hit {
+        default_type text/plain;
+        return 200 "200 OK\n";
+    }
+--- request
+GET /hit
+--- error_code: 200
+--- no_error_log
+[error]
+
+=== TEST 4: a reply of another protocol
+--- http_config eval: $::HttpConfig
+--- config
+    location /hit {
+        rate_limit $remote_addr requests=10 period=1m burst=9;
+        rate_limit_prefix memcached_redis;
+        rate_limit_backend memcached;
+        rate_limit_pass redis;
+
+        error_page 404 =200 @hit;
+    }
+
+    location @hit {
+        default_type text/plain;
+        return 200 "200 OK\n";
+    }
+--- request
+GET /hit
+--- error_code: 500
+--- error_log
+rate limit: memcached sent invalid response
+
+=== TEST 5: a window of more than 30 days
+--- http_config eval: $::HttpConfig
+--- config
+    location /hit {
+        rate_limit $TEST_NGINX_RUN_ID requests=2 period=3650d burst=0;
+        rate_limit_prefix memcached_long;
+        rate_limit_log_level info;
+        rate_limit_backend memcached;
+        rate_limit_pass memcached;
+
+        error_page 404 =200 @hit;
+    }
+
+    location @hit {
+        default_type text/plain;
+        return 200 "200 OK\n";
+    }
+--- pipelined_requests eval
+["GET /hit", "GET /hit", "GET /hit"]
+--- error_code eval
+[200, 200, 429]
+--- no_error_log
+[error]
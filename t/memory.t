@@ -0,0 +1,118 @@
+#!/usr/bin/env perl
+
+use Test::Nginx::Socket;
+
+# the usage of the request pool is only logged by a debug build
+my $v = `$Test::Nginx::Util::NginxBinary -V 2>&1`;
+
+if ($v !~ /--with-debug/) {
+    plan skip_all => 'nginx is not built with --with-debug';
+
+} else {
+    plan tests => repeat_each() * 9;
+}
+
+$ENV{TEST_NGINX_REDIS_PORT} ||= 6379;
+
+our $HttpConfig = qq{
+    upstream redis {
+       server 127.0.0.1:$ENV{TEST_NGINX_REDIS_PORT};
+
+       keepalive 16;
+    }
+};
+
+# Checks run one after the other share the pool of the main request, so the
+# growth from one line to the next is what a subrequest and its check cost
+add_response_body_check(sub {
+    my ($block, $body, $req_idx, $repeated_req_idx, $dry_run) = @_;
+
+    my $max = $block->max_bytes_per_check;
+
+    return if !defined $max || $dry_run;
+
+    my @usage = map { /request pool holds (\d+) bytes in \d+ blocks and (\d+)/
+                      ? [$1, $2] : () }
+                @{ Test::Nginx::Util::error_log_data() };
+
+    my $growth = 0;
+
+    for my $i (1 .. $#usage) {
+        my $bytes = $usage[$i][0] - $usage[$i - 1][0];
+        $growth = $bytes if $bytes > $growth;
+    }
+
+    cmp_ok($growth, '<=', $max, $block->name . ' - bytes added per check');
+
+    # the reply is read into a buffer of the worker, not a pool page
+    is(scalar(grep { $_->[1] } @usage), 0,
+       $block->name . ' - no large allocations');
+});
+
+log_level('debug');
+no_long_string();
+#no_diff();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: pool usage of concurrent checks
+--- http_config eval: $::HttpConfig
+--- config
+    location = /ssi {
+        ssi on;
+        default_type text/html;
+        return 200 '<!--# include virtual="/hit" --><!--# include virtual="/hit" --><!--# include virtual="/hit" --><!--# include virtual="/hit" --><!--# include virtual="/hit" --><!--# include virtual="/hit" --><!--# include virtual="/hit" --><!--# include virtual="/hit" -->';
+    }
+
+    location /hit {
+        rate_limit $remote_addr requests=100 period=1m burst=99;
+        rate_limit_quantity 0;
+        rate_limit_prefix memory;
+        rate_limit_pass redis;
+
+        error_page 404 = @hit;
+    }
+
+    location @hit {
+        return 200 "ok\n";
+    }
+--- request
+    GET /ssi
+--- response_body eval
+"ok\n" x 8
+--- grep_error_log eval: qr/rate limit: request pool holds \d+ bytes in \d+ blocks and \d+ large allocations/
+--- grep_error_log_out eval
+qr/\A(?:rate limit: request pool holds \d+ bytes in \d+ blocks and \d+ large allocations\n){8}\z/
+--- no_error_log
+[error]
+
+=== TEST 2: pool growth of checks in a row
+--- http_config eval: $::HttpConfig
+--- config
+    location = /ssi {
+        ssi on;
+        default_type text/html;
+        return 200 '<!--# include virtual="/hit" wait="yes" --><!--# include virtual="/hit" wait="yes" --><!--# include virtual="/hit" wait="yes" --><!--# include virtual="/hit" wait="yes" --><!--# include virtual="/hit" wait="yes" --><!--# include virtual="/hit" wait="yes" --><!--# include virtual="/hit" wait="yes" --><!--# include virtual="/hit" wait="yes" -->';
+    }
+
+    location /hit {
+        rate_limit $remote_addr requests=100 period=1m burst=99;
+        rate_limit_quantity 0;
+        rate_limit_prefix memory;
+        rate_limit_pass redis;
+
+        error_page 404 = @hit;
+    }
+
+    location @hit {
+        return 200 "ok\n";
+    }
+--- request
+    GET /ssi
+--- response_body eval
+"ok\n" x 8
+--- max_bytes_per_check: 8192
+--- no_error_log
+[error]
@@ -0,0 +1,111 @@
+#!/usr/bin/env perl
+
+use Test::Nginx::Socket;
+
+plan tests => repeat_each() * 30;
+
+$ENV{TEST_NGINX_REDIS_PORT} ||= 6379;
+
+our $HttpConfig = qq{
+    upstream redis {
+        server 127.0.0.1:$ENV{TEST_NGINX_REDIS_PORT};
+    }
+
+    rate_limit_local_zone zone=a:1m;
+    rate_limit_policy_zone zone=p max=4;
+};
+
+our $Config = qq{
+    location /t {
+        rate_limit \$arg_k requests=100 period=1m burst=10;
+        rate_limit_prefix t;
+        rate_limit_local zone=a;
+        rate_limit_policy zone=p;
+
+        error_page 404 =200 \@hit;
+    }
+
+    location = /policy {
+        rate_limit_policy_api zone=p;
+    }
+
+    location \@hit {
+        default_type text/plain;
+        return 200 "200 OK\\n";
+    }
+};
+
+no_long_string();
+#no_diff();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: tighten a location at runtime
+--- http_config eval: $::HttpConfig
+--- config eval: $::Config
+--- request eval
+['POST /policy?location=/t&requests=1&burst=0', 'GET /t?k=1', 'GET /t?k=1']
+--- response_body_like eval
+['"version":2,"policies":\[\{"location":"/t","requests":1,"burst":0\}\]',
+ '200 OK', '429 Too Many Requests']
+--- error_code eval
+[200, 200, 429]
+
+=== TEST 2: removing an override of the key prefix restores the limit
+--- http_config eval: $::HttpConfig
+--- config eval: $::Config
+--- request eval
+['POST /policy?prefix=t&requests=1&period=1h&burst=0', 'GET /t?k=1',
+ 'GET /t?k=1', 'DELETE /policy?prefix=t', 'GET /t?k=2', 'GET /t?k=2']
+--- response_body_like eval
+['"prefix":"t","requests":1,"period":3600,"burst":0', '200 OK',
+ '429 Too Many Requests', '"version":3,"policies":\[\]', '200 OK', '200 OK']
+--- error_code eval
+[200, 200, 429, 200, 200, 200]
+
+=== TEST 3: an override without a limit is rejected
+--- http_config eval: $::HttpConfig
+--- config eval: $::Config
+--- request
+POST /policy?location=/t
+--- response_body_like: 400 Bad Request
+--- error_code: 400
+
+=== TEST 4: list and remove unknown overrides
+--- http_config eval: $::HttpConfig
+--- config eval: $::Config
+--- request eval
+['GET /policy', 'DELETE /policy?location=/none']
+--- response_body_like eval
+['^\{"version":1,"policies":\[\]\}$', '404 Not Found']
+--- error_code eval
+[200, 404]
+
+=== TEST 5: the override is sent to redis
+--- http_config eval: $::HttpConfig
+--- config
+    location /r {
+        rate_limit $arg_k requests=100 period=2s burst=10;
+        rate_limit_prefix policy_redis;
+        rate_limit_pass redis;
+        rate_limit_policy zone=p;
+
+        error_page 404 =200 @hit;
+    }
+
+    location = /policy {
+        rate_limit_policy_api zone=p;
+    }
+
+    location @hit {
+        default_type text/plain;
+        return 200 "200 OK\n";
+    }
+--- request eval
+['POST /policy?location=/r&requests=1&burst=0', 'GET /r?k=1', 'GET /r?k=1']
+--- response_body_like eval
+['"location":"/r","requests":1,"burst":0', '200 OK', '429 Too Many Requests']
+--- error_code eval
+[200, 200, 429]
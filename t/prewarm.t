@@ -0,0 +1,94 @@
+#!/usr/bin/env perl
+
+use Test::Nginx::Socket;
+use Time::HiRes qw(sleep);
+
+plan tests => repeat_each() * 9;
+
+# the connections taken from the pool are only logged by a debug build
+our $Debug = `$Test::Nginx::Util::NginxBinary -V 2>&1` =~ /--with-debug/;
+
+$ENV{TEST_NGINX_REDIS_PORT} ||= 6379;
+
+our $HttpConfig = qq{
+    upstream redis {
+       server 127.0.0.1:$ENV{TEST_NGINX_REDIS_PORT};
+
+       keepalive 16;
+    }
+
+    rate_limit_prewarm 4 ping=1s;
+};
+
+no_long_string();
+#no_diff();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: prewarmed connections
+--- http_config eval: $::HttpConfig
+--- config
+    location /hit {
+        rate_limit $remote_addr requests=100 period=1m;
+        rate_limit_quantity 0;
+        rate_limit_pass redis;
+
+        error_page 404 =200 @hit;
+    }
+
+    location @hit {
+        default_type text/plain;
+        return 200 "200 OK\n";
+    }
+--- request
+    GET /hit
+--- response_body_like: 200 OK
+--- error_code: 200
+--- no_error_log
+[error]
+
+=== TEST 2: the pool is full before the first request
+--- http_config eval: $::HttpConfig
+--- config
+    location /hit {
+        rate_limit $remote_addr requests=1 period=1m burst=0;
+        rate_limit_prefix prewarm_ready;
+        rate_limit_quantity 2;
+        rate_limit_pass redis;
+    }
+--- request
+    GET /hit
+--- error_code: 429
+--- error_log
+rate limit: 4 connections to upstream "redis" are ready
+rate limit exceeded
+
+=== TEST 3: a check takes a prewarmed connection instead of connecting
+--- http_config eval: $::HttpConfig
+--- config
+    location /hit {
+        rate_limit $remote_addr requests=100 period=1m;
+        rate_limit_quantity 0;
+        rate_limit_pass redis;
+
+        error_page 404 =200 @hit;
+    }
+
+    location @hit {
+        default_type text/plain;
+        return 200 "200 OK\n";
+    }
+--- skip_eval: 3: !$::Debug
+--- log_level: debug
+--- init
+sleep(0.5);
+--- request
+    GET /hit
+--- grep_error_log eval
+qr/connect to \S+, fd:\d+|rate limit: get prewarmed connection/
+--- grep_error_log_out eval
+qr/rate limit: get prewarmed connection\n\z/
+--- no_error_log
+[error]
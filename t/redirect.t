@@ -0,0 +1,113 @@
+#!/usr/bin/env perl
+
+use Test::Nginx::Socket;
+
+plan tests => repeat_each() * 9;
+
+$ENV{TEST_NGINX_REDIS_PORT} ||= 6379;
+
+our $HttpConfig = qq{
+    upstream redis {
+        server 127.0.0.1:$ENV{TEST_NGINX_REDIS_PORT};
+        keepalive 1024;
+    }
+};
+
+no_long_string();
+#no_diff();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: the decision is reused after an internal redirect
+--- http_config eval: $::HttpConfig
+--- config
+    rate_limit $remote_addr requests=1 period=1m burst=0;
+    rate_limit_prefix redirect;
+    rate_limit_pass redis;
+
+    location /missing {
+        error_page 404 =200 /t/a.txt;
+    }
+
+    location /t/ {
+    }
+--- user_files
+>>> t/a.txt
+hello
+--- request
+GET /missing
+--- response_body
+hello
+--- error_code: 200
+--- no_error_log
+rate limit exceeded
+
+=== TEST 2: checked again with rate_limit_recheck
+--- http_config eval: $::HttpConfig
+--- config
+    rate_limit $remote_addr requests=1 period=1m burst=0;
+    rate_limit_prefix redirect_recheck;
+    rate_limit_pass redis;
+
+    location /missing {
+        error_page 404 =200 /t/a.txt;
+    }
+
+    location /t/ {
+        rate_limit_recheck on;
+    }
+--- user_files
+>>> t/a.txt
+hello
+--- request
+GET /missing
+--- error_log
+rate limit exceeded
+
+=== TEST 3: a rejection of the sketch is reused after an internal redirect
+--- http_config
+    rate_limit_sketch_zone zone=redirect width=64 depth=2 slots=4 period=1m;
+--- config
+    location /t/ {
+        rate_limit $remote_addr;
+        rate_limit_sketch zone=redirect requests=1;
+
+        error_page 429 /t/limited.txt;
+    }
+--- user_files
+>>> t/a.txt
+hello
+>>> t/limited.txt
+limited
+--- pipelined_requests eval
+["GET /t/a.txt", "GET /t/a.txt"]
+--- error_code eval
+[200, 429]
+--- grep_error_log: rate limit exceeded
+--- grep_error_log_out
+rate limit exceeded
+
+=== TEST 4: a denied address is not checked again after an internal redirect
+--- http_config
+    rate_limit_sketch_zone zone=redirect width=64 depth=2 slots=4 period=1m;
+--- config
+    location /t/ {
+        rate_limit $remote_addr;
+        rate_limit_sketch zone=redirect requests=100;
+        rate_limit_deny $TEST_NGINX_HTML_DIR/deny.txt;
+
+        error_page 429 /t/limited.txt;
+    }
+--- user_files
+>>> deny.txt
+127.0.0.0/8
+>>> t/limited.txt
+limited
+--- request
+GET /t/a.txt
+--- error_code: 429
+--- grep_error_log: rate limit denied client address
+--- grep_error_log_out
+rate limit denied client address
@@ -0,0 +1,150 @@
+#!/usr/bin/env perl
+
+use Test::Nginx::Socket;
+
+plan tests => repeat_each() * 17;
+
+$ENV{TEST_NGINX_REDIS_PORT} ||= 6379;
+
+our $HttpConfig = qq{
+    upstream redis {
+        server 127.0.0.1:$ENV{TEST_NGINX_REDIS_PORT};
+        keepalive 1024;
+    }
+
+    upstream redis_replica {
+        server 127.0.0.1:$ENV{TEST_NGINX_REDIS_PORT};
+        keepalive 1024;
+    }
+
+    upstream redis_down {
+        server 127.0.0.1:1;
+    }
+
+    upstream redis_gone {
+        server 127.0.0.1:1;
+        server 127.0.0.1:2;
+    }
+
+    # a mock that closes the connection before a reply is complete
+    upstream redis_broken {
+        server 127.0.0.1:19490;
+    }
+};
+
+no_long_string();
+#no_diff();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: a quota check is answered by the replica
+--- http_config eval: $::HttpConfig
+--- config
+    location /quota {
+        rate_limit $remote_addr requests=10 period=1m burst=9;
+        rate_limit_prefix replica;
+        rate_limit_quantity 0;
+        rate_limit_pass redis_down;
+        rate_limit_pass_replica redis_replica;
+        rate_limit_headers on;
+
+        error_page 404 =200 @quota;
+    }
+
+    location @quota {
+        default_type text/plain;
+        return 200 "200 OK\n";
+    }
+--- request
+GET /quota
+--- response_headers
+X-RateLimit-Remaining: 10
+--- error_code: 200
+--- no_error_log
+[warn]
+
+=== TEST 2: a failed replica falls back to the primary
+--- http_config eval: $::HttpConfig
+--- config
+    location /quota {
+        rate_limit $remote_addr requests=10 period=1m burst=9;
+        rate_limit_prefix replica;
+        rate_limit_quantity 0;
+        rate_limit_pass redis;
+        rate_limit_pass_replica redis_down;
+        rate_limit_headers on;
+
+        error_page 404 =200 @quota;
+    }
+
+    location @quota {
+        default_type text/plain;
+        return 200 "200 OK\n";
+    }
+--- request
+GET /quota
+--- response_headers
+X-RateLimit-Remaining: 10
+--- raw_response_headers_unlike eval
+qr/X-RateLimit-Remaining(?s:.*)X-RateLimit-Remaining/
+--- error_code: 200
+--- error_log
+checking on the primary
+
+=== TEST 3: a replica that closes the connection falls back to the primary
+--- http_config eval: $::HttpConfig
+--- config
+    location /quota {
+        rate_limit $remote_addr requests=10 period=1m burst=9;
+        rate_limit_prefix replica;
+        rate_limit_quantity 0;
+        rate_limit_pass redis;
+        rate_limit_pass_replica redis_broken;
+        rate_limit_headers on;
+
+        error_page 404 =200 @quota;
+    }
+
+    location @quota {
+        default_type text/plain;
+        return 200 "200 OK\n";
+    }
+--- tcp_listen: 19490
+--- tcp_reply eval
+"*5\r\n:0\r\n"
+--- request
+GET /quota
+--- response_headers
+X-RateLimit-Remaining: 10
+--- error_code: 200
+--- error_log
+checking on the primary
+
+=== TEST 4: a replica without live servers falls back to the primary
+--- http_config eval: $::HttpConfig
+--- config
+    location /quota {
+        rate_limit $remote_addr requests=10 period=1m burst=9;
+        rate_limit_prefix replica;
+        rate_limit_quantity 0;
+        rate_limit_pass redis;
+        rate_limit_pass_replica redis_gone;
+        rate_limit_headers on;
+
+        error_page 404 =200 @quota;
+    }
+
+    location @quota {
+        default_type text/plain;
+        return 200 "$sent_http_x_ratelimit_remaining\n";
+    }
+--- pipelined_requests eval
+["GET /quota", "GET /quota", "GET /quota"]
+--- response_body eval
+["10\n", "10\n", "10\n"]
+--- error_code eval
+[200, 200, 200]
+--- error_log
+checking on the primary
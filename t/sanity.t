@@ -2,7 +2,7 @@
 
 use Test::Nginx::Socket;
 
-plan tests => repeat_each() * (blocks() * 10 - 2);
+plan tests => repeat_each() * (blocks() * 10 - 3);
 
 $ENV{TEST_NGINX_REDIS_PORT} ||= 6379;
 
@@ -101,3 +101,51 @@ X-RateLimit-Reset: 0
 --- response_body_like: 429 Too Many Requests
 --- error_code: 429
 --- error_log: rate limit exceeded for key "b_127.0.0.1"
+
+=== TEST 4: a period of less than a second
+--- http_config eval: $::HttpConfig
+--- config
+    location /hit {
+        rate_limit $remote_addr requests=4 period=500ms burst=3;
+        rate_limit_prefix ms;
+        rate_limit_pass redis;
+        rate_limit_headers on;
+
+        error_page 404 =200 @hit;
+    }
+
+    location @hit {
+        default_type text/plain;
+        return 200 "200 OK\n";
+    }
+--- request eval
+['GET /hit', 'GET /hit', 'GET /hit', 'GET /hit', 'GET /hit']
+--- response_headers eval
+['X-RateLimit-Remaining: 3', 'X-RateLimit-Remaining: 2', 'X-RateLimit-Remaining: 1', 'X-RateLimit-Remaining: 0', 'Retry-After: 1']
+--- response_body_like eval
+['200 OK', '200 OK', '200 OK', '200 OK', '429 Too Many Requests']
+--- error_code eval
+[200, 200, 200, 200, 429]
+
+=== TEST 5: a period without a unit is in seconds
+--- http_config eval: $::HttpConfig
+--- config
+    location /hit {
+        rate_limit $remote_addr requests=1 period=60 burst=0;
+        rate_limit_prefix unitless;
+        rate_limit_pass redis;
+        rate_limit_headers on;
+
+        error_page 404 =200 @hit;
+    }
+
+    location @hit {
+        default_type text/plain;
+        return 200 "200 OK\n";
+    }
+--- request eval
+['GET /hit', 'GET /hit']
+--- response_headers_like eval
+['X-RateLimit-Remaining: 0', 'Retry-After: (?:59|60)']
+--- error_code eval
+[200, 429]
@@ -0,0 +1,37 @@
+#!/usr/bin/env perl
+
+use Test::Nginx::Socket;
+
+plan tests => repeat_each() * (blocks() * 9);
+
+no_long_string();
+#no_diff();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: approximate limit without redis
+--- http_config
+    rate_limit_sketch_zone zone=flood width=64 depth=2 slots=4 period=1m;
+--- config
+    location /hit {
+        rate_limit $remote_addr;
+        rate_limit_sketch zone=flood requests=2;
+        rate_limit_headers on;
+
+        error_page 404 =200 @hit;
+    }
+
+    location @hit {
+        default_type text/plain;
+        return 200 "200 OK\n";
+    }
+--- request eval
+['GET /hit', 'GET /hit', 'GET /hit']
+--- response_headers eval
+['X-RateLimit-Remaining: 1', 'X-RateLimit-Remaining: 0', 'X-RateLimit-Limit: 2']
+--- response_body_like eval
+['200 OK', '200 OK', '429 Too Many Requests']
+--- error_code eval
+[200, 200, 429]
@@ -0,0 +1,110 @@
+#!/usr/bin/env perl
+
+use Test::Nginx::Socket;
+
+plan tests => repeat_each() * 19;
+
+$ENV{TEST_NGINX_REDIS_TLS_PORT} ||= 6380;
+$ENV{TEST_NGINX_REDIS_TLS_CA} ||= '/etc/redis-tls/ca.crt';
+
+our $HttpConfig = qq{
+    upstream redis_tls {
+        server 127.0.0.1:$ENV{TEST_NGINX_REDIS_TLS_PORT};
+        keepalive 16;
+    }
+
+    # a new connection for every check
+    upstream redis_tls_close {
+        server 127.0.0.1:$ENV{TEST_NGINX_REDIS_TLS_PORT};
+    }
+
+    rate_limit_ssl on;
+    rate_limit_ssl_name localhost;
+    rate_limit_ssl_verify on;
+    rate_limit_ssl_trusted_certificate $ENV{TEST_NGINX_REDIS_TLS_CA};
+};
+
+no_long_string();
+#no_diff();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: checks over TLS
+--- http_config eval: $::HttpConfig
+--- config
+    location /hit {
+        rate_limit $remote_addr requests=10 period=1m burst=9;
+        rate_limit_prefix ssl_hit;
+        rate_limit_pass redis_tls;
+
+        error_page 404 =200 @hit;
+    }
+
+    location @hit {
+        default_type text/plain;
+        return 200 "200 OK\n";
+    }
+--- pipelined_requests eval
+["GET /hit", "GET /hit"]
+--- error_code eval
+[200, 200]
+--- no_error_log
+[error]
+
+=== TEST 2: a kept connection makes one handshake
+--- http_config eval: $::HttpConfig
+--- config
+    location /hit {
+        rate_limit $remote_addr requests=10 period=1m burst=9;
+        rate_limit_prefix ssl_keepalive;
+        rate_limit_pass redis_tls;
+
+        error_page 404 =200 @hit;
+    }
+
+    location @hit {
+        default_type text/plain;
+        return 200 "200 OK\n";
+    }
+
+    location /metrics {
+        rate_limit_metrics;
+    }
+--- pipelined_requests eval
+["GET /hit", "GET /hit", "GET /metrics"]
+--- error_code eval
+[200, 200, 200]
+--- response_body_like eval
+["200 OK", "200 OK", "rate_limit_ssl_handshakes_total 1\n"]
+--- no_error_log
+[error]
+
+=== TEST 3: new connections resume the session
+--- http_config eval: $::HttpConfig
+--- config
+    location /hit {
+        rate_limit $remote_addr requests=10 period=1m burst=9;
+        rate_limit_prefix ssl_resume;
+        rate_limit_pass redis_tls_close;
+
+        error_page 404 =200 @hit;
+    }
+
+    location @hit {
+        default_type text/plain;
+        return 200 "200 OK\n";
+    }
+
+    location /metrics {
+        rate_limit_metrics;
+    }
+--- pipelined_requests eval
+["GET /hit", "GET /hit", "GET /hit", "GET /metrics"]
+--- error_code eval
+[200, 200, 200, 200]
+--- response_body_like eval
+["200 OK", "200 OK", "200 OK", "rate_limit_ssl_handshakes_reused_total 2\n"]
+--- no_error_log
+[error]
@@ -0,0 +1,89 @@
+#!/usr/bin/env perl
+
+use Test::Nginx::Socket;
+
+plan tests => repeat_each() * (blocks() * 3 + 1);
+
+# outside of the server root, which is set up again for every block
+$ENV{TEST_NGINX_STATE_FILE} ||= '/tmp/rate_limit_test_flood.state';
+
+# a file of an earlier run would be loaded by TEST 2
+unlink $ENV{TEST_NGINX_STATE_FILE};
+
+our $HttpConfig = qq{
+    rate_limit_sketch_zone zone=flood width=64 depth=2 slots=4 period=1m
+                           state=$ENV{TEST_NGINX_STATE_FILE};
+};
+
+no_long_string();
+#no_diff();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: zone with a state file
+--- http_config
+    rate_limit_sketch_zone zone=flood width=64 depth=2 slots=4 period=1m
+                           state=logs/flood.state;
+--- config
+    location /hit {
+        rate_limit $remote_addr;
+        rate_limit_sketch zone=flood requests=2;
+
+        error_page 404 =200 @hit;
+    }
+
+    location @hit {
+        default_type text/plain;
+        return 200 "200 OK\n";
+    }
+--- request
+    GET /hit
+--- response_body_like: 200 OK
+--- error_code: 200
+--- no_error_log
+[crit]
+
+=== TEST 2: counts are saved when nginx stops
+--- http_config eval: $::HttpConfig
+--- config
+    location /hit {
+        rate_limit $remote_addr;
+        rate_limit_sketch zone=flood requests=2;
+
+        error_page 404 =200 @hit;
+    }
+
+    location @hit {
+        default_type text/plain;
+        return 200 "200 OK\n";
+    }
+--- pipelined_requests eval
+["GET /hit", "GET /hit", "GET /hit"]
+--- error_code eval
+[200, 200, 429]
+--- no_error_log
+[crit]
+
+=== TEST 3: and loaded when it starts again
+--- http_config eval: $::HttpConfig
+--- config
+    location /hit {
+        rate_limit $remote_addr;
+        rate_limit_sketch zone=flood requests=2;
+
+        error_page 404 =200 @hit;
+    }
+
+    location @hit {
+        default_type text/plain;
+        return 200 "200 OK\n";
+    }
+--- request
+    GET /hit
+--- error_code: 429
+--- error_log
+loaded zone "flood" from
+--- no_error_log
+[crit]
@@ -0,0 +1,91 @@
+#!/usr/bin/env perl
+
+use Test::Nginx::Socket;
+
+plan tests => repeat_each() * (blocks() * 2);
+
+$ENV{TEST_NGINX_REDIS_PORT} ||= 6379;
+
+our $StreamConfig = qq{
+    upstream redis {
+        server 127.0.0.1:$ENV{TEST_NGINX_REDIS_PORT};
+    }
+};
+
+no_long_string();
+#no_diff();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: preaccess check
+--- stream_config eval: $::StreamConfig
+--- stream_server_config
+    rate_limit $remote_addr requests=10 period=1m burst=9;
+    rate_limit_prefix stream_preaccess;
+    rate_limit_pass redis;
+
+    return "ok\n";
+--- stream_request
+hello
+--- stream_response
+ok
+--- no_error_log
+[error]
+
+=== TEST 2: preread check is answered without more client data
+--- stream_config eval: $::StreamConfig
+--- stream_server_config
+    preread_timeout 30s;
+
+    rate_limit $remote_addr requests=10 period=1m burst=9;
+    rate_limit_prefix stream_preread;
+    rate_limit_preread on;
+    rate_limit_pass redis;
+
+    return "ok\n";
+--- stream_request
+hello
+--- stream_response
+ok
+--- no_error_log
+[error]
+
+=== TEST 3: preread check rejects
+--- stream_config eval: $::StreamConfig
+--- stream_server_config
+    preread_timeout 30s;
+
+    rate_limit $remote_addr requests=1 period=1m burst=0;
+    rate_limit_prefix stream_rejected;
+    rate_limit_quantity 2;
+    rate_limit_preread on;
+    rate_limit_pass redis;
+
+    return "ok\n";
+--- stream_request
+hello
+--- stream_response_like: ^$
+--- error_log
+rate limit exceeded for key "stream_rejected_127.0.0.1"
+
+=== TEST 4: a redis server that cannot be connected to is marked failed
+--- stream_config eval
+qq{
+    upstream redis_failing {
+        server 127.0.0.1:1;
+        server 127.0.0.1:$ENV{TEST_NGINX_REDIS_PORT};
+    }
+}
+--- stream_server_config
+    rate_limit $remote_addr requests=10 period=1m burst=9;
+    rate_limit_prefix stream_failed;
+    rate_limit_pass redis_failing;
+
+    return "ok\n";
+--- stream_request
+hello
+--- stream_response_like: ^$
+--- error_log
+upstream server temporarily disabled
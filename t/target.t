@@ -0,0 +1,183 @@
+#!/usr/bin/env perl
+
+use Test::Nginx::Socket;
+
+plan tests => repeat_each() * 14;
+
+$ENV{TEST_NGINX_REDIS_PORT} ||= 6379;
+
+our $HttpConfig = qq{
+    upstream redis {
+        server 127.0.0.1:$ENV{TEST_NGINX_REDIS_PORT};
+        keepalive 16;
+    }
+
+    rate_limit_pass_keepalive 4 timeout=10s;
+};
+
+# the reuse of connections is only logged by a debug build
+our $NoDebug = `$Test::Nginx::Util::NginxBinary -V 2>&1` !~ /--with-debug/;
+
+# Answers a query of the resolver with 127.0.0.1 for 30 seconds
+sub dns_reply {
+    my ($query) = @_;
+
+    my $id = unpack("n", $query);
+
+    my $name = "redis.test";
+    $name =~ s/([^.]+)\.?/chr(length($1)) . $1/ge;
+    $name .= "\0";
+
+    # a response, recursion desired and available, no error
+    my $s = pack("nn", $id, 0x8180);
+
+    # one question and one answer
+    $s .= pack("nnnn", 1, 1, 0, 0);
+
+    # the question: A, IN
+    $s .= $name . pack("nn", 1, 1);
+
+    # the answer, named by a pointer to the question
+    $s .= pack("nnnNn", 0xc00c, 1, 1, 30, 4) . pack("C4", 127, 0, 0, 1);
+
+    return $s;
+}
+
+no_long_string();
+#no_diff();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: a host:port target from a variable
+--- http_config eval: $::HttpConfig
+--- config
+    location /hit {
+        set $redis_target 127.0.0.1:$TEST_NGINX_REDIS_PORT;
+
+        rate_limit $remote_addr requests=10 period=1m burst=9;
+        rate_limit_prefix target_address;
+        rate_limit_pass $redis_target;
+
+        error_page 404 =200 @hit;
+    }
+
+    location @hit {
+        default_type text/plain;
+        return 200 "200 OK\n";
+    }
+--- pipelined_requests eval
+["GET /hit", "GET /hit"]
+--- error_code eval
+[200, 200]
+--- no_error_log
+[error]
+
+=== TEST 2: the name of an upstream block is not resolved
+--- http_config eval: $::HttpConfig
+--- config
+    location /hit {
+        set $redis_target redis;
+
+        rate_limit $remote_addr requests=10 period=1m burst=9;
+        rate_limit_prefix target_upstream;
+        rate_limit_pass $redis_target;
+
+        error_page 404 =200 @hit;
+    }
+
+    location @hit {
+        default_type text/plain;
+        return 200 "200 OK\n";
+    }
+--- request
+GET /hit
+--- error_code: 200
+--- no_error_log
+[error]
+
+=== TEST 3: a host name needs a resolver
+--- http_config eval: $::HttpConfig
+--- config
+    location /hit {
+        set $redis_target redis.invalid:6379;
+
+        rate_limit $remote_addr requests=10 period=1m burst=9;
+        rate_limit_prefix target_host;
+        rate_limit_pass $redis_target;
+
+        error_page 404 =200 @hit;
+    }
+
+    location @hit {
+        default_type text/plain;
+        return 200 "200 OK\n";
+    }
+--- request
+GET /hit
+--- error_code: 500
+--- error_log
+rate limit: no resolver defined to resolve redis.invalid
+
+=== TEST 4: a host name is resolved
+--- http_config eval: $::HttpConfig
+--- config
+    location /hit {
+        set $redis_target redis.test:$TEST_NGINX_REDIS_PORT;
+
+        resolver 127.0.0.1:19530 ipv6=off;
+
+        rate_limit $remote_addr requests=10 period=1m burst=9;
+        rate_limit_prefix target_resolved;
+        rate_limit_pass $redis_target;
+
+        error_page 404 =200 @hit;
+    }
+
+    location @hit {
+        default_type text/plain;
+        return 200 "200 OK\n";
+    }
+--- udp_listen: 19530
+--- udp_reply eval: \&::dns_reply
+--- pipelined_requests eval
+["GET /hit", "GET /hit"]
+--- error_code eval
+[200, 200]
+--- no_error_log
+[error]
+
+=== TEST 5: a resolved target keeps its connection
+--- skip_eval: 4: $::NoDebug
+--- http_config eval: $::HttpConfig
+--- config
+    location /hit {
+        set $redis_target redis.test:$TEST_NGINX_REDIS_PORT;
+
+        resolver 127.0.0.1:19530 ipv6=off;
+
+        rate_limit $remote_addr requests=10 period=1m burst=9;
+        rate_limit_prefix target_cached;
+        rate_limit_pass $redis_target;
+
+        error_page 404 =200 @hit;
+    }
+
+    location @hit {
+        default_type text/plain;
+        return 200 "200 OK\n";
+    }
+--- udp_listen: 19530
+--- udp_reply eval: \&::dns_reply
+--- pipelined_requests eval
+["GET /hit", "GET /hit"]
+--- error_code eval
+[200, 200]
+--- grep_error_log eval: qr/rate limit: (?:get cached|keep) connection/
+--- grep_error_log_out
+rate limit: keep connection
+rate limit: get cached connection
+rate limit: keep connection
+--- no_error_log
+[error]
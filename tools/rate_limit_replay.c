@@ -0,0 +1,1068 @@
+/*
+ * Replays access logs through the GCRA of the module, to see what a
+ * configuration would have rejected before it is rolled out.
+ *
+ * The logs are mapped and read in rounds. In each round, every thread
+ * parses a slice of lines and sorts the requests by key into one bucket
+ * per thread; then every thread runs the requests of its keys, from all
+ * slices in order. A key is only ever handled by one thread, so the state
+ * needs no locks and the requests of a key keep the order of the log.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/ngx_rate_limit_gcra.h"
+
+/* the input of a thread per round */
+#define REPLAY_SLICE_SIZE (64 * 1024 * 1024)
+
+#define REPLAY_MAX_TIERS 16
+#define REPLAY_MAX_THREADS 256
+
+typedef struct {
+    const char *name;
+    size_t      len;
+
+    uint64_t requests;
+    uint64_t period; /* msec */
+    uint64_t burst;
+    uint64_t quantity;
+
+    uint64_t interval; /* usec */
+} replay_rule_t;
+
+typedef struct {
+    uint64_t    hash;
+    uint64_t    time; /* usec */
+    const char *key;
+    uint32_t    len;
+    uint32_t    tier;
+} replay_record_t;
+
+typedef struct {
+    replay_record_t *elts;
+    size_t           nelts;
+    size_t           nalloc;
+} replay_bucket_t;
+
+typedef struct {
+    uint64_t hash;
+    uint64_t tat;
+    uint64_t allowed;
+    uint64_t rejected;
+    char    *key;
+    uint32_t len;
+    uint32_t tier;
+} replay_key_t;
+
+typedef struct {
+    replay_key_t *keys;
+    size_t        nkeys;
+    size_t        mask;
+
+    /* the keys are copied here, the logs are unmapped after a file */
+    char  *arena;
+    size_t arena_left;
+
+    /* commands per second of log time, from the first request on */
+    uint32_t *seconds;
+    size_t    nseconds;
+
+    uint64_t requests[REPLAY_MAX_TIERS];
+    uint64_t rejected[REPLAY_MAX_TIERS];
+} replay_shard_t;
+
+typedef struct {
+    const char *start;
+    const char *end;
+
+    /* one per shard */
+    replay_bucket_t *buckets;
+
+    uint64_t lines;
+    uint64_t skipped;
+} replay_slice_t;
+
+typedef struct {
+    replay_rule_t rules[REPLAY_MAX_TIERS];
+    size_t        nrules;
+
+    int key_field;
+    int time_field;
+    int tier_field;
+
+    size_t nthreads;
+    size_t top;
+
+    /* the second of the first request */
+    int64_t base;
+
+    replay_slice_t slices[REPLAY_MAX_THREADS];
+    replay_shard_t shards[REPLAY_MAX_THREADS];
+} replay_t;
+
+typedef struct {
+    replay_t *replay;
+    size_t    index;
+} replay_job_t;
+
+static void *replay_alloc(size_t size);
+static int replay_parse_rule(replay_t *rp, char *s);
+static int64_t replay_parse_period(const char *s, size_t len);
+static int replay_file(replay_t *rp, const char *path);
+static void replay_round(replay_t *rp, const char *start, const char *end);
+static void *replay_parse_slice(void *data);
+static int replay_parse_line(replay_t *rp, const char *p, const char *last,
+                             replay_record_t *rec);
+static int64_t replay_parse_time(const char *p, const char *last);
+static int64_t replay_days_from_civil(int64_t y, unsigned m, unsigned d);
+static void *replay_run_shard(void *data);
+static replay_key_t *replay_key(replay_shard_t *shard, replay_record_t *rec);
+static void replay_count(replay_t *rp, replay_shard_t *shard, uint64_t time);
+static void replay_report(replay_t *rp, double elapsed);
+static int replay_cmp_rejected(const void *one, const void *two);
+
+static const char *replay_months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+
+static void
+replay_usage(void)
+{
+    fprintf(stderr,
+            "usage: rate_limit_replay -r rule [-r rule ...] [options] "
+            "log ...\n\n"
+            "  -r rule   \"[tier=NAME] requests=N period=TIME [burst=N] "
+            "[quantity=N]\",\n"
+            "            the first rule is used for keys of no other tier\n"
+            "  -k field  the field of the key (1, $remote_addr in the "
+            "combined format)\n"
+            "  -t field  the field of the time, $msec or [$time_local] "
+            "(4)\n"
+            "  -c field  the field that names the tier of a request "
+            "(none)\n"
+            "  -j n      the number of threads (the number of CPUs)\n"
+            "  -n n      the number of keys listed with the most "
+            "rejections (10)\n\n"
+            "Fields are separated by spaces and counted from 1.\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    int             ch, i;
+    long            n;
+    double          elapsed;
+    replay_t       *rp;
+    struct timespec start, end;
+
+    rp = replay_alloc(sizeof(replay_t));
+    memset(rp, 0, sizeof(replay_t));
+
+    rp->key_field = 1;
+    rp->time_field = 4;
+    rp->tier_field = 0;
+    rp->top = 10;
+    rp->base = -1;
+
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+    rp->nthreads = (n > 0) ? (size_t) n : 1;
+
+    while ((ch = getopt(argc, argv, "r:k:t:c:j:n:h")) != -1) {
+        switch (ch) {
+
+        case 'r':
+            if (replay_parse_rule(rp, optarg) != 0) {
+                fprintf(stderr, "invalid rule \"%s\"\n", optarg);
+                return 1;
+            }
+            break;
+
+        case 'k':
+        case 't':
+        case 'c':
+            n = strtol(optarg, NULL, 10);
+            if (n <= 0) {
+                fprintf(stderr, "invalid field \"%s\"\n", optarg);
+                return 1;
+            }
+
+            if (ch == 'k') {
+                rp->key_field = (int) n;
+
+            } else if (ch == 't') {
+                rp->time_field = (int) n;
+
+            } else {
+                rp->tier_field = (int) n;
+            }
+            break;
+
+        case 'j':
+            n = strtol(optarg, NULL, 10);
+            if (n <= 0 || n > REPLAY_MAX_THREADS) {
+                fprintf(stderr, "invalid number of threads \"%s\"\n",
+                        optarg);
+                return 1;
+            }
+
+            rp->nthreads = (size_t) n;
+            break;
+
+        case 'n':
+            n = strtol(optarg, NULL, 10);
+            if (n < 0) {
+                fprintf(stderr, "invalid number of keys \"%s\"\n", optarg);
+                return 1;
+            }
+
+            rp->top = (size_t) n;
+            break;
+
+        default:
+            replay_usage();
+            return 1;
+        }
+    }
+
+    if (rp->nrules == 0 || optind == argc) {
+        replay_usage();
+        return 1;
+    }
+
+    if (rp->nthreads > REPLAY_MAX_THREADS) {
+        rp->nthreads = REPLAY_MAX_THREADS;
+    }
+
+    for (i = 0; i < (int) rp->nthreads; i++) {
+        rp->slices[i].buckets =
+            replay_alloc(rp->nthreads * sizeof(replay_bucket_t));
+        memset(rp->slices[i].buckets, 0,
+               rp->nthreads * sizeof(replay_bucket_t));
+
+        rp->shards[i].mask = 1023;
+        rp->shards[i].keys = replay_alloc(1024 * sizeof(replay_key_t));
+        memset(rp->shards[i].keys, 0, 1024 * sizeof(replay_key_t));
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (i = optind; i < argc; i++) {
+        if (replay_file(rp, argv[i]) != 0) {
+            return 1;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    elapsed = (double) (end.tv_sec - start.tv_sec) +
+              (double) (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    replay_report(rp, elapsed);
+
+    return 0;
+}
+
+static void *
+replay_alloc(size_t size)
+{
+    void *p;
+
+    p = malloc(size);
+    if (p == NULL) {
+        fprintf(stderr, "malloc(%zu) failed\n", size);
+        exit(1);
+    }
+
+    return p;
+}
+
+/* "tier=premium requests=100 period=1m burst=50", as in rate_limit */
+static int
+replay_parse_rule(replay_t *rp, char *s)
+{
+    char          *p, *value;
+    int64_t        period;
+    replay_rule_t *rule;
+
+    if (rp->nrules == REPLAY_MAX_TIERS) {
+        return -1;
+    }
+
+    rule = &rp->rules[rp->nrules];
+
+    rule->name = (rp->nrules == 0) ? "default" : NULL;
+    rule->requests = 1;
+    rule->period = 60000;
+    rule->burst = 0;
+    rule->quantity = 1;
+
+    for (p = strtok(s, " ,"); p; p = strtok(NULL, " ,")) {
+        value = strchr(p, '=');
+        if (value == NULL) {
+            return -1;
+        }
+
+        *value++ = '\0';
+
+        if (strcmp(p, "tier") == 0) {
+            rule->name = value;
+
+        } else if (strcmp(p, "requests") == 0) {
+            rule->requests = strtoull(value, NULL, 10);
+            if (rule->requests == 0) {
+                return -1;
+            }
+
+        } else if (strcmp(p, "period") == 0) {
+            period = replay_parse_period(value, strlen(value));
+            if (period <= 0) {
+                return -1;
+            }
+
+            rule->period = (uint64_t) period;
+
+        } else if (strcmp(p, "burst") == 0) {
+            rule->burst = strtoull(value, NULL, 10);
+
+        } else if (strcmp(p, "quantity") == 0) {
+            rule->quantity = strtoull(value, NULL, 10);
+
+        } else {
+            return -1;
+        }
+    }
+
+    if (rule->name == NULL) {
+        return -1;
+    }
+
+    rule->len = strlen(rule->name);
+    rule->interval =
+        ngx_rate_limit_gcra_interval(rule->requests, rule->period * 1000);
+
+    rp->nrules++;
+
+    return 0;
+}
+
+/* Reference: ngx_parse_time, in msec */
+static int64_t
+replay_parse_period(const char *s, size_t len)
+{
+    size_t  i;
+    int64_t total, value, scale;
+
+    total = 0;
+    value = 0;
+
+    for (i = 0; i < len; i++) {
+
+        if (s[i] >= '0' && s[i] <= '9') {
+            value = value * 10 + (s[i] - '0');
+            continue;
+        }
+
+        switch (s[i]) {
+        case 'd':
+            scale = 86400000;
+            break;
+        case 'h':
+            scale = 3600000;
+            break;
+        case 'm':
+            if (i + 1 < len && s[i + 1] == 's') {
+                i++;
+                scale = 1;
+                break;
+            }
+
+            scale = 60000;
+            break;
+        case 's':
+            scale = 1000;
+            break;
+        default:
+            return -1;
+        }
+
+        total += value * scale;
+        value = 0;
+    }
+
+    /* a plain number is seconds */
+    return total + value * 1000;
+}
+
+static int
+replay_file(replay_t *rp, const char *path)
+{
+    int         fd;
+    size_t      round;
+    const char *data, *p, *last, *end;
+    struct stat sb;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "open(\"%s\") failed: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    if (fstat(fd, &sb) == -1) {
+        fprintf(stderr, "fstat(\"%s\") failed: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if (sb.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+
+    data = mmap(NULL, (size_t) sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "mmap(\"%s\") failed: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    close(fd);
+
+    (void) madvise((void *) data, (size_t) sb.st_size, MADV_SEQUENTIAL);
+
+    last = data + sb.st_size;
+    round = rp->nthreads * REPLAY_SLICE_SIZE;
+
+    for (p = data; p < last; p = end) {
+        end = ((size_t) (last - p) > round) ? p + round : last;
+
+        /* a round ends with a whole line */
+        while (end < last && end[-1] != '\n') {
+            end++;
+        }
+
+        replay_round(rp, p, end);
+
+        /* the pages of the round are not needed again */
+        (void) madvise((void *) data, (size_t) (end - data), MADV_DONTNEED);
+    }
+
+    munmap((void *) data, (size_t) sb.st_size);
+
+    return 0;
+}
+
+static void
+replay_round(replay_t *rp, const char *start, const char *end)
+{
+    size_t          i, size;
+    const char     *p, *eol;
+    pthread_t       threads[REPLAY_MAX_THREADS];
+    replay_job_t    jobs[REPLAY_MAX_THREADS];
+    replay_record_t rec;
+
+    size = (size_t) (end - start) / rp->nthreads + 1;
+
+    p = start;
+
+    for (i = 0; i < rp->nthreads; i++) {
+        rp->slices[i].start = p;
+
+        p = ((size_t) (end - p) > size) ? p + size : end;
+
+        while (p < end && p[-1] != '\n') {
+            p++;
+        }
+
+        rp->slices[i].end = p;
+    }
+
+    /* the time of the first request sets the base of the counts */
+    if (rp->base == -1) {
+        for (p = start; p < end; p++) {
+            eol = memchr(p, '\n', (size_t) (end - p));
+
+            if (eol == NULL) {
+                eol = end;
+            }
+
+            if (replay_parse_line(rp, p, eol, &rec) == 0) {
+                rp->base = (int64_t) (rec.time / 1000000);
+                break;
+            }
+
+            p = eol;
+        }
+    }
+
+    for (i = 0; i < rp->nthreads; i++) {
+        jobs[i].replay = rp;
+        jobs[i].index = i;
+
+        if (pthread_create(&threads[i], NULL, replay_parse_slice, &jobs[i])) {
+            fprintf(stderr, "pthread_create() failed\n");
+            exit(1);
+        }
+    }
+
+    for (i = 0; i < rp->nthreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (i = 0; i < rp->nthreads; i++) {
+        if (pthread_create(&threads[i], NULL, replay_run_shard, &jobs[i])) {
+            fprintf(stderr, "pthread_create() failed\n");
+            exit(1);
+        }
+    }
+
+    for (i = 0; i < rp->nthreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+static void *
+replay_parse_slice(void *data)
+{
+    replay_job_t *job = data;
+
+    size_t           i;
+    replay_t        *rp;
+    const char      *p, *eol;
+    replay_slice_t  *slice;
+    replay_bucket_t *bucket;
+    replay_record_t  rec;
+
+    rp = job->replay;
+    slice = &rp->slices[job->index];
+
+    for (i = 0; i < rp->nthreads; i++) {
+        slice->buckets[i].nelts = 0;
+    }
+
+    for (p = slice->start; p < slice->end; p = eol + 1) {
+        eol = memchr(p, '\n', (size_t) (slice->end - p));
+
+        if (eol == NULL) {
+            eol = slice->end;
+        }
+
+        if (eol == p) {
+            continue;
+        }
+
+        slice->lines++;
+
+        if (replay_parse_line(rp, p, eol, &rec) != 0) {
+            slice->skipped++;
+            continue;
+        }
+
+        bucket = &slice->buckets[(rec.hash >> 32) % rp->nthreads];
+
+        if (bucket->nelts == bucket->nalloc) {
+            bucket->nalloc = bucket->nalloc ? bucket->nalloc * 2 : 4096;
+            bucket->elts = realloc(bucket->elts,
+                                   bucket->nalloc * sizeof(replay_record_t));
+            if (bucket->elts == NULL) {
+                fprintf(stderr, "realloc() failed\n");
+                exit(1);
+            }
+        }
+
+        bucket->elts[bucket->nelts++] = rec;
+    }
+
+    return NULL;
+}
+
+static int
+replay_parse_line(replay_t *rp, const char *p, const char *last,
+                  replay_record_t *rec)
+{
+    int         field;
+    size_t      i, len;
+    int64_t     time;
+    uint64_t    hash;
+    const char *start, *key, *tier, *when;
+    size_t      key_len, tier_len;
+
+    key = NULL;
+    tier = NULL;
+    when = NULL;
+    key_len = 0;
+    tier_len = 0;
+
+    for (field = 1; p < last; field++) {
+        while (p < last && *p == ' ') {
+            p++;
+        }
+
+        start = p;
+
+        while (p < last && *p != ' ') {
+            p++;
+        }
+
+        len = (size_t) (p - start);
+
+        if (field == rp->key_field) {
+            key = start;
+            key_len = len;
+        }
+
+        if (field == rp->time_field) {
+            when = start;
+        }
+
+        if (field == rp->tier_field) {
+            tier = start;
+            tier_len = len;
+        }
+    }
+
+    /* an empty key is not limited, as in the module */
+    if (key == NULL || key_len == 0 || (key_len == 1 && *key == '-')) {
+        return -1;
+    }
+
+    if (when == NULL) {
+        return -1;
+    }
+
+    time = replay_parse_time(when, last);
+    if (time < 0) {
+        return -1;
+    }
+
+    /* FNV-1a */
+    hash = 14695981039346656037ULL;
+
+    for (i = 0; i < key_len; i++) {
+        hash ^= (unsigned char) key[i];
+        hash *= 1099511628211ULL;
+    }
+
+    rec->hash = hash;
+    rec->time = (uint64_t) time;
+    rec->key = key;
+    rec->len = (uint32_t) key_len;
+    rec->tier = 0;
+
+    if (tier) {
+        for (i = 1; i < rp->nrules; i++) {
+            if (rp->rules[i].len == tier_len &&
+                memcmp(rp->rules[i].name, tier, tier_len) == 0) {
+                rec->tier = (uint32_t) i;
+                break;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * "1760795736.123" ($msec), or "[18/Oct/2026:13:55:36 +0000]"
+ * ($time_local), in usec since the epoch
+ */
+static int64_t
+replay_parse_time(const char *p, const char *last)
+{
+    int64_t     sec, usec, scale, days, offset;
+    unsigned    day, month, year, hour, min, s;
+    const char *m;
+
+    if (*p != '[') {
+        sec = 0;
+
+        while (p < last && *p >= '0' && *p <= '9') {
+            sec = sec * 10 + (*p++ - '0');
+        }
+
+        usec = 0;
+        scale = 1000000;
+
+        if (p < last && *p == '.') {
+            for (p++; p < last && *p >= '0' && *p <= '9'; p++) {
+                scale /= 10;
+                usec += (*p - '0') * scale;
+            }
+        }
+
+        if (p < last && *p != ' ') {
+            return -1;
+        }
+
+        return sec * 1000000 + usec;
+    }
+
+    /* [dd/Mon/yyyy:hh:mm:ss +zzzz] */
+
+    if (last - p < (int) sizeof("[18/Oct/2026:13:55:36 +0000]") - 1) {
+        return -1;
+    }
+
+    if (p[3] != '/' || p[7] != '/' || p[12] != ':' || p[15] != ':' ||
+        p[18] != ':' || p[21] != ' ') {
+        return -1;
+    }
+
+    for (m = replay_months; *m; m += 3) {
+        if (memcmp(m, p + 4, 3) == 0) {
+            break;
+        }
+    }
+
+    if (*m == '\0') {
+        return -1;
+    }
+
+    day = (unsigned) ((p[1] - '0') * 10 + (p[2] - '0'));
+    month = (unsigned) ((m - replay_months) / 3 + 1);
+    year = (unsigned) ((p[8] - '0') * 1000 + (p[9] - '0') * 100 +
+                       (p[10] - '0') * 10 + (p[11] - '0'));
+    hour = (unsigned) ((p[13] - '0') * 10 + (p[14] - '0'));
+    min = (unsigned) ((p[16] - '0') * 10 + (p[17] - '0'));
+    s = (unsigned) ((p[19] - '0') * 10 + (p[20] - '0'));
+
+    offset = ((p[23] - '0') * 10 + (p[24] - '0')) * 3600 +
+             ((p[25] - '0') * 10 + (p[26] - '0')) * 60;
+
+    if (p[22] == '-') {
+        offset = -offset;
+    }
+
+    days = replay_days_from_civil(year, month, day);
+
+    sec = days * 86400 + hour * 3600 + min * 60 + s - offset;
+
+    return sec * 1000000;
+}
+
+/* Reference: http://howardhinnant.github.io/date_algorithms.html */
+static int64_t
+replay_days_from_civil(int64_t y, unsigned m, unsigned d)
+{
+    int64_t  era;
+    unsigned yoe, doy, doe;
+
+    y -= m <= 2;
+    era = (y >= 0 ? y : y - 399) / 400;
+    yoe = (unsigned) (y - era * 400);
+    doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+    return era * 146097 + (int64_t) doe - 719468;
+}
+
+static void *
+replay_run_shard(void *data)
+{
+    replay_job_t *job = data;
+
+    size_t                i, j;
+    replay_t             *rp;
+    replay_key_t         *k;
+    replay_rule_t        *rule;
+    replay_shard_t       *shard;
+    replay_bucket_t      *bucket;
+    replay_record_t      *rec;
+    ngx_rate_limit_gcra_t res;
+
+    rp = job->replay;
+    shard = &rp->shards[job->index];
+
+    /* the slices in the order of the log */
+    for (i = 0; i < rp->nthreads; i++) {
+        bucket = &rp->slices[i].buckets[job->index];
+
+        for (j = 0; j < bucket->nelts; j++) {
+            rec = &bucket->elts[j];
+            rule = &rp->rules[rec->tier];
+
+            k = replay_key(shard, rec);
+
+            ngx_rate_limit_gcra(&k->tat, rec->time, rule->interval,
+                                rule->burst, rule->quantity, &res);
+
+            if (res.limited) {
+                k->rejected++;
+                shard->rejected[rec->tier]++;
+
+            } else {
+                k->allowed++;
+            }
+
+            shard->requests[rec->tier]++;
+
+            replay_count(rp, shard, rec->time);
+        }
+    }
+
+    return NULL;
+}
+
+static replay_key_t *
+replay_key(replay_shard_t *shard, replay_record_t *rec)
+{
+    size_t        i, j, n;
+    replay_key_t *k, *keys;
+
+    for (i = rec->hash & shard->mask;; i = (i + 1) & shard->mask) {
+        k = &shard->keys[i];
+
+        if (k->key == NULL) {
+            break;
+        }
+
+        if (k->hash == rec->hash && k->len == rec->len &&
+            memcmp(k->key, rec->key, rec->len) == 0) {
+            return k;
+        }
+    }
+
+    if (shard->arena_left < rec->len) {
+        shard->arena_left = 1024 * 1024;
+        shard->arena = replay_alloc(shard->arena_left);
+    }
+
+    k->hash = rec->hash;
+    k->tat = 0;
+    k->allowed = 0;
+    k->rejected = 0;
+    k->key = shard->arena;
+    k->len = rec->len;
+    k->tier = rec->tier;
+
+    memcpy(shard->arena, rec->key, rec->len);
+    shard->arena += rec->len;
+    shard->arena_left -= rec->len;
+
+    if (++shard->nkeys * 10 < (shard->mask + 1) * 7) {
+        return k;
+    }
+
+    /* twice as large once 70% full */
+
+    n = (shard->mask + 1) * 2;
+
+    keys = replay_alloc(n * sizeof(replay_key_t));
+    memset(keys, 0, n * sizeof(replay_key_t));
+
+    for (i = 0; i <= shard->mask; i++) {
+        if (shard->keys[i].key == NULL) {
+            continue;
+        }
+
+        for (j = shard->keys[i].hash & (n - 1); keys[j].key;
+             j = (j + 1) & (n - 1)) {
+            /* void */
+        }
+
+        keys[j] = shard->keys[i];
+
+        if (&shard->keys[i] == k) {
+            k = &keys[j];
+        }
+    }
+
+    free(shard->keys);
+
+    shard->keys = keys;
+    shard->mask = n - 1;
+
+    return k;
+}
+
+static void
+replay_count(replay_t *rp, replay_shard_t *shard, uint64_t time)
+{
+    size_t  n;
+    int64_t sec;
+
+    sec = (int64_t) (time / 1000000) - rp->base;
+
+    /* a line out of order before the first one */
+    if (sec < 0) {
+        sec = 0;
+    }
+
+    if ((size_t) sec >= shard->nseconds) {
+        n = shard->nseconds ? shard->nseconds : 4096;
+
+        while (n <= (size_t) sec) {
+            n *= 2;
+        }
+
+        shard->seconds = realloc(shard->seconds, n * sizeof(uint32_t));
+        if (shard->seconds == NULL) {
+            fprintf(stderr, "realloc() failed\n");
+            exit(1);
+        }
+
+        memset(shard->seconds + shard->nseconds, 0,
+               (n - shard->nseconds) * sizeof(uint32_t));
+
+        shard->nseconds = n;
+    }
+
+    shard->seconds[sec]++;
+}
+
+static void
+replay_report(replay_t *rp, double elapsed)
+{
+    size_t          i, j, n, nseconds, last, peak_at;
+    uint64_t        lines, skipped, requests, rejected, peak, total, count;
+    time_t          t;
+    struct tm       tm;
+    char            buf[32];
+    replay_key_t  **top;
+    replay_shard_t *shard;
+
+    lines = 0;
+    skipped = 0;
+
+    for (i = 0; i < rp->nthreads; i++) {
+        lines += rp->slices[i].lines;
+        skipped += rp->slices[i].skipped;
+    }
+
+    printf("lines        %llu, %llu without a key or time\n",
+           (unsigned long long) lines, (unsigned long long) skipped);
+    printf("elapsed      %.2fs, %.1fM lines/s on %zu threads\n\n", elapsed,
+           elapsed > 0 ? (double) lines / elapsed / 1e6 : 0.0,
+           rp->nthreads);
+
+    printf("%-16s %14s %14s %8s\n", "tier", "requests", "rejected", "rate");
+
+    for (j = 0; j < rp->nrules; j++) {
+        requests = 0;
+        rejected = 0;
+
+        for (i = 0; i < rp->nthreads; i++) {
+            requests += rp->shards[i].requests[j];
+            rejected += rp->shards[i].rejected[j];
+        }
+
+        printf("%-16s %14llu %14llu %7.2f%%\n", rp->rules[j].name,
+               (unsigned long long) requests, (unsigned long long) rejected,
+               requests ? 100.0 * (double) rejected / (double) requests
+                        : 0.0);
+    }
+
+    /* every request is a RATER.LIMIT command */
+
+    nseconds = 0;
+
+    for (i = 0; i < rp->nthreads; i++) {
+        if (rp->shards[i].nseconds > nseconds) {
+            nseconds = rp->shards[i].nseconds;
+        }
+    }
+
+    peak = 0;
+    peak_at = 0;
+    total = 0;
+    last = 0;
+
+    for (j = 0; j < nseconds; j++) {
+        count = 0;
+
+        for (i = 0; i < rp->nthreads; i++) {
+            shard = &rp->shards[i];
+
+            if (j < shard->nseconds) {
+                count += shard->seconds[j];
+            }
+        }
+
+        if (count) {
+            last = j;
+        }
+
+        if (count > peak) {
+            peak = count;
+            peak_at = j;
+        }
+
+        total += count;
+    }
+
+    if (total) {
+        t = (time_t) (rp->base + (int64_t) peak_at);
+        gmtime_r(&t, &tm);
+        strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%SZ", &tm);
+
+        printf("\nredis        %.1f commands/s on average, %llu at peak "
+               "(%s)\n",
+               (double) total / (double) (last + 1),
+               (unsigned long long) peak, buf);
+    }
+
+    if (rp->top == 0) {
+        return;
+    }
+
+    n = 0;
+
+    for (i = 0; i < rp->nthreads; i++) {
+        n += rp->shards[i].nkeys;
+    }
+
+    top = replay_alloc((n ? n : 1) * sizeof(replay_key_t *));
+
+    n = 0;
+
+    for (i = 0; i < rp->nthreads; i++) {
+        shard = &rp->shards[i];
+
+        for (j = 0; j <= shard->mask; j++) {
+            if (shard->keys[j].key && shard->keys[j].rejected) {
+                top[n++] = &shard->keys[j];
+            }
+        }
+    }
+
+    qsort(top, n, sizeof(replay_key_t *), replay_cmp_rejected);
+
+    if (n > rp->top) {
+        n = rp->top;
+    }
+
+    if (n) {
+        printf("\n%-40s %-16s %14s %14s\n", "key", "tier", "rejected",
+               "requests");
+    }
+
+    for (i = 0; i < n; i++) {
+        printf("%-40.*s %-16s %14llu %14llu\n", (int) top[i]->len,
+               top[i]->key, rp->rules[top[i]->tier].name,
+               (unsigned long long) top[i]->rejected,
+               (unsigned long long) (top[i]->rejected + top[i]->allowed));
+    }
+
+    free(top);
+}
+
+static int
+replay_cmp_rejected(const void *one, const void *two)
+{
+    const replay_key_t *a = *(replay_key_t *const *) one;
+    const replay_key_t *b = *(replay_key_t *const *) two;
+
+    if (a->rejected != b->rejected) {
+        return (a->rejected < b->rejected) ? 1 : -1;
+    }
+
+    return 0;
+}